@@ -0,0 +1,636 @@
+#define _GNU_SOURCE
+#include "agg.h"
+#include "index.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KDB_AGG_X86 1
+#endif
+
+// smallest group table
+#define KDB_GROUPS_MIN 64
+
+// a reducer folds the rows of each block set in bits into acc, data points
+// at the first row of the first block
+typedef void (*kdb_reduce_fn)(const void *data, const uint64_t *bits, const size_t blocks, kdb_acc_t *acc);
+
+// reducers by column type, signed then unsigned
+typedef kdb_reduce_fn kdb_reducers_t[K_TYPE_STRING][2];
+
+static inline int kdb_acc_unsigned(const kdb_acc_t *acc) {
+    return acc->min.type == K_TYPE_BOOL || (acc->min.flags & K_TYPE_UNSIGNED);
+}
+
+// fold what a run of rows came to into the accumulator, by how its
+// column compares
+static inline void kdb_fold_i(kdb_acc_t *acc, const uint64_t count, const uint64_t sum, const int64_t lo, const int64_t hi) {
+    if (count == 0)
+        return;
+    if (acc->count == 0 || lo < acc->min.i)
+        acc->min.i = lo;
+    if (acc->count == 0 || hi > acc->max.i)
+        acc->max.i = hi;
+    acc->sum.u += sum;
+    acc->count += count;
+}
+
+static inline void kdb_fold_u(kdb_acc_t *acc, const uint64_t count, const uint64_t sum, const uint64_t lo, const uint64_t hi) {
+    if (count == 0)
+        return;
+    if (acc->count == 0 || lo < acc->min.u)
+        acc->min.u = lo;
+    if (acc->count == 0 || hi > acc->max.u)
+        acc->max.u = hi;
+    acc->sum.u += sum;
+    acc->count += count;
+}
+
+static inline void kdb_fold_d(kdb_acc_t *acc, const uint64_t count, const double sum, const double lo, const double hi) {
+    if (count == 0)
+        return;
+    if (acc->count == 0 || lo < acc->min.d)
+        acc->min.d = lo;
+    if (acc->count == 0 || hi > acc->max.d)
+        acc->max.d = hi;
+    acc->sum.d += sum;
+    acc->count += count;
+}
+
+// portable reducers, integers sum as unsigned so they wrap instead of
+// overflowing and nan is never less or greater than anything
+#define KDB_SCALAR_REDUCER(name, type, sum_type, fold, lo_init, hi_init)                \
+    static void name(const void *data, const uint64_t *bits, const size_t blocks,        \
+                     kdb_acc_t *acc) {                                                   \
+        size_t b;                                                                        \
+        uint64_t mask, count = 0;                                                        \
+        sum_type sum = 0;                                                                \
+        type lo = lo_init, hi = hi_init;                                                 \
+        const type *v = (const type*)data;                                               \
+        for (b = 0; b < blocks; b++, v += KDB_BLOCK) {                                   \
+            count += __builtin_popcountll(bits[b]);                                      \
+            for (mask = bits[b]; mask; mask &= mask - 1) {                               \
+                const type x = v[__builtin_ctzll(mask)];                                 \
+                sum += (sum_type)x;                                                      \
+                if (x < lo)                                                              \
+                    lo = x;                                                              \
+                if (x > hi)                                                              \
+                    hi = x;                                                              \
+            }                                                                            \
+        }                                                                                \
+        fold(acc, count, sum, lo, hi);                                                   \
+    }
+
+KDB_SCALAR_REDUCER(kdb_scalar_i8, int8_t, uint64_t, kdb_fold_i, INT8_MAX, INT8_MIN)
+KDB_SCALAR_REDUCER(kdb_scalar_u8, uint8_t, uint64_t, kdb_fold_u, UINT8_MAX, 0)
+KDB_SCALAR_REDUCER(kdb_scalar_i16, int16_t, uint64_t, kdb_fold_i, INT16_MAX, INT16_MIN)
+KDB_SCALAR_REDUCER(kdb_scalar_u16, uint16_t, uint64_t, kdb_fold_u, UINT16_MAX, 0)
+KDB_SCALAR_REDUCER(kdb_scalar_i32, int32_t, uint64_t, kdb_fold_i, INT32_MAX, INT32_MIN)
+KDB_SCALAR_REDUCER(kdb_scalar_u32, uint32_t, uint64_t, kdb_fold_u, UINT32_MAX, 0)
+KDB_SCALAR_REDUCER(kdb_scalar_i64, int64_t, uint64_t, kdb_fold_i, INT64_MAX, INT64_MIN)
+KDB_SCALAR_REDUCER(kdb_scalar_u64, uint64_t, uint64_t, kdb_fold_u, UINT64_MAX, 0)
+KDB_SCALAR_REDUCER(kdb_scalar_f32, float, double, kdb_fold_d, INFINITY, -INFINITY)
+KDB_SCALAR_REDUCER(kdb_scalar_f64, double, double, kdb_fold_d, INFINITY, -INFINITY)
+
+static const kdb_reducers_t kdb_scalar_reducers = {
+    [K_TYPE_BYTE] = { kdb_scalar_i8, kdb_scalar_u8 },
+    [K_TYPE_SHORT] = { kdb_scalar_i16, kdb_scalar_u16 },
+    [K_TYPE_INT] = { kdb_scalar_i32, kdb_scalar_u32 },
+    [K_TYPE_LONG] = { kdb_scalar_i64, kdb_scalar_u64 },
+    [K_TYPE_BOOL] = { kdb_scalar_u8, kdb_scalar_u8 },
+    [K_TYPE_FLOAT] = { kdb_scalar_f32, kdb_scalar_f32 },
+    [K_TYPE_DOUBLE] = { kdb_scalar_f64, kdb_scalar_f64 },
+};
+
+#ifdef KDB_AGG_X86
+// whole blocks go through in vectors, a block with only some rows set is
+// left to the portable reducer. avx2 has unsigned min and max up to 32
+// bits, so narrow signed values get their top bit flipped and the sum put
+// right after. 64 bit ones go the other way onto the signed compare
+
+__attribute__((target("avx2")))
+static void kdb_avx2_8(const void *data, const uint64_t *bits, const size_t blocks, kdb_acc_t *acc, const int is_unsigned) {
+    size_t b, i, full = 0;
+    uint8_t lo = UINT8_MAX, hi = 0, los[32], his[32];
+    uint64_t sum, count, sums[4];
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i flip = _mm256_set1_epi8(is_unsigned ? 0 : (char)0x80);
+    __m256i vsum = zero, vlo = _mm256_set1_epi8((char)0xFF), vhi = zero;
+    const __m256i *v = (const __m256i*)data;
+
+    for (b = 0; b < blocks; b++, v += 2) {
+        if (bits[b] != UINT64_MAX) {
+            if (bits[b])
+                kdb_scalar_reducers[K_TYPE_BYTE][is_unsigned](v, &bits[b], 1, acc);
+            continue;
+        }
+        for (i = 0; i < 2; i++) {
+            const __m256i x = _mm256_xor_si256(_mm256_load_si256(v + i), flip);
+            vsum = _mm256_add_epi64(vsum, _mm256_sad_epu8(x, zero));
+            vlo = _mm256_min_epu8(vlo, x);
+            vhi = _mm256_max_epu8(vhi, x);
+        }
+        full++;
+    }
+    if (full == 0)
+        return;
+    _mm256_storeu_si256((__m256i*)los, vlo);
+    _mm256_storeu_si256((__m256i*)his, vhi);
+    _mm256_storeu_si256((__m256i*)sums, vsum);
+    for (i = 0; i < 32; i++) {
+        lo = los[i] < lo ? los[i] : lo;
+        hi = his[i] > hi ? his[i] : hi;
+    }
+    sum = sums[0] + sums[1] + sums[2] + sums[3];
+    count = full * KDB_BLOCK;
+    if (is_unsigned)
+        kdb_fold_u(acc, count, sum, lo, hi);
+    else
+        kdb_fold_i(acc, count, sum - count * 0x80, (int8_t)(lo ^ 0x80), (int8_t)(hi ^ 0x80));
+}
+
+__attribute__((target("avx2")))
+static void kdb_avx2_16(const void *data, const uint64_t *bits, const size_t blocks, kdb_acc_t *acc, const int is_unsigned) {
+    size_t b, i, full = 0;
+    uint16_t lo = UINT16_MAX, hi = 0, los[16], his[16];
+    uint64_t sum, count, sums[4];
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i flip = _mm256_set1_epi16(is_unsigned ? 0 : (short)0x8000);
+    __m256i vsum = zero, vlo = _mm256_set1_epi16((short)0xFFFF), vhi = zero;
+    const __m256i *v = (const __m256i*)data;
+
+    // a block sums into 32 bit lanes before widening, 8 rows to a lane
+    for (b = 0; b < blocks; b++, v += 4) {
+        if (bits[b] != UINT64_MAX) {
+            if (bits[b])
+                kdb_scalar_reducers[K_TYPE_SHORT][is_unsigned](v, &bits[b], 1, acc);
+            continue;
+        }
+        __m256i part = zero;
+        for (i = 0; i < 4; i++) {
+            const __m256i x = _mm256_xor_si256(_mm256_load_si256(v + i), flip);
+            part = _mm256_add_epi32(part, _mm256_add_epi32(_mm256_unpacklo_epi16(x, zero), _mm256_unpackhi_epi16(x, zero)));
+            vlo = _mm256_min_epu16(vlo, x);
+            vhi = _mm256_max_epu16(vhi, x);
+        }
+        vsum = _mm256_add_epi64(vsum, _mm256_add_epi64(_mm256_unpacklo_epi32(part, zero), _mm256_unpackhi_epi32(part, zero)));
+        full++;
+    }
+    if (full == 0)
+        return;
+    _mm256_storeu_si256((__m256i*)los, vlo);
+    _mm256_storeu_si256((__m256i*)his, vhi);
+    _mm256_storeu_si256((__m256i*)sums, vsum);
+    for (i = 0; i < 16; i++) {
+        lo = los[i] < lo ? los[i] : lo;
+        hi = his[i] > hi ? his[i] : hi;
+    }
+    sum = sums[0] + sums[1] + sums[2] + sums[3];
+    count = full * KDB_BLOCK;
+    if (is_unsigned)
+        kdb_fold_u(acc, count, sum, lo, hi);
+    else
+        kdb_fold_i(acc, count, sum - count * 0x8000, (int16_t)(lo ^ 0x8000), (int16_t)(hi ^ 0x8000));
+}
+
+__attribute__((target("avx2")))
+static void kdb_avx2_32(const void *data, const uint64_t *bits, const size_t blocks, kdb_acc_t *acc, const int is_unsigned) {
+    size_t b, i, full = 0;
+    uint32_t lo = UINT32_MAX, hi = 0, los[8], his[8];
+    uint64_t sum, count, sums[4];
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i flip = _mm256_set1_epi32(is_unsigned ? 0 : INT32_MIN);
+    __m256i vsum = zero, vlo = _mm256_set1_epi32(-1), vhi = zero;
+    const __m256i *v = (const __m256i*)data;
+
+    for (b = 0; b < blocks; b++, v += 8) {
+        if (bits[b] != UINT64_MAX) {
+            if (bits[b])
+                kdb_scalar_reducers[K_TYPE_INT][is_unsigned](v, &bits[b], 1, acc);
+            continue;
+        }
+        for (i = 0; i < 8; i++) {
+            const __m256i x = _mm256_xor_si256(_mm256_load_si256(v + i), flip);
+            vsum = _mm256_add_epi64(vsum, _mm256_add_epi64(_mm256_unpacklo_epi32(x, zero), _mm256_unpackhi_epi32(x, zero)));
+            vlo = _mm256_min_epu32(vlo, x);
+            vhi = _mm256_max_epu32(vhi, x);
+        }
+        full++;
+    }
+    if (full == 0)
+        return;
+    _mm256_storeu_si256((__m256i*)los, vlo);
+    _mm256_storeu_si256((__m256i*)his, vhi);
+    _mm256_storeu_si256((__m256i*)sums, vsum);
+    for (i = 0; i < 8; i++) {
+        lo = los[i] < lo ? los[i] : lo;
+        hi = his[i] > hi ? his[i] : hi;
+    }
+    sum = sums[0] + sums[1] + sums[2] + sums[3];
+    count = full * KDB_BLOCK;
+    if (is_unsigned)
+        kdb_fold_u(acc, count, sum, lo, hi);
+    else
+        kdb_fold_i(acc, count, sum - count * 0x80000000ULL, (int32_t)(lo ^ 0x80000000U), (int32_t)(hi ^ 0x80000000U));
+}
+
+__attribute__((target("avx2")))
+static void kdb_avx2_64(const void *data, const uint64_t *bits, const size_t blocks, kdb_acc_t *acc, const int is_unsigned) {
+    size_t b, i, full = 0;
+    int64_t lo = INT64_MAX, hi = INT64_MIN, los[4], his[4];
+    uint64_t sum, sums[4];
+    const __m256i flip = _mm256_set1_epi64x(is_unsigned ? INT64_MIN : 0);
+    __m256i vsum = _mm256_setzero_si256(), vlo = _mm256_set1_epi64x(INT64_MAX), vhi = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i *v = (const __m256i*)data;
+
+    for (b = 0; b < blocks; b++, v += 16) {
+        if (bits[b] != UINT64_MAX) {
+            if (bits[b])
+                kdb_scalar_reducers[K_TYPE_LONG][is_unsigned](v, &bits[b], 1, acc);
+            continue;
+        }
+        for (i = 0; i < 16; i++) {
+            const __m256i raw = _mm256_load_si256(v + i);
+            const __m256i x = _mm256_xor_si256(raw, flip);
+            vsum = _mm256_add_epi64(vsum, raw);
+            vlo = _mm256_blendv_epi8(vlo, x, _mm256_cmpgt_epi64(vlo, x));
+            vhi = _mm256_blendv_epi8(vhi, x, _mm256_cmpgt_epi64(x, vhi));
+        }
+        full++;
+    }
+    if (full == 0)
+        return;
+    _mm256_storeu_si256((__m256i*)los, vlo);
+    _mm256_storeu_si256((__m256i*)his, vhi);
+    _mm256_storeu_si256((__m256i*)sums, vsum);
+    for (i = 0; i < 4; i++) {
+        lo = los[i] < lo ? los[i] : lo;
+        hi = his[i] > hi ? his[i] : hi;
+    }
+    sum = sums[0] + sums[1] + sums[2] + sums[3];
+    if (is_unsigned)
+        kdb_fold_u(acc, full * KDB_BLOCK, sum, (uint64_t)lo ^ (1ULL << 63), (uint64_t)hi ^ (1ULL << 63));
+    else
+        kdb_fold_i(acc, full * KDB_BLOCK, sum, lo, hi);
+}
+
+// floats sum as doubles, min and max take the vector last so a nan row
+// keeps what was there like the portable compare does
+__attribute__((target("avx2")))
+static void kdb_avx2_f32(const void *data, const uint64_t *bits, const size_t blocks, kdb_acc_t *acc) {
+    size_t b, i, full = 0;
+    float lo = INFINITY, hi = -INFINITY, los[8], his[8];
+    double sums[4];
+    __m256d vsum = _mm256_setzero_pd();
+    __m256 vlo = _mm256_set1_ps(INFINITY), vhi = _mm256_set1_ps(-INFINITY);
+    const float *v = (const float*)data;
+
+    for (b = 0; b < blocks; b++, v += KDB_BLOCK) {
+        if (bits[b] != UINT64_MAX) {
+            if (bits[b])
+                kdb_scalar_f32(v, &bits[b], 1, acc);
+            continue;
+        }
+        for (i = 0; i < 8; i++) {
+            const __m256 x = _mm256_load_ps(v + i * 8);
+            vsum = _mm256_add_pd(vsum, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(x)), _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1))));
+            vlo = _mm256_min_ps(x, vlo);
+            vhi = _mm256_max_ps(x, vhi);
+        }
+        full++;
+    }
+    if (full == 0)
+        return;
+    _mm256_storeu_ps(los, vlo);
+    _mm256_storeu_ps(his, vhi);
+    _mm256_storeu_pd(sums, vsum);
+    for (i = 0; i < 8; i++) {
+        lo = los[i] < lo ? los[i] : lo;
+        hi = his[i] > hi ? his[i] : hi;
+    }
+    kdb_fold_d(acc, full * KDB_BLOCK, sums[0] + sums[1] + sums[2] + sums[3], lo, hi);
+}
+
+__attribute__((target("avx2")))
+static void kdb_avx2_f64(const void *data, const uint64_t *bits, const size_t blocks, kdb_acc_t *acc) {
+    size_t b, i, full = 0;
+    double lo = INFINITY, hi = -INFINITY, los[4], his[4], sums[4];
+    __m256d vsum = _mm256_setzero_pd(), vlo = _mm256_set1_pd(INFINITY), vhi = _mm256_set1_pd(-INFINITY);
+    const double *v = (const double*)data;
+
+    for (b = 0; b < blocks; b++, v += KDB_BLOCK) {
+        if (bits[b] != UINT64_MAX) {
+            if (bits[b])
+                kdb_scalar_f64(v, &bits[b], 1, acc);
+            continue;
+        }
+        for (i = 0; i < 16; i++) {
+            const __m256d x = _mm256_load_pd(v + i * 4);
+            vsum = _mm256_add_pd(vsum, x);
+            vlo = _mm256_min_pd(x, vlo);
+            vhi = _mm256_max_pd(x, vhi);
+        }
+        full++;
+    }
+    if (full == 0)
+        return;
+    _mm256_storeu_pd(los, vlo);
+    _mm256_storeu_pd(his, vhi);
+    _mm256_storeu_pd(sums, vsum);
+    for (i = 0; i < 4; i++) {
+        lo = los[i] < lo ? los[i] : lo;
+        hi = his[i] > hi ? his[i] : hi;
+    }
+    kdb_fold_d(acc, full * KDB_BLOCK, sums[0] + sums[1] + sums[2] + sums[3], lo, hi);
+}
+
+#define KDB_AVX2_SIGNS(name)                                                             \
+    __attribute__((target("avx2")))                                                      \
+    static void name##_s(const void *data, const uint64_t *bits, const size_t blocks,    \
+                         kdb_acc_t *acc) {                                               \
+        name(data, bits, blocks, acc, 0);                                                \
+    }                                                                                    \
+    __attribute__((target("avx2")))                                                      \
+    static void name##_u(const void *data, const uint64_t *bits, const size_t blocks,    \
+                         kdb_acc_t *acc) {                                               \
+        name(data, bits, blocks, acc, 1);                                                \
+    }
+
+KDB_AVX2_SIGNS(kdb_avx2_8)
+KDB_AVX2_SIGNS(kdb_avx2_16)
+KDB_AVX2_SIGNS(kdb_avx2_32)
+KDB_AVX2_SIGNS(kdb_avx2_64)
+
+static const kdb_reducers_t kdb_avx2_reducers = {
+    [K_TYPE_BYTE] = { kdb_avx2_8_s, kdb_avx2_8_u },
+    [K_TYPE_SHORT] = { kdb_avx2_16_s, kdb_avx2_16_u },
+    [K_TYPE_INT] = { kdb_avx2_32_s, kdb_avx2_32_u },
+    [K_TYPE_LONG] = { kdb_avx2_64_s, kdb_avx2_64_u },
+    [K_TYPE_BOOL] = { kdb_avx2_8_u, kdb_avx2_8_u },
+    [K_TYPE_FLOAT] = { kdb_avx2_f32, kdb_avx2_f32 },
+    [K_TYPE_DOUBLE] = { kdb_avx2_f64, kdb_avx2_f64 },
+};
+#endif
+
+static const kdb_reducers_t* kdb_reducers_pick() {
+#ifdef KDB_AGG_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &kdb_avx2_reducers;
+#endif
+    return &kdb_scalar_reducers;
+}
+
+int kdb_agg_check(const kdb_column_t *col, const uint8_t op) {
+    // strings can only be counted
+    if (op > K_AGG_AVG)
+        return KDB_ERR_VALUE;
+    if (col->type == K_TYPE_STRING && op != K_AGG_COUNT)
+        return KDB_ERR_TYPE;
+    return KDB_OK;
+}
+
+uint8_t kdb_agg_type(const kdb_column_t *col, const uint8_t op) {
+    const int is_float = col->type == K_TYPE_FLOAT || col->type == K_TYPE_DOUBLE;
+    const int is_unsigned = col->type == K_TYPE_BOOL || (col->flags & K_TYPE_UNSIGNED);
+    switch (op) {
+        case K_AGG_COUNT: return K_TYPE_LONG | (K_TYPE_UNSIGNED << 3);
+        case K_AGG_SUM: return is_float ? K_TYPE_DOUBLE : K_TYPE_LONG | (is_unsigned ? K_TYPE_UNSIGNED << 3 : 0);
+        case K_AGG_MIN:
+        case K_AGG_MAX: return col->type | ((col->flags & K_TYPE_UNSIGNED) << 3);
+    }
+    return K_TYPE_DOUBLE;
+}
+
+void kdb_agg_batch(const kdb_column_t *col, const uint64_t block, const size_t blocks, const uint64_t *bits, kdb_acc_t *acc) {
+    size_t b;
+    static const kdb_reducers_t *impl = NULL;
+
+    // pick the widest reducers the cpu supports once
+    const kdb_reducers_t *reducers = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+    if (reducers == NULL) {
+        reducers = kdb_reducers_pick();
+        __atomic_store_n(&impl, reducers, __ATOMIC_RELAXED);
+    }
+    if (col->type == K_TYPE_STRING) {
+        for (b = 0; b < blocks; b++)
+            acc->count += __builtin_popcountll(bits[b]);
+        return;
+    }
+    const void *data = col->data + block * KDB_BLOCK * col->width;
+    (*reducers)[col->type][col->flags & K_TYPE_UNSIGNED](data, bits, blocks, acc);
+}
+
+void kdb_acc_init(kdb_acc_t *acc, const kdb_column_t *col) {
+    const int is_unsigned = col->type == K_TYPE_BOOL || (col->flags & K_TYPE_UNSIGNED);
+    memset(acc, 0, sizeof(kdb_acc_t));
+    acc->sum.type = col->type == K_TYPE_FLOAT || col->type == K_TYPE_DOUBLE ? K_TYPE_DOUBLE : K_TYPE_LONG;
+    acc->sum.flags = is_unsigned ? K_TYPE_UNSIGNED : 0;
+    acc->min.type = acc->max.type = col->type;
+    acc->min.flags = acc->max.flags = col->flags & K_TYPE_UNSIGNED;
+}
+
+void kdb_acc_add(kdb_acc_t *acc, const kproto_value_t *value) {
+    switch (acc->min.type) {
+        case K_TYPE_STRING:
+            acc->count++;
+            return;
+        case K_TYPE_FLOAT:
+        case K_TYPE_DOUBLE:
+            kdb_fold_d(acc, 1, value->d, value->d, value->d);
+            return;
+    }
+    if (kdb_acc_unsigned(acc))
+        kdb_fold_u(acc, 1, value->u, value->u, value->u);
+    else
+        kdb_fold_i(acc, 1, value->u, value->i, value->i);
+}
+
+void kdb_acc_merge(kdb_acc_t *acc, const kdb_acc_t *from) {
+    switch (acc->min.type) {
+        case K_TYPE_STRING:
+            acc->count += from->count;
+            return;
+        case K_TYPE_FLOAT:
+        case K_TYPE_DOUBLE:
+            kdb_fold_d(acc, from->count, from->sum.d, from->min.d, from->max.d);
+            return;
+    }
+    if (kdb_acc_unsigned(acc))
+        kdb_fold_u(acc, from->count, from->sum.u, from->min.u, from->max.u);
+    else
+        kdb_fold_i(acc, from->count, from->sum.u, from->min.i, from->max.i);
+}
+
+void kdb_acc_value(const kdb_acc_t *acc, const uint8_t op, kproto_value_t *value) {
+    // typed as kdb_agg_type says, an average of no rows is 0
+    switch (op) {
+        case K_AGG_COUNT:
+            value->type = K_TYPE_LONG;
+            value->flags = K_TYPE_UNSIGNED;
+            value->u = acc->count;
+            return;
+        case K_AGG_SUM: *value = acc->sum; return;
+        case K_AGG_MIN: *value = acc->min; return;
+        case K_AGG_MAX: *value = acc->max; return;
+    }
+    value->type = K_TYPE_DOUBLE;
+    value->flags = 0;
+    if (acc->count == 0)
+        value->d = 0;
+    else if (acc->sum.type == K_TYPE_DOUBLE)
+        value->d = acc->sum.d / acc->count;
+    else if (acc->sum.flags & K_TYPE_UNSIGNED)
+        value->d = (double)acc->sum.u / acc->count;
+    else
+        value->d = (double)acc->sum.i / acc->count;
+}
+
+int kdb_groups_init(kdb_groups_t *groups, const kdb_acc_t *empty, const uint8_t n_accs) {
+    memset(groups, 0, sizeof(kdb_groups_t));
+    groups->n_accs = n_accs;
+    groups->mask = KDB_GROUPS_MIN - 1;
+    if ((groups->slots = calloc(KDB_GROUPS_MIN, sizeof(uint32_t))) == NULL ||
+        (groups->empty = malloc(n_accs * sizeof(kdb_acc_t))) == NULL)
+        return -1;
+    memcpy(groups->empty, empty, n_accs * sizeof(kdb_acc_t));
+    return 0;
+}
+
+void kdb_groups_free(kdb_groups_t *groups) {
+    size_t i;
+    for (i = 0; i < groups->len; i++)
+        if (groups->keys[i].type == K_TYPE_STRING)
+            free((char*)groups->keys[i].s.data);
+    free(groups->slots);
+    free(groups->hashes);
+    free(groups->keys);
+    free(groups->accs);
+    free(groups->empty);
+    memset(groups, 0, sizeof(kdb_groups_t));
+}
+
+static inline uint64_t kdb_groups_pos(const uint64_t hash, const uint64_t mask) {
+    const uint64_t mixed = hash * 0x9e3779b97f4a7c15ULL;
+    return (mixed ^ (mixed >> 32)) & mask;
+}
+
+static int kdb_groups_grow(kdb_groups_t *groups) {
+    size_t i, max;
+    uint64_t pos, mask;
+    uint32_t *slots;
+    void *grown;
+
+    // groups double, the slots keep at most half of them taken
+    if (groups->len == groups->max) {
+        if (groups->len >= UINT32_MAX - 1)
+            return -1;
+        max = groups->max ? groups->max * 2 : KDB_GROUPS_MIN;
+        if ((grown = realloc(groups->hashes, max * sizeof(uint64_t))) == NULL)
+            return -1;
+        groups->hashes = grown;
+        if ((grown = realloc(groups->keys, max * sizeof(kproto_value_t))) == NULL)
+            return -1;
+        groups->keys = grown;
+        if ((grown = realloc(groups->accs, max * groups->n_accs * sizeof(kdb_acc_t))) == NULL)
+            return -1;
+        groups->accs = grown;
+        groups->max = max;
+    }
+    if ((groups->len + 1) * 2 <= groups->mask + 1)
+        return 0;
+    mask = groups->mask * 2 + 1;
+    if ((slots = calloc(mask + 1, sizeof(uint32_t))) == NULL)
+        return -1;
+    for (i = 0; i < groups->len; i++) {
+        for (pos = kdb_groups_pos(groups->hashes[i], mask); slots[pos]; pos = (pos + 1) & mask);
+        slots[pos] = (uint32_t)i + 1;
+    }
+    free(groups->slots);
+    groups->slots = slots;
+    groups->mask = mask;
+    return 0;
+}
+
+kdb_acc_t* kdb_groups_find(kdb_groups_t *groups, const kproto_value_t *key) {
+    char *copy = NULL;
+    uint32_t group;
+    const uint64_t hash = kdb_index_key(key);
+    uint64_t pos = kdb_groups_pos(hash, groups->mask);
+
+    // keys are equal when their index keys are, strings are compared
+    // in full since theirs are only hashes
+    for (; (group = groups->slots[pos]) != 0; pos = (pos + 1) & groups->mask) {
+        const kproto_value_t *other = &groups->keys[group - 1];
+        if (groups->hashes[group - 1] != hash)
+            continue;
+        if (key->type != K_TYPE_STRING || (other->s.len == key->s.len && (key->s.len == 0 || memcmp(other->s.data, key->s.data, key->s.len) == 0)))
+            return groups->accs + (size_t)(group - 1) * groups->n_accs;
+    }
+
+    // a new group, its string key copied out of the rows it came from
+    if (kdb_groups_grow(groups))
+        return NULL;
+    if (key->type == K_TYPE_STRING) {
+        if ((copy = malloc(key->s.len ? key->s.len : 1)) == NULL)
+            return NULL;
+        memcpy(copy, key->s.data, key->s.len);
+    }
+    for (pos = kdb_groups_pos(hash, groups->mask); groups->slots[pos]; pos = (pos + 1) & groups->mask);
+    groups->slots[pos] = (uint32_t)++groups->len;
+    groups->hashes[groups->len - 1] = hash;
+    groups->keys[groups->len - 1] = *key;
+    if (key->type == K_TYPE_STRING)
+        groups->keys[groups->len - 1].s.data = copy;
+    memcpy(groups->accs + (groups->len - 1) * groups->n_accs, groups->empty, groups->n_accs * sizeof(kdb_acc_t));
+    return groups->accs + (groups->len - 1) * groups->n_accs;
+}
+
+int kdb_groups_merge(kdb_groups_t *groups, const kdb_groups_t *from) {
+    size_t i, k;
+    kdb_acc_t *accs;
+    for (i = 0; i < from->len; i++) {
+        if ((accs = kdb_groups_find(groups, &from->keys[i])) == NULL)
+            return -1;
+        for (k = 0; k < groups->n_accs; k++)
+            kdb_acc_merge(&accs[k], &from->accs[i * from->n_accs + k]);
+    }
+    return 0;
+}
+
+static int kdb_group_order(const void *a, const void *b, void *arg) {
+    int order;
+    const kdb_groups_t *groups = (const kdb_groups_t*)arg;
+    const kproto_value_t *x = &groups->keys[*(const uint32_t*)a];
+    const kproto_value_t *y = &groups->keys[*(const uint32_t*)b];
+
+    switch (x->type) {
+        case K_TYPE_STRING:
+            if ((order = memcmp(x->s.data, y->s.data, x->s.len < y->s.len ? x->s.len : y->s.len)) != 0)
+                return order;
+            return (x->s.len > y->s.len) - (x->s.len < y->s.len);
+        case K_TYPE_FLOAT:
+        case K_TYPE_DOUBLE:
+            return (x->d > y->d) - (x->d < y->d);
+        case K_TYPE_BOOL:
+            return (x->u > y->u) - (x->u < y->u);
+    }
+    if (x->flags & K_TYPE_UNSIGNED)
+        return (x->u > y->u) - (x->u < y->u);
+    return (x->i > y->i) - (x->i < y->i);
+}
+
+uint32_t* kdb_groups_sort(const kdb_groups_t *groups) {
+    uint32_t i, *order;
+
+    // the places of the groups in key order
+    if ((order = malloc((groups->len ? groups->len : 1) * sizeof(uint32_t))) == NULL)
+        return NULL;
+    for (i = 0; i < groups->len; i++)
+        order[i] = i;
+    qsort_r(order, groups->len, sizeof(uint32_t), kdb_group_order, (void*)groups);
+    return order;
+}
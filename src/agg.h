@@ -0,0 +1,45 @@
+#ifndef K_AGG_H
+#define K_AGG_H
+
+#include "table.h"
+
+// what the rows of a column fold into, integer sums wrap at 64 bits and
+// floating ones are kept as doubles. min and max hold nothing until the
+// first row, strings are only counted
+typedef struct {
+    uint64_t count;
+    kproto_value_t sum;
+    kproto_value_t min;
+    kproto_value_t max;
+} kdb_acc_t;
+
+// open addressing from group keys to their accumulators, groups keep the
+// order they were first seen in and a copy of every string key
+typedef struct {
+    uint8_t n_accs; // for each group, at least one
+    uint32_t *slots; // group + 1, 0 is an empty slot
+    uint64_t mask;
+    uint64_t *hashes;
+    kproto_value_t *keys;
+    kdb_acc_t *accs;
+    kdb_acc_t *empty; // what a new group starts from
+    size_t len;
+    size_t max;
+} kdb_groups_t;
+
+int kdb_agg_check(const kdb_column_t *col, const uint8_t op);
+uint8_t kdb_agg_type(const kdb_column_t *col, const uint8_t op);
+void kdb_agg_batch(const kdb_column_t *col, const uint64_t block, const size_t blocks, const uint64_t *bits, kdb_acc_t *acc);
+
+void kdb_acc_init(kdb_acc_t *acc, const kdb_column_t *col);
+void kdb_acc_add(kdb_acc_t *acc, const kproto_value_t *value);
+void kdb_acc_merge(kdb_acc_t *acc, const kdb_acc_t *from);
+void kdb_acc_value(const kdb_acc_t *acc, const uint8_t op, kproto_value_t *value);
+
+int kdb_groups_init(kdb_groups_t *groups, const kdb_acc_t *empty, const uint8_t n_accs);
+void kdb_groups_free(kdb_groups_t *groups);
+kdb_acc_t* kdb_groups_find(kdb_groups_t *groups, const kproto_value_t *key);
+int kdb_groups_merge(kdb_groups_t *groups, const kdb_groups_t *from);
+uint32_t* kdb_groups_sort(const kdb_groups_t *groups);
+
+#endif // K_AGG_H
@@ -1,65 +1,231 @@
+#define _GNU_SOURCE
 #include "buffer.h"
 #include <stdlib.h>
 #include <string.h>
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
 
 void kbuf_init(kbuf_t *buf) {
-    buf->pos = 0;
     buf->len = 0;
-    buf->max = 0;
-    buf->data = NULL;
+    buf->head = NULL;
+    buf->tail = NULL;
+    buf->spare = NULL;
 }
 
 void kbuf_free(kbuf_t *buf) {
-    if (buf->data != NULL) {
-        free(buf->data);
-        buf->data = NULL;
+    kbuf_chunk_t *chunk;
+    while ((chunk = buf->head) != NULL) {
+        buf->head = chunk->next;
+        free(chunk);
     }
+    free(buf->spare);
+    kbuf_init(buf);
 }
 
-int kbuf_read(kbuf_t *buf, void *output, size_t size) {
+static kbuf_chunk_t* kbuf_chunk(kbuf_t *buf, const size_t size) {
+    kbuf_chunk_t *chunk;
+
+    // reuse the last drained chunk when it is big enough
+    if (buf->spare != NULL && buf->spare->max >= size) {
+        chunk = buf->spare;
+        buf->spare = NULL;
+    } else {
+        const size_t max = MAX(size, KBUF_CHUNK_SIZE);
+        if ((chunk = malloc(sizeof(kbuf_chunk_t) + max)) == NULL)
+            return NULL;
+        chunk->max = max;
+    }
+    chunk->next = NULL;
+    chunk->pos = 0;
+    chunk->len = 0;
+    return chunk;
+}
+
+static void kbuf_release(kbuf_t *buf, kbuf_chunk_t *chunk) {
+    // keep one regular sized chunk around for the next write
+    if (buf->spare == NULL && chunk->max == KBUF_CHUNK_SIZE)
+        buf->spare = chunk;
+    else
+        free(chunk);
+}
+
+static inline void kbuf_append(kbuf_t *buf, kbuf_chunk_t *chunk) {
+    if (buf->tail == NULL)
+        buf->head = chunk;
+    else
+        buf->tail->next = chunk;
+    buf->tail = chunk;
+}
+
+int kbuf_skip(kbuf_t *buf, size_t size) {
+    size_t n;
+    kbuf_chunk_t *chunk;
     if (buf == NULL)
         return -1;
-    if (size == 0 || buf->len == 0 || buf->pos >= buf->len)
-        return 0;
-    size = MIN(size, buf->len - buf->pos);
-    memcpy(output, buf->data + buf->pos, size);
-    buf->pos += size;
+
+    // drop consumed bytes, releasing chunks once they are drained
+    size = MIN(size, buf->len);
+    buf->len -= size;
+    while (size > 0 && (chunk = buf->head) != NULL) {
+        n = MIN(size, chunk->len - chunk->pos);
+        chunk->pos += n;
+        size -= n;
+        if (chunk->pos < chunk->len)
+            break;
+        buf->head = chunk->next;
+        if (buf->head == NULL)
+            buf->tail = NULL;
+        kbuf_release(buf, chunk);
+    }
     return 0;
 }
 
-int kbuf_write(kbuf_t *buf, const char *data, const size_t size) {
+int kbuf_read(kbuf_t *buf, void *output, size_t size) {
+    size_t n, copied = 0;
+    kbuf_chunk_t *chunk;
     if (buf == NULL)
         return -1;
-    if (size == 0)
-        return 0;
 
-    // first write, initialze buffer to size
-    if (buf->data == NULL) {
-        buf->len = size;
-        buf->max = size;
-        buf->data = calloc(buf->max, sizeof(buf->data));
-        memcpy(buf->data, data, size);
-        return 0;
-    }
-    
-    // reposition contents in order to avoid wasting front bytes
-    if (buf->pos != 0) {
-        memmove(buf->data, buf->data + buf->pos, buf->len - buf->pos);
-        buf->len -= buf->pos;
-        buf->pos = 0;
+    // copy out across chunks, then consume what was copied
+    size = MIN(size, buf->len);
+    for (chunk = buf->head; chunk != NULL && copied < size; chunk = chunk->next) {
+        n = MIN(size - copied, chunk->len - chunk->pos);
+        memcpy((char*)output + copied, chunk->data + chunk->pos, n);
+        copied += n;
     }
+    return kbuf_skip(buf, size);
+}
+
+char* kbuf_reserve(kbuf_t *buf, const size_t size, size_t *avail) {
+    kbuf_chunk_t *chunk = buf->tail;
 
-    // resize buffer data if too small + extra room to avoid constant resizing
-    if (buf->len + size > buf->max) {
-        buf->max = (buf->len + size) * 12 / 10;
-        buf->data = realloc(buf->data, buf->max);
-        memset(buf->data + buf->len, 0, buf->max - buf->len);
+    // hand out the free space at the tail, starting a new chunk of at least
+    // size bytes once it is full
+    if (chunk == NULL || chunk->len == chunk->max) {
+        if ((chunk = kbuf_chunk(buf, size)) == NULL)
+            return NULL;
+        kbuf_append(buf, chunk);
     }
+    if (avail != NULL)
+        *avail = chunk->max - chunk->len;
+    return chunk->data + chunk->len;
+}
 
-    // write the data
-    memcpy(buf->data + buf->len, data, size);
+void kbuf_commit(kbuf_t *buf, const size_t size) {
+    buf->tail->len += size;
     buf->len += size;
+}
+
+int kbuf_write(kbuf_t *buf, const char *data, const size_t size) {
+    char *dst;
+    size_t n, avail, written = 0;
+    if (buf == NULL)
+        return -1;
+
+    // fill the tail chunk then chain new ones, buffered bytes never move
+    while (written < size) {
+        if ((dst = kbuf_reserve(buf, size - written, &avail)) == NULL)
+            return -1;
+        n = MIN(size - written, avail);
+        memcpy(dst, data + written, n);
+        kbuf_commit(buf, n);
+        written += n;
+    }
+    return 0;
+}
+
+static void kbuf_merge(kbuf_t *buf, kbuf_chunk_t *merged, size_t size) {
+    size_t n;
+    kbuf_chunk_t *chunk;
+
+    // copy the first size bytes into merged and put it in front
+    while (size > 0 && (chunk = buf->head) != NULL) {
+        n = MIN(size, chunk->len - chunk->pos);
+        memcpy(merged->data + merged->len, chunk->data + chunk->pos, n);
+        merged->len += n;
+        chunk->pos += n;
+        size -= n;
+        if (chunk->pos < chunk->len)
+            break;
+        buf->head = chunk->next;
+        if (buf->head == NULL)
+            buf->tail = NULL;
+        kbuf_release(buf, chunk);
+    }
+    merged->next = buf->head;
+    buf->head = merged;
+    if (buf->tail == NULL)
+        buf->tail = merged;
+}
+
+char* kbuf_peek(kbuf_t *buf, const size_t size) {
+    kbuf_chunk_t *chunk = buf->head;
+    if (size > buf->len)
+        return NULL;
+    if (chunk == NULL)
+        return (char*)"";
+
+    // already contiguous, which is the common case
+    if (chunk->len - chunk->pos >= size)
+        return chunk->data + chunk->pos;
+
+    // the range spans chunks, copy it into a single one
+    if ((chunk = kbuf_chunk(buf, size)) == NULL)
+        return NULL;
+    kbuf_merge(buf, chunk, size);
+    return chunk->data;
+}
+
+int kbuf_expect(kbuf_t *buf, const size_t size) {
+    kbuf_chunk_t *chunk = buf->head;
+
+    // make the next size bytes arrive contiguously, only moving what is
+    // buffered so far when the front chunk cannot hold all of them
+    if (size <= buf->len || (chunk != NULL && chunk == buf->tail && chunk->max - chunk->pos >= size))
+        return 0;
+    if ((chunk = kbuf_chunk(buf, size)) == NULL)
+        return -1;
+    kbuf_merge(buf, chunk, buf->len);
     return 0;
-}
\ No newline at end of file
+}
+
+static int kbuf_match(const kbuf_chunk_t *chunk, size_t pos, const char *goal, size_t size) {
+    size_t n;
+
+    // compare a delimiter that may continue into the following chunks
+    while (size > 0 && chunk != NULL) {
+        n = MIN(size, chunk->len - pos);
+        if (memcmp(chunk->data + pos, goal, n))
+            return 0;
+        goal += n;
+        size -= n;
+        chunk = chunk->next;
+        if (chunk != NULL)
+            pos = chunk->pos;
+    }
+    return size == 0;
+}
+
+int64_t kbuf_find(const kbuf_t *buf, const size_t from, const char *goal, const size_t size) {
+    char *found;
+    size_t avail, start, i, base = 0;
+    const kbuf_chunk_t *chunk;
+
+    if (size == 0)
+        return from <= buf->len ? (int64_t)from : -1;
+
+    // search each chunk, then the few offsets that could straddle its end
+    for (chunk = buf->head; chunk != NULL; base += avail, chunk = chunk->next) {
+        avail = chunk->len - chunk->pos;
+        if (from >= base + avail)
+            continue;
+        start = from > base ? from - base : 0;
+        if ((found = memmem(chunk->data + chunk->pos + start, avail - start, goal, size)) != NULL)
+            return (int64_t)(base + (found - (chunk->data + chunk->pos)));
+        for (i = MAX(start, avail > size - 1 ? avail - (size - 1) : 0); i < avail; i++)
+            if (kbuf_match(chunk, chunk->pos + i, goal, size))
+                return (int64_t)(base + i);
+    }
+    return -1;
+}
@@ -4,16 +4,35 @@
 #include <stdint.h>
 #include <stddef.h>
 
+// size of the chunks a buffer grows by, larger runs get their own chunk
+#ifndef KBUF_CHUNK_SIZE
+#define KBUF_CHUNK_SIZE 16384
+#endif
+
 typedef struct {
+    void *next;
     size_t pos;
     size_t len;
     size_t max;
-    char *data;
+    char data[];
+} kbuf_chunk_t;
+
+typedef struct {
+    size_t len;
+    kbuf_chunk_t *head;
+    kbuf_chunk_t *tail;
+    kbuf_chunk_t *spare;
 } kbuf_t;
 
 void kbuf_init(kbuf_t *buf);
 void kbuf_free(kbuf_t *buf);
 int kbuf_read(kbuf_t *buf, void *output, size_t size);
+int kbuf_skip(kbuf_t *buf, size_t size);
 int kbuf_write(kbuf_t *buf, const char *data, const size_t size);
+char* kbuf_reserve(kbuf_t *buf, const size_t size, size_t *avail);
+void kbuf_commit(kbuf_t *buf, const size_t size);
+char* kbuf_peek(kbuf_t *buf, const size_t size);
+int kbuf_expect(kbuf_t *buf, const size_t size);
+int64_t kbuf_find(const kbuf_t *buf, const size_t from, const char *goal, const size_t size);
 
-#endif // K_BUFFER_H
\ No newline at end of file
+#endif // K_BUFFER_H
@@ -0,0 +1,120 @@
+#include "catalog.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int kdb_catalog_init(kdb_catalog_t *catalog) {
+    memset(catalog, 0, sizeof(kdb_catalog_t));
+    catalog->next = 1;
+    if (kdb_index_init(&catalog->names) || kdb_index_init(&catalog->tables) ||
+        kdb_index_init(&catalog->handles) || kdb_index_init(&catalog->columns))
+        return -1;
+    return 0;
+}
+
+void kdb_catalog_free(kdb_catalog_t *catalog) {
+    uint32_t i;
+    for (i = 0; i < catalog->n_strs; i++)
+        free((char*)catalog->strs[i].data);
+    free(catalog->strs);
+    kdb_index_free(&catalog->names);
+    kdb_index_free(&catalog->tables);
+    kdb_index_free(&catalog->handles);
+    kdb_index_free(&catalog->columns);
+    memset(catalog, 0, sizeof(kdb_catalog_t));
+}
+
+static inline uint64_t kdb_catalog_hash(const kproto_str_t *name) {
+    kproto_value_t value;
+    value.type = K_TYPE_STRING;
+    value.s = *name;
+    return kdb_index_key(&value);
+}
+
+static inline uint64_t kdb_catalog_find(const kdb_index_t *index, const uint64_t key) {
+    uint64_t pos = kdb_index_start(index, key);
+    return kdb_index_next(index, key, &pos);
+}
+
+uint32_t kdb_catalog_symbol(const kdb_catalog_t *catalog, const kproto_str_t *name) {
+    uint64_t pos, sym;
+    const uint64_t key = kdb_catalog_hash(name);
+
+    // names sharing a hash sit in the same probe run
+    for (pos = kdb_index_start(&catalog->names, key); (sym = kdb_index_next(&catalog->names, key, &pos)) != KDB_INDEX_END;) {
+        const kproto_str_t *str = &catalog->strs[sym];
+        if (str->len == name->len && !memcmp(str->data, name->data, name->len))
+            return (uint32_t)sym;
+    }
+    return KDB_CATALOG_NONE;
+}
+
+uint32_t kdb_catalog_intern(kdb_catalog_t *catalog, const kproto_str_t *name) {
+    char *data;
+    kproto_str_t *strs;
+    uint32_t sym = kdb_catalog_symbol(catalog, name);
+    if (sym != KDB_CATALOG_NONE)
+        return sym;
+
+    // first time the name is seen, keep a copy for good
+    if (catalog->n_strs == catalog->max_strs) {
+        const uint32_t max = catalog->max_strs ? catalog->max_strs * 2 : 64;
+        if ((strs = realloc(catalog->strs, max * sizeof(kproto_str_t))) == NULL)
+            return KDB_CATALOG_NONE;
+        catalog->strs = strs;
+        catalog->max_strs = max;
+    }
+    if (kdb_index_reserve(&catalog->names, catalog->names.used + 1) || (data = malloc(name->len)) == NULL)
+        return KDB_CATALOG_NONE;
+    memcpy(data, name->data, name->len);
+    sym = catalog->n_strs++;
+    catalog->strs[sym].data = data;
+    catalog->strs[sym].len = name->len;
+    kdb_index_put(&catalog->names, kdb_catalog_hash(name), sym);
+    return sym;
+}
+
+const kproto_str_t* kdb_catalog_name(const kdb_catalog_t *catalog, const uint32_t sym) {
+    return &catalog->strs[sym];
+}
+
+int kdb_catalog_reserve(kdb_catalog_t *catalog, const uint8_t n_cols) {
+    // room for one more table so registering it cant fail halfway
+    if (kdb_index_reserve(&catalog->tables, catalog->tables.used + 1) ||
+        kdb_index_reserve(&catalog->handles, catalog->handles.used + 1) ||
+        kdb_index_reserve(&catalog->columns, catalog->columns.used + n_cols))
+        return -1;
+    return 0;
+}
+
+void kdb_catalog_put(kdb_catalog_t *catalog, const uint32_t sym, const uint32_t handle, const uint64_t slot) {
+    // a table put back right after its removal lands on the tombstone
+    // left in its probe run, so moving one needs no reserve
+    kdb_index_put(&catalog->tables, sym, slot);
+    kdb_index_put(&catalog->handles, handle, slot);
+}
+
+void kdb_catalog_remove(kdb_catalog_t *catalog, const uint32_t sym, const uint32_t handle, const uint64_t slot) {
+    kdb_index_remove(&catalog->tables, sym, slot);
+    kdb_index_remove(&catalog->handles, handle, slot);
+}
+
+void kdb_catalog_put_column(kdb_catalog_t *catalog, const uint32_t handle, const uint32_t sym, const uint8_t col) {
+    kdb_index_put(&catalog->columns, (uint64_t)handle << 32 | sym, col);
+}
+
+void kdb_catalog_remove_column(kdb_catalog_t *catalog, const uint32_t handle, const uint32_t sym, const uint8_t col) {
+    kdb_index_remove(&catalog->columns, (uint64_t)handle << 32 | sym, col);
+}
+
+uint64_t kdb_catalog_table(const kdb_catalog_t *catalog, const uint32_t sym) {
+    return kdb_catalog_find(&catalog->tables, sym);
+}
+
+uint64_t kdb_catalog_handle(const kdb_catalog_t *catalog, const uint32_t handle) {
+    return kdb_catalog_find(&catalog->handles, handle);
+}
+
+uint64_t kdb_catalog_column(const kdb_catalog_t *catalog, const uint32_t handle, const uint32_t sym) {
+    return kdb_catalog_find(&catalog->columns, (uint64_t)handle << 32 | sym);
+}
@@ -0,0 +1,45 @@
+#ifndef K_CATALOG_H
+#define K_CATALOG_H
+
+#include "index.h"
+
+// symbol of a name never interned, and a lookup that found nothing
+#define KDB_CATALOG_NONE UINT32_MAX
+
+// where every table and column is found by name or by handle. names are
+// interned once and known by their symbol afterwards, each map is a hash
+// index so no lookup walks the tables or their schemas:
+//
+//   names   := fnv-1a(name) -> symbol
+//   tables  := table symbol -> slot in dbs
+//   handles := table handle -> slot in dbs
+//   columns := table handle << 32 | column symbol -> column
+//
+// handles are never reused so one kept past a REM cant reach a new table,
+// interned names live as long as the catalog
+typedef struct {
+    kdb_index_t names;
+    kdb_index_t tables;
+    kdb_index_t handles;
+    kdb_index_t columns;
+    kproto_str_t *strs; // symbol -> name
+    uint32_t n_strs;
+    uint32_t max_strs;
+    uint32_t next; // handle the next table gets
+} kdb_catalog_t;
+
+int kdb_catalog_init(kdb_catalog_t *catalog);
+void kdb_catalog_free(kdb_catalog_t *catalog);
+uint32_t kdb_catalog_intern(kdb_catalog_t *catalog, const kproto_str_t *name);
+uint32_t kdb_catalog_symbol(const kdb_catalog_t *catalog, const kproto_str_t *name);
+const kproto_str_t* kdb_catalog_name(const kdb_catalog_t *catalog, const uint32_t sym);
+int kdb_catalog_reserve(kdb_catalog_t *catalog, const uint8_t n_cols);
+void kdb_catalog_put(kdb_catalog_t *catalog, const uint32_t sym, const uint32_t handle, const uint64_t slot);
+void kdb_catalog_remove(kdb_catalog_t *catalog, const uint32_t sym, const uint32_t handle, const uint64_t slot);
+void kdb_catalog_put_column(kdb_catalog_t *catalog, const uint32_t handle, const uint32_t sym, const uint8_t col);
+void kdb_catalog_remove_column(kdb_catalog_t *catalog, const uint32_t handle, const uint32_t sym, const uint8_t col);
+uint64_t kdb_catalog_table(const kdb_catalog_t *catalog, const uint32_t sym);
+uint64_t kdb_catalog_handle(const kdb_catalog_t *catalog, const uint32_t handle);
+uint64_t kdb_catalog_column(const kdb_catalog_t *catalog, const uint32_t handle, const uint32_t sym);
+
+#endif // K_CATALOG_H
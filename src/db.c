@@ -1,38 +1,728 @@
+#define _GNU_SOURCE
 #include "db.h"
 #include "ws.h"
+#include "query.h"
+#include "snap.h"
+#include "exec.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
-static kio_ctx_t *io_ctx;
+// milliseconds between checks on a snapshot being written
+#define KDB_SNAP_POLL 100
+
+// milliseconds between taking rows deleted under readers out of indexes
+#define KDB_COLLECT_INTERVAL 100
+
+// an answer held back until the log covers the commands behind it
+typedef struct {
+    void *next;
+    kws_client_t *ws; // NULL once the client closed
+    kproto_writer_t out;
+    uint8_t malformed;
+} kdb_ack_t;
+
+typedef struct {
+    kdb_ack_t *head;
+    kdb_ack_t *tail;
+    uint64_t lsn; // log end the queued answers wait on
+    unsigned scheduled : 1;
+    kpool_t acks;
+} kdb_worker_t;
+
+// a frame handed to a storage thread, the answer comes back to the loop
+// of the client through the post
+typedef struct {
+    kio_post_t post;
+    void *next;       // frames of the same client waiting their turn
+    void *session;
+    kio_ctx_t *ctx;
+    kproto_writer_t out;
+    uint64_t lsn;
+    uint8_t reads;
+    uint8_t malformed;
+    size_t len;
+    char data[];
+} kdb_job_t;
+
+// what a client keeps between frames, it outlives the client while one
+// of its frames is still with a storage thread
+typedef struct {
+    kws_client_t *ws; // NULL once the client closed
+    kdb_stmts_t *stmts;
+    kdb_job_t *head;  // frames waiting their turn
+    kdb_job_t *tail;
+    void *next;       // sessions stalled on the same io worker
+    uint8_t busy;     // a frame is with a storage thread
+    uint8_t stalled;  // its next frame found a storage ring full
+} kdb_session_t;
+
+// sessions of one io worker waiting on room in a storage ring. a storage
+// thread taking a job off posts back to every worker waiting, which then
+// tries them again in the order they stalled
+#define KDB_STALL_IDLE 0
+#define KDB_STALL_WAITING 1
+#define KDB_STALL_POSTED 2
+
+typedef struct {
+    kio_post_t post;
+    kdb_session_t *head;
+    kdb_session_t *tail;
+    uint8_t state;
+} kdb_stall_t;
+
+static kio_ctx_t *io_ctxs;
+static size_t io_workers;
+static kdb_ctx_t kdb_storage;
+static kdb_opts_t kdb_opts;
+static kdb_wal_t kdb_log;
+static kdb_worker_t *kdb_workers;
+static pid_t kdb_snap_pid;     // child writing a snapshot
+static uint64_t kdb_snap_lsn;  // log covered by the last snapshot
+static uint64_t kdb_snap_next; // and by the one being written
+static pthread_t kdb_trunc_thread; // cutting the log down to the snapshot
+static uint8_t kdb_truncating;
+static kio_post_t kdb_trunc_post;
+static uint64_t kdb_stmt_hits;   // statement caches of closed clients
+static uint64_t kdb_stmt_misses;
+static kdb_exec_t *kdb_execs;  // storage threads, the writer first
+static kdb_stall_t *kdb_stalls; // one per io worker, with storage threads
+static size_t kdb_exec_count;  // none runs commands on the io workers
+static size_t kdb_exec_live;   // storage threads yet to stop
+static kdb_team_t kdb_team;    // threads sharing scans over shards
 
 static void kdb_sig_cleanup(int sig) {
-    kio_free(io_ctx);
+    size_t i;
+
+    // storage threads stop first, the last one out stops the io workers
+    // so every answer it posted still finds its loop
+    if (kdb_execs != NULL) {
+        for (i = 0; i < kdb_exec_count; i++)
+            kdb_exec_stop(&kdb_execs[i]);
+        return;
+    }
+    for (i = 0; i < io_workers; i++)
+        kio_stop(&io_ctxs[i]);
+}
+
+static void kdb_answer(kws_client_t *client, kproto_writer_t *out, const int malformed, const int logged) {
+    // answer every command in one frame, the frame takes over the buffer
+    if (out->failed || !logged) {
+        kproto_writer_free(out);
+        kws_close(client, 1011, logged ? "Out of memory" : "Log failed");
+        return;
+    }
+    if (out->len > 0)
+        kws_send_owned(client, out->data, out->len, KWS_OP_BIN, free, out->data);
+    else
+        kproto_writer_free(out);
+    if (malformed)
+        kws_close(client, 1007, "Malformed command");
+}
+
+static void kdb_flush_acks(void *data) {
+    kdb_ack_t *ack;
+    kdb_worker_t *worker = (kdb_worker_t*)data;
+
+    // one commit covers every answer queued since the last one, other
+    // workers committing at the same time share the write and sync
+    const int logged = kdb_wal_commit(&kdb_log, worker->lsn) == 0;
+    worker->scheduled = 0;
+    while ((ack = worker->head) != NULL) {
+        worker->head = ack->next;
+        if (ack->ws != NULL)
+            kdb_answer(ack->ws, &ack->out, ack->malformed, logged);
+        else
+            kproto_writer_free(&ack->out);
+        kpool_release(&worker->acks, ack);
+    }
+    worker->tail = NULL;
+}
+
+static int kdb_defer(kws_client_t *client, kproto_writer_t *out, const int malformed, const uint64_t lsn) {
+    kio_ctx_t *ctx = client->client->ctx;
+    kdb_worker_t *worker = &kdb_workers[ctx->id];
+    kdb_ack_t *ack;
+
+    // reads with nothing queued ahead of them can go out right away
+    if (lsn == 0 && worker->head == NULL)
+        return -1;
+    if ((ack = kpool_alloc(&worker->acks)) == NULL)
+        return -1;
+    ack->next = NULL;
+    ack->ws = client;
+    ack->out = *out;
+    ack->malformed = malformed;
+    if (worker->tail != NULL)
+        worker->tail->next = ack;
+    else
+        worker->head = ack;
+    worker->tail = ack;
+    if (lsn > worker->lsn)
+        worker->lsn = lsn;
+
+    // commit once the worker is done with the messages read this turn
+    if (!worker->scheduled) {
+        if (kio_call(ctx, 0, worker, kdb_flush_acks))
+            kdb_flush_acks(worker);
+        else
+            worker->scheduled = 1;
+    }
+    return 0;
+}
+
+static kdb_stmts_t* kdb_session_stmts(kdb_session_t *session) {
+    // a client only pays for a statement cache once it uses one
+    if (session->stmts == NULL && (session->stmts = malloc(sizeof(kdb_stmts_t))) != NULL)
+        kdb_stmts_init(session->stmts);
+    return session->stmts;
+}
+
+static void kdb_session_free(kdb_session_t *session) {
+    kdb_job_t *job;
+
+    // statements go with the client, their counters add to the totals
+    if (session->stmts != NULL) {
+        __atomic_fetch_add(&kdb_stmt_hits, session->stmts->hits, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&kdb_stmt_misses, session->stmts->misses, __ATOMIC_RELAXED);
+        kdb_stmts_free(session->stmts);
+        free(session->stmts);
+    }
+    while ((job = session->head) != NULL) {
+        session->head = job->next;
+        free(job);
+    }
+    free(session);
+}
+
+static int kdb_frame_reads(kdb_session_t *session, const char *data, const size_t len) {
+    int reads;
+    kproto_cmd_t cmd;
+    kproto_reader_t reader;
+
+    // a frame of nothing but reads runs on a snapshot beside the writer
+    kproto_reader(&reader, data, len);
+    for (reads = kdb_storage.shared; reads && kproto_next(&reader, &cmd) > 0;)
+        reads = kdb_query_reads(session->stmts, &cmd);
+    return reads;
+}
+
+static int kdb_execute(kdb_session_t *session, const size_t reader, const int reads, const char *data, const size_t len, kproto_writer_t *out, uint64_t *lsn) {
+    int decoded;
+    size_t start;
+    kproto_cmd_t cmd;
+    kdb_locks_t locks;
+    kdb_stmts_t *stmts;
+    kproto_writer_t redo;
+    kproto_reader_t frame;
+
+    // run every command in the frame, stop at the first malformed one,
+    // changes are logged in the order they were applied. an EXEC is
+    // logged as the command it ran, plain commands as they arrived.
+    // each command holds what it locked until it is logged
+    kproto_reader(&frame, data, len);
+    kproto_writer(&redo);
+    for (start = 0; (decoded = kproto_next(&frame, &cmd)) > 0; start = frame.pos) {
+        stmts = cmd.op == K_CMD_STMT || cmd.op == K_CMD_EXEC ? kdb_session_stmts(session) : NULL;
+        if (reads) {
+            kdb_query_read(&kdb_storage, reader, stmts, &cmd, out);
+            continue;
+        }
+        redo.len = 0;
+        redo.failed = 0;
+        if (kdb_query(&kdb_storage, stmts, &cmd, out, kdb_workers != NULL ? &redo : NULL, &locks) == KDB_OK && kdb_workers != NULL) {
+            if (redo.failed)
+                *lsn = kdb_wal_append(&kdb_log, NULL, 0);
+            else if (redo.len > 0)
+                *lsn = kdb_wal_append(&kdb_log, redo.data, redo.len);
+            else if (cmd.op != K_CMD_GET && cmd.op < K_CMD_PREP)
+                *lsn = kdb_wal_append(&kdb_log, data + start, frame.pos - start);
+        }
+        kdb_query_unlock(&kdb_storage, &locks);
+    }
+    kproto_writer_free(&redo);
+    return decoded < 0;
+}
+
+static void kdb_reply(kws_client_t *client, kproto_writer_t *out, const int malformed, const uint64_t lsn) {
+    // with a log, answers keep their order behind any waiting on a commit
+    if (kdb_workers != NULL && !kdb_defer(client, out, malformed, lsn))
+        return;
+    kdb_answer(client, out, malformed, lsn == 0 || kdb_wal_commit(&kdb_log, lsn) == 0);
+}
+
+static void kdb_session_next(kdb_session_t *session);
+
+static void kdb_unstall(void *data) {
+    kdb_stall_t *stall = (kdb_stall_t*)data;
+    kdb_session_t *session = stall->head, *next;
+
+    // sessions stalling again from here wait on the next post
+    __atomic_store_n(&stall->state, KDB_STALL_IDLE, __ATOMIC_SEQ_CST);
+    stall->head = stall->tail = NULL;
+    for (; session != NULL; session = next) {
+        next = session->next;
+        session->stalled = 0;
+        if (session->ws == NULL)
+            kdb_session_free(session);
+        else
+            kdb_session_next(session);
+    }
+}
+
+static void kdb_stall_wake() {
+    size_t i;
+    uint8_t waiting;
+
+    // runs on a storage thread right after it took a job off its ring
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < io_workers; i++) {
+        waiting = KDB_STALL_WAITING;
+        if (__atomic_load_n(&kdb_stalls[i].state, __ATOMIC_RELAXED) == waiting &&
+            __atomic_compare_exchange_n(&kdb_stalls[i].state, &waiting, KDB_STALL_POSTED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            kio_post(&io_ctxs[i], &kdb_stalls[i].post, &kdb_stalls[i], kdb_unstall);
+    }
+}
+
+static int kdb_stall_push(kdb_exec_t *exec, kdb_job_t *job) {
+    uint8_t idle = KDB_STALL_IDLE;
+    kdb_stall_t *stall = &kdb_stalls[job->ctx->id];
+
+    // say the worker waits and try once more, a storage thread taking a
+    // job off either makes room for this push or sees it waiting. a post
+    // already on its way retries everything stalled anyway
+    __atomic_compare_exchange_n(&stall->state, &idle, KDB_STALL_WAITING, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return kdb_exec_push(exec, job);
+}
+
+static void kdb_session_next(kdb_session_t *session) {
+    size_t i;
+    kdb_stall_t *stall;
+    kdb_exec_t *exec = &kdb_execs[0];
+    kdb_job_t *job = session->head;
+
+    // one frame at a time, so answers go out in order and a frame sees
+    // every change the ones before it made
+    if (session->busy || session->stalled || job == NULL)
+        return;
+    session->head = job->next;
+    if (session->head == NULL)
+        session->tail = NULL;
+
+    // the writer takes frames that change something, reads go to the
+    // reader with the least left to do so a short one doesnt wait on a scan.
+    // with sharded tables writers on different shards run side by side,
+    // so changes go to whichever thread has the least left as well
+    if ((job->reads = kdb_frame_reads(session, job->data, job->len)) || __atomic_load_n(&kdb_storage.n_shards, __ATOMIC_RELAXED))
+        for (exec = &kdb_execs[i = job->reads ? 1 : 0]; i < kdb_exec_count; i++)
+            if (__atomic_load_n(&kdb_execs[i].pending, __ATOMIC_RELAXED) < __atomic_load_n(&exec->pending, __ATOMIC_RELAXED))
+                exec = &kdb_execs[i];
+
+    // a full ring leaves the frame first in line and the session waits
+    // for storage to make room, unless storage is stopping and the frame
+    // goes with the client
+    if (kdb_exec_push(exec, job) && (exec->stop || kdb_stall_push(exec, job))) {
+        job->next = session->head;
+        session->head = job;
+        if (session->tail == NULL)
+            session->tail = job;
+        if (exec->stop)
+            return;
+        stall = &kdb_stalls[job->ctx->id];
+        session->next = NULL;
+        session->stalled = 1;
+        if (stall->tail != NULL)
+            stall->tail->next = session;
+        else
+            stall->head = session;
+        stall->tail = session;
+        return;
+    }
+    session->busy = 1;
+}
+
+static void kdb_job_done(void *data) {
+    kdb_job_t *job = (kdb_job_t*)data;
+    kdb_session_t *session = (kdb_session_t*)job->session;
+
+    // still busy while answering, closing the client on a bad frame
+    // leaves the session to this
+    if (session->ws != NULL)
+        kdb_reply(session->ws, &job->out, job->malformed, job->lsn);
+    else
+        kproto_writer_free(&job->out);
+    free(job);
+    session->busy = 0;
+    if (session->ws == NULL)
+        kdb_session_free(session);
+    else
+        kdb_session_next(session);
+}
+
+static void kdb_job_run(void *arg, void *data) {
+    kdb_exec_t *exec = (kdb_exec_t*)arg;
+    kdb_job_t *job = (kdb_job_t*)data;
+    size_t i;
+
+    // the last storage thread to stop lets the io workers go
+    if (job == NULL) {
+        if (__atomic_sub_fetch(&kdb_exec_live, 1, __ATOMIC_ACQ_REL) == 0)
+            for (i = 0; i < io_workers; i++)
+                kio_stop(&io_ctxs[i]);
+        return;
+    }
+    kdb_stall_wake();
+    job->lsn = 0;
+    kproto_writer(&job->out);
+    job->malformed = kdb_execute(job->session, job->reads ? exec->id - 1 : 0, job->reads, job->data, job->len, &job->out, &job->lsn);
+    kio_post(job->ctx, &job->post, job, kdb_job_done);
+}
+
+static void kdb_job_drop(void *arg, void *data) {
+    kdb_job_t *job = (kdb_job_t*)data;
+    kdb_session_t *session = (kdb_session_t*)job->session;
+
+    // left in a ring at exit, the client closed with its loop
+    free(job);
+    kdb_session_free(session);
 }
 
 static void kdb_on_message(kws_client_t *client, const char *data, size_t len) {
-    printf("Got message: %.*s\n", (int)len, data);
+    int malformed;
+    uint64_t lsn = 0;
+    kdb_job_t *job;
+    kproto_writer_t out;
+    kdb_session_t *session = (kdb_session_t*)client->data;
+
+    // without storage threads the frame runs right here
+    if (kdb_execs == NULL) {
+        kproto_writer(&out);
+        malformed = kdb_execute(session, client->client->ctx->id, kdb_frame_reads(session, data, len), data, len, &out, &lsn);
+        kdb_reply(client, &out, malformed, lsn);
+        return;
+    }
+
+    // the frame only lives as long as this call, its job takes a copy
+    if ((job = malloc(sizeof(kdb_job_t) + len)) == NULL) {
+        kws_close(client, 1011, "Out of memory");
+        return;
+    }
+    memcpy(job->data, data, len);
+    job->len = len;
+    job->next = NULL;
+    job->session = session;
+    job->ctx = client->client->ctx;
+    if (session->tail != NULL)
+        session->tail->next = job;
+    else
+        session->head = job;
+    session->tail = job;
+    kdb_session_next(session);
 }
 
 static void kdb_on_close(kws_client_t *client, uint16_t code, const char *reason, size_t len) {
+    kdb_ack_t *ack;
+    kdb_session_t *session = (kdb_session_t*)client->data;
     printf("Closing with code: %hu and reason: %.*s\n", code, (int)len, reason);
+
+    // a frame still with a storage thread frees the session once done,
+    // a stalled one once it is tried again
+    session->ws = NULL;
+    client->data = NULL;
+    if (!session->busy && !session->stalled)
+        kdb_session_free(session);
+
+    // answers still waiting on the log have nowhere to go
+    if (kdb_workers != NULL)
+        for (ack = kdb_workers[client->client->ctx->id].head; ack != NULL; ack = ack->next)
+            if (ack->ws == client)
+                ack->ws = NULL;
 }
 
 static void kdb_on_client(kws_client_t *client) {
+    kdb_session_t *session = calloc(1, sizeof(kdb_session_t));
     printf("Accepted client\n");
+    if (session == NULL) {
+        kws_close(client, 1011, "Out of memory");
+        return;
+    }
+    session->ws = client;
+    client->data = session;
     kws_on_close(client, kdb_on_close);
     kws_on_message(client, kdb_on_message);
 }
 
-int kdb_run(kio_ctx_t *ctx, const uint16_t port) {
-    io_ctx = ctx;
+static void kdb_replay(const char *data, const size_t len, void *arg) {
+    kproto_cmd_t cmd;
+    kdb_locks_t locks;
+    kproto_reader_t reader;
+    kproto_writer_t *out = (kproto_writer_t*)arg;
+
+    // the log only holds commands that decoded and succeeded before
+    kproto_reader(&reader, data, len);
+    out->len = 0;
+    if (kproto_next(&reader, &cmd) > 0) {
+        kdb_query(&kdb_storage, NULL, &cmd, out, NULL, &locks);
+        kdb_query_unlock(&kdb_storage, &locks);
+    }
+}
+
+static void kdb_sync_log(void *data) {
+    kdb_wal_sync(&kdb_log);
+    if (kio_call(&io_ctxs[0], kdb_opts.wal_interval, NULL, kdb_sync_log))
+        fprintf(stderr, "[KDB] Failed to schedule log sync\n");
+}
+
+static void kdb_collect(void *data) {
+    pthread_mutex_lock(&kdb_storage.lock);
+    kdb_ctx_collect(&kdb_storage);
+    pthread_mutex_unlock(&kdb_storage.lock);
+    if (kio_call(&io_ctxs[0], KDB_COLLECT_INTERVAL, NULL, kdb_collect))
+        fprintf(stderr, "[KDB] Failed to schedule collecting deleted rows\n");
+}
+
+static void kdb_snap_start(void *data);
+
+static void kdb_trunc_done(void *data) {
+    // the next snapshot waits on the log being cut down to this one
+    pthread_join(kdb_trunc_thread, NULL);
+    kdb_truncating = 0;
+    kio_call(&io_ctxs[0], kdb_opts.snap_interval * 1000, NULL, kdb_snap_start);
+}
+
+static void* kdb_trunc_run(void *arg) {
+    kdb_wal_truncate(&kdb_log, kdb_snap_lsn);
+    kio_post(&io_ctxs[0], &kdb_trunc_post, NULL, kdb_trunc_done);
+    return NULL;
+}
+
+static void kdb_snap_wait(void *data) {
+    int status;
+    const pid_t pid = waitpid(kdb_snap_pid, &status, WNOHANG);
+    if (pid == 0) {
+        kio_call(&io_ctxs[0], KDB_SNAP_POLL, NULL, kdb_snap_wait);
+        return;
+    }
+
+    // the log only has to keep what came after the snapshot
+    kdb_snap_pid = 0;
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "[KDB] Snapshot failed, keeping the log\n");
+    } else {
+        kdb_snap_lsn = kdb_snap_next;
+        printf("Snapshot written up to log %lu\n", (unsigned long)kdb_snap_lsn);
+
+        // copying the log takes a while for a long one, so it happens
+        // off the loop and posts back once the new file is in
+        if (kdb_workers != NULL) {
+            if (pthread_create(&kdb_trunc_thread, NULL, kdb_trunc_run, NULL) == 0) {
+                kdb_truncating = 1;
+                return;
+            }
+            kdb_wal_truncate(&kdb_log, kdb_snap_lsn);
+        }
+    }
+    kio_call(&io_ctxs[0], kdb_opts.snap_interval * 1000, NULL, kdb_snap_start);
+}
+
+static void kdb_snap_start(void *data) {
+    pid_t pid = 0;
+    uint64_t lsn = 0;
+
+    // the child writes the tables as they were at the fork, holding the
+    // lock and every shard means no command is half applied in its copy
+    kdb_ctx_lock(&kdb_storage);
+    if (kdb_workers != NULL)
+        lsn = kdb_log.appended;
+    if ((kdb_workers == NULL || lsn > kdb_snap_lsn) && (pid = fork()) == 0) {
+        // sockets closed by the parent shouldnt stay open in here
+        signal(SIGINT, SIG_IGN);
+        close_range(3, ~0U, 0);
+        _exit(kdb_snap_write(&kdb_storage, kdb_opts.snap_path, lsn) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    kdb_ctx_unlock(&kdb_storage);
+
+    if (pid > 0) {
+        kdb_snap_pid = pid;
+        kdb_snap_next = lsn;
+        kio_call(&io_ctxs[0], KDB_SNAP_POLL, NULL, kdb_snap_wait);
+        return;
+    }
+    if (pid < 0)
+        fprintf(stderr, "[KDB] Failed to start snapshot: %s\n", strerror(errno));
+    kio_call(&io_ctxs[0], kdb_opts.snap_interval * 1000, NULL, kdb_snap_start);
+}
+
+static int kdb_open_log() {
+    size_t i;
+    kproto_writer_t out;
+
+    // rebuild the tables from the log before taking clients
+    kproto_writer(&out);
+    const int err = kdb_wal_open(&kdb_log, kdb_opts.wal_path, kdb_opts.wal_mode, kdb_snap_lsn, kdb_replay, &out);
+    kproto_writer_free(&out);
+    if (err) {
+        kdb_wal_close(&kdb_log);
+        return -1;
+    }
+
+    if ((kdb_workers = calloc(io_workers, sizeof(kdb_worker_t))) == NULL) {
+        fprintf(stderr, "[KDB] Not enough memory for log workers\n");
+        kdb_wal_close(&kdb_log);
+        return -1;
+    }
+    for (i = 0; i < io_workers; i++)
+        kpool_init(&kdb_workers[i].acks, sizeof(kdb_ack_t));
+    if (kdb_opts.wal_mode == KDB_WAL_PERIODIC)
+        kio_call(&io_ctxs[0], kdb_opts.wal_interval, NULL, kdb_sync_log);
+    return 0;
+}
+
+static void kdb_close_log() {
+    size_t i;
+    kdb_ack_t *ack;
+
+    // clients are gone, drop what they never got
+    for (i = 0; i < io_workers; i++) {
+        while ((ack = kdb_workers[i].head) != NULL) {
+            kdb_workers[i].head = ack->next;
+            kproto_writer_free(&ack->out);
+            kpool_release(&kdb_workers[i].acks, ack);
+        }
+        kpool_free(&kdb_workers[i].acks);
+    }
+    free(kdb_workers);
+    kdb_workers = NULL;
+    printf("Log wrote %lu batches with %lu syncs\n", (unsigned long)kdb_log.batches, (unsigned long)kdb_log.syncs);
+    kdb_wal_close(&kdb_log);
+}
+
+static void kdb_stop_execs(const size_t count) {
+    size_t i;
+    kdb_session_t *session;
+
+    // already stopped unless the io workers quit on their own
+    for (i = 0; i < count; i++)
+        kdb_exec_stop(&kdb_execs[i]);
+    for (i = 0; i < count; i++)
+        kdb_exec_join(&kdb_execs[i], kdb_job_drop);
+    free(kdb_execs);
+    kdb_execs = NULL;
+    kdb_exec_count = 0;
+
+    // sessions still stalled lost their clients with the loops
+    for (i = 0; i < io_workers; i++) {
+        while ((session = kdb_stalls[i].head) != NULL) {
+            kdb_stalls[i].head = session->next;
+            kdb_session_free(session);
+        }
+    }
+    free(kdb_stalls);
+    kdb_stalls = NULL;
+}
+
+static int kdb_start_execs(const size_t count) {
+    size_t i;
+    if ((kdb_execs = calloc(count, sizeof(kdb_exec_t))) == NULL || (kdb_stalls = calloc(io_workers, sizeof(kdb_stall_t))) == NULL) {
+        fprintf(stderr, "[KDB] Not enough memory for storage threads\n");
+        free(kdb_execs);
+        kdb_execs = NULL;
+        return -1;
+    }
+    kdb_exec_live = count;
+    for (i = 0; i < count; i++) {
+        if (kdb_exec_start(&kdb_execs[i], i, kdb_job_run, NULL)) {
+            kdb_stop_execs(i);
+            return -1;
+        }
+    }
+    kdb_exec_count = count;
+    return 0;
+}
+
+int kdb_run(kio_ctx_t *ctxs, const size_t workers, const uint16_t port, const kdb_opts_t *opts) {
+    size_t i, readers;
+    io_ctxs = ctxs;
+    io_workers = workers;
+    kdb_opts = *opts;
 
     // bind CTRL-C to exit
     struct sigaction sig_handler;
+    memset(&sig_handler, 0, sizeof(sig_handler));
+    sigemptyset(&sig_handler.sa_mask);
     sig_handler.sa_handler = kdb_sig_cleanup;
     sigaction(SIGINT, &sig_handler, NULL);
 
-    // start websocket server
-    kws_init(io_ctx, kdb_on_client);
-    return kio_run(io_ctx, port);
-}
\ No newline at end of file
+    // start from the last snapshot and whatever the log has after it
+    if (kdb_ctx_init(&kdb_storage)) {
+        fprintf(stderr, "[KDB] Not enough memory for the catalog\n");
+        kdb_ctx_free(&kdb_storage);
+        return -1;
+    }
+    if (kdb_opts.snap_path != NULL && kdb_snap_load(&kdb_storage, kdb_opts.snap_path, &kdb_snap_lsn)) {
+        kdb_ctx_free(&kdb_storage);
+        return -1;
+    }
+    if (kdb_opts.wal_path != NULL && kdb_open_log()) {
+        kdb_ctx_free(&kdb_storage);
+        return -1;
+    }
+    if (kdb_opts.snap_path != NULL)
+        kio_call(&io_ctxs[0], kdb_opts.snap_interval * 1000, NULL, kdb_snap_start);
+
+    // reads only run beside the writer with more than one thread running
+    // commands, which is when rows start keeping versions for them. with
+    // storage threads the first one writes and the rest read
+    readers = kdb_opts.exec_threads ? kdb_opts.exec_threads - 1 : (workers > 1 ? workers : 0);
+    if (readers > 0) {
+        if (kdb_ctx_share(&kdb_storage, readers)) {
+            fprintf(stderr, "[KDB] Not enough memory for the readers\n");
+            kdb_ctx_free(&kdb_storage);
+            return -1;
+        }
+        kio_call(&io_ctxs[0], KDB_COLLECT_INTERVAL, NULL, kdb_collect);
+    }
+    if (kdb_opts.scan_threads) {
+        if (kdb_team_start(&kdb_team, kdb_opts.scan_threads)) {
+            kdb_ctx_free(&kdb_storage);
+            return -1;
+        }
+        kdb_storage.team = &kdb_team;
+    }
+    if (kdb_opts.exec_threads && kdb_start_execs(kdb_opts.exec_threads)) {
+        if (kdb_storage.team != NULL)
+            kdb_team_stop(&kdb_team);
+        kdb_ctx_free(&kdb_storage);
+        return -1;
+    }
+
+    // start websocket server on every worker, sharing one storage
+    for (i = 0; i < workers; i++)
+        kws_init(&io_ctxs[i], kdb_on_client);
+    const int result = kio_run_workers(io_ctxs, io_workers, port);
+    if (kdb_execs != NULL)
+        kdb_stop_execs(kdb_exec_count);
+    if (kdb_storage.team != NULL)
+        kdb_team_stop(&kdb_team);
+
+    // a snapshot cut short is never swapped in, the last one stands
+    if (kdb_snap_pid > 0) {
+        kill(kdb_snap_pid, SIGKILL);
+        waitpid(kdb_snap_pid, NULL, 0);
+    }
+    if (kdb_truncating) {
+        pthread_join(kdb_trunc_thread, NULL);
+        kdb_truncating = 0;
+    }
+    if (kdb_workers != NULL)
+        kdb_close_log();
+    if (kdb_stmt_hits + kdb_stmt_misses > 0)
+        printf("Statements hit %lu times and missed %lu times\n", (unsigned long)kdb_stmt_hits, (unsigned long)kdb_stmt_misses);
+    kdb_ctx_free(&kdb_storage);
+    return result;
+}
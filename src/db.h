@@ -2,26 +2,100 @@
 #define K_DB_H
 
 #include "io.h"
+#include "index.h"
+#include "catalog.h"
+#include "tree.h"
+#include "wal.h"
+#include "team.h"
+#include <pthread.h>
 
 typedef struct {
-    char *name;
+    const char *name; // interned in the catalog
+    uint32_t sym;
     uint8_t type;
     uint8_t name_len;
     size_t maxsize;
+    uint8_t flags;
+    uint8_t width;
+    uint8_t mapped; // KDB_MAPPED_* arrays still in a snapshot
+    char *data;
+    uint32_t *lens;
+    char *arena;
+    size_t arena_len;
+    size_t arena_max;
+    kdb_index_t index; // no slots when the column isnt indexed
+    kdb_tree_t tree;   // no root when the column isnt ordered
 } kdb_column_t;
 
+// rows as they were before writers changed them under readers, see
+// version.h
 typedef struct {
-    char *name;
+    uint64_t *touched; // epoch each block last changed at
+    uint64_t *kept;    // rows of each block kept at that epoch
+    void **chains;     // newest version kept in each block
+    size_t size;       // bytes a version of a row takes
+    uint64_t *gone;    // deleted rows readers may still find in the indexes
+    size_t n_gone;
+    size_t max_gone;
+} kdb_versions_t;
+
+typedef struct {
+    const char *name; // interned in the catalog
+    uint32_t sym;
+    uint32_t handle;
     uint8_t name_len;
     uint8_t n_cols;
     kdb_column_t *cols;
+    uint64_t n_rows;
+    uint64_t n_live;
+    uint64_t cap;
+    uint64_t *live;
+    uint8_t mapped; // live bitmap still in a snapshot
+    kdb_versions_t versions;
+    uint8_t n_shards;  // rows split by a hash of a column, 0 when they arent
+    uint8_t shard_key; // that column
+    void *shards;      // kdb_t holding the rows of each shard, in its context
 } kdb_t;
 
+// snapshots readers are at and the memory versions are cut from, which
+// goes back once every reader is past it
+typedef struct {
+    uint64_t *reading; // epoch of each reader, KDB_EPOCH_LATEST when idle
+    size_t n_readers;
+    void *oldest;      // chunks of versions in the order they were cut
+    void *newest;
+    void *spare;
+    size_t n_spare;
+    size_t used;       // bytes cut from the newest chunk
+} kdb_epochs_t;
+
 typedef struct {
     kdb_t *dbs;
     size_t db_len;
+    kdb_catalog_t catalog;
+    void *snap;      // loaded snapshot, tables point into it until they
+    size_t snap_len; // grow or change their strings
+    pthread_mutex_t lock;    // one writer at a time
+    pthread_rwlock_t layout; // readers share it, writers moving things take it
+    uint64_t epoch;          // last command the writer finished
+    uint8_t shared;          // readers run beside the writer, keep versions
+    uint8_t exclusive;       // the running command holds the layout
+    kdb_epochs_t epochs;
+    void *shards;      // kdb_ctx_t of each shard number tables split into,
+    size_t n_shards;   // with the lock, epoch and versions of its rows
+    kdb_team_t *team;  // threads scans over shards fan out to, none when NULL
 } kdb_ctx_t;
 
-int kdb_run(kio_ctx_t *ctx, const uint16_t port);
+typedef struct {
+    const char *wal_path; // no log when NULL
+    int wal_mode;
+    uint64_t wal_interval;
+    const char *snap_path; // no snapshots when NULL
+    uint64_t snap_interval;
+    size_t exec_threads; // storage threads, commands run on the io workers when 0
+    size_t scan_threads; // threads helping scans over shards, each runs in turn when 0
+} kdb_opts_t;
+
+int kdb_run(kio_ctx_t *ctxs, const size_t workers, const uint16_t port, const kdb_opts_t *opts);
 
 #endif
\ No newline at end of file
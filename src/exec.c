@@ -0,0 +1,111 @@
+#include "exec.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static void* kdb_exec_loop(void *arg) {
+    void *job;
+    uint64_t wakeups;
+    kdb_exec_t *exec = (kdb_exec_t*)arg;
+
+    while (!exec->stop) {
+        if ((job = kring_pop(&exec->ring)) != NULL) {
+            exec->run(exec, job);
+            __atomic_sub_fetch(&exec->pending, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // say it is going to sleep and look once more, a push racing it
+        // is either seen here or sees it asleep and wakes it
+        __atomic_store_n(&exec->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if ((job = kring_pop(&exec->ring)) != NULL) {
+            __atomic_store_n(&exec->sleeping, 0, __ATOMIC_RELAXED);
+            exec->run(exec, job);
+            __atomic_sub_fetch(&exec->pending, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (read(exec->wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EINTR) {
+            fprintf(stderr, "[KDB] Storage thread %u failed to wait for jobs\n", exec->id);
+            break;
+        }
+        __atomic_store_n(&exec->sleeping, 0, __ATOMIC_RELAXED);
+    }
+    exec->run(exec, NULL);
+    return NULL;
+}
+
+int kdb_exec_start(kdb_exec_t *exec, const unsigned id, kdb_exec_cb_t run, void *data) {
+    int err;
+    sigset_t mask, old_mask;
+    exec->id = id;
+    exec->run = run;
+    exec->data = data;
+    exec->stop = 0;
+    exec->sleeping = 0;
+    exec->pending = 0;
+    if ((exec->wake_fd = eventfd(0, 0)) == -1) {
+        fprintf(stderr, "[KDB] Failed to create storage thread wakeup\n");
+        return -1;
+    }
+    if (kring_init(&exec->ring, KRING_SIZE)) {
+        fprintf(stderr, "[KDB] Not enough memory for a storage ring\n");
+        close(exec->wake_fd);
+        return -1;
+    }
+
+    // signals stay with the thread that runs the first io worker
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    err = pthread_create(&exec->thread, NULL, kdb_exec_loop, exec);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (err) {
+        fprintf(stderr, "[KDB] Failed to spawn storage thread %u\n", id);
+        kring_free(&exec->ring);
+        close(exec->wake_fd);
+        return -1;
+    }
+    return 0;
+}
+
+int kdb_exec_push(kdb_exec_t *exec, void *job) {
+    const uint64_t one = 1;
+
+    // counted before the thread can finish it
+    __atomic_add_fetch(&exec->pending, 1, __ATOMIC_RELAXED);
+    if (kring_push(&exec->ring, job)) {
+        __atomic_sub_fetch(&exec->pending, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    // only a thread that said it sleeps needs the eventfd
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&exec->sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&exec->sleeping, 0, __ATOMIC_RELAXED)) {
+        if (write(exec->wake_fd, &one, sizeof(one)) < 0)
+            fprintf(stderr, "[KDB] Failed to wake storage thread %u\n", exec->id);
+    }
+    return 0;
+}
+
+void kdb_exec_stop(kdb_exec_t *exec) {
+    const uint64_t one = 1;
+
+    // safe to call from signals, the thread finishes the job it is on
+    exec->stop = 1;
+    if (write(exec->wake_fd, &one, sizeof(one)) < 0)
+        fprintf(stderr, "[KDB] Failed to wake storage thread %u\n", exec->id);
+}
+
+void kdb_exec_join(kdb_exec_t *exec, kdb_exec_cb_t left) {
+    void *job;
+    pthread_join(exec->thread, NULL);
+
+    // jobs it never got to go back to whoever pushed them
+    while ((job = kring_pop(&exec->ring)) != NULL)
+        left(exec, job);
+    kring_free(&exec->ring);
+    close(exec->wake_fd);
+    exec->wake_fd = -1;
+}
@@ -0,0 +1,31 @@
+#ifndef K_EXEC_H
+#define K_EXEC_H
+
+#include "ring.h"
+#include <signal.h>
+#include <pthread.h>
+
+// called on the storage thread with each job, and once with no job when
+// the thread stops
+typedef void (*kdb_exec_cb_t)(void *exec, void *job);
+
+// a storage thread running the jobs io workers push onto its ring, it
+// sleeps on an eventfd while the ring is empty
+typedef struct {
+    unsigned id;
+    int wake_fd;
+    uint8_t sleeping;
+    volatile sig_atomic_t stop;
+    uint64_t pending; // jobs pushed and not yet run to the end
+    kring_t ring;
+    pthread_t thread;
+    kdb_exec_cb_t run;
+    void *data;
+} kdb_exec_t;
+
+int kdb_exec_start(kdb_exec_t *exec, const unsigned id, kdb_exec_cb_t run, void *data);
+int kdb_exec_push(kdb_exec_t *exec, void *job);
+void kdb_exec_stop(kdb_exec_t *exec);
+void kdb_exec_join(kdb_exec_t *exec, kdb_exec_cb_t left);
+
+#endif // K_EXEC_H
@@ -0,0 +1,443 @@
+#include "filter.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KDB_FILTER_X86 1
+#endif
+
+// a kernel ands the rows of each block that pass the comparison into bits,
+// data points at the first row of the first block
+typedef void (*kdb_kernel_fn)(const void *data, const uint8_t cmp, const kproto_value_t *goal, const size_t blocks, uint64_t *bits);
+
+// kernels by column type, signed then unsigned
+typedef kdb_kernel_fn kdb_kernels_t[K_TYPE_STRING][2];
+
+static int kdb_filter_const(kdb_filter_t *filter, const int holds) {
+    const kdb_column_t *col = filter->col;
+
+    // a comparison every row passes or none does, made against the least
+    // value of the column so it stays one the log can replay
+    filter->cmp = holds ? K_CMP_GE : K_CMP_LT;
+    filter->value.type = col->type;
+    filter->value.flags = col->flags;
+    if (col->flags & K_TYPE_UNSIGNED)
+        filter->value.u = 0;
+    else
+        filter->value.i = col->width < 8 ? -(1LL << (col->width * 8 - 1)) : INT64_MIN;
+    return KDB_OK;
+}
+
+static int kdb_filter_outside(kdb_filter_t *filter, const int above) {
+    // a literal past either end of the column orders the same against every row
+    switch (filter->cmp) {
+        case K_CMP_EQ: return kdb_filter_const(filter, 0);
+        case K_CMP_NE: return kdb_filter_const(filter, 1);
+        case K_CMP_LT:
+        case K_CMP_LE: return kdb_filter_const(filter, above);
+    }
+    return kdb_filter_const(filter, !above);
+}
+
+static int kdb_filter_whole(kdb_filter_t *filter, const kproto_value_t *value, kproto_value_t *literal) {
+    double floor, ceil, whole;
+    const double d = value->d;
+    const unsigned bits = filter->col->width * 8;
+    const int is_unsigned = filter->col->flags & K_TYPE_UNSIGNED;
+    const double low = is_unsigned ? 0 : -(double)(1ULL << (bits - 1));
+    const double end = is_unsigned ? 2.0 * (double)(1ULL << (bits - 1)) : (double)(1ULL << (bits - 1));
+
+    // nan equals nothing and orders against nothing
+    if (d != d)
+        return kdb_filter_const(filter, filter->cmp == K_CMP_NE);
+
+    // a fraction between two integers falls to the one that keeps the
+    // comparison, x < 2.5 is x <= 2 and x > 2.5 is x >= 3
+    floor = ceil = d;
+    if (d > -4503599627370496.0 && d < 4503599627370496.0) {
+        whole = (double)(int64_t)d;
+        floor = whole > d ? whole - 1 : whole;
+        ceil = whole < d ? whole + 1 : whole;
+    }
+    if (floor != d) {
+        switch (filter->cmp) {
+            case K_CMP_EQ: return kdb_filter_const(filter, 0);
+            case K_CMP_NE: return kdb_filter_const(filter, 1);
+            case K_CMP_LT:
+            case K_CMP_LE:
+                filter->cmp = K_CMP_LE;
+                whole = floor;
+                break;
+            default:
+                filter->cmp = K_CMP_GE;
+                whole = ceil;
+                break;
+        }
+    } else {
+        whole = d;
+    }
+    if (whole < low || whole >= end)
+        return kdb_filter_outside(filter, whole >= end);
+    literal->type = K_TYPE_LONG;
+    literal->flags = is_unsigned ? K_TYPE_UNSIGNED : 0;
+    if (is_unsigned)
+        literal->u = (uint64_t)whole;
+    else
+        literal->i = (int64_t)whole;
+    return -1;
+}
+
+int kdb_filter_init(kdb_filter_t *filter, kdb_column_t *col, const uint8_t join, const uint8_t cmp, const kproto_value_t *value) {
+    kproto_value_t literal = *value;
+    const unsigned bits = col->width * 8;
+    filter->col = col;
+    filter->cmp = cmp;
+    filter->join = join;
+
+    // strings compare as they are, one longer than the column holds
+    // orders after the rows it starts with and equals none of them
+    if (col->type == K_TYPE_STRING || value->type == K_TYPE_STRING) {
+        if (col->type != value->type)
+            return KDB_ERR_TYPE;
+        filter->value = *value;
+        filter->value.flags = col->flags;
+        return KDB_OK;
+    }
+
+    // floating point and bool columns take numbers as rows are stored
+    if (kdb_is_float(col->type))
+        return kdb_value_cast(col, value, &filter->value);
+    if (col->type == K_TYPE_BOOL) {
+        if (kdb_is_float(value->type)) {
+            literal.type = K_TYPE_BOOL;
+            literal.u = value->d != 0;
+        }
+        return kdb_value_cast(col, &literal, &filter->value);
+    }
+    if (kdb_is_float(value->type) && kdb_filter_whole(filter, value, &literal) != -1)
+        return KDB_OK;
+
+    // an integer the column cant hold is below or above all of its rows
+    if (literal.type != K_TYPE_BOOL && !(literal.flags & K_TYPE_UNSIGNED) && literal.i < 0) {
+        if ((col->flags & K_TYPE_UNSIGNED) || (bits < 64 && literal.i < -(1LL << (bits - 1))))
+            return kdb_filter_outside(filter, 0);
+    } else if (col->flags & K_TYPE_UNSIGNED) {
+        if (bits < 64 && literal.u >> bits)
+            return kdb_filter_outside(filter, 1);
+    } else if (literal.u > (bits < 64 ? (1ULL << (bits - 1)) - 1 : (uint64_t)INT64_MAX)) {
+        return kdb_filter_outside(filter, 1);
+    }
+    return kdb_value_cast(col, &literal, &filter->value);
+}
+
+static inline uint64_t kdb_cmp_bits(const uint8_t cmp, const uint64_t eq, const uint64_t lt, const uint64_t gt) {
+    switch (cmp) {
+        case K_CMP_EQ: return eq;
+        case K_CMP_NE: return ~eq;
+        case K_CMP_LT: return lt;
+        case K_CMP_LE: return lt | eq;
+        case K_CMP_GT: return gt;
+        case K_CMP_GE: return gt | eq;
+    }
+    return 0;
+}
+
+// portable kernels, the goal is narrowed to the column type so floats
+// compare at the precision they were stored with
+#define KDB_SCALAR_KERNEL(name, type, field)                                            \
+    static void name(const void *data, const uint8_t cmp, const kproto_value_t *goal,    \
+                     const size_t blocks, uint64_t *bits) {                              \
+        size_t b, i;                                                                     \
+        uint64_t eq, lt, gt;                                                             \
+        const type g = (type)goal->field;                                                \
+        const type *v = (const type*)data;                                               \
+        for (b = 0; b < blocks; b++, v += KDB_BLOCK) {                                   \
+            if (!bits[b])                                                                \
+                continue;                                                                \
+            eq = lt = gt = 0;                                                            \
+            for (i = 0; i < KDB_BLOCK; i++) {                                            \
+                eq |= (uint64_t)(v[i] == g) << i;                                        \
+                lt |= (uint64_t)(v[i] < g) << i;                                         \
+                gt |= (uint64_t)(v[i] > g) << i;                                         \
+            }                                                                            \
+            bits[b] &= kdb_cmp_bits(cmp, eq, lt, gt);                                    \
+        }                                                                                \
+    }
+
+KDB_SCALAR_KERNEL(kdb_scalar_i8, int8_t, i)
+KDB_SCALAR_KERNEL(kdb_scalar_u8, uint8_t, u)
+KDB_SCALAR_KERNEL(kdb_scalar_i16, int16_t, i)
+KDB_SCALAR_KERNEL(kdb_scalar_u16, uint16_t, u)
+KDB_SCALAR_KERNEL(kdb_scalar_i32, int32_t, i)
+KDB_SCALAR_KERNEL(kdb_scalar_u32, uint32_t, u)
+KDB_SCALAR_KERNEL(kdb_scalar_i64, int64_t, i)
+KDB_SCALAR_KERNEL(kdb_scalar_u64, uint64_t, u)
+KDB_SCALAR_KERNEL(kdb_scalar_f32, float, d)
+KDB_SCALAR_KERNEL(kdb_scalar_f64, double, d)
+
+static const kdb_kernels_t kdb_scalar_kernels = {
+    [K_TYPE_BYTE] = { kdb_scalar_i8, kdb_scalar_u8 },
+    [K_TYPE_SHORT] = { kdb_scalar_i16, kdb_scalar_u16 },
+    [K_TYPE_INT] = { kdb_scalar_i32, kdb_scalar_u32 },
+    [K_TYPE_LONG] = { kdb_scalar_i64, kdb_scalar_u64 },
+    [K_TYPE_BOOL] = { kdb_scalar_u8, kdb_scalar_u8 },
+    [K_TYPE_FLOAT] = { kdb_scalar_f32, kdb_scalar_f32 },
+    [K_TYPE_DOUBLE] = { kdb_scalar_f64, kdb_scalar_f64 },
+};
+
+#ifdef KDB_FILTER_X86
+// avx2 only has signed integer compares, unsigned values get their top bit
+// flipped first which maps their order onto the signed one. blocks are 64
+// rows so every kernel loads whole aligned vectors
+
+__attribute__((target("avx2")))
+static void kdb_avx2_8(const void *data, const uint8_t cmp, const kproto_value_t *goal,
+                       const size_t blocks, uint64_t *bits, const int is_unsigned) {
+    size_t b, i;
+    uint64_t eq, gt;
+    const __m256i flip = _mm256_set1_epi8(is_unsigned ? (char)0x80 : 0);
+    const __m256i g = _mm256_xor_si256(_mm256_set1_epi8((char)goal->u), flip);
+    const __m256i *v = (const __m256i*)data;
+
+    for (b = 0; b < blocks; b++, v += 2) {
+        if (!bits[b])
+            continue;
+        eq = gt = 0;
+        for (i = 0; i < 2; i++) {
+            const __m256i x = _mm256_xor_si256(_mm256_load_si256(v + i), flip);
+            eq |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, g)) << (i * 32);
+            gt |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(x, g)) << (i * 32);
+        }
+        bits[b] &= kdb_cmp_bits(cmp, eq, ~(eq | gt), gt);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t kdb_avx2_pack16(const __m256i lo, const __m256i hi) {
+    // narrow two 16 bit masks to bytes, packs works per lane so put the
+    // quarters back in order before taking one bit per row
+    return (uint32_t)_mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8));
+}
+
+__attribute__((target("avx2")))
+static void kdb_avx2_16(const void *data, const uint8_t cmp, const kproto_value_t *goal,
+                        const size_t blocks, uint64_t *bits, const int is_unsigned) {
+    size_t b, i;
+    uint64_t eq, gt;
+    const __m256i flip = _mm256_set1_epi16(is_unsigned ? (short)0x8000 : 0);
+    const __m256i g = _mm256_xor_si256(_mm256_set1_epi16((short)goal->u), flip);
+    const __m256i *v = (const __m256i*)data;
+
+    for (b = 0; b < blocks; b++, v += 4) {
+        if (!bits[b])
+            continue;
+        eq = gt = 0;
+        for (i = 0; i < 4; i += 2) {
+            const __m256i x0 = _mm256_xor_si256(_mm256_load_si256(v + i), flip);
+            const __m256i x1 = _mm256_xor_si256(_mm256_load_si256(v + i + 1), flip);
+            eq |= (uint64_t)kdb_avx2_pack16(_mm256_cmpeq_epi16(x0, g), _mm256_cmpeq_epi16(x1, g)) << (i * 16);
+            gt |= (uint64_t)kdb_avx2_pack16(_mm256_cmpgt_epi16(x0, g), _mm256_cmpgt_epi16(x1, g)) << (i * 16);
+        }
+        bits[b] &= kdb_cmp_bits(cmp, eq, ~(eq | gt), gt);
+    }
+}
+
+__attribute__((target("avx2")))
+static void kdb_avx2_32(const void *data, const uint8_t cmp, const kproto_value_t *goal,
+                        const size_t blocks, uint64_t *bits, const int is_unsigned) {
+    size_t b, i;
+    uint64_t eq, gt;
+    const __m256i flip = _mm256_set1_epi32(is_unsigned ? INT32_MIN : 0);
+    const __m256i g = _mm256_xor_si256(_mm256_set1_epi32((int)goal->u), flip);
+    const __m256i *v = (const __m256i*)data;
+
+    for (b = 0; b < blocks; b++, v += 8) {
+        if (!bits[b])
+            continue;
+        eq = gt = 0;
+        for (i = 0; i < 8; i++) {
+            const __m256i x = _mm256_xor_si256(_mm256_load_si256(v + i), flip);
+            eq |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(x, g))) << (i * 8);
+            gt |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(x, g))) << (i * 8);
+        }
+        bits[b] &= kdb_cmp_bits(cmp, eq, ~(eq | gt), gt);
+    }
+}
+
+__attribute__((target("avx2")))
+static void kdb_avx2_64(const void *data, const uint8_t cmp, const kproto_value_t *goal,
+                        const size_t blocks, uint64_t *bits, const int is_unsigned) {
+    size_t b, i;
+    uint64_t eq, gt;
+    const __m256i flip = _mm256_set1_epi64x(is_unsigned ? INT64_MIN : 0);
+    const __m256i g = _mm256_xor_si256(_mm256_set1_epi64x((long long)goal->u), flip);
+    const __m256i *v = (const __m256i*)data;
+
+    for (b = 0; b < blocks; b++, v += 16) {
+        if (!bits[b])
+            continue;
+        eq = gt = 0;
+        for (i = 0; i < 16; i++) {
+            const __m256i x = _mm256_xor_si256(_mm256_load_si256(v + i), flip);
+            eq |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(x, g))) << (i * 4);
+            gt |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, g))) << (i * 4);
+        }
+        bits[b] &= kdb_cmp_bits(cmp, eq, ~(eq | gt), gt);
+    }
+}
+
+// floats need the less than mask too, nan is neither of the three
+__attribute__((target("avx2")))
+static void kdb_avx2_f32(const void *data, const uint8_t cmp, const kproto_value_t *goal,
+                         const size_t blocks, uint64_t *bits) {
+    size_t b, i;
+    uint64_t eq, lt, gt;
+    const __m256 g = _mm256_set1_ps((float)goal->d);
+    const float *v = (const float*)data;
+
+    for (b = 0; b < blocks; b++, v += KDB_BLOCK) {
+        if (!bits[b])
+            continue;
+        eq = lt = gt = 0;
+        for (i = 0; i < 8; i++) {
+            const __m256 x = _mm256_load_ps(v + i * 8);
+            eq |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(x, g, _CMP_EQ_OQ)) << (i * 8);
+            lt |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(x, g, _CMP_LT_OQ)) << (i * 8);
+            gt |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(x, g, _CMP_GT_OQ)) << (i * 8);
+        }
+        bits[b] &= kdb_cmp_bits(cmp, eq, lt, gt);
+    }
+}
+
+__attribute__((target("avx2")))
+static void kdb_avx2_f64(const void *data, const uint8_t cmp, const kproto_value_t *goal,
+                         const size_t blocks, uint64_t *bits) {
+    size_t b, i;
+    uint64_t eq, lt, gt;
+    const __m256d g = _mm256_set1_pd(goal->d);
+    const double *v = (const double*)data;
+
+    for (b = 0; b < blocks; b++, v += KDB_BLOCK) {
+        if (!bits[b])
+            continue;
+        eq = lt = gt = 0;
+        for (i = 0; i < 16; i++) {
+            const __m256d x = _mm256_load_pd(v + i * 4);
+            eq |= (uint64_t)_mm256_movemask_pd(_mm256_cmp_pd(x, g, _CMP_EQ_OQ)) << (i * 4);
+            lt |= (uint64_t)_mm256_movemask_pd(_mm256_cmp_pd(x, g, _CMP_LT_OQ)) << (i * 4);
+            gt |= (uint64_t)_mm256_movemask_pd(_mm256_cmp_pd(x, g, _CMP_GT_OQ)) << (i * 4);
+        }
+        bits[b] &= kdb_cmp_bits(cmp, eq, lt, gt);
+    }
+}
+
+#define KDB_AVX2_SIGNS(name)                                                             \
+    __attribute__((target("avx2")))                                                      \
+    static void name##_s(const void *data, const uint8_t cmp, const kproto_value_t *goal,\
+                         const size_t blocks, uint64_t *bits) {                          \
+        name(data, cmp, goal, blocks, bits, 0);                                          \
+    }                                                                                    \
+    __attribute__((target("avx2")))                                                      \
+    static void name##_u(const void *data, const uint8_t cmp, const kproto_value_t *goal,\
+                         const size_t blocks, uint64_t *bits) {                          \
+        name(data, cmp, goal, blocks, bits, 1);                                          \
+    }
+
+KDB_AVX2_SIGNS(kdb_avx2_8)
+KDB_AVX2_SIGNS(kdb_avx2_16)
+KDB_AVX2_SIGNS(kdb_avx2_32)
+KDB_AVX2_SIGNS(kdb_avx2_64)
+
+static const kdb_kernels_t kdb_avx2_kernels = {
+    [K_TYPE_BYTE] = { kdb_avx2_8_s, kdb_avx2_8_u },
+    [K_TYPE_SHORT] = { kdb_avx2_16_s, kdb_avx2_16_u },
+    [K_TYPE_INT] = { kdb_avx2_32_s, kdb_avx2_32_u },
+    [K_TYPE_LONG] = { kdb_avx2_64_s, kdb_avx2_64_u },
+    [K_TYPE_BOOL] = { kdb_avx2_8_u, kdb_avx2_8_u },
+    [K_TYPE_FLOAT] = { kdb_avx2_f32, kdb_avx2_f32 },
+    [K_TYPE_DOUBLE] = { kdb_avx2_f64, kdb_avx2_f64 },
+};
+#endif
+
+static const kdb_kernels_t* kdb_kernels_pick() {
+#ifdef KDB_FILTER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &kdb_avx2_kernels;
+#endif
+    return &kdb_scalar_kernels;
+}
+
+static void kdb_filter_strings(const kdb_filter_t *filter, const uint64_t row, const size_t blocks, uint64_t *bits) {
+    int order;
+    size_t b, len;
+    uint64_t mask, hits;
+    const kdb_column_t *col = filter->col;
+    const kproto_str_t *goal = &filter->value.s;
+
+    // strings dont vectorize, only compare rows that are still selected
+    for (b = 0; b < blocks; b++) {
+        hits = 0;
+        for (mask = bits[b]; mask; mask &= mask - 1) {
+            uint32_t size;
+            const unsigned i = __builtin_ctzll(mask);
+            const char *data = kdb_table_str(col, row + b * KDB_BLOCK + i, &size);
+            len = size < goal->len ? size : goal->len;
+            order = memcmp(data, goal->data, len);
+            if (order == 0)
+                order = (size > goal->len) - (size < goal->len);
+            hits |= (kdb_cmp_bits(filter->cmp, order == 0, order < 0, order > 0) & 1) << i;
+        }
+        bits[b] &= hits;
+    }
+}
+
+static inline int kdb_filter_none(const uint64_t *bits, const size_t blocks) {
+    size_t b;
+    for (b = 0; b < blocks; b++)
+        if (bits[b])
+            return 0;
+    return 1;
+}
+
+// bits holds the candidate rows of each block going in and the matching ones coming out
+void kdb_filter_batch(const kdb_t *table, const kdb_filter_t *filters, const size_t n, const uint64_t block, const size_t blocks, uint64_t *bits) {
+    size_t i, b;
+    uint64_t rows[KDB_BATCH], group[KDB_BATCH];
+    static const kdb_kernels_t *impl = NULL;
+
+    // pick the widest kernels the cpu supports once
+    const kdb_kernels_t *kernels = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+    if (kernels == NULL) {
+        kernels = kdb_kernels_pick();
+        __atomic_store_n(&impl, kernels, __ATOMIC_RELAXED);
+    }
+
+    // filters are a disjunction of conjunctions, each group starts from the
+    // candidate rows and is or'ed into the result once the next group begins
+    memcpy(rows, bits, blocks * sizeof(uint64_t));
+    memcpy(group, bits, blocks * sizeof(uint64_t));
+    memset(bits, 0, blocks * sizeof(uint64_t));
+    for (i = 0; i < n; i++) {
+        const kdb_filter_t *filter = &filters[i];
+        if (i > 0 && filter->join == K_Q_OR) {
+            for (b = 0; b < blocks; b++) {
+                bits[b] |= group[b];
+                group[b] = rows[b] & ~bits[b];
+            }
+        }
+
+        // an empty group stays empty, skip the rest of its filters
+        if (kdb_filter_none(group, blocks))
+            continue;
+        if (filter->col->type == K_TYPE_STRING) {
+            kdb_filter_strings(filter, block * KDB_BLOCK, blocks, group);
+            continue;
+        }
+        const void *data = filter->col->data + block * KDB_BLOCK * filter->col->width;
+        (*kernels)[filter->col->type][filter->col->flags & K_TYPE_UNSIGNED](data, filter->cmp, &filter->value, blocks, group);
+    }
+    for (b = 0; b < blocks; b++)
+        bits[b] |= group[b];
+}
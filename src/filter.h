@@ -0,0 +1,20 @@
+#ifndef K_FILTER_H
+#define K_FILTER_H
+
+#include "table.h"
+
+// blocks evaluated per filter pass, small enough that every column a
+// query touches stays in cache between filters
+#define KDB_BATCH 16
+
+typedef struct {
+    kdb_column_t *col;
+    uint8_t cmp;
+    uint8_t join; // K_Q_WHERE ands with the filter before, K_Q_OR starts a new group
+    kproto_value_t value;
+} kdb_filter_t;
+
+int kdb_filter_init(kdb_filter_t *filter, kdb_column_t *col, const uint8_t join, const uint8_t cmp, const kproto_value_t *value);
+void kdb_filter_batch(const kdb_t *table, const kdb_filter_t *filters, const size_t n, const uint64_t block, const size_t blocks, uint64_t *bits);
+
+#endif // K_FILTER_H
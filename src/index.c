@@ -0,0 +1,134 @@
+#include "index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// removed entries keep their slot so probe runs stay unbroken
+#define KDB_INDEX_DEAD UINT64_MAX
+
+static inline uint64_t kdb_index_hash(uint64_t key) {
+    // murmur3 finalizer, sequential ids spread over the whole table
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static kdb_slot_t* kdb_index_alloc(const uint64_t cap) {
+    kdb_slot_t *slots = aligned_alloc(64, cap * sizeof(kdb_slot_t));
+    if (slots != NULL)
+        memset(slots, 0, cap * sizeof(kdb_slot_t));
+    return slots;
+}
+
+int kdb_index_init(kdb_index_t *index) {
+    index->used = 0;
+    index->dead = 0;
+    index->mask = KDB_INDEX_MIN - 1;
+    return (index->slots = kdb_index_alloc(KDB_INDEX_MIN)) == NULL ? -1 : 0;
+}
+
+void kdb_index_free(kdb_index_t *index) {
+    free(index->slots);
+    memset(index, 0, sizeof(kdb_index_t));
+}
+
+static inline void kdb_index_place(kdb_slot_t *slots, const uint64_t mask, const uint64_t key, const uint64_t row) {
+    uint64_t pos = kdb_index_hash(key) & mask;
+    while (slots[pos].row != 0 && slots[pos].row != KDB_INDEX_DEAD)
+        pos = (pos + 1) & mask;
+    slots[pos].key = key;
+    slots[pos].row = row + 1;
+}
+
+int kdb_index_reserve(kdb_index_t *index, const uint64_t entries) {
+    uint64_t i;
+    kdb_slot_t *slots;
+    uint64_t cap = KDB_INDEX_MIN;
+
+    // keep at most half the slots taken, tombstones included
+    if ((entries + index->dead) * 2 <= index->mask + 1)
+        return 0;
+    while (cap < entries * 2)
+        cap *= 2;
+    if ((slots = kdb_index_alloc(cap)) == NULL)
+        return -1;
+
+    // rehashing drops the tombstones
+    for (i = 0; i <= index->mask; i++)
+        if (index->slots[i].row != 0 && index->slots[i].row != KDB_INDEX_DEAD)
+            kdb_index_place(slots, cap - 1, index->slots[i].key, index->slots[i].row - 1);
+    free(index->slots);
+    index->slots = slots;
+    index->mask = cap - 1;
+    index->dead = 0;
+    return 0;
+}
+
+void kdb_index_put(kdb_index_t *index, const uint64_t key, const uint64_t row) {
+    // callers reserve first so there is always a free slot
+    uint64_t pos = kdb_index_hash(key) & index->mask;
+    while (index->slots[pos].row != 0 && index->slots[pos].row != KDB_INDEX_DEAD)
+        pos = (pos + 1) & index->mask;
+    if (index->slots[pos].row == KDB_INDEX_DEAD)
+        index->dead--;
+    index->slots[pos].key = key;
+    index->slots[pos].row = row + 1;
+    index->used++;
+}
+
+void kdb_index_remove(kdb_index_t *index, const uint64_t key, const uint64_t row) {
+    uint64_t pos = kdb_index_hash(key) & index->mask;
+    for (; index->slots[pos].row != 0; pos = (pos + 1) & index->mask) {
+        if (index->slots[pos].key == key && index->slots[pos].row == row + 1) {
+            index->slots[pos].row = KDB_INDEX_DEAD;
+            index->used--;
+            index->dead++;
+            return;
+        }
+    }
+}
+
+uint64_t kdb_index_start(const kdb_index_t *index, const uint64_t key) {
+    return kdb_index_hash(key) & index->mask;
+}
+
+uint64_t kdb_index_next(const kdb_index_t *index, const uint64_t key, uint64_t *pos) {
+    // every row stored under a key sits in the probe run starting at its hash
+    for (; index->slots[*pos].row != 0; *pos = (*pos + 1) & index->mask) {
+        const kdb_slot_t *slot = &index->slots[*pos];
+        if (slot->key == key && slot->row != KDB_INDEX_DEAD) {
+            *pos = (*pos + 1) & index->mask;
+            return slot->row - 1;
+        }
+    }
+    return KDB_INDEX_END;
+}
+
+uint64_t kdb_index_key(const kproto_value_t *value) {
+    float f;
+    double d;
+    uint64_t i, key;
+
+    // keys are the value bits, floats at the precision of the column with
+    // both zeros folded together, strings by their fnv-1a hash
+    switch (value->type) {
+        case K_TYPE_FLOAT:
+            f = (float)value->d;
+            d = f == 0 ? 0 : f;
+            memcpy(&key, &d, sizeof(key));
+            return key;
+        case K_TYPE_DOUBLE:
+            d = value->d == 0 ? 0 : value->d;
+            memcpy(&key, &d, sizeof(key));
+            return key;
+        case K_TYPE_STRING:
+            key = 0xcbf29ce484222325ULL;
+            for (i = 0; i < value->s.len; i++)
+                key = (key ^ (uint8_t)value->s.data[i]) * 0x100000001b3ULL;
+            return key;
+    }
+    return value->u;
+}
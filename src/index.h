@@ -0,0 +1,33 @@
+#ifndef K_INDEX_H
+#define K_INDEX_H
+
+#include "proto.h"
+
+// smallest index and the end of a lookup
+#define KDB_INDEX_MIN 64
+#define KDB_INDEX_END UINT64_MAX
+
+// open addressing multimap from column values to rows, four slots to a
+// cache line and linear probing so a probe run rarely leaves its line
+typedef struct {
+    uint64_t key;
+    uint64_t row; // row + 1, 0 is an empty slot
+} kdb_slot_t;
+
+typedef struct {
+    kdb_slot_t *slots;
+    uint64_t mask;
+    uint64_t used;
+    uint64_t dead;
+} kdb_index_t;
+
+int kdb_index_init(kdb_index_t *index);
+void kdb_index_free(kdb_index_t *index);
+int kdb_index_reserve(kdb_index_t *index, const uint64_t entries);
+void kdb_index_put(kdb_index_t *index, const uint64_t key, const uint64_t row);
+void kdb_index_remove(kdb_index_t *index, const uint64_t key, const uint64_t row);
+uint64_t kdb_index_next(const kdb_index_t *index, const uint64_t key, uint64_t *pos);
+uint64_t kdb_index_start(const kdb_index_t *index, const uint64_t key);
+uint64_t kdb_index_key(const kproto_value_t *value);
+
+#endif // K_INDEX_H
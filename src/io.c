@@ -1,48 +1,158 @@
+#define _GNU_SOURCE
 #include "io.h"
 #include "buffer.h"
+#include "uring.h"
 
 // ANSI-C libs
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 
 // iso-c/posix libs
 #include <netdb.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <netinet/tcp.h>
 
 // linux kernel libs
-#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
-
-static inline uint64_t k_now(struct timeval *tv) {
-    gettimeofday(tv, NULL);
-    return (uint64_t)((tv->tv_sec * 1000) + (tv->tv_usec / 1000));
-}
+#include <sys/eventfd.h>
 
 kio_ctx_t* kio_init(kio_ctx_t *ctx) {
     if (ctx == NULL) return NULL;
+    ctx->id = 0;
     ctx->data = NULL;
+    ctx->ring = NULL;
+    ctx->uring = 0;
+    ctx->stop = 0;
+    ctx->server = -1;
+    ctx->wake_fd = -1;
     ctx->epoll_fd = -1;
     ctx->clients = NULL;
+    ctx->closing = NULL;
+    ctx->posted = NULL;
     ctx->accept_cb = NULL;
-    ctx->tasks = NULL;
     ctx->closed = 0;
     ctx->client_num = 0;
+    ctx->wmark_high = KIO_WMARK_HIGH;
+    ctx->wmark_low = KIO_WMARK_LOW;
+    ctx->max_header = KIO_MAX_HEADER;
+    memset(&ctx->stats, 0, sizeof(kio_stats_t));
+    ktimer_init(&ctx->timers, ktimer_clock());
+    kpool_init(&ctx->client_pool, sizeof(kio_client_t));
+    kpool_init(&ctx->rtask_pool, sizeof(kio_rtask_t));
+    kpool_init(&ctx->timer_pool, sizeof(kio_task_t));
+    kpool_init(&ctx->data_pool, 0);
+
+    // the wakeup event lives as long as the context so other threads can
+    // stop it before its loop starts and after it ended
+    if ((ctx->wake_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        fprintf(stderr, "[KDB] Failed to create wakeup event\n");
+        return NULL;
+    }
     return ctx;
 }
 
-void kio_close(kio_client_t *client) {
-    if (client == NULL) return;
+void kio_destroy(kio_ctx_t *ctx) {
+    if (ctx == NULL) return;
 
-    // remove from epoll context
-    epoll_ctl(client->ctx->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    // only once no thread can stop or post to it anymore, a late signal
+    // finds it gone rather than closed
+    const int wake_fd = ctx->wake_fd;
+    ctx->wake_fd = -1;
+    if (wake_fd != -1)
+        close(wake_fd);
+}
 
-    // close socket file descriptor
+#ifdef KURING_SUPPORTED
+typedef struct {
+    kuring_t ring;
+    kuring_bufs_t bufs;
+} kio_uring_t;
+
+// completion tags stored in the low bits of the submission user data
+#define KIO_UD_ACCEPT 1
+#define KIO_UD_WAKE 2
+#define KIO_UD_RECV 3
+#define KIO_UD_SEND 4
+#define KIO_UD_MASK 7
+#define KIO_UD(ptr, tag) ((uint64_t)(uintptr_t)(ptr) | (tag))
+#endif
+
+static int kio_flush(kio_client_t *client);
+
+static inline void kio_chunk_free(kio_chunk_t *chunk) {
+    if (chunk->release != NULL)
+        chunk->release(chunk->arg);
+    free(chunk);
+}
+
+static void kio_queue_free(kio_client_t *client) {
+    kio_chunk_t *chunk;
+    while ((chunk = client->wqueue) != NULL) {
+        client->wqueue = (kio_chunk_t*)chunk->next;
+        kio_chunk_free(chunk);
+    }
+    client->ctx->stats.queued -= client->wqueued;
+    client->wtail = NULL;
+    client->wqueued = 0;
+}
+
+static void kio_client_free(kio_client_t *client) {
+    kio_rtask_t *task;
+    kio_ctx_t *ctx = client->ctx;
+
+    // free pending read tasks and queued writes
+    while ((task = client->rtasks) != NULL) {
+        client->rtasks = task->next;
+        kpool_release(&ctx->rtask_pool, task);
+    }
+    kio_queue_free(client);
+
+    // close socket file descriptor and give the client back to the pool
     close(client->fd);
+    kpool_release(&ctx->client_pool, client);
+}
+
+static void kio_reap(kio_ctx_t *ctx, const int force) {
+    kio_client_t *client, **link = (kio_client_t**)&ctx->closing;
+
+    // free closed clients once no backend operation references them
+    while ((client = *link) != NULL) {
+        if (client->inflight && !force) {
+            link = (kio_client_t**)&client->next;
+            continue;
+        }
+        *link = (kio_client_t*)client->next;
+        kio_client_free(client);
+    }
+}
+
+void kio_close(kio_client_t *client) {
+    if (client == NULL || client->closing) return;
+    kio_ctx_t *ctx = client->ctx;
+    client->closing = 1;
+
+    // give queued data one last non-blocking chance to go out
+#ifdef KURING_SUPPORTED
+    if (ctx->ring == NULL)
+#endif
+        if (client->wqueued > 0)
+            kio_flush(client);
+
+    // detach from the backend, shutting down the read side completes the
+    // pending io_uring receive while an in-flight send still gets to finish,
+    // the file descriptor is closed once the client is reaped
+#ifdef KURING_SUPPORTED
+    if (ctx->ring != NULL)
+        shutdown(client->fd, SHUT_RD);
+    else
+#endif
+        epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
 
     // call on_close callback
     if (client->on_close != NULL)
@@ -52,115 +162,434 @@ void kio_close(kio_client_t *client) {
     kbuf_free(&client->rbuf);
 
     // remove from context
-    if (client->ctx != NULL) {
-        kio_client_t *c = (kio_client_t*)client->ctx->clients;
-        if (c != NULL && c->fd == client->fd) {
-            client->ctx->clients = client->next;
-        } else {
-            while (c->next != NULL && ((kio_client_t*)c->next)->fd != client->fd)
-                c = (kio_client_t*)c->next;
-            if (c->next == client)
-                c->next = client->next;
-        }
-        client->ctx->client_num--;
-    }
+    *client->prev = client->next;
+    if (client->next != NULL)
+        ((kio_client_t*)client->next)->prev = client->prev;
+    client->prev = NULL;
+    ctx->client_num--;
+
+    // defer freeing until the end of the loop turn so pending events are safe
+    client->next = ctx->closing;
+    ctx->closing = client;
+}
 
-    // free client
-    free(client);
-    client = NULL;
+#ifdef KPOOL_STATS
+static void kio_pool_stats(kio_ctx_t *ctx, const char *name, kpool_t *pool) {
+    fprintf(stderr, "[KDB] Worker %u %s pool: %lu hits, %lu misses, %zu peak\n",
+        ctx->id, name, (unsigned long)pool->hits, (unsigned long)pool->misses, pool->peak);
 }
+#endif
 
-void kio_free(kio_ctx_t *ctx) {
-    if (ctx == NULL || ctx->closed == 0) return;
+void kio_each(kio_ctx_t *ctx, kio_eachcb_t callback, void *arg) {
+    kio_client_t *client, *next;
+    if (ctx == NULL || callback == NULL) return;
+
+    // the callback may close the client it is given
+    for (client = (kio_client_t*)ctx->clients; client != NULL; client = next) {
+        next = (kio_client_t*)client->next;
+        callback(client, arg);
+    }
+}
 
-    kio_task_t *task, *last_task;
-    kio_client_t *client, *last_client;
+static void kio_run_posts(kio_ctx_t *ctx) {
+    kio_post_t *post, *next, *order = NULL;
 
-    // free client objects
-    client = (kio_client_t*)ctx->clients;
-    while (client != NULL) {
-        last_client = client;
-        client = (kio_client_t*)client->next;
-        if (last_client != NULL)
-            kio_close(last_client);
+    // take the whole list and run it in the order it was posted
+    for (post = __atomic_exchange_n(&ctx->posted, NULL, __ATOMIC_ACQUIRE); post != NULL; post = next) {
+        next = post->next;
+        post->next = order;
+        order = post;
     }
-    ctx->clients = NULL;
+    for (post = order; post != NULL; post = next) {
+        next = post->next;
+        post->callback(post->data);
+    }
+}
+
+static void kio_close_each(kio_client_t *client, void *arg) {
+    kio_close(client);
+}
+
+void kio_free(kio_ctx_t *ctx) {
+    if (ctx == NULL || ctx->closed) return;
+    kio_task_t *task;
+
+    // tear down the ring first, this cancels every in-flight request
+#ifdef KURING_SUPPORTED
+    kio_uring_t *uring = (kio_uring_t*)ctx->ring;
+    if (uring != NULL) {
+        kuring_bufs_free(&uring->ring, &uring->bufs);
+        kuring_free(&uring->ring);
+        free(uring);
+        ctx->ring = NULL;
+    }
+#endif
+
+    // free client objects, posts still queued run after so whoever
+    // posted them finds the clients closed
+    kio_each(ctx, kio_close_each, NULL);
+    kio_reap(ctx, 1);
+    kio_run_posts(ctx);
     
     // free task objects
-    task = ctx->tasks;
-    while (task != NULL) {
-        last_task = task;
-        task = (kio_task_t*)task->next;
-        if (last_task != NULL)
-            free(last_task);
-    }
-    ctx->tasks = NULL;
+    while ((task = ktimer_drain(&ctx->timers)) != NULL)
+        kpool_release(&ctx->timer_pool, task);
+
+    // every pooled object is back, release the slabs
+#ifdef KPOOL_STATS
+    kio_pool_stats(ctx, "clients", &ctx->client_pool);
+    kio_pool_stats(ctx, "rtasks", &ctx->rtask_pool);
+    kio_pool_stats(ctx, "timers", &ctx->timer_pool);
+    kio_pool_stats(ctx, "data", &ctx->data_pool);
+#endif
+    kpool_free(&ctx->client_pool);
+    kpool_free(&ctx->rtask_pool);
+    kpool_free(&ctx->timer_pool);
+    kpool_free(&ctx->data_pool);
+
+    // close the context file descriptors, the wakeup event stays for
+    // threads still stopping it until kio_destroy
+    if (ctx->server != -1)
+        close(ctx->server);
+    if (ctx->epoll_fd != -1)
+        close(ctx->epoll_fd);
+    ctx->server = ctx->epoll_fd = -1;
 
     // set context officially closed
     ctx->closed = 1;
     ctx->client_num = 0;
 }
 
-int kio_call(kio_ctx_t *ctx, const uint64_t delay, void *data, kio_callback_t callback) {
-    if (ctx == NULL) return -1;
+void kio_post(kio_ctx_t *ctx, kio_post_t *post, void *data, kio_callback_t callback) {
+    void *head = __atomic_load_n(&ctx->posted, __ATOMIC_RELAXED);
+    const uint64_t one = 1;
+
+    // only a post finding the list empty wakes the loop, which takes the
+    // whole list so the first one after it wakes it again
+    post->data = data;
+    post->callback = callback;
+    do {
+        post->next = head;
+    } while (!__atomic_compare_exchange_n(&ctx->posted, &head, post, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (head == NULL && ctx->wake_fd != -1 && write(ctx->wake_fd, &one, sizeof(one)) < 0)
+        fprintf(stderr, "[KDB] Failed to wake kio context\n");
+}
+
+void kio_stop(kio_ctx_t *ctx) {
+    if (ctx == NULL) return;
+    const uint64_t one = 1;
+
+    // flag the loop and wake it up, safe to call from signals or other threads
+    ctx->stop = 1;
+    if (ctx->wake_fd != -1 && write(ctx->wake_fd, &one, sizeof(one)) < 0)
+        fprintf(stderr, "[KDB] Failed to wake kio context\n");
+}
+
+kio_task_t* kio_timer(kio_ctx_t *ctx, const uint64_t delay, void *data, kio_callback_t callback) {
+    if (ctx == NULL) return NULL;
 
     // create task obejct
-    kio_task_t *task = malloc(sizeof(kio_task_t));
+    kio_task_t *task = kpool_alloc(&ctx->timer_pool);
     if (task == NULL) {
         fprintf(stderr, "[KDB] Not enough memory for kio_task!\n");
-        return -1;
+        return NULL;
     }
     task->data = data;
     task->next = NULL;
+    task->prev = NULL;
     task->callback = callback;
 
-    // set expires as current time + ms delay
-    struct timeval tv;
-    task->expires = k_now(&tv) + delay;
+    // expire relative to the time cached for the current loop turn
+    task->expires = ctx->timers.now + delay;
+    ktimer_add(&ctx->timers, task);
+    return task;
+}
 
-    // append task to context
-    if (ctx->tasks == NULL) {
-        task->last = NULL;
-        ctx->tasks = task;
-    } else {
-        kio_task_t *t = ctx->tasks;
-        while (t->next != NULL)
-            t = t->next;
-        task->last = t;
-        t->next = task;
+void kio_cancel(kio_ctx_t *ctx, kio_task_t *task) {
+    if (ctx == NULL || task == NULL) return;
+    ktimer_del(&ctx->timers, task);
+    kpool_release(&ctx->timer_pool, task);
+}
+
+int kio_call(kio_ctx_t *ctx, const uint64_t delay, void *data, kio_callback_t callback) {
+    return kio_timer(ctx, delay, data, callback) == NULL ? -1 : 0;
+}
+
+static void kio_queued(kio_client_t *client, const size_t len) {
+    kio_ctx_t *ctx = client->ctx;
+
+    // track queued bytes for the client and the whole context
+    client->wqueued += len;
+    ctx->stats.queued += len;
+    if (ctx->stats.queued > ctx->stats.queued_peak)
+        ctx->stats.queued_peak = ctx->stats.queued;
+
+    // crossed the high watermark, tell the producer to back off
+    if (!client->throttled && client->wqueued >= ctx->wmark_high) {
+        client->throttled = 1;
+        ctx->stats.throttled++;
+        if (client->on_wmark != NULL)
+            ((kio_wmarkcb_t)client->on_wmark)(client, 1);
+    }
+}
+
+static inline void kio_queue_link(kio_client_t *client, kio_chunk_t *chunk) {
+    if (client->wtail != NULL)
+        client->wtail->next = chunk;
+    else
+        client->wqueue = chunk;
+    client->wtail = chunk;
+}
+
+static int kio_queue(kio_client_t *client, const char *data, size_t len) {
+    size_t n, queued = 0;
+    kio_chunk_t *chunk = client->wtail;
+
+    // fill the spare room of the last copied chunk first
+    if (chunk != NULL && chunk->release == NULL && chunk->len < chunk->max) {
+        n = chunk->max - chunk->len;
+        n = n < len ? n : len;
+        memcpy(chunk->buf + chunk->len, data, n);
+        chunk->len += n;
+        queued += n;
+        data += n;
+        len -= n;
+    }
+
+    // append a new chunk for the rest
+    if (len > 0) {
+        n = len > KIO_CHUNK_SIZE ? len : KIO_CHUNK_SIZE;
+        chunk = malloc(sizeof(kio_chunk_t) + n);
+        if (chunk == NULL) {
+            fprintf(stderr, "[KDB] Not enough memory for write queue!\n");
+            return -1;
+        }
+        chunk->next = NULL;
+        chunk->pos = 0;
+        chunk->max = n;
+        chunk->len = len;
+        chunk->buf = chunk->data;
+        chunk->arg = NULL;
+        chunk->release = NULL;
+        memcpy(chunk->buf, data, len);
+        kio_queue_link(client, chunk);
+        queued += len;
     }
 
-    // success creating task
+    kio_queued(client, queued);
     return 0;
 }
 
-void kio_write(kio_client_t *client, const char *data, const size_t len) {
-    if (client == NULL) return;
-    ssize_t offset = 0, n_write;
-
-    // start writing data
-    while (offset < len) {
-        n_write = write(client->fd, data + offset, len - offset);
-        
-        // error or done writing data
-        if (n_write == -1) {
-            if (errno != EAGAIN)
-                kio_close(client);
+static int kio_queue_ref(kio_client_t *client, const char *data, const size_t len, kio_release_t release, void *arg) {
+    // reference an owned buffer instead of copying it
+    kio_chunk_t *chunk = malloc(sizeof(kio_chunk_t));
+    if (chunk == NULL) {
+        fprintf(stderr, "[KDB] Not enough memory for write queue!\n");
+        return -1;
+    }
+    chunk->next = NULL;
+    chunk->pos = 0;
+    chunk->len = len;
+    chunk->max = len;
+    chunk->buf = (char*)data;
+    chunk->arg = arg;
+    chunk->release = release;
+    kio_queue_link(client, chunk);
+    kio_queued(client, len);
+    return 0;
+}
+
+static void kio_queue_consume(kio_client_t *client, size_t len) {
+    size_t n;
+    kio_chunk_t *chunk;
+    kio_ctx_t *ctx = client->ctx;
+
+    // advance through sent bytes, freeing drained chunks
+    client->wqueued -= len;
+    ctx->stats.queued -= len;
+    while (len > 0 && (chunk = client->wqueue) != NULL) {
+        n = chunk->len - chunk->pos;
+        if (len < n) {
+            chunk->pos += len;
             break;
         }
+        len -= n;
+        client->wqueue = (kio_chunk_t*)chunk->next;
+        if (client->wqueue == NULL)
+            client->wtail = NULL;
+        kio_chunk_free(chunk);
+    }
 
-        // there is no more data to write
-        if (n_write == 0)
-            break;
+    // drained below the low watermark, the producer can resume
+    if (client->throttled && client->wqueued <= ctx->wmark_low) {
+        client->throttled = 0;
+        if (client->on_wmark != NULL)
+            ((kio_wmarkcb_t)client->on_wmark)(client, 0);
+    }
+}
+
+static int kio_queue_iov(kio_client_t *client, struct iovec *iov) {
+    int n = 0;
+    kio_chunk_t *chunk = client->wqueue;
+
+    // gather the queued chunks into an iovec array
+    while (chunk != NULL && n < KIO_WRITE_IOVS) {
+        iov[n].iov_base = chunk->buf + chunk->pos;
+        iov[n].iov_len = chunk->len - chunk->pos;
+        chunk = (kio_chunk_t*)chunk->next;
+        n++;
+    }
+    return n;
+}
 
-        // start writing where left off
-        offset += n_write;
+#ifdef KURING_SUPPORTED
+static void kio_uring_send(kio_client_t *client) {
+    kio_uring_t *uring = (kio_uring_t*)client->ctx->ring;
+    struct io_uring_sqe *sqe;
+
+    // only one send in flight per client to keep the stream ordered
+    if (client->sending || client->wqueued == 0)
+        return;
+    if ((sqe = kuring_sqe(&uring->ring)) == NULL) {
+        fprintf(stderr, "[KDB] io_uring submission queue is full\n");
+        kio_close(client);
+        return;
     }
+
+    // the queued chunks stay put until the kernel reports them sent
+    memset(&client->wmsg, 0, sizeof(client->wmsg));
+    client->wmsg.msg_iov = client->wiov;
+    client->wmsg.msg_iovlen = kio_queue_iov(client, client->wiov);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&client->wmsg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = KIO_UD(client, KIO_UD_SEND);
+    client->sending = 1;
+    client->inflight++;
+}
+#endif
+
+static int kio_flush(kio_client_t *client) {
+    ssize_t n_write;
+    struct msghdr msg;
+    struct iovec iov[KIO_WRITE_IOVS];
+
+    // gather queued chunks into as few syscalls as possible
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    while (client->wqueued > 0) {
+        msg.msg_iovlen = kio_queue_iov(client, iov);
+        n_write = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+        if (n_write < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        kio_queue_consume(client, n_write);
+    }
+    return 0;
+}
+
+static int kio_want_write(kio_client_t *client, const unsigned enable) {
+    struct epoll_event event;
+    if (client->sending == enable)
+        return 0;
+
+    // only wait on EPOLLOUT while there is data queued
+    event.data.ptr = client;
+    event.events = EPOLLIN | EPOLLET | (enable ? EPOLLOUT : 0);
+    client->sending = enable;
+    return epoll_ctl(client->ctx->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+void kio_on_wmark(kio_client_t *client, kio_wmarkcb_t callback) {
+    if (client != NULL)
+        client->on_wmark = callback;
+}
+
+void kio_on_data(kio_client_t *client, kio_clientcb_t callback) {
+    if (client != NULL)
+        client->on_data = callback;
+}
+
+void kio_writev(kio_client_t *client, const struct iovec *iov, const int iovcnt, kio_release_t release, void *arg) {
+    int i;
+    size_t skip;
+    struct msghdr msg;
+    ssize_t n_write = 0;
+
+    // closed client, the owned buffer is released right away
+    if (client == NULL || client->closing) {
+        if (release != NULL)
+            release(arg);
+        return;
+    }
+
+    // nothing queued on epoll, try to send everything with a single syscall
+#ifdef KURING_SUPPORTED
+    if (client->ctx->ring == NULL && client->wqueued == 0) {
+#else
+    if (client->wqueued == 0) {
+#endif
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec*)iov;
+        msg.msg_iovlen = iovcnt;
+        n_write = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+        if (n_write < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                if (release != NULL)
+                    release(arg);
+                kio_close(client);
+                return;
+            }
+            n_write = 0;
+        }
+    }
+
+    // queue whatever wasnt sent, the owned last buffer by reference
+    skip = n_write;
+    for (i = 0; i < iovcnt; i++) {
+        const char *base = (const char*)iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        const int owned = (release != NULL && i == iovcnt - 1);
+        if (skip >= len) {
+            skip -= len;
+            if (owned)
+                release(arg);
+            continue;
+        }
+        base += skip;
+        len -= skip;
+        skip = 0;
+        if (owned ? kio_queue_ref(client, base, len, release, arg) : kio_queue(client, base, len)) {
+            if (owned)
+                release(arg);
+            kio_close(client);
+            return;
+        }
+    }
+
+    // io_uring sends are submitted in a batch on the next loop turn,
+    // epoll waits until the socket is writable again
+#ifdef KURING_SUPPORTED
+    if (client->ctx->ring != NULL) {
+        kio_uring_send(client);
+        return;
+    }
+#endif
+    if (client->wqueued > 0 && kio_want_write(client, 1))
+        kio_close(client);
+}
+
+void kio_write(kio_client_t *client, const char *data, const size_t len) {
+    struct iovec iov;
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+    kio_writev(client, &iov, 1, NULL, NULL);
 }
 
 static inline int kio_rtask(kio_client_t *client, const uint64_t goal_size, const char *str_goal, kio_clientcb_t callback) {
     // allocate memory for the task
-    kio_rtask_t *task = malloc(sizeof(kio_rtask_t));
+    kio_rtask_t *task = kpool_alloc(&client->ctx->rtask_pool);
     if (task == NULL) {
         fprintf(stderr, "[KDB] Not enough memory for read task!\n");
         return -1;
@@ -170,6 +599,7 @@ static inline int kio_rtask(kio_client_t *client, const uint64_t goal_size, cons
     task->next = NULL;
     task->str_goal = str_goal;
     task->goal_size = goal_size;
+    task->scanned = 0;
     task->callback = callback;
     task->gtype = str_goal == NULL ? 0 : 1;
 
@@ -229,6 +659,14 @@ static int kio_server(const uint16_t port) {
         return -1;
     }
 
+    // enable REUSEPORT so every worker binds its own listener and the
+    // kernel load balances incoming connections between them
+    if (setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        fprintf(stderr, "[KDB] Failed to set SO_REUSEPORT\n");
+        close(server);
+        return -1;
+    }
+
     // bind the server to the created address
     if (bind(server, (struct sockaddr*)&addr, sizeof(addr))) {
         fprintf(stderr, "[KDB] Failed to bind server to address\n");
@@ -254,24 +692,119 @@ static int kio_server(const uint16_t port) {
     return server;
 }
 
+static kio_client_t* kio_client(kio_ctx_t *ctx, int fd, struct sockaddr_in *addr) {
+    // create kio_client object for incoming fd
+    kio_client_t *client = kpool_alloc(&ctx->client_pool);
+    if (client == NULL) {
+        fprintf(stderr, "[KDB] Not enough memory for k_client! closing client\n");
+        close(fd);
+        return NULL;
+    }
+
+    // prepare client
+    client->fd = fd;
+    client->ctx = ctx;
+    client->data = NULL;
+    client->next = NULL;
+    client->rtasks = NULL;
+    client->on_data = NULL;
+    client->on_close = NULL;
+    client->on_wmark = NULL;
+    client->inflight = 0;
+    client->throttled = 0;
+    client->closing = 0;
+    client->sending = 0;
+    client->wqueued = 0;
+    client->wqueue = NULL;
+    client->wtail = NULL;
+    client->addr = *addr;
+    kbuf_init(&client->rbuf);
+
+    // add to context
+    client->next = ctx->clients;
+    client->prev = &ctx->clients;
+    if (client->next != NULL)
+        ((kio_client_t*)client->next)->prev = &client->next;
+    ctx->clients = client;
+    ctx->client_num++;
+    return client;
+}
+
+static inline void kio_accepted(kio_ctx_t *ctx, kio_client_t *client) {
+    // call the context client-accept callback
+    if (ctx->accept_cb != NULL) {
+        kio_clientcb_t callback = (kio_clientcb_t)ctx->accept_cb;
+        callback(client);
+    }
+}
+
+static void kio_process_reads(kio_client_t *client) {
+    kio_rtask_t *task;
+    kbuf_t *buf = &client->rbuf;
+
+    // process client read tasks, a callback may close the client
+    while (!client->closing && (task = client->rtasks)) {
+        const size_t avail = buf->len;
+        if (avail < task->goal_size)
+            break;
+
+        // only scan bytes that arrived since the last attempt, keeping enough
+        // of the tail to catch a delimiter split across reads
+        if (task->gtype) {
+            if (kbuf_find(buf, task->scanned, task->str_goal, task->goal_size) < 0) {
+                task->scanned = avail - task->goal_size + 1;
+                if (avail >= client->ctx->max_header) {
+                    fprintf(stderr, "[KDB] Client exceeded max header size of %zu\n", client->ctx->max_header);
+                    kio_close(client);
+                }
+                break;
+            }
+        }
+        client->rtasks = task->next;
+        ((kio_clientcb_t)task->callback)(client);
+        kpool_release(&client->ctx->rtask_pool, task);
+        task = NULL;
+    }
+
+    // no read tasks left, hand everything buffered to the data callback
+    if (!client->closing && client->rtasks == NULL && client->on_data != NULL && buf->len > 0)
+        ((kio_clientcb_t)client->on_data)(client);
+}
+
+static void kio_expire(kio_ctx_t *ctx) {
+    kio_task_t *task;
+
+    // read the clock once per loop turn, expire timers against it
+    ktimer_expire(&ctx->timers, ktimer_clock());
+
+    // call and free every task that is ready
+    while ((task = ktimer_pop(&ctx->timers)) != NULL) {
+        task->callback(task->data);
+        kpool_release(&ctx->timer_pool, task);
+    }
+}
+
+static int kio_wakeup(kio_ctx_t *ctx) {
+    uint64_t wakeups;
+
+    // drain the wakeup event, run what other threads posted and check if
+    // the loop should stop
+    if (read(ctx->wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+        return 0;
+    kio_run_posts(ctx);
+    return !ctx->stop;
+}
+
 static void kio_accept(kio_ctx_t *ctx, int server, struct epoll_event *event) {
     int fd;
     kio_client_t *client;
     socklen_t client_len;
+    struct sockaddr_in addr;
 
     // accept incoming clients
     while (1) {
-
-        // create kio_client object for incoming fd
-        client = malloc(sizeof(kio_client_t));
-        if (client == NULL) {
-            fprintf(stderr, "[KDB] Not enough memory for k_client! closing client\n");
-            close(fd);
-            continue;
-        }
-
-        client_len = sizeof(client->addr);
-        fd = accept(server, (struct sockaddr*)&client->addr, &client_len);
+        client_len = sizeof(addr);
+        fd = accept(server, (struct sockaddr*)&addr, &client_len);
 
         // client valid fd
         if (fd == -1) {
@@ -288,17 +821,11 @@ static void kio_accept(kio_ctx_t *ctx, int server, struct epoll_event *event) {
             continue;
         }
 
-        // prepare client
-        client->fd = fd;
-        client->ctx = ctx;
-        client->data = NULL;
-        client->next = NULL;
-        client->rtasks = NULL;
-        client->on_close = NULL;
-        kbuf_init(&client->rbuf);
+        // create the client
+        if ((client = kio_client(ctx, fd, &addr)) == NULL)
+            continue;
 
         // register client to epoll context
-        event->data.fd = fd;
         event->data.ptr = client;
         event->events = EPOLLIN | EPOLLET;
         if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, fd, event) == -1) {
@@ -307,86 +834,24 @@ static void kio_accept(kio_ctx_t *ctx, int server, struct epoll_event *event) {
             continue;
         }
 
-        // add to context
-        if (ctx->clients == NULL) {
-            ctx->clients = client;
-        } else {
-            kio_client_t *c = (kio_client_t*)ctx->clients;
-            while (c->next != NULL)
-                c = c->next;
-            c->next = client;
-        }
-        ctx->client_num++;
-
-        // call the context client-accept callback
-        if (ctx->accept_cb != NULL) {
-            kio_clientcb_t callback = (kio_clientcb_t)ctx->accept_cb;
-            callback(client);
-        }
-    }
-}
-
-static int kio_process_and_poll(kio_ctx_t *ctx, struct epoll_event *events) {
-    if (ctx == NULL || ctx->closed) return -1;
-
-    // prepare variables
-    struct timeval tv;
-    int wait_time = -1;
-    uint64_t now, delay;
-    kio_task_t *task, *next;
-
-    // iterate through tasks
-    task = ctx->tasks;
-    while (task != NULL) {
-        now = k_now(&tv);
-
-        // a task is ready, update the ones around it, call it and free it
-        if (now >= task->expires) {
-            next = (kio_task_t*)task->next;
-            task->callback(task->data);
-            if (task->last != NULL) // make previous point to next
-                ((kio_task_t*)task->last)->next = next;
-            else if (task == ctx->tasks) // make root point to next
-                ctx->tasks = (kio_task_t*)ctx->tasks->next;
-            if (next != NULL) // make next's last (this) point to null
-                next->last = NULL;
-            // free and continue
-            free(task);
-            task = NULL;
-            task = next;
-
-        // task wasnt ready, but check if it should take priority in waiting
-        } else {
-            delay = task->expires - now;
-            if (wait_time < 0 || delay < wait_time)
-                wait_time = delay;
-            task = (kio_task_t*)task->next;
-        }
+        kio_accepted(ctx, client);
     }
-
-    // poll for socket events given time to wait for tasks
-    return epoll_wait(ctx->epoll_fd, events, KIO_MAX_EVENTS, wait_time);
 }
 
 static inline int kio_is_err(int e) {
     return ((e & EPOLLERR) || (e & EPOLLHUP) || (!(e & EPOLLIN))) ? 1 : 0;
 }
 
-int kio_run(kio_ctx_t *ctx, const uint16_t port) {
+static int kio_epoll_loop(kio_ctx_t *ctx) {
     // create runtime variables
-    kbuf_t *buf;
+    char *read_buf;
+    size_t read_len;
     ssize_t n_read;
-    kio_rtask_t *task;
     kio_client_t *client;
     struct epoll_event event;
-    char read_buf[KIO_READ_SIZE];
-    int polled, running, server, should_close;
+    int polled, running, flushed, should_close;
     struct epoll_event events[KIO_MAX_EVENTS];
 
-    // invalid context
-    if (ctx == NULL || ctx->closed)
-        return -1;
-
     // create epoll context for ctx
     ctx->epoll_fd = epoll_create1(0);
     if (ctx->epoll_fd == -1) {
@@ -394,50 +859,77 @@ int kio_run(kio_ctx_t *ctx, const uint16_t port) {
         return -1;
     }
 
-    // create server
-    server = kio_server(port);
-    if (server < 0)
+    // register wakeup event used to stop the loop from other threads
+    event.data.ptr = &ctx->wake_fd;
+    event.events = EPOLLIN;
+    if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->wake_fd, &event) == -1) {
+        fprintf(stderr, "[KDB] Failed to register wakeup event\n");
         return -1;
+    }
 
     // register server to epoll instance
-    event.data.fd = server;
+    event.data.ptr = &ctx->server;
     event.events  = EPOLLIN | EPOLLET;
-    if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, server, &event) == -1) {
+    if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->server, &event) == -1) {
         fprintf(stderr, "[KDB] Failed to register server on epoll instance\n");
-        close(server);
         return -1;
     }
 
     // start io server
-    running = 1;
-    printf("[KDB] Server started on %d\n", port);
+    running = !ctx->stop;
     while (!ctx->closed && running) {
-        polled = kio_process_and_poll(ctx, events);
-        if (polled < 0) break;
-        while (polled-- && running) {
+
+        // poll for socket events given time to wait for the next timer
+        polled = epoll_wait(ctx->epoll_fd, events, KIO_MAX_EVENTS, ktimer_timeout(&ctx->timers));
+        if (polled < 0 && errno != EINTR)
+            break;
+        kio_expire(ctx);
+
+        while (polled-- > 0 && running) {
+
+            // wakeup event, drain it and check if the loop should stop
+            if (events[polled].data.ptr == &ctx->wake_fd) {
+                running = kio_wakeup(ctx);
 
             // server event (either error or accept)
-            if (events[polled].data.fd == server) {
+            } else if (events[polled].data.ptr == &ctx->server) {
                 if (kio_is_err(events[polled].events))
                     running = 0;
                 else
-                    kio_accept(ctx, server, &event);
+                    kio_accept(ctx, ctx->server, &event);
 
-            // client event (either error or read event)
-            } else if (events[polled].events & EPOLLIN) {
+            // client event (error, writable or read event)
+            } else {
                 client = (kio_client_t*)events[polled].data.ptr;
-                buf = &client->rbuf;
+                if (client->closing)
+                    continue;
 
                 // handle client error
-                if (client == NULL || kio_is_err(events[polled].events)) {
+                if (events[polled].events & (EPOLLERR | EPOLLHUP)) {
                     kio_close(client);
                     continue;
                 }
 
+                // socket drained, flush the queue and stop waiting when empty
+                if (events[polled].events & EPOLLOUT) {
+                    flushed = kio_flush(client);
+                    if (flushed < 0 || (flushed == 0 && kio_want_write(client, 0))) {
+                        kio_close(client);
+                        continue;
+                    }
+                }
+                if (!(events[polled].events & EPOLLIN))
+                    continue;
+
                 // process read task
                 should_close = 0;
                 while (!should_close) {
-                    n_read = read(client->fd, read_buf, KIO_READ_SIZE);
+                    // read straight into the tail of the receive buffer
+                    if ((read_buf = kbuf_reserve(&client->rbuf, KIO_READ_SIZE, &read_len)) == NULL) {
+                        should_close = 1;
+                        break;
+                    }
+                    n_read = read(client->fd, read_buf, read_len);
                     if (n_read < 0) {
                         if (errno != EAGAIN)
                             should_close = 1;
@@ -446,32 +938,306 @@ int kio_run(kio_ctx_t *ctx, const uint16_t port) {
                         should_close = 1;
                         break;
                     } else {
-                        kbuf_write(buf, read_buf, n_read);
+                        kbuf_commit(&client->rbuf, n_read);
                     }
                 }
 
                 // process client read tasks
-                while ((task = client->rtasks)) {
-                    if (buf->len - buf->pos < task->goal_size)
-                        break;
-                    if (task->gtype)
-                        if (!strstr(buf->data + buf->pos, task->str_goal))
-                            break;
-                    client->rtasks = task->next;
-                    ((kio_clientcb_t)task->callback)(client);
-                    free(task);
-                    task = NULL;
-                }
+                kio_process_reads(client);
 
                 // close client if should close
                 if (should_close)
                     kio_close(client);
             }
         }
+
+        // free clients closed during this turn
+        kio_reap(ctx, 0);
+    }
+
+    return 0;
+}
+
+#ifdef KURING_SUPPORTED
+static int kio_uring_arm(kio_ctx_t *ctx, const uint64_t tag, kio_client_t *client) {
+    kio_uring_t *uring = (kio_uring_t*)ctx->ring;
+    struct io_uring_sqe *sqe = kuring_sqe(&uring->ring);
+    if (sqe == NULL) {
+        fprintf(stderr, "[KDB] io_uring submission queue is full\n");
+        return -1;
+    }
+
+    switch (tag) {
+
+        // multishot accept, one completion per incoming connection
+        case KIO_UD_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = ctx->server;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->user_data = KIO_UD(NULL, KIO_UD_ACCEPT);
+            break;
+
+        // multishot poll on the wakeup event
+        case KIO_UD_WAKE:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = ctx->wake_fd;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            sqe->poll32_events = POLLIN;
+            sqe->user_data = KIO_UD(NULL, KIO_UD_WAKE);
+            break;
+
+        // multishot receive into buffers picked from the provided ring
+        case KIO_UD_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = client->fd;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = uring->bufs.bgid;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->user_data = KIO_UD(client, KIO_UD_RECV);
+            client->inflight++;
+            break;
+    }
+    return 0;
+}
+
+static void kio_uring_accept(kio_ctx_t *ctx, int fd) {
+    kio_client_t *client;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    // multishot accept doesnt report the peer address
+    memset(&addr, 0, sizeof(addr));
+    getpeername(fd, (struct sockaddr*)&addr, &addr_len);
+    if ((client = kio_client(ctx, fd, &addr)) == NULL)
+        return;
+
+    // start receiving then hand the client over
+    if (kio_uring_arm(ctx, KIO_UD_RECV, client)) {
+        kio_close(client);
+        return;
+    }
+    kio_accepted(ctx, client);
+}
+
+static void kio_uring_recv(kio_ctx_t *ctx, kio_client_t *client, struct io_uring_cqe *cqe) {
+    kio_uring_t *uring = (kio_uring_t*)ctx->ring;
+    const int more = cqe->flags & IORING_CQE_F_MORE;
+
+    // copy out of the provided buffer and give it straight back
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        const unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !client->closing)
+            kbuf_write(&client->rbuf, kuring_bufs_get(&uring->bufs, bid), cqe->res);
+        kuring_bufs_recycle(&uring->bufs, bid);
+    }
+    if (!more)
+        client->inflight--;
+    if (client->closing)
+        return;
+
+    // process client read tasks
+    if (cqe->res > 0)
+        kio_process_reads(client);
+
+    // multishot receive ended, re-arm it unless the peer is gone
+    if (!more && !client->closing) {
+        if ((cqe->res > 0 || cqe->res == -ENOBUFS) && !kio_uring_arm(ctx, KIO_UD_RECV, client))
+            return;
+        kio_close(client);
+    }
+}
+
+static void kio_uring_sent(kio_client_t *client, struct io_uring_cqe *cqe) {
+    client->inflight--;
+    client->sending = 0;
+
+    // remove sent data and keep sending what is left, even when closing so
+    // frames written right before kio_close still go out
+    if (cqe->res < 0) {
+        kio_close(client);
+        return;
+    }
+    kio_queue_consume(client, cqe->res);
+    kio_uring_send(client);
+}
+
+static int kio_uring_loop(kio_ctx_t *ctx) {
+    int running;
+    uint64_t tag;
+    kio_client_t *client;
+    struct io_uring_cqe *cqe;
+    kio_uring_t *uring = (kio_uring_t*)ctx->ring;
+
+    // arm the multishot accept and wakeup requests
+    if (kio_uring_arm(ctx, KIO_UD_ACCEPT, NULL) || kio_uring_arm(ctx, KIO_UD_WAKE, NULL))
+        return -1;
+
+    // start io server
+    running = !ctx->stop;
+    while (!ctx->closed && running) {
+
+        // submit everything queued last turn and wait for completions
+        if (kuring_submit(&uring->ring, ktimer_timeout(&ctx->timers)))
+            break;
+        kio_expire(ctx);
+
+        // process completions
+        while (running && (cqe = kuring_cqe(&uring->ring)) != NULL) {
+            tag = cqe->user_data & KIO_UD_MASK;
+            client = (kio_client_t*)(uintptr_t)(cqe->user_data & ~(uint64_t)KIO_UD_MASK);
+
+            switch (tag) {
+                case KIO_UD_ACCEPT:
+                    if (cqe->res >= 0)
+                        kio_uring_accept(ctx, cqe->res);
+                    if (!(cqe->flags & IORING_CQE_F_MORE) && kio_uring_arm(ctx, KIO_UD_ACCEPT, NULL))
+                        running = 0;
+                    break;
+                case KIO_UD_WAKE:
+                    running = kio_wakeup(ctx);
+                    if (running && !(cqe->flags & IORING_CQE_F_MORE) && kio_uring_arm(ctx, KIO_UD_WAKE, NULL))
+                        running = 0;
+                    break;
+                case KIO_UD_RECV:
+                    kio_uring_recv(ctx, client, cqe);
+                    break;
+                case KIO_UD_SEND:
+                    kio_uring_sent(client, cqe);
+                    break;
+            }
+            kuring_cqe_seen(&uring->ring);
+        }
+
+        // free clients closed during this turn with nothing left in flight
+        kio_reap(ctx, 0);
+    }
+
+    return 0;
+}
+
+static int kio_uring_init(kio_ctx_t *ctx) {
+    // create the ring and register the receive buffer group
+    kio_uring_t *uring = malloc(sizeof(kio_uring_t));
+    if (uring == NULL)
+        return -1;
+    if (kuring_init(&uring->ring, KIO_URING_ENTRIES)) {
+        free(uring);
+        return -1;
+    }
+    if (kuring_bufs_init(&uring->ring, &uring->bufs, 0, KIO_URING_BUFS, KIO_READ_SIZE)) {
+        kuring_free(&uring->ring);
+        free(uring);
+        return -1;
+    }
+    ctx->ring = uring;
+    return 0;
+}
+#endif
+
+int kio_run(kio_ctx_t *ctx, const uint16_t port) {
+    int result;
+
+    // invalid context
+    if (ctx == NULL || ctx->closed)
+        return -1;
+
+    // create server
+    ctx->server = kio_server(port);
+    if (ctx->server < 0) {
+        kio_free(ctx);
+        return -1;
+    }
+
+    // run on io_uring when requested and supported, fall back to epoll
+#ifdef KURING_SUPPORTED
+    if (ctx->uring && kio_uring_init(ctx) == 0) {
+        printf("[KDB] Worker %u started on %d (io_uring)\n", ctx->id, port);
+        result = kio_uring_loop(ctx);
+    } else
+#endif
+    {
+        if (ctx->uring)
+            fprintf(stderr, "[KDB] io_uring unavailable, using epoll\n");
+        printf("[KDB] Worker %u started on %d\n", ctx->id, port);
+        result = kio_epoll_loop(ctx);
     }
 
     // free and return
     kio_free(ctx);
-    return 0;
+    return result;
+}
+
+typedef struct {
+    int result;
+    uint16_t port;
+    kio_ctx_t *ctx;
+    kio_ctx_t *first; // runs on the calling thread
+} kio_worker_t;
+
+static void* kio_worker(void *arg) {
+    kio_worker_t *worker = (kio_worker_t*)arg;
+
+    // a worker that fails stops the first one, which then stops the rest
+    // so the server never keeps going on fewer threads
+    if ((worker->result = kio_run(worker->ctx, worker->port)) != 0) {
+        fprintf(stderr, "[KDB] Worker %u failed, stopping the server\n", worker->ctx->id);
+        kio_stop(worker->first);
+    }
+    return NULL;
 }
-    
\ No newline at end of file
+
+int kio_run_workers(kio_ctx_t *ctxs, const size_t workers, const uint16_t port) {
+    size_t i;
+    int result;
+    pthread_t *threads;
+    kio_worker_t *args;
+    sigset_t mask, old_mask;
+
+    // invalid contexts
+    if (ctxs == NULL || workers == 0)
+        return -1;
+    if (workers == 1)
+        return kio_run(ctxs, port);
+
+    // allocate thread handles and worker arguments
+    threads = malloc(sizeof(pthread_t) * workers);
+    args = malloc(sizeof(kio_worker_t) * workers);
+    if (threads == NULL || args == NULL) {
+        fprintf(stderr, "[KDB] Not enough memory for kio workers!\n");
+        free(threads);
+        free(args);
+        return -1;
+    }
+
+    // block signals in the workers so only the calling thread handles them
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    // spawn every worker except the first, which runs on this thread
+    for (i = 1; i < workers; i++) {
+        ctxs[i].id = i;
+        args[i].port = port;
+        args[i].result = 0;
+        args[i].ctx = &ctxs[i];
+        args[i].first = &ctxs[0];
+        if (pthread_create(&threads[i], NULL, kio_worker, &args[i])) {
+            fprintf(stderr, "[KDB] Failed to spawn kio worker %zu\n", i);
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    // run the first worker, then stop and wait on the rest
+    ctxs[0].id = 0;
+    result = (i == workers) ? kio_run(&ctxs[0], port) : -1;
+    while (--i > 0) {
+        kio_stop(&ctxs[i]);
+        pthread_join(threads[i], NULL);
+        if (args[i].result)
+            result = -1;
+    }
+
+    free(threads);
+    free(args);
+    return result;
+}
\ No newline at end of file
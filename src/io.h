@@ -2,7 +2,12 @@
 #define K_IO_H
 
 #include "buffer.h"
+#include "pool.h"
+#include "timer.h"
 #include <stdio.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 
 #ifndef KIO_READ_SIZE
@@ -13,15 +18,40 @@
 #define KIO_MAX_EVENTS 128
 #endif
 
-typedef void (*kio_callback_t)(void *data);
+// outbound queue chunk size and iovecs gathered per send
+#ifndef KIO_CHUNK_SIZE
+#define KIO_CHUNK_SIZE 16384
+#endif
 
-typedef struct {
-    void *data;
-    void *next;
-    void *last;
-    uint64_t expires;
-    kio_callback_t callback;
-} kio_task_t;
+#ifndef KIO_WRITE_IOVS
+#define KIO_WRITE_IOVS 8
+#endif
+
+// default outbound queue watermarks, see kio_ctx_t wmark_high/wmark_low
+#ifndef KIO_WMARK_HIGH
+#define KIO_WMARK_HIGH (1024 * 1024)
+#endif
+
+#ifndef KIO_WMARK_LOW
+#define KIO_WMARK_LOW (256 * 1024)
+#endif
+
+// io_uring backend sizing: submission entries and provided receive buffers
+#ifndef KIO_URING_ENTRIES
+#define KIO_URING_ENTRIES 1024
+#endif
+
+#ifndef KIO_URING_BUFS
+#define KIO_URING_BUFS 256
+#endif
+
+// default limit on bytes buffered while waiting for a kio_read_until delimiter
+#ifndef KIO_MAX_HEADER
+#define KIO_MAX_HEADER (16 * 1024)
+#endif
+
+typedef ktimer_cb_t kio_callback_t;
+typedef ktimer_t kio_task_t;
 
 typedef struct {
     void *next;
@@ -29,38 +59,105 @@ typedef struct {
     const char *str_goal;
     unsigned gtype : 1;
     uint64_t goal_size;
+    size_t scanned;
 } kio_rtask_t;
 
+typedef void (*kio_release_t)(void *arg);
+
+typedef struct {
+    void *next;
+    size_t pos;
+    size_t len;
+    size_t max;
+    char *buf;
+    void *arg;
+    kio_release_t release;
+    char data[];
+} kio_chunk_t;
+
+// work handed to a loop by another thread, see kio_post
+typedef struct {
+    void *next;
+    void *data;
+    kio_callback_t callback;
+} kio_post_t;
+
+typedef struct {
+    uint64_t queued;
+    uint64_t queued_peak;
+    uint64_t throttled;
+} kio_stats_t;
+
 typedef struct {
     void *data;
+    void *ring;
+    unsigned id;
+    int server;
+    int wake_fd;
     int epoll_fd;
     void *clients;
+    void *closing;
+    void *posted; // kio_post_t from other threads, newest first
     void *accept_cb;
+    unsigned uring : 1;
     unsigned closed : 1;
     unsigned running : 1;
-    kio_task_t *tasks;
+    volatile sig_atomic_t stop;
     uint64_t client_num;
+    size_t wmark_high;
+    size_t wmark_low;
+    size_t max_header;
+    kio_stats_t stats;
+    ktimer_wheel_t timers;
+    kpool_t client_pool;
+    kpool_t rtask_pool;
+    kpool_t timer_pool;
+    kpool_t data_pool;
 } kio_ctx_t;
 
 typedef struct {
     int fd;
     void *data;
     void *next;
+    void **prev;
+    void *on_data;
     void *on_close;
+    void *on_wmark;
     kbuf_t rbuf;
     kio_ctx_t *ctx; 
     kio_rtask_t *rtasks;
+    uint8_t inflight;
+    unsigned closing : 1;
+    unsigned sending : 1;
+    unsigned throttled : 1;
+    size_t wqueued;
+    kio_chunk_t *wqueue;
+    kio_chunk_t *wtail;
+    struct msghdr wmsg;
+    struct iovec wiov[KIO_WRITE_IOVS];
     struct sockaddr_in addr;
 } kio_client_t;
 
 typedef void (*kio_clientcb_t)(kio_client_t *client);
+typedef void (*kio_wmarkcb_t)(kio_client_t *client, int throttled);
+typedef void (*kio_eachcb_t)(kio_client_t *client, void *arg);
 
 kio_ctx_t* kio_init(kio_ctx_t *ctx);
 void kio_free(kio_ctx_t *ctx);
+void kio_destroy(kio_ctx_t *ctx);
+void kio_stop(kio_ctx_t *ctx);
 void kio_close(kio_client_t *client);
+void kio_each(kio_ctx_t *ctx, kio_eachcb_t callback, void *arg);
 int kio_run(kio_ctx_t *ctx, const uint16_t port);
+int kio_run_workers(kio_ctx_t *ctxs, const size_t workers, const uint16_t port);
 int kio_call(kio_ctx_t *ctx, const uint64_t delay, void *data, kio_callback_t callback);
+void kio_post(kio_ctx_t *ctx, kio_post_t *post, void *data, kio_callback_t callback);
+kio_task_t* kio_timer(kio_ctx_t *ctx, const uint64_t delay, void *data, kio_callback_t callback);
+void kio_cancel(kio_ctx_t *ctx, kio_task_t *task);
 void kio_write(kio_client_t *client, const char *data, const size_t len);
+void kio_writev(kio_client_t *client, const struct iovec *iov, const int iovcnt, kio_release_t release, void *arg);
+void kio_on_wmark(kio_client_t *client, kio_wmarkcb_t callback);
+void kio_on_data(kio_client_t *client, kio_clientcb_t callback);
 int kio_read(kio_client_t *client, const uint64_t goal, kio_clientcb_t callback);
 int kio_read_until(kio_client_t *client, const char *goal, kio_clientcb_t callback);
 
@@ -1,17 +1,105 @@
 #include "db.h"
+#include "snap.h"
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #define KDB_SERVER_PORT 11011
+#define KDB_MAX_WORKERS 256
 
 int main(int argc, char **argv) {
-    kio_ctx_t ctx;
+    int opt;
+    int uring = 0;
+    size_t i, workers = 1;
+    kio_ctx_t *ctxs;
+    kdb_opts_t opts = { NULL, KDB_WAL_BATCH, KDB_WAL_INTERVAL, NULL, KDB_SNAP_INTERVAL, 0, 0 };
 
-    if (kio_init(&ctx) == NULL) {
-        fprintf(stderr, "Failed to initalize kio_ctx\n");
+    // parse command line options
+    while ((opt = getopt(argc, argv, "uw:e:p:l:d:i:s:t:")) != -1) {
+        switch (opt) {
+            case 'u':
+                uring = 1;
+                break;
+            case 'w':
+                workers = strtoul(optarg, NULL, 10);
+                break;
+            case 'e':
+                opts.exec_threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                opts.scan_threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                opts.wal_path = optarg;
+                break;
+            case 'd':
+                if (!strcmp(optarg, "none"))
+                    opts.wal_mode = KDB_WAL_NONE;
+                else if (!strcmp(optarg, "periodic"))
+                    opts.wal_mode = KDB_WAL_PERIODIC;
+                else if (!strcmp(optarg, "batch"))
+                    opts.wal_mode = KDB_WAL_BATCH;
+                else {
+                    fprintf(stderr, "Durability must be none, periodic or batch\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'i':
+                opts.wal_interval = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                opts.snap_path = optarg;
+                break;
+            case 't':
+                opts.snap_interval = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-u] [-w workers] [-e storage threads] [-p scan threads] [-l log] [-d none|periodic|batch] [-i sync ms] [-s snapshot] [-t snapshot secs]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (workers == 0 || workers > KDB_MAX_WORKERS) {
+        fprintf(stderr, "Worker count must be between 1 and %d\n", KDB_MAX_WORKERS);
+        return EXIT_FAILURE;
+    }
+    if (opts.exec_threads > KDB_MAX_WORKERS) {
+        fprintf(stderr, "Storage thread count must be at most %d\n", KDB_MAX_WORKERS);
+        return EXIT_FAILURE;
+    }
+    if (opts.scan_threads > KDB_MAX_WORKERS) {
+        fprintf(stderr, "Scan thread count must be at most %d\n", KDB_MAX_WORKERS);
+        return EXIT_FAILURE;
+    }
+    if (opts.wal_interval == 0) {
+        fprintf(stderr, "Sync interval must be at least 1 ms\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.snap_interval == 0) {
+        fprintf(stderr, "Snapshot interval must be at least 1 second\n");
         return EXIT_FAILURE;
     }
 
-    if (kdb_run(&ctx, KDB_SERVER_PORT))
+    // one io context per worker
+    ctxs = calloc(workers, sizeof(kio_ctx_t));
+    if (ctxs == NULL) {
+        fprintf(stderr, "Not enough memory for kio_ctx\n");
         return EXIT_FAILURE;
-    return EXIT_SUCCESS;
+    }
+    for (i = 0; i < workers; i++) {
+        if (kio_init(&ctxs[i]) == NULL) {
+            fprintf(stderr, "Failed to initalize kio_ctx\n");
+            while (i-- > 0)
+                kio_destroy(&ctxs[i]);
+            free(ctxs);
+            return EXIT_FAILURE;
+        }
+        ctxs[i].uring = uring;
+    }
+
+    // every thread that could stop a context is joined by now
+    const int result = kdb_run(ctxs, workers, KDB_SERVER_PORT, &opts);
+    for (i = 0; i < workers; i++)
+        kio_destroy(&ctxs[i]);
+    free(ctxs);
+    return result ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -25,6 +25,9 @@ static const size_t
 // data type opcode flags
 #define K_TYPE_UNSIGNED 1
 #define K_TYPE_DEFAULT 2
+#define K_TYPE_INDEX 4   // hash index the column, NEW only
+#define K_TYPE_ORDERED 8 // b+-tree index a numeric column, NEW only
+#define K_TYPE_PARAM 16  // placeholder bound on EXEC, STMT only
 
 // command opcodes
 #define K_CMD_GET 0 // SELECT
@@ -33,9 +36,30 @@ static const size_t
 #define K_CMD_DEL 3 // DELETE
 #define K_CMD_REM 4 // DROP
 #define K_CMD_NEW 5 // CREATE
+#define K_CMD_PREP 6 // resolve names to handles
+#define K_CMD_STMT 7 // prepare a statement
+#define K_CMD_EXEC 8 // run a prepared statement
+#define K_CMD_AGG 9  // SELECT COUNT/SUM/MIN/MAX/AVG
 
 // sub command opcode
 #define K_Q_WHERE 0 // WHERE str(x) comp(op) val(?)
 #define K_Q_LIMIT 1 // LIMIT int(x)
+#define K_Q_OR 2    // OR str(x) comp(op) val(?)
+#define K_Q_GROUP 3 // GROUP BY str(x), AGG only
+
+// aggregate opcodes
+#define K_AGG_COUNT 0
+#define K_AGG_SUM 1
+#define K_AGG_MIN 2
+#define K_AGG_MAX 3
+#define K_AGG_AVG 4
+
+// comparison opcodes
+#define K_CMP_EQ 0 // ==
+#define K_CMP_NE 1 // !=
+#define K_CMP_LT 2 // <
+#define K_CMP_LE 3 // <=
+#define K_CMP_GT 4 // >
+#define K_CMP_GE 5 // >=
 
 #endif // K_OP_H
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include "pool.h"
+#include <stdlib.h>
+
+#ifdef KPOOL_STATS
+#define KPOOL_STAT(expr) expr
+#else
+#define KPOOL_STAT(expr)
+#endif
+
+// slabs are linked through a header kept in front of the objects
+typedef struct {
+    void *next;
+    max_align_t align[];
+} kpool_slab_t;
+
+void kpool_init(kpool_t *pool, const size_t size) {
+    const size_t align = _Alignof(max_align_t);
+
+    // every object must fit the freelist link and keep its alignment
+    pool->free = NULL;
+    pool->slabs = NULL;
+    pool->used = 0;
+    pool->size = size < sizeof(void*) ? sizeof(void*) : size;
+    pool->size = (pool->size + align - 1) & ~(align - 1);
+    KPOOL_STAT(pool->hits = pool->misses = pool->peak = 0);
+}
+
+void kpool_free(kpool_t *pool) {
+    kpool_slab_t *slab;
+    while ((slab = (kpool_slab_t*)pool->slabs) != NULL) {
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    pool->free = NULL;
+    pool->used = 0;
+}
+
+static int kpool_grow(kpool_t *pool) {
+    size_t i;
+    char *obj;
+
+    // allocate a slab and thread all of its objects onto the freelist
+    kpool_slab_t *slab = malloc(sizeof(kpool_slab_t) + pool->size * KPOOL_SLAB_OBJECTS);
+    if (slab == NULL)
+        return -1;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    obj = (char*)slab->align;
+    for (i = 0; i < KPOOL_SLAB_OBJECTS; i++, obj += pool->size) {
+        *(void**)obj = pool->free;
+        pool->free = obj;
+    }
+    return 0;
+}
+
+void* kpool_alloc(kpool_t *pool) {
+    void *obj;
+
+    // pop from the freelist, only hitting malloc when it is empty
+    if (pool->free != NULL) {
+        KPOOL_STAT(pool->hits++);
+    } else {
+        KPOOL_STAT(pool->misses++);
+        if (kpool_grow(pool))
+            return NULL;
+    }
+    obj = pool->free;
+    pool->free = *(void**)obj;
+    pool->used++;
+    KPOOL_STAT(if (pool->used > pool->peak) pool->peak = pool->used);
+    return obj;
+}
+
+void kpool_release(kpool_t *pool, void *obj) {
+    if (obj == NULL) return;
+    *(void**)obj = pool->free;
+    pool->free = obj;
+    pool->used--;
+}
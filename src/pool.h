@@ -0,0 +1,31 @@
+#ifndef K_POOL_H
+#define K_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// objects carved out of each slab when a pool runs dry
+#ifndef KPOOL_SLAB_OBJECTS
+#define KPOOL_SLAB_OBJECTS 64
+#endif
+
+// fixed-size object pool, build with -DKPOOL_STATS to count freelist
+// hits, slab misses and peak objects in use
+typedef struct {
+    void *free;
+    void *slabs;
+    size_t size;
+    size_t used;
+#ifdef KPOOL_STATS
+    uint64_t hits;
+    uint64_t misses;
+    size_t peak;
+#endif
+} kpool_t;
+
+void kpool_init(kpool_t *pool, const size_t size);
+void kpool_free(kpool_t *pool);
+void* kpool_alloc(kpool_t *pool);
+void kpool_release(kpool_t *pool, void *obj);
+
+#endif // K_POOL_H
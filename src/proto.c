@@ -0,0 +1,450 @@
+#include "proto.h"
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+// kinds of lists a command body can hold
+#define KPROTO_LIST_COLUMNS 0
+#define KPROTO_LIST_NAMES 1
+#define KPROTO_LIST_REFS 2
+#define KPROTO_LIST_ASSIGNS 3
+#define KPROTO_LIST_CLAUSES 4
+#define KPROTO_LIST_AGGS 5
+
+void kproto_reader(kproto_reader_t *reader, const void *data, const size_t len) {
+    reader->data = (const uint8_t*)data;
+    reader->len = len;
+    reader->pos = 0;
+}
+
+static inline const uint8_t* kproto_take(kproto_reader_t *reader, const size_t size) {
+    const uint8_t *data = reader->data + reader->pos;
+    if (size > reader->len - reader->pos)
+        return NULL;
+    reader->pos += size;
+    return data;
+}
+
+static inline int kproto_u8(kproto_reader_t *reader, uint8_t *out) {
+    const uint8_t *data = kproto_take(reader, 1);
+    if (data == NULL)
+        return -1;
+    *out = data[0];
+    return 0;
+}
+
+static inline int kproto_u32(kproto_reader_t *reader, uint32_t *out) {
+    const uint8_t *data = kproto_take(reader, 4);
+    if (data == NULL)
+        return -1;
+    memcpy(out, data, 4);
+    *out = le32toh(*out);
+    return 0;
+}
+
+static inline int kproto_u64(kproto_reader_t *reader, uint64_t *out) {
+    const uint8_t *data = kproto_take(reader, 8);
+    if (data == NULL)
+        return -1;
+    memcpy(out, data, 8);
+    *out = le64toh(*out);
+    return 0;
+}
+
+int kproto_name(kproto_reader_t *reader, kproto_str_t *name) {
+    uint8_t len;
+    if (kproto_u8(reader, &len) || len == 0)
+        return -1;
+    if ((name->data = (const char*)kproto_take(reader, len)) == NULL)
+        return -1;
+    name->len = len;
+    return 0;
+}
+
+int kproto_ref(kproto_reader_t *reader, kproto_ref_t *ref, const int is_table) {
+    uint8_t len, u8;
+    const size_t start = reader->pos;
+
+    // an empty name is followed by the handle instead
+    ref->handle = 0;
+    if (kproto_u8(reader, &len))
+        return -1;
+    if (len != 0) {
+        reader->pos = start;
+        return kproto_name(reader, &ref->name);
+    }
+    ref->name.data = NULL;
+    ref->name.len = 0;
+    if (is_table)
+        return kproto_u32(reader, &ref->handle);
+    if (kproto_u8(reader, &u8))
+        return -1;
+    ref->handle = u8;
+    return 0;
+}
+
+int kproto_value(kproto_reader_t *reader, const uint8_t type, kproto_value_t *value) {
+    uint8_t u8;
+    uint16_t u16;
+    uint32_t u32;
+    uint64_t u64;
+    float f;
+    const uint8_t *data;
+    const int is_unsigned = KPROTO_FLAGS(type) & K_TYPE_UNSIGNED;
+
+    // integers are sign or zero extended to 64 bits by the column flags,
+    // placeholders leave their value to EXEC
+    value->type = KPROTO_TYPE(type);
+    value->flags = KPROTO_FLAGS(type);
+    if (value->flags & K_TYPE_PARAM)
+        return 0;
+    switch (value->type) {
+        case K_TYPE_BYTE:
+            if (kproto_u8(reader, &u8)) return -1;
+            value->u = is_unsigned ? u8 : (uint64_t)(int64_t)(int8_t)u8;
+            return 0;
+        case K_TYPE_SHORT:
+            if ((data = kproto_take(reader, 2)) == NULL) return -1;
+            memcpy(&u16, data, 2);
+            u16 = le16toh(u16);
+            value->u = is_unsigned ? u16 : (uint64_t)(int64_t)(int16_t)u16;
+            return 0;
+        case K_TYPE_INT:
+            if (kproto_u32(reader, &u32)) return -1;
+            value->u = is_unsigned ? u32 : (uint64_t)(int64_t)(int32_t)u32;
+            return 0;
+        case K_TYPE_LONG:
+            return kproto_u64(reader, &value->u);
+        case K_TYPE_BOOL:
+            if (kproto_u8(reader, &u8)) return -1;
+            value->u = u8 != 0;
+            return 0;
+        case K_TYPE_FLOAT:
+            if (kproto_u32(reader, &u32)) return -1;
+            memcpy(&f, &u32, 4);
+            value->d = f;
+            return 0;
+        case K_TYPE_DOUBLE:
+            if (kproto_u64(reader, &u64)) return -1;
+            memcpy(&value->d, &u64, 8);
+            return 0;
+        case K_TYPE_STRING:
+            if (kproto_u32(reader, &value->s.len)) return -1;
+            if ((value->s.data = (const char*)kproto_take(reader, value->s.len)) == NULL) return -1;
+            return 0;
+    }
+    return -1;
+}
+
+int kproto_typed(kproto_reader_t *reader, kproto_value_t *value) {
+    uint8_t type;
+    if (kproto_u8(reader, &type))
+        return -1;
+    return kproto_value(reader, type, value);
+}
+
+int kproto_column(kproto_reader_t *reader, kproto_column_t *col) {
+    uint8_t type;
+    if (kproto_u8(reader, &type) || kproto_name(reader, &col->name) || kproto_u32(reader, &col->maxsize))
+        return -1;
+    col->type = KPROTO_TYPE(type);
+    col->flags = KPROTO_FLAGS(type);
+    return 0;
+}
+
+int kproto_assign(kproto_reader_t *reader, kproto_ref_t *col, kproto_value_t *value) {
+    if (kproto_ref(reader, col, 0))
+        return -1;
+    return kproto_typed(reader, value);
+}
+
+int kproto_clause(kproto_reader_t *reader, kproto_clause_t *clause) {
+    if (kproto_u8(reader, &clause->type))
+        return -1;
+    switch (clause->type) {
+        case K_Q_WHERE:
+        case K_Q_OR:
+            if (kproto_ref(reader, &clause->column, 0) || kproto_u8(reader, &clause->cmp))
+                return -1;
+            if (clause->cmp > K_CMP_GE)
+                return -1;
+            return kproto_typed(reader, &clause->value);
+        case K_Q_LIMIT:
+            return kproto_u64(reader, &clause->limit);
+        case K_Q_GROUP:
+            return kproto_ref(reader, &clause->column, 0);
+    }
+    return -1;
+}
+
+int kproto_agg(kproto_reader_t *reader, uint8_t *op, kproto_ref_t *col) {
+    if (kproto_u8(reader, op) || *op > K_AGG_AVG)
+        return -1;
+    return kproto_ref(reader, col, 0);
+}
+
+// walk a list once so callers can iterate it later without failing,
+// view covers exactly the bytes the entries take up
+static int kproto_list(kproto_reader_t *reader, kproto_reader_t *view, const uint8_t count, const int kind, kproto_cmd_t *cmd) {
+    uint8_t i, op;
+    kproto_str_t name;
+    kproto_ref_t ref;
+    kproto_value_t value;
+    kproto_column_t col;
+    kproto_clause_t clause;
+    const size_t start = reader->pos;
+
+    for (i = 0; i < count; i++) {
+        int failed, param = 0;
+        switch (kind) {
+            case KPROTO_LIST_COLUMNS: failed = kproto_column(reader, &col); break;
+            case KPROTO_LIST_NAMES: failed = kproto_name(reader, &name); break;
+            case KPROTO_LIST_REFS: failed = kproto_ref(reader, &ref, 0); break;
+            case KPROTO_LIST_ASSIGNS:
+                failed = kproto_assign(reader, &ref, &value);
+                param = value.flags & K_TYPE_PARAM;
+                break;
+            case KPROTO_LIST_AGGS: failed = kproto_agg(reader, &op, &ref); break;
+            default:
+                failed = kproto_clause(reader, &clause);
+                param = (clause.type == K_Q_WHERE || clause.type == K_Q_OR) && (clause.value.flags & K_TYPE_PARAM);
+                cmd->n_groups += !failed && clause.type == K_Q_GROUP;
+                break;
+        }
+        if (failed)
+            return -1;
+        cmd->n_params += param != 0;
+    }
+    kproto_reader(view, reader->data + start, reader->pos - start);
+    return 0;
+}
+
+static int kproto_clauses(kproto_reader_t *body, kproto_cmd_t *cmd) {
+    if (kproto_u8(body, &cmd->n_clauses))
+        return -1;
+    return kproto_list(body, &cmd->clauses, cmd->n_clauses, KPROTO_LIST_CLAUSES, cmd);
+}
+
+int kproto_next(kproto_reader_t *reader, kproto_cmd_t *cmd) {
+    uint8_t op;
+    uint32_t len;
+    const uint8_t *data;
+    kproto_reader_t body;
+
+    // end of the frame, or the command header/body is cut short
+    if (reader->pos == reader->len)
+        return 0;
+    if (kproto_u8(reader, &cmd->op) || kproto_u32(reader, &len))
+        return -1;
+    if ((data = kproto_take(reader, len)) == NULL)
+        return -1;
+
+    // decode the body in place
+    cmd->n_cols = 0;
+    cmd->n_rows = 0;
+    cmd->n_clauses = 0;
+    cmd->n_groups = 0;
+    cmd->n_params = 0;
+    cmd->n_shards = 0;
+    cmd->shard_key = 0;
+    kproto_reader(&body, data, len);
+    kproto_reader(&cmd->cols, data, 0);
+    kproto_reader(&cmd->rows, data, 0);
+    kproto_reader(&cmd->clauses, data, 0);
+    kproto_reader(&cmd->params, data, 0);
+
+    // placeholder values need the statement to decode, hand them over
+    if (cmd->op == K_CMD_EXEC) {
+        if (kproto_u32(&body, &cmd->stmt))
+            return -1;
+        kproto_reader(&cmd->params, body.data + body.pos, body.len - body.pos);
+        return 1;
+    }
+
+    // a statement wraps the command it holds, the rest starts with a table
+    // and only the ones resolving names need it by name
+    if ((op = cmd->op) == K_CMD_STMT && (kproto_u8(&body, &op) || op > K_CMD_DEL))
+        return -1;
+    cmd->stmt_op = op;
+    cmd->body.data = (const char*)body.data + body.pos;
+    cmd->body.len = body.len - body.pos;
+    if (kproto_ref(&body, &cmd->table, 1))
+        return -1;
+    if ((op == K_CMD_NEW || op == K_CMD_PREP) && cmd->table.name.len == 0)
+        return -1;
+
+    switch (op) {
+        case K_CMD_NEW:
+            if (kproto_u8(&body, &cmd->n_cols) || cmd->n_cols == 0)
+                return -1;
+            if (kproto_list(&body, &cmd->cols, cmd->n_cols, KPROTO_LIST_COLUMNS, cmd))
+                return -1;
+            if (body.pos < body.len && (kproto_u8(&body, &cmd->n_shards) || kproto_u8(&body, &cmd->shard_key)))
+                return -1;
+            break;
+
+        case K_CMD_PREP:
+            if (kproto_u8(&body, &cmd->n_cols))
+                return -1;
+            if (kproto_list(&body, &cmd->cols, cmd->n_cols, KPROTO_LIST_NAMES, cmd))
+                return -1;
+            break;
+
+        case K_CMD_REM:
+            break;
+
+        // rows need the table schema to decode, hand the rest of the body over
+        case K_CMD_ADD:
+            if (kproto_u32(&body, &cmd->n_rows))
+                return -1;
+            kproto_reader(&cmd->rows, body.data + body.pos, body.len - body.pos);
+            body.pos = body.len;
+            break;
+
+        case K_CMD_GET:
+        case K_CMD_SET:
+            if (kproto_u8(&body, &cmd->n_cols))
+                return -1;
+            if (kproto_list(&body, &cmd->cols, cmd->n_cols, op == K_CMD_GET ? KPROTO_LIST_REFS : KPROTO_LIST_ASSIGNS, cmd))
+                return -1;
+            if (kproto_clauses(&body, cmd))
+                return -1;
+            break;
+
+        case K_CMD_DEL:
+            if (kproto_clauses(&body, cmd))
+                return -1;
+            break;
+
+        // aggregates are listed like columns, one at least
+        case K_CMD_AGG:
+            if (kproto_u8(&body, &cmd->n_cols) || cmd->n_cols == 0)
+                return -1;
+            if (kproto_list(&body, &cmd->cols, cmd->n_cols, KPROTO_LIST_AGGS, cmd))
+                return -1;
+            if (kproto_clauses(&body, cmd))
+                return -1;
+            break;
+
+        default:
+            return -1;
+    }
+
+    // trailing bytes mean the body does not match its command, statements
+    // are the only place for placeholders and an ADD one takes no rows
+    if (cmd->op != K_CMD_STMT && cmd->n_params)
+        return -1;
+    if (cmd->n_groups > (op == K_CMD_AGG))
+        return -1;
+    if (cmd->op == K_CMD_STMT && op == K_CMD_ADD && (cmd->n_rows || cmd->rows.len))
+        return -1;
+    return body.pos == body.len ? 1 : -1;
+}
+
+void kproto_writer(kproto_writer_t *writer) {
+    writer->data = NULL;
+    writer->len = 0;
+    writer->max = 0;
+    writer->failed = 0;
+}
+
+void kproto_writer_free(kproto_writer_t *writer) {
+    free(writer->data);
+    kproto_writer(writer);
+}
+
+char* kproto_put(kproto_writer_t *writer, const size_t size) {
+    char *data;
+    size_t max = writer->max ? writer->max : 256;
+
+    // grow by doubling, a failed writer drops everything after the failure
+    if (writer->failed)
+        return NULL;
+    if (writer->len + size > writer->max) {
+        while (max < writer->len + size)
+            max *= 2;
+        if ((data = realloc(writer->data, max)) == NULL) {
+            writer->failed = 1;
+            return NULL;
+        }
+        writer->data = data;
+        writer->max = max;
+    }
+    data = writer->data + writer->len;
+    writer->len += size;
+    return data;
+}
+
+void kproto_put_u8(kproto_writer_t *writer, const uint8_t value) {
+    char *data = kproto_put(writer, 1);
+    if (data != NULL)
+        *data = (char)value;
+}
+
+void kproto_put_u32(kproto_writer_t *writer, const uint32_t value) {
+    const uint32_t le = htole32(value);
+    char *data = kproto_put(writer, 4);
+    if (data != NULL)
+        memcpy(data, &le, 4);
+}
+
+void kproto_put_u64(kproto_writer_t *writer, const uint64_t value) {
+    const uint64_t le = htole64(value);
+    char *data = kproto_put(writer, 8);
+    if (data != NULL)
+        memcpy(data, &le, 8);
+}
+
+void kproto_put_name(kproto_writer_t *writer, const char *name, const uint8_t len) {
+    char *data = kproto_put(writer, 1 + len);
+    if (data != NULL) {
+        data[0] = (char)len;
+        memcpy(data + 1, name, len);
+    }
+}
+
+void kproto_put_value(kproto_writer_t *writer, const kproto_value_t *value) {
+    char *data;
+    uint16_t u16;
+    uint32_t u32;
+    uint64_t u64;
+    float f;
+
+    // encode with the width of the value type, mirroring kproto_value
+    switch (value->type) {
+        case K_TYPE_BYTE:
+        case K_TYPE_BOOL:
+            kproto_put_u8(writer, (uint8_t)value->u);
+            break;
+        case K_TYPE_SHORT:
+            u16 = htole16((uint16_t)value->u);
+            if ((data = kproto_put(writer, 2)) != NULL)
+                memcpy(data, &u16, 2);
+            break;
+        case K_TYPE_INT:
+            kproto_put_u32(writer, (uint32_t)value->u);
+            break;
+        case K_TYPE_LONG:
+            kproto_put_u64(writer, value->u);
+            break;
+        case K_TYPE_FLOAT:
+            f = (float)value->d;
+            memcpy(&u32, &f, 4);
+            kproto_put_u32(writer, u32);
+            break;
+        case K_TYPE_DOUBLE:
+            memcpy(&u64, &value->d, 8);
+            kproto_put_u64(writer, u64);
+            break;
+        case K_TYPE_STRING:
+            kproto_put_u32(writer, value->s.len);
+            if ((data = kproto_put(writer, value->s.len)) != NULL)
+                memcpy(data, value->s.data, value->s.len);
+            break;
+    }
+}
+
+void kproto_put_typed(kproto_writer_t *writer, const kproto_value_t *value) {
+    kproto_put_u8(writer, value->type | (value->flags << 3));
+    kproto_put_value(writer, value);
+}
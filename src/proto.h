@@ -0,0 +1,180 @@
+#ifndef K_PROTO_H
+#define K_PROTO_H
+
+#include "ops.h"
+#include <stdint.h>
+
+// wire format, every integer is little endian:
+//
+//   frame   := command*
+//   command := u8 K_CMD_* | u32 body length | body
+//   name    := u8 length | bytes
+//   ref     := name | u8 0 | handle, u32 for tables and u8 for columns
+//   type    := u8 K_TYPE_* | (K_TYPE_UNSIGNED/DEFAULT/INDEX/ORDERED/PARAM << 3)
+//   value   := fixed width by type, strings are u32 length | bytes
+//   typed   := type | value
+//
+//   NEW  name(table) u8 n_cols { type name(col) u32 maxsize }
+//        [u8 n_shards u8 key(col)]
+//   REM  ref(table)
+//   ADD  ref(table) u32 n_rows { value per column in schema order }
+//   GET  ref(table) u8 n_cols { ref(col) } u8 n_clauses { clause }
+//   SET  ref(table) u8 n_cols { ref(col) typed } u8 n_clauses { clause }
+//   DEL  ref(table) u8 n_clauses { clause }
+//   PREP name(table) u8 n_cols { name(col) }
+//   STMT u8 K_CMD_GET/SET/ADD/DEL | body of that command
+//   EXEC u32 id(stmt) | value per placeholder in order
+//   AGG  ref(table) u8 n_aggs { u8 K_AGG_* ref(col) } u8 n_clauses { clause }
+//
+//   clause := u8 K_Q_WHERE ref(col) u8 K_CMP_* typed
+//           | u8 K_Q_OR ref(col) u8 K_CMP_* typed
+//           | u8 K_Q_LIMIT u64 count
+//           | u8 K_Q_GROUP ref(col), AGG only and once at most
+//
+//   PREP hands out the handles a ref can use in place of a name, a table
+//   handle stays with its table until it is removed, a column handle is
+//   its place in the schema
+//
+//   STMT keeps a command compiled on the connection, any typed value in
+//   it can be a placeholder: its type flagged K_TYPE_PARAM and no value.
+//   an ADD statement has no rows, they are what its EXEC sends as
+//   u32 n_rows { value per column }. statements are dropped least
+//   recently used first, EXEC answers KDB_ERR_STMT once it is gone
+//
+//   K_TYPE_DEFAULT is reserved, ADD sends every column of a row so a NEW
+//   flagging a column with it fails with KDB_ERR_VALUE
+//
+//   a NEW ending in a shard count above 1 splits the rows of the table
+//   over that many shards by a hash of the column at place key. each
+//   shard has a writer of its own, commands on rows of different shards
+//   run side by side. the key of a row cant be SET, it would change shard
+//
+//   WHERE binds tighter than OR: a WHERE b OR c WHERE d is (a && b) || (c && d)
+//
+//   a WHERE or OR value is compared as the number or string it is, not
+//   cast as a stored value would be: one past either end of an integer
+//   column orders the same against every row, a fraction against one
+//   rounds to the integer keeping the comparison (x < 2.5 is x <= 2) and
+//   a string longer than the column holds equals none of its rows. only
+//   a string against a number, or a number against a string, fails with
+//   KDB_ERR_TYPE
+//
+//   matching rows come back in table order, except when a range on a
+//   K_TYPE_ORDERED column is answered by its index, then in column order.
+//   a sharded table answers shard by shard, ranges merged in column order
+//
+//   AGG folds the matching rows into a row of aggregates, or one for each
+//   value of the GROUP column in its order, LIMIT caps those rows. COUNT
+//   takes any column and the others no strings. a SUM of integers wraps
+//   at 64 bits, floats sum as doubles in no set order. with no rows MIN,
+//   MAX and AVG are 0. AGG cant be prepared
+//
+// every command is answered in order, all answers to a frame go back in
+// a single binary frame:
+//
+//   result  := u8 K_CMD_* | u8 status | body when status is 0
+//   GET     := u8 n_cols { type name(col) } u32 n_rows { value per column }
+//   AGG     := as GET, the GROUP column first then each aggregate by the
+//              name of its column: COUNT as an unsigned LONG, SUM as a LONG
+//              or a DOUBLE, MIN and MAX as the column, AVG as a DOUBLE
+//   PREP    := u32 handle(table) u8 n_cols { u8 handle(col) type }
+//   STMT    := u32 id(stmt) u16 n_params { type }
+//   EXEC    := the answer of the command the statement holds
+//   others  := u64 rows affected
+
+#define KPROTO_CMD_HEADER 5
+#define KPROTO_TYPE(t) ((t) & 0x07)
+#define KPROTO_FLAGS(t) ((t) >> 3)
+
+typedef struct {
+    const char *data;
+    uint32_t len;
+} kproto_str_t;
+
+// a table or column given by name, or by handle when the name is empty
+typedef struct {
+    kproto_str_t name;
+    uint32_t handle;
+} kproto_ref_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        kproto_str_t s;
+    };
+} kproto_value_t;
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+} kproto_reader_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t maxsize;
+    kproto_str_t name;
+} kproto_column_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t cmp;
+    uint64_t limit;
+    kproto_ref_t column;
+    kproto_value_t value;
+} kproto_clause_t;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t max;
+    unsigned failed : 1;
+} kproto_writer_t;
+
+typedef struct {
+    uint8_t op;
+    uint8_t stmt_op; // command a STMT holds, op for every other one
+    uint8_t n_cols;
+    uint8_t n_clauses;
+    uint8_t n_groups;
+    uint16_t n_params;
+    uint8_t n_shards; // NEW only, 0 when not sharded
+    uint8_t shard_key;
+    uint32_t n_rows;
+    uint32_t stmt; // EXEC statement id
+    kproto_ref_t table;
+    kproto_str_t body; // of the stmt_op command, every field points into it
+    kproto_reader_t cols;
+    kproto_reader_t rows;
+    kproto_reader_t clauses;
+    kproto_reader_t params; // EXEC values
+} kproto_cmd_t;
+
+void kproto_reader(kproto_reader_t *reader, const void *data, const size_t len);
+int kproto_next(kproto_reader_t *reader, kproto_cmd_t *cmd);
+
+int kproto_value(kproto_reader_t *reader, const uint8_t type, kproto_value_t *value);
+int kproto_typed(kproto_reader_t *reader, kproto_value_t *value);
+int kproto_name(kproto_reader_t *reader, kproto_str_t *name);
+int kproto_ref(kproto_reader_t *reader, kproto_ref_t *ref, const int is_table);
+int kproto_column(kproto_reader_t *reader, kproto_column_t *col);
+int kproto_assign(kproto_reader_t *reader, kproto_ref_t *col, kproto_value_t *value);
+int kproto_clause(kproto_reader_t *reader, kproto_clause_t *clause);
+int kproto_agg(kproto_reader_t *reader, uint8_t *op, kproto_ref_t *col);
+
+void kproto_writer(kproto_writer_t *writer);
+void kproto_writer_free(kproto_writer_t *writer);
+char* kproto_put(kproto_writer_t *writer, const size_t size);
+void kproto_put_u8(kproto_writer_t *writer, const uint8_t value);
+void kproto_put_u32(kproto_writer_t *writer, const uint32_t value);
+void kproto_put_u64(kproto_writer_t *writer, const uint64_t value);
+void kproto_put_name(kproto_writer_t *writer, const char *name, const uint8_t len);
+void kproto_put_value(kproto_writer_t *writer, const kproto_value_t *value);
+void kproto_put_typed(kproto_writer_t *writer, const kproto_value_t *value);
+
+#endif // K_PROTO_H
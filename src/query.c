@@ -0,0 +1,2026 @@
+#define _GNU_SOURCE
+#include "query.h"
+#include "agg.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/mman.h>
+
+// most clauses or columns a single command can carry
+#define KDB_MAX_LIST 256
+
+// a row read at a snapshot changed while it was copied out
+#define KDB_RETRY -1
+
+// blocks in a morsel of a full scan shared out over the team, and the
+// fewest morsels a table needs before it is worth sharing
+#define KDB_MORSEL 256
+#define KDB_MORSEL_MIN 4
+
+typedef struct {
+    size_t n_filters;
+    uint64_t limit;
+    uint64_t epoch;       // snapshot rows are read at
+    kdb_filter_t *index;  // equality answered by a hash index
+    kdb_column_t *range; // ordered column bounding the scan
+    uint64_t low, high;  // inclusive bounds in tree key order
+    kdb_filter_t filters[KDB_MAX_LIST];
+} kdb_plan_t;
+
+typedef struct {
+    uint64_t *data;
+    size_t len;
+    size_t max;
+} kdb_rows_t;
+
+// a block as a snapshot saw it, dressed up as a table of one block so
+// filters and row callbacks run over it as they would over the table
+typedef struct {
+    kdb_t table;
+    kdb_column_t *cols;
+    kdb_filter_t *filters;
+    char *data; // the block of every column
+    uint64_t live;
+} kdb_view_t;
+
+typedef int (*kdb_row_cb_t)(kdb_t *table, const uint64_t row, void *arg);
+
+int kdb_ctx_init(kdb_ctx_t *ctx) {
+    pthread_rwlockattr_t attr;
+    ctx->dbs = NULL;
+    ctx->db_len = 0;
+    ctx->snap = NULL;
+    ctx->snap_len = 0;
+    ctx->epoch = 0;
+    ctx->shared = 0;
+    ctx->exclusive = 0;
+    ctx->shards = NULL;
+    ctx->n_shards = 0;
+    ctx->team = NULL;
+    memset(&ctx->epochs, 0, sizeof(kdb_epochs_t));
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    // readers come and go all the time, a writer waiting for the layout
+    // has to stop new ones or it might never get it
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&ctx->layout, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return kdb_catalog_init(&ctx->catalog);
+}
+
+void kdb_ctx_free(kdb_ctx_t *ctx) {
+    size_t i;
+    for (i = 0; i < ctx->db_len; i++)
+        kdb_table_free(&ctx->dbs[i]);
+    free(ctx->dbs);
+    ctx->dbs = NULL;
+    ctx->db_len = 0;
+    for (i = 0; i < ctx->n_shards; i++)
+        kdb_ctx_free(kdb_ctx_shard(ctx, i));
+    free(ctx->shards);
+    ctx->shards = NULL;
+    ctx->n_shards = 0;
+    kdb_catalog_free(&ctx->catalog);
+
+    // tables are gone, nothing points into the snapshot anymore
+    if (ctx->snap != NULL)
+        munmap(ctx->snap, ctx->snap_len);
+    ctx->snap = NULL;
+    kdb_epochs_free(&ctx->epochs);
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_rwlock_destroy(&ctx->layout);
+}
+
+int kdb_ctx_share(kdb_ctx_t *ctx, const size_t readers) {
+    size_t i;
+
+    // a slot for each reader to announce the snapshot it is at, the
+    // same one in every shard
+    if (kdb_epochs_init(&ctx->epochs, readers))
+        return KDB_ERR_MEMORY;
+    ctx->shared = 1;
+    for (i = 0; i < ctx->n_shards; i++)
+        if (kdb_ctx_share(kdb_ctx_shard(ctx, i), readers))
+            return KDB_ERR_MEMORY;
+    return KDB_OK;
+}
+
+int kdb_ctx_shards(kdb_ctx_t *ctx, const size_t n) {
+    kdb_ctx_t *shard;
+
+    // contexts hold locks so they never move, room for all of them is
+    // set aside once and each is made when a table first splits that far
+    if (ctx->shards == NULL && (ctx->shards = calloc(KDB_MAX_SHARDS, sizeof(kdb_ctx_t))) == NULL)
+        return KDB_ERR_MEMORY;
+    while (ctx->n_shards < n) {
+        shard = kdb_ctx_shard(ctx, ctx->n_shards);
+        if (kdb_ctx_init(shard) || (ctx->shared && kdb_ctx_share(shard, ctx->epochs.n_readers))) {
+            kdb_ctx_free(shard);
+            return KDB_ERR_MEMORY;
+        }
+        __atomic_store_n(&ctx->n_shards, ctx->n_shards + 1, __ATOMIC_RELEASE);
+    }
+    return KDB_OK;
+}
+
+kdb_ctx_t* kdb_ctx_shard(const kdb_ctx_t *ctx, const size_t shard) {
+    return &((kdb_ctx_t*)ctx->shards)[shard];
+}
+
+void kdb_ctx_lock(kdb_ctx_t *ctx) {
+    size_t i;
+
+    // stops every writer, shards go in order as they do for a writer
+    // locking several
+    pthread_mutex_lock(&ctx->lock);
+    for (i = 0; i < ctx->n_shards; i++)
+        pthread_mutex_lock(&kdb_ctx_shard(ctx, i)->lock);
+}
+
+void kdb_ctx_unlock(kdb_ctx_t *ctx) {
+    size_t i;
+    for (i = ctx->n_shards; i-- > 0;)
+        pthread_mutex_unlock(&kdb_ctx_shard(ctx, i)->lock);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void kdb_ctx_exclusive(kdb_ctx_t *ctx) {
+    // held until the command is published
+    if (!ctx->exclusive) {
+        pthread_rwlock_wrlock(&ctx->layout);
+        ctx->exclusive = 1;
+    }
+}
+
+static inline uint64_t kdb_ctx_keep(const kdb_ctx_t *ctx) {
+    // epoch the running command versions rows at, 0 when no reader can see
+    return ctx->shared && !ctx->exclusive ? ctx->epoch + 1 : 0;
+}
+
+static void kdb_ctx_begin(kdb_ctx_t *ctx) {
+    // versions every reader is past are cut from again while still warm
+    if (ctx->shared)
+        kdb_epochs_reclaim(&ctx->epochs, ctx->epoch);
+}
+
+static void kdb_ctx_publish(kdb_ctx_t *ctx) {
+    // readers let in after this start from its epoch, so none of them
+    // predates a command that held the layout
+    __atomic_store_n(&ctx->epoch, ctx->epoch + 1, __ATOMIC_RELEASE);
+    if (ctx->exclusive) {
+        ctx->exclusive = 0;
+        pthread_rwlock_unlock(&ctx->layout);
+    }
+}
+
+static int kdb_ctx_gone(const kdb_ctx_t *ctx, const size_t shard) {
+    size_t i;
+    for (i = 0; i < ctx->db_len; i++)
+        if (ctx->dbs[i].n_shards > shard && kdb_table_shard(&ctx->dbs[i], shard)->versions.n_gone)
+            return 1;
+    return 0;
+}
+
+void kdb_ctx_collect(kdb_ctx_t *ctx) {
+    size_t i, s;
+    kdb_ctx_t *shard;
+
+    // taken with the writer lock held, only deleted rows wait on the
+    // readers to be out, versions go as soon as they are past them
+    for (i = 0; i < ctx->db_len && ctx->dbs[i].versions.n_gone == 0; i++);
+    if (i < ctx->db_len) {
+        pthread_rwlock_wrlock(&ctx->layout);
+        for (; i < ctx->db_len; i++)
+            kdb_version_collect(&ctx->dbs[i]);
+        pthread_rwlock_unlock(&ctx->layout);
+    }
+
+    // rows of a shard wait on the readers of that shard, under its lock
+    for (s = 0; s < ctx->n_shards; s++) {
+        shard = kdb_ctx_shard(ctx, s);
+        pthread_mutex_lock(&shard->lock);
+        if (kdb_ctx_gone(ctx, s)) {
+            pthread_rwlock_wrlock(&shard->layout);
+            for (i = 0; i < ctx->db_len; i++)
+                if (ctx->dbs[i].n_shards > s)
+                    kdb_version_collect(kdb_table_shard(&ctx->dbs[i], s));
+            pthread_rwlock_unlock(&shard->layout);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+kdb_t* kdb_ctx_table(kdb_ctx_t *ctx, const kproto_ref_t *ref) {
+    uint64_t slot;
+    uint32_t sym;
+
+    // a name nobody interned cant belong to any table
+    if (ref->name.len == 0) {
+        slot = kdb_catalog_handle(&ctx->catalog, ref->handle);
+    } else {
+        if ((sym = kdb_catalog_symbol(&ctx->catalog, &ref->name)) == KDB_CATALOG_NONE)
+            return NULL;
+        slot = kdb_catalog_table(&ctx->catalog, sym);
+    }
+    return slot == KDB_INDEX_END ? NULL : &ctx->dbs[slot];
+}
+
+kdb_column_t* kdb_ctx_column(kdb_ctx_t *ctx, kdb_t *table, const kproto_ref_t *ref) {
+    uint64_t col;
+    uint32_t sym;
+
+    // column handles are places in the schema, which never changes
+    if (ref->name.len == 0)
+        return ref->handle < table->n_cols ? &table->cols[ref->handle] : NULL;
+    if ((sym = kdb_catalog_symbol(&ctx->catalog, &ref->name)) == KDB_CATALOG_NONE)
+        return NULL;
+    col = kdb_catalog_column(&ctx->catalog, table->handle, sym);
+    return col == KDB_INDEX_END ? NULL : &table->cols[col];
+}
+
+int kdb_ctx_register(kdb_ctx_t *ctx, const size_t slot) {
+    uint8_t i;
+    const kdb_t *table = &ctx->dbs[slot];
+
+    // the table already has its handle, make it and its columns findable
+    if (kdb_catalog_reserve(&ctx->catalog, table->n_cols))
+        return -1;
+    kdb_catalog_put(&ctx->catalog, table->sym, table->handle, slot);
+    for (i = 0; i < table->n_cols; i++)
+        kdb_catalog_put_column(&ctx->catalog, table->handle, table->cols[i].sym, i);
+    return 0;
+}
+
+static int kdb_rows_push(kdb_rows_t *rows, const uint64_t row) {
+    uint64_t *grown;
+    if (rows->len == rows->max) {
+        rows->max = rows->max ? rows->max * 2 : 64;
+        if ((grown = realloc(rows->data, rows->max * sizeof(uint64_t))) == NULL)
+            return -1;
+        rows->data = grown;
+    }
+    rows->data[rows->len++] = row;
+    return 0;
+}
+
+static void kdb_plan_bound(kdb_plan_t *plan, const kdb_filter_t *filter) {
+    const uint64_t key = kdb_tree_key(&filter->value);
+
+    // bounds only ever narrow, strict ones step past the key and an
+    // impossible one leaves low above high
+    switch (filter->cmp) {
+        case K_CMP_LT:
+            if (key == 0) {
+                plan->low = UINT64_MAX;
+                plan->high = 0;
+            } else if (key - 1 < plan->high) {
+                plan->high = key - 1;
+            }
+            break;
+        case K_CMP_GT:
+            if (key == UINT64_MAX) {
+                plan->low = UINT64_MAX;
+                plan->high = 0;
+            } else if (key + 1 > plan->low) {
+                plan->low = key + 1;
+            }
+            break;
+        case K_CMP_EQ:
+        case K_CMP_LE:
+        case K_CMP_GE:
+            if (filter->cmp != K_CMP_GE && key < plan->high)
+                plan->high = key;
+            if (filter->cmp != K_CMP_LE && key > plan->low)
+                plan->low = key;
+            break;
+    }
+}
+
+static int kdb_plan_clause(kdb_plan_t *plan, kdb_column_t *col, const kproto_clause_t *clause) {
+    // the smallest LIMIT wins
+    if (clause->type == K_Q_LIMIT) {
+        if (clause->limit < plan->limit)
+            plan->limit = clause->limit;
+        return KDB_OK;
+    }
+    return kdb_filter_init(&plan->filters[plan->n_filters++], col, clause->type, clause->cmp, &clause->value);
+}
+
+static void kdb_plan_scan(kdb_plan_t *plan) {
+    size_t i;
+
+    // without OR every match has to pass each filter, so an equality on a
+    // hashed column or the bounds on an ordered one narrow down the scan
+    plan->index = NULL;
+    plan->range = NULL;
+    plan->low = 0;
+    plan->high = UINT64_MAX;
+    for (i = 0; i < plan->n_filters; i++) {
+        kdb_filter_t *filter = &plan->filters[i];
+        if (i > 0 && filter->join == K_Q_OR) {
+            plan->index = NULL;
+            plan->range = NULL;
+            return;
+        }
+        if (plan->index == NULL && filter->cmp == K_CMP_EQ && filter->col->index.slots)
+            plan->index = filter;
+        if (filter->cmp == K_CMP_NE || filter->col->tree.root == NULL)
+            continue;
+        if (plan->range == NULL)
+            plan->range = filter->col;
+        if (plan->range == filter->col)
+            kdb_plan_bound(plan, filter);
+    }
+
+    // walking the tree beats a vector scan when the limit or a closed
+    // range keeps it short
+    if (plan->index != NULL || (plan->limit == UINT64_MAX && (plan->low == 0 || plan->high == UINT64_MAX)))
+        plan->range = NULL;
+}
+
+static int kdb_plan(kdb_ctx_t *ctx, kdb_t *table, const kproto_cmd_t *cmd, kdb_plan_t *plan) {
+    int err;
+    uint8_t i;
+    kproto_clause_t clause;
+    kdb_column_t *col = NULL;
+    kproto_reader_t clauses = cmd->clauses;
+
+    // compile WHERE and OR clauses against the schema
+    plan->n_filters = 0;
+    plan->limit = UINT64_MAX;
+    plan->epoch = KDB_EPOCH_LATEST;
+    for (i = 0; i < cmd->n_clauses; i++) {
+        kproto_clause(&clauses, &clause);
+        if (clause.type == K_Q_GROUP)
+            continue;
+        if (clause.type != K_Q_LIMIT && (col = kdb_ctx_column(ctx, table, &clause.column)) == NULL)
+            return KDB_ERR_COLUMN;
+        if ((err = kdb_plan_clause(plan, col, &clause)))
+            return err;
+    }
+    kdb_plan_scan(plan);
+    return KDB_OK;
+}
+
+static void kdb_plan_move(kdb_plan_t *to, const kdb_plan_t *from, const kdb_t *table, kdb_t *shard) {
+    size_t i;
+
+    // the same clauses over the columns of a shard, which has every index
+    // the table has so the scan comes out the same
+    to->n_filters = from->n_filters;
+    to->limit = from->limit;
+    to->epoch = from->epoch;
+    for (i = 0; i < from->n_filters; i++) {
+        to->filters[i] = from->filters[i];
+        to->filters[i].col = shard->cols + (from->filters[i].col - table->cols);
+    }
+    kdb_plan_scan(to);
+}
+
+static inline size_t kdb_shard_of(const kdb_t *table, const kproto_value_t *key) {
+    // keys counting up spread over every shard
+    return (size_t)((kdb_index_key(key) * 0x9e3779b97f4a7c15ULL) >> 32) % table->n_shards;
+}
+
+static uint64_t kdb_plan_shards(const kdb_t *table, const kdb_plan_t *plan) {
+    size_t i;
+    uint64_t group = 0, shards = 0;
+    const uint64_t all = table->n_shards == 64 ? UINT64_MAX : (1ULL << table->n_shards) - 1;
+    const kdb_column_t *key = &table->cols[table->shard_key];
+
+    // each OR group matches rows of one shard at most once it pins the key,
+    // a group that doesnt may match rows anywhere
+    for (i = 0; i <= plan->n_filters && shards != all; i++) {
+        if (i == plan->n_filters || (i > 0 && plan->filters[i].join == K_Q_OR)) {
+            shards |= group ? group : all;
+            group = 0;
+            if (i == plan->n_filters)
+                break;
+        }
+        if (group == 0 && plan->filters[i].col == key && plan->filters[i].cmp == K_CMP_EQ)
+            group = 1ULL << kdb_shard_of(table, &plan->filters[i].value);
+    }
+    return shards;
+}
+
+static void kdb_shards_lock(kdb_ctx_t *ctx, uint64_t shards, kdb_locks_t *locks) {
+    // in shard order, so writers taking several never wait on each other
+    locks->shards = shards;
+    for (; shards; shards &= shards - 1)
+        pthread_mutex_lock(&kdb_ctx_shard(ctx, __builtin_ctzll(shards))->lock);
+}
+
+static int kdb_row_order(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void kdb_view_free(kdb_view_t *view) {
+    free(view->cols);
+    free(view->filters);
+    free(view->data);
+}
+
+static kdb_t* kdb_view_load(kdb_view_t *view, kdb_t *table, const kdb_plan_t *plan, const uint64_t block) {
+    size_t i, size = 0;
+    char *data;
+
+    // set up for the first block a scan needs, the filters move over to
+    // the columns of the view
+    if (view->data == NULL) {
+        for (i = 0; i < table->n_cols; i++)
+            size += kdb_version_slice(&table->cols[i]);
+        if ((view->cols = malloc(table->n_cols * sizeof(kdb_column_t))) == NULL ||
+            (plan->n_filters && (view->filters = malloc(plan->n_filters * sizeof(kdb_filter_t))) == NULL) ||
+            (view->data = aligned_alloc(KDB_ALIGN, size)) == NULL)
+            return NULL;
+        memcpy(view->cols, table->cols, table->n_cols * sizeof(kdb_column_t));
+        view->table = *table;
+        view->table.cols = view->cols;
+        view->table.n_rows = KDB_BLOCK;
+        view->table.live = &view->live;
+        memset(&view->table.versions, 0, sizeof(kdb_versions_t));
+        for (data = view->data, i = 0; i < table->n_cols; i++) {
+            view->cols[i].data = data;
+            if (view->cols[i].type == K_TYPE_STRING)
+                view->cols[i].lens = (uint32_t*)(data + KDB_BLOCK * view->cols[i].width);
+            data += kdb_version_slice(&view->cols[i]);
+        }
+        for (i = 0; i < plan->n_filters; i++) {
+            view->filters[i] = plan->filters[i];
+            view->filters[i].col = view->cols + (plan->filters[i].col - table->cols);
+        }
+    }
+    kdb_version_read(table, block, plan->epoch, &view->table);
+    return &view->table;
+}
+
+static kdb_t* kdb_block_view(kdb_t *table, const kdb_plan_t *plan, kdb_view_t *view, const uint64_t block, uint64_t *bits) {
+    kdb_t *from = kdb_view_load(view, table, plan, block);
+    if (from == NULL)
+        return NULL;
+    *bits &= view->live;
+    kdb_filter_batch(from, view->filters, plan->n_filters, 0, 1, bits);
+    return from;
+}
+
+// narrows bits to the rows of a block matching the plan at its epoch and
+// returns where to read them, the table while no writer changed the block
+// since, else a view of the block as the epoch saw it
+static kdb_t* kdb_block(kdb_t *table, const kdb_plan_t *plan, kdb_view_t *view, const uint64_t block, uint64_t *bits) {
+    const uint64_t rows = *bits;
+    const uint64_t stamp = kdb_version_stamp(table, block);
+    if (stamp <= plan->epoch) {
+        *bits &= table->live[block];
+        kdb_filter_batch(table, plan->filters, plan->n_filters, block, 1, bits);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (kdb_version_stamp(table, block) == stamp)
+            return table;
+        *bits = rows;
+    }
+    return kdb_block_view(table, plan, view, block, bits);
+}
+
+// runs the callback over the matching rows of a block until the limit, a
+// row that changed under it is read again from a view with the rest
+static int kdb_visit(kdb_t *table, kdb_t *from, const kdb_plan_t *plan, kdb_view_t *view, const uint64_t block, uint64_t bits, kdb_row_cb_t callback, void *arg, uint64_t *matched) {
+    int err;
+    for (; bits && *matched < plan->limit; bits &= bits - 1) {
+        const unsigned i = __builtin_ctzll(bits);
+        if ((err = callback(from, from == table ? block * KDB_BLOCK + i : i, arg)) == KDB_RETRY) {
+            if ((from = kdb_view_load(view, table, plan, block)) == NULL)
+                return KDB_ERR_MEMORY;
+            err = callback(from, i, arg);
+        }
+        if (err)
+            return err;
+        (*matched)++;
+    }
+    return KDB_OK;
+}
+
+static int kdb_scan_index(kdb_t *table, const kdb_plan_t *plan, kdb_view_t *view, kdb_row_cb_t callback, void *arg, uint64_t *matched) {
+    size_t i;
+    kdb_t *from;
+    int err = KDB_OK;
+    uint64_t row, pos, block, bits;
+    kdb_rows_t rows = { NULL, 0, 0 };
+    const kdb_index_t *index = &plan->index->col->index;
+    const uint64_t key = kdb_index_key(&plan->index->value);
+
+    // collect the rows under the key up front, callbacks may change the index
+    for (pos = kdb_index_start(index, key); (row = kdb_index_next(index, key, &pos)) != KDB_INDEX_END;) {
+        if (kdb_rows_push(&rows, row)) {
+            free(rows.data);
+            return KDB_ERR_MEMORY;
+        }
+    }
+
+    // visit them in table order, running every filter over each block they
+    // fall in since string keys are only hashes
+    if (rows.len > 1)
+        qsort(rows.data, rows.len, sizeof(uint64_t), kdb_row_order);
+    *matched = 0;
+    for (i = 0; i < rows.len && *matched < plan->limit && err == KDB_OK;) {
+        block = rows.data[i] / 64;
+        for (bits = 0; i < rows.len && rows.data[i] / 64 == block; i++)
+            bits |= 1ULL << (rows.data[i] % 64);
+        if ((from = kdb_block(table, plan, view, block, &bits)) == NULL)
+            err = KDB_ERR_MEMORY;
+        else
+            err = kdb_visit(table, from, plan, view, block, bits, callback, arg, matched);
+    }
+    free(rows.data);
+    return err;
+}
+
+static int kdb_scan_range(kdb_t *table, const kdb_plan_t *plan, kdb_view_t *view, kdb_row_cb_t callback, void *arg, uint64_t *matched) {
+    size_t i;
+    int err = KDB_OK;
+    kdb_cursor_t cursor;
+    uint64_t key, row, bits;
+    kdb_rows_t rows = { NULL, 0, 0 };
+
+    // walk the range in column order until the limit is met, callbacks run
+    // after the walk since they may move rows around in the tree
+    kdb_tree_seek(&plan->range->tree, plan->low, &cursor);
+    while (plan->low <= plan->high && rows.len < plan->limit && kdb_tree_next(&cursor, &key, &row) && key <= plan->high) {
+        bits = 1ULL << (row % 64);
+        if (kdb_block(table, plan, view, row / 64, &bits) == NULL || (bits && kdb_rows_push(&rows, row))) {
+            free(rows.data);
+            return KDB_ERR_MEMORY;
+        }
+    }
+    *matched = 0;
+    for (i = 0; i < rows.len && err == KDB_OK; i++)
+        err = kdb_visit(table, table, plan, view, rows.data[i] / 64, 1ULL << (rows.data[i] % 64), callback, arg, matched);
+    free(rows.data);
+    return err;
+}
+
+static int kdb_scan_blocks(kdb_t *table, const kdb_plan_t *plan, kdb_view_t *view, const uint64_t first, const uint64_t blocks, kdb_row_cb_t callback, void *arg, uint64_t *matched) {
+    int err;
+    size_t i, n;
+    kdb_t *from;
+    uint64_t block, bits[KDB_BATCH], stamps[KDB_BATCH];
+
+    // filter a batch of blocks at a time, then visit matching rows in order.
+    // a block a writer changed since the epoch, or while it was filtered,
+    // is filtered again as the epoch saw it
+    *matched = 0;
+    for (block = first; block < blocks && *matched < plan->limit; block += n) {
+        n = blocks - block < KDB_BATCH ? blocks - block : KDB_BATCH;
+        for (i = 0; i < n; i++)
+            stamps[i] = kdb_version_stamp(table, block + i);
+        memcpy(bits, table->live + block, n * sizeof(uint64_t));
+        kdb_filter_batch(table, plan->filters, plan->n_filters, block, n, bits);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        for (i = 0; i < n && *matched < plan->limit; i++) {
+            from = table;
+            if (plan->epoch != KDB_EPOCH_LATEST && (stamps[i] > plan->epoch || kdb_version_stamp(table, block + i) != stamps[i])) {
+                bits[i] = UINT64_MAX;
+                if ((from = kdb_block_view(table, plan, view, block + i, &bits[i])) == NULL)
+                    return KDB_ERR_MEMORY;
+            }
+            if ((err = kdb_visit(table, from, plan, view, block + i, bits[i], callback, arg, matched)))
+                return err;
+        }
+    }
+    return KDB_OK;
+}
+
+static int kdb_scan_all(kdb_t *table, const kdb_plan_t *plan, kdb_view_t *view, kdb_row_cb_t callback, void *arg, uint64_t *matched) {
+    return kdb_scan_blocks(table, plan, view, 0, (table->n_rows + 63) / 64, callback, arg, matched);
+}
+
+static int kdb_scan(kdb_t *table, const kdb_plan_t *plan, kdb_row_cb_t callback, void *arg, uint64_t *matched) {
+    int err;
+    kdb_view_t view;
+    view.cols = NULL;
+    view.filters = NULL;
+    view.data = NULL;
+    if (plan->index != NULL)
+        err = kdb_scan_index(table, plan, &view, callback, arg, matched);
+    else if (plan->range != NULL)
+        err = kdb_scan_range(table, plan, &view, callback, arg, matched);
+    else
+        err = kdb_scan_all(table, plan, &view, callback, arg, matched);
+    kdb_view_free(&view);
+    return err;
+}
+
+static int kdb_plan_shared(const kdb_ctx_t *ctx, const kdb_t *table, const kdb_plan_t *plan) {
+    // a long vector scan is shared out over the team
+    return ctx->team != NULL && plan->index == NULL && plan->range == NULL && table->n_rows > (uint64_t)KDB_MORSEL_MIN * KDB_MORSEL * KDB_BLOCK;
+}
+
+static int kdb_table_split(kdb_ctx_t *ctx, kdb_t *table, const kproto_cmd_t *cmd) {
+    int err;
+    uint8_t i;
+
+    // the table keeps the schema and its name, rows go to a table of the
+    // same schema in each shard
+    if (cmd->n_shards < 2)
+        return KDB_OK;
+    if (kdb_ctx_shards(ctx, cmd->n_shards) || (table->shards = calloc(cmd->n_shards, sizeof(kdb_t))) == NULL)
+        return KDB_ERR_MEMORY;
+    table->n_shards = cmd->n_shards;
+    table->shard_key = cmd->shard_key;
+    for (i = 0; i < table->n_shards; i++)
+        if ((err = kdb_table_init(kdb_table_shard(table, i), &ctx->catalog, cmd)))
+            return err;
+    return KDB_OK;
+}
+
+static int kdb_query_new(kdb_ctx_t *ctx, const kproto_cmd_t *cmd, kproto_writer_t *out) {
+    int err;
+    uint8_t i;
+    kdb_t *dbs, *table;
+
+    if (kdb_ctx_table(ctx, &cmd->table) != NULL)
+        return KDB_ERR_EXISTS;
+    if (cmd->n_shards > KDB_MAX_SHARDS)
+        return KDB_ERR_VALUE;
+    if (cmd->n_shards > 1 && cmd->shard_key >= cmd->n_cols)
+        return KDB_ERR_COLUMN;
+    if ((dbs = realloc(ctx->dbs, (ctx->db_len + 1) * sizeof(kdb_t))) == NULL)
+        return KDB_ERR_MEMORY;
+    ctx->dbs = dbs;
+    table = &ctx->dbs[ctx->db_len];
+    if ((err = kdb_table_init(table, &ctx->catalog, cmd)) || (err = kdb_table_split(ctx, table, cmd))) {
+        kdb_table_free(table);
+        return err;
+    }
+
+    // only tables that made it take a handle, so replaying the log hands
+    // out the same ones
+    table->handle = ctx->catalog.next;
+    for (i = 0; i < table->n_shards; i++)
+        kdb_table_shard(table, i)->handle = table->handle;
+    if (kdb_ctx_register(ctx, ctx->db_len)) {
+        kdb_table_free(&ctx->dbs[ctx->db_len]);
+        return KDB_ERR_MEMORY;
+    }
+    ctx->catalog.next++;
+    ctx->db_len++;
+    kproto_put_u64(out, 0);
+    return KDB_OK;
+}
+
+static int kdb_query_rem(kdb_ctx_t *ctx, const kproto_cmd_t *cmd, kproto_writer_t *out) {
+    uint8_t i;
+    kdb_t *last;
+    kdb_t *table = kdb_ctx_table(ctx, &cmd->table);
+    if (table == NULL)
+        return KDB_ERR_TABLE;
+
+    // forget the table, then fill the hole with the last table
+    const size_t slot = table - ctx->dbs;
+    kdb_catalog_remove(&ctx->catalog, table->sym, table->handle, slot);
+    for (i = 0; i < table->n_cols; i++)
+        kdb_catalog_remove_column(&ctx->catalog, table->handle, table->cols[i].sym, i);
+    kdb_table_free(table);
+    last = &ctx->dbs[--ctx->db_len];
+    if (last != table) {
+        kdb_catalog_remove(&ctx->catalog, last->sym, last->handle, ctx->db_len);
+        kdb_catalog_put(&ctx->catalog, last->sym, last->handle, slot);
+        *table = *last;
+    }
+    kproto_put_u64(out, 0);
+    return KDB_OK;
+}
+
+static int kdb_query_prep(kdb_ctx_t *ctx, const kproto_cmd_t *cmd, kproto_writer_t *out) {
+    uint8_t i;
+    kdb_column_t *col;
+    kproto_ref_t ref;
+    kproto_reader_t cols = cmd->cols;
+    kdb_t *table = kdb_ctx_table(ctx, &cmd->table);
+    if (table == NULL)
+        return KDB_ERR_TABLE;
+
+    // resolve every name once, no columns means the whole schema
+    const uint8_t n_cols = cmd->n_cols ? cmd->n_cols : table->n_cols;
+    kproto_put_u32(out, table->handle);
+    kproto_put_u8(out, n_cols);
+    ref.handle = 0;
+    for (i = 0; i < n_cols; i++) {
+        col = &table->cols[i];
+        if (cmd->n_cols) {
+            kproto_name(&cols, &ref.name);
+            if ((col = kdb_ctx_column(ctx, table, &ref)) == NULL)
+                return KDB_ERR_COLUMN;
+        }
+        kproto_put_u8(out, (uint8_t)(col - table->cols));
+        kproto_put_u8(out, col->type | (col->flags << 3));
+    }
+    return KDB_OK;
+}
+
+static int kdb_shard_add(kdb_ctx_t *ctx, kdb_t *table, kproto_reader_t *rows, const uint32_t n_rows, kdb_locks_t *locks) {
+    int err = KDB_OK;
+    uint8_t i;
+    uint32_t r;
+    char *data;
+    kdb_ctx_t *shard;
+    kproto_reader_t part;
+    size_t at, start, min_row = 0;
+    uint64_t shards = 0;
+    kproto_value_t value, key = { 0 };
+    uint32_t counts[KDB_MAX_SHARDS] = { 0 };
+    kproto_writer_t split[KDB_MAX_SHARDS];
+
+    // rows are checked and dealt out to their shards before any goes in,
+    // so a bad one leaves every shard as it was. only running out of
+    // memory part way can leave the shards before it with their rows
+    for (i = 0; i < table->n_cols; i++)
+        min_row += table->cols[i].type == K_TYPE_STRING ? 4 : table->cols[i].width;
+    if (n_rows > rows->len / min_row)
+        return KDB_ERR_VALUE;
+    for (at = 0; at < table->n_shards; at++)
+        kproto_writer(&split[at]);
+    for (r = 0; r < n_rows && err == KDB_OK; r++) {
+        start = rows->pos;
+        for (i = 0; i < table->n_cols && err == KDB_OK; i++) {
+            const kdb_column_t *col = &table->cols[i];
+            if (kproto_value(rows, col->type | (col->flags << 3), &value) || (col->maxsize && col->type == K_TYPE_STRING && value.s.len > col->maxsize))
+                err = KDB_ERR_VALUE;
+            else if (i == table->shard_key)
+                key = value;
+        }
+        if (err == KDB_OK) {
+            at = kdb_shard_of(table, &key);
+            if ((data = kproto_put(&split[at], rows->pos - start)) != NULL)
+                memcpy(data, (const char*)rows->data + start, rows->pos - start);
+            counts[at]++;
+            shards |= 1ULL << at;
+        }
+    }
+    if (err == KDB_OK && rows->pos != rows->len)
+        err = KDB_ERR_VALUE;
+    for (at = 0; at < table->n_shards && err == KDB_OK; at++)
+        if (split[at].failed)
+            err = KDB_ERR_MEMORY;
+
+    // only the shards getting rows are locked, each moves its own layout
+    if (err == KDB_OK)
+        kdb_shards_lock(ctx, shards, locks);
+    for (; shards && err == KDB_OK; shards &= shards - 1) {
+        at = __builtin_ctzll(shards);
+        shard = kdb_ctx_shard(ctx, at);
+        kdb_ctx_begin(shard);
+        kdb_ctx_exclusive(shard);
+        kproto_reader(&part, split[at].data, split[at].len);
+        err = kdb_table_add(kdb_table_shard(table, at), &part, counts[at]);
+        kdb_ctx_publish(shard);
+    }
+    for (at = 0; at < table->n_shards; at++)
+        kproto_writer_free(&split[at]);
+    return err;
+}
+
+static int kdb_run_add(kdb_ctx_t *ctx, kdb_t *table, kproto_reader_t *rows, const uint32_t n_rows, kdb_locks_t *locks) {
+    // growing columns moves them out from under readers
+    if (table->n_shards)
+        return kdb_shard_add(ctx, table, rows, n_rows, locks);
+    kdb_ctx_exclusive(ctx);
+    return kdb_table_add(table, rows, n_rows);
+}
+
+static int kdb_query_add(kdb_ctx_t *ctx, const kproto_cmd_t *cmd, kproto_writer_t *out, kdb_locks_t *locks) {
+    int err;
+    kproto_reader_t rows = cmd->rows;
+    kdb_t *table = kdb_ctx_table(ctx, &cmd->table);
+    if (table == NULL)
+        return KDB_ERR_TABLE;
+    if ((err = kdb_run_add(ctx, table, &rows, cmd->n_rows, locks)))
+        return err;
+    kproto_put_u64(out, cmd->n_rows);
+    return KDB_OK;
+}
+
+typedef struct {
+    uint8_t n_cols;
+    uint64_t epoch;
+    kproto_writer_t *out;
+    uint8_t cols[KDB_MAX_LIST]; // by place, rows may come from a view
+} kdb_get_t;
+
+static int kdb_get_row(kdb_t *table, const uint64_t row, void *arg) {
+    uint8_t i;
+    kproto_value_t value;
+    kdb_get_t *get = (kdb_get_t*)arg;
+    const size_t start = get->out->len;
+
+    for (i = 0; i < get->n_cols; i++) {
+        kdb_table_get(table, &table->cols[get->cols[i]], row, &value);
+        kproto_put_value(get->out, &value);
+    }
+
+    // the row is only good if no writer got to it while it was copied,
+    // views are never stamped
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (kdb_version_stamp(table, row / KDB_BLOCK) > get->epoch) {
+        get->out->len = start;
+        return KDB_RETRY;
+    }
+    return get->out->failed ? KDB_ERR_MEMORY : KDB_OK;
+}
+
+static size_t kdb_get_head(const kdb_t *table, const kdb_get_t *get, kproto_writer_t *out) {
+    uint8_t i;
+    size_t count_at;
+
+    // describe the columns, then the rows with their count filled in last
+    kproto_put_u8(out, get->n_cols);
+    for (i = 0; i < get->n_cols; i++) {
+        const kdb_column_t *col = &table->cols[get->cols[i]];
+        kproto_put_u8(out, col->type | (col->flags << 3));
+        kproto_put_name(out, col->name, col->name_len);
+    }
+    count_at = out->len;
+    kproto_put_u32(out, 0);
+    return count_at;
+}
+
+static int kdb_get_count(kproto_writer_t *out, const size_t count_at, const uint64_t matched) {
+    if (out->failed || matched > UINT32_MAX)
+        return KDB_ERR_MEMORY;
+    const uint32_t count = htole32((uint32_t)matched);
+    memcpy(out->data + count_at, &count, 4);
+    return KDB_OK;
+}
+
+// where the rows a morsel matched ended up
+typedef struct {
+    size_t worker;
+    size_t start;
+    size_t end;
+    uint64_t matched;
+    uint8_t done;
+} kdb_morsel_t;
+
+// a thread scanning morsels, rows go to a writer of its own
+typedef struct {
+    kdb_view_t view;
+    kdb_get_t get;
+    kproto_writer_t out;
+} kdb_scanner_t;
+
+// a full scan cut into morsels for the team, rows go back together in
+// morsel order so they still come out in table order
+typedef struct {
+    kdb_t *table;
+    const kdb_plan_t *plan;
+    kdb_scanner_t *scanners;
+    kdb_morsel_t *morsels;
+    size_t n_morsels;
+    size_t first;   // morsel the team starts from
+    size_t stop;    // morsels from here on are past the limit
+    size_t prefix;  // morsels before this one are done
+    uint64_t found; // rows they matched
+    int status;
+    pthread_mutex_t lock;
+} kdb_morsels_t;
+
+static void kdb_morsel_get(void *arg, const size_t worker, const size_t at) {
+    int err;
+    kdb_morsels_t *scan = (kdb_morsels_t*)arg;
+    const size_t i = scan->first + at;
+    kdb_scanner_t *scanner = &scan->scanners[worker];
+    kdb_morsel_t *morsel = &scan->morsels[i];
+    const uint64_t blocks = (scan->table->n_rows + 63) / 64;
+    const uint64_t first = (uint64_t)i * KDB_MORSEL;
+    const uint64_t last = blocks - first < KDB_MORSEL ? blocks : first + KDB_MORSEL;
+
+    // morsels behind the limit, or after one failed, are left alone
+    if (i >= __atomic_load_n(&scan->stop, __ATOMIC_RELAXED))
+        return;
+    morsel->worker = worker;
+    morsel->start = scanner->out.len;
+    err = kdb_scan_blocks(scan->table, scan->plan, &scanner->view, first, last, kdb_get_row, &scanner->get, &morsel->matched);
+    morsel->end = scanner->out.len;
+
+    // once the morsels in front hold every row the limit takes, the ones
+    // behind them neednt run
+    pthread_mutex_lock(&scan->lock);
+    morsel->done = 1;
+    if (err) {
+        scan->status = err;
+        __atomic_store_n(&scan->stop, 0, __ATOMIC_RELAXED);
+    }
+    while (scan->prefix < scan->n_morsels && scan->morsels[scan->prefix].done)
+        scan->found += scan->morsels[scan->prefix++].matched;
+    if (scan->found >= scan->plan->limit && scan->prefix < scan->stop)
+        __atomic_store_n(&scan->stop, scan->prefix, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static size_t kdb_rows_len(const kdb_t *table, const kdb_get_t *get, const char *data, const size_t len, uint64_t n) {
+    uint8_t i;
+    kproto_value_t value;
+    kproto_reader_t rows;
+
+    // bytes the first n rows of an answer take
+    kproto_reader(&rows, data, len);
+    for (; n > 0; n--) {
+        for (i = 0; i < get->n_cols; i++) {
+            const kdb_column_t *col = &table->cols[get->cols[i]];
+            kproto_value(&rows, col->type | (col->flags << 3), &value);
+        }
+    }
+    return rows.pos;
+}
+
+static int kdb_morsels_get(kdb_ctx_t *ctx, kdb_t *table, const kdb_get_t *get, const kdb_plan_t *plan, kproto_writer_t *out, uint64_t *matched) {
+    int err;
+    char *data;
+    size_t i, len;
+    kdb_morsels_t scan;
+    const size_t n_scanners = kdb_team_size(ctx->team);
+    const uint64_t blocks = (table->n_rows + 63) / 64;
+
+    scan.table = table;
+    scan.plan = plan;
+    scan.n_morsels = (blocks + KDB_MORSEL - 1) / KDB_MORSEL;
+    scan.first = 0;
+    scan.stop = scan.n_morsels;
+    scan.prefix = 0;
+    scan.found = 0;
+    scan.status = KDB_OK;
+    scan.scanners = calloc(n_scanners, sizeof(kdb_scanner_t));
+    scan.morsels = calloc(scan.n_morsels, sizeof(kdb_morsel_t));
+    if (scan.scanners == NULL || scan.morsels == NULL) {
+        free(scan.scanners);
+        free(scan.morsels);
+        return KDB_ERR_MEMORY;
+    }
+    pthread_mutex_init(&scan.lock, NULL);
+    for (i = 0; i < n_scanners; i++) {
+        kproto_writer(&scan.scanners[i].out);
+        scan.scanners[i].get = *get;
+        scan.scanners[i].get.out = &scan.scanners[i].out;
+    }
+
+    // a limit is often met by the first morsel, the team only gets the
+    // rest when it isnt
+    if (plan->limit != UINT64_MAX) {
+        kdb_morsel_get(&scan, 0, 0);
+        scan.first = 1;
+    }
+    if (scan.first < scan.stop)
+        kdb_team_range(ctx->team, kdb_morsel_get, &scan, scan.n_morsels - scan.first);
+
+    // morsels go out in order, the one the limit falls in only up to it
+    err = scan.status;
+    for (i = 0; i < n_scanners && err == KDB_OK; i++)
+        if (scan.scanners[i].out.failed)
+            err = KDB_ERR_MEMORY;
+    for (*matched = 0, i = 0; i < scan.stop && *matched < plan->limit && err == KDB_OK; i++) {
+        const kdb_morsel_t *morsel = &scan.morsels[i];
+        const char *rows = scan.scanners[morsel->worker].out.data + morsel->start;
+        len = morsel->end - morsel->start;
+        if (morsel->matched > plan->limit - *matched) {
+            len = kdb_rows_len(table, get, rows, len, plan->limit - *matched);
+            *matched = plan->limit;
+        } else {
+            *matched += morsel->matched;
+        }
+        if (len && (data = kproto_put(out, len)) != NULL)
+            memcpy(data, rows, len);
+    }
+    for (i = 0; i < n_scanners; i++) {
+        kdb_view_free(&scan.scanners[i].view);
+        kproto_writer_free(&scan.scanners[i].out);
+    }
+    pthread_mutex_destroy(&scan.lock);
+    free(scan.scanners);
+    free(scan.morsels);
+    return err;
+}
+
+// a shard a GET fans out to, what it found is put together once every
+// shard is done
+typedef struct {
+    kdb_ctx_t *ctx;          // of the shard
+    kdb_t *table;            // the sharded table
+    kdb_t *shard;
+    const kdb_plan_t *plan;  // over the table
+    size_t reader;
+    kdb_get_t get;
+    kproto_writer_t out;
+    kdb_rows_t starts;       // where each row starts in out
+    kdb_rows_t keys;         // and its key when the plan walks a range
+    int range;               // column the range is on, -1 for table order
+    int status;
+    uint64_t matched;
+} kdb_part_t;
+
+static int kdb_part_row(kdb_t *table, const uint64_t row, void *arg) {
+    int err;
+    kproto_value_t key;
+    kdb_part_t *part = (kdb_part_t*)arg;
+    const size_t start = part->out.len;
+
+    // the key is read ahead of the check for writers, so the check covers it
+    if (part->range >= 0)
+        kdb_table_get(table, &table->cols[part->range], row, &key);
+    if ((err = kdb_get_row(table, row, &part->get)))
+        return err;
+    if (kdb_rows_push(&part->starts, start) || (part->range >= 0 && kdb_rows_push(&part->keys, kdb_tree_key(&key))))
+        return KDB_ERR_MEMORY;
+    return KDB_OK;
+}
+
+static int kdb_shard_enter(kdb_ctx_t *ctx, const kdb_plan_t *plan, const kdb_t *table, kdb_t *shard, const size_t reader, kdb_plan_t *moved) {
+    const int reads = plan->epoch != KDB_EPOCH_LATEST;
+
+    // a reader enters the shard at its own snapshot there, the writer
+    // already holds the lock of the shard
+    if (reads)
+        pthread_rwlock_rdlock(&ctx->layout);
+    kdb_plan_move(moved, plan, table, shard);
+    if (reads)
+        moved->epoch = kdb_epochs_enter(&ctx->epochs, reader, &ctx->epoch);
+    return reads;
+}
+
+static void kdb_shard_leave(kdb_ctx_t *ctx, const int reads, const size_t reader) {
+    if (reads) {
+        kdb_epochs_leave(&ctx->epochs, reader);
+        pthread_rwlock_unlock(&ctx->layout);
+    }
+}
+
+static void kdb_part_get(void *arg) {
+    kdb_plan_t plan;
+    kdb_part_t *part = (kdb_part_t*)arg;
+    const int reads = kdb_shard_enter(part->ctx, part->plan, part->table, part->shard, part->reader, &plan);
+
+    part->range = plan.range != NULL ? (int)(plan.range - part->shard->cols) : -1;
+    part->get.out = &part->out;
+    part->get.epoch = plan.epoch;
+    part->status = kdb_scan(part->shard, &plan, kdb_part_row, part, &part->matched);
+    kdb_shard_leave(part->ctx, reads, part->reader);
+}
+
+static void kdb_part_copy(const kdb_part_t *part, const size_t row, kproto_writer_t *out) {
+    char *data;
+    const size_t start = part->starts.data[row];
+    const size_t end = row + 1 < part->starts.len ? part->starts.data[row + 1] : part->out.len;
+    if ((data = kproto_put(out, end - start)) != NULL)
+        memcpy(data, part->out.data + start, end - start);
+}
+
+static void kdb_parts_merge(const kdb_part_t *parts, const size_t n, const uint64_t limit, kproto_writer_t *out, uint64_t *matched) {
+    size_t i, best, at[KDB_MAX_SHARDS] = { 0 };
+
+    // shards answer one after the other in table order, a range goes back
+    // into column order taking the lowest key any shard has left
+    for (*matched = 0; *matched < limit; (*matched)++) {
+        for (best = n, i = 0; i < n; i++) {
+            if (at[i] == parts[i].starts.len)
+                continue;
+            if (best == n || (parts[i].range >= 0 && parts[i].keys.data[at[i]] < parts[best].keys.data[at[best]]))
+                best = i;
+            if (parts[i].range < 0)
+                break;
+        }
+        if (best == n)
+            break;
+        kdb_part_copy(&parts[best], at[best]++, out);
+    }
+}
+
+static int kdb_shard_get(kdb_ctx_t *ctx, kdb_t *table, kdb_get_t *get, const kdb_plan_t *plan, const size_t reader, kdb_locks_t *locks, kproto_writer_t *out) {
+    int err = KDB_OK;
+    size_t i, n = 0, count_at;
+    uint64_t matched, shards = kdb_plan_shards(table, plan);
+    kdb_part_t parts[KDB_MAX_SHARDS];
+
+    // only the writer locks the shards, readers go in at their snapshots.
+    // shards are searched on the team when there is one
+    if (plan->epoch == KDB_EPOCH_LATEST)
+        kdb_shards_lock(ctx, shards, locks);
+    for (; shards; shards &= shards - 1, n++) {
+        kdb_part_t *part = &parts[n];
+        part->ctx = kdb_ctx_shard(ctx, __builtin_ctzll(shards));
+        part->table = table;
+        part->shard = kdb_table_shard(table, __builtin_ctzll(shards));
+        part->plan = plan;
+        part->reader = reader;
+        part->get = *get;
+        kproto_writer(&part->out);
+        part->starts = (kdb_rows_t){ NULL, 0, 0 };
+        part->keys = (kdb_rows_t){ NULL, 0, 0 };
+        part->matched = 0;
+    }
+    kdb_team_run(ctx->team, kdb_part_get, parts, sizeof(kdb_part_t), n);
+
+    count_at = kdb_get_head(table, get, out);
+    for (i = 0; i < n && err == KDB_OK; i++)
+        if ((err = parts[i].status) == KDB_OK && parts[i].out.failed)
+            err = KDB_ERR_MEMORY;
+    if (err == KDB_OK) {
+        kdb_parts_merge(parts, n, plan->limit, out, &matched);
+        err = kdb_get_count(out, count_at, matched);
+    }
+    for (i = 0; i < n; i++) {
+        kproto_writer_free(&parts[i].out);
+        free(parts[i].starts.data);
+        free(parts[i].keys.data);
+    }
+    return err;
+}
+
+static int kdb_run_get(kdb_ctx_t *ctx, kdb_t *table, kdb_get_t *get, const kdb_plan_t *plan, const size_t reader, kdb_locks_t *locks, kproto_writer_t *out) {
+    int err;
+    size_t count_at;
+    uint64_t matched;
+    if (table->n_shards)
+        return kdb_shard_get(ctx, table, get, plan, reader, locks, out);
+
+    get->epoch = plan->epoch;
+    count_at = kdb_get_head(table, get, out);
+    if (kdb_plan_shared(ctx, table, plan))
+        err = kdb_morsels_get(ctx, table, get, plan, out, &matched);
+    else
+        err = kdb_scan(table, plan, kdb_get_row, get, &matched);
+    if (err)
+        return err;
+    return kdb_get_count(out, count_at, matched);
+}
+
+static int kdb_query_get(kdb_ctx_t *ctx, const kproto_cmd_t *cmd, kproto_writer_t *out, const uint64_t epoch, const size_t reader, kdb_locks_t *locks) {
+    int err;
+    uint8_t i;
+    kdb_get_t get;
+    kdb_plan_t plan;
+    kproto_ref_t ref;
+    kdb_column_t *col;
+    kproto_reader_t cols = cmd->cols;
+    kdb_t *table = kdb_ctx_table(ctx, &cmd->table);
+    if (table == NULL)
+        return KDB_ERR_TABLE;
+
+    // resolve the projection, no columns means every column
+    get.out = out;
+    get.n_cols = cmd->n_cols ? cmd->n_cols : table->n_cols;
+    for (i = 0; i < get.n_cols; i++) {
+        if (cmd->n_cols == 0) {
+            get.cols[i] = i;
+            continue;
+        }
+        kproto_ref(&cols, &ref, 0);
+        if ((col = kdb_ctx_column(ctx, table, &ref)) == NULL)
+            return KDB_ERR_COLUMN;
+        get.cols[i] = (uint8_t)(col - table->cols);
+    }
+    if ((err = kdb_plan(ctx, table, cmd, &plan)))
+        return err;
+    plan.epoch = epoch;
+    return kdb_run_get(ctx, table, &get, &plan, reader, locks, out);
+}
+
+// the aggregates of an AGG, each reads the accumulator of its column so a
+// column aggregated more than once is folded once
+typedef struct {
+    uint8_t n_aggs;
+    uint8_t n_accs;
+    int group;                      // column grouped by, -1 for none
+    uint8_t ops[KDB_MAX_LIST];
+    uint8_t cols[KDB_MAX_LIST];     // column of each aggregate
+    uint8_t accs[KDB_MAX_LIST];     // accumulator of each aggregate
+    uint8_t acc_cols[KDB_MAX_LIST]; // column of each accumulator
+} kdb_aggs_t;
+
+// what a thread folded rows into, the totals without GROUP and a set of
+// accumulators for each group with it
+typedef struct {
+    const kdb_aggs_t *aggs;
+    uint64_t epoch;
+    kdb_acc_t *totals;
+    kdb_acc_t *batch; // a batch of blocks on its way into the totals
+    kdb_groups_t groups;
+    kdb_view_t view;
+} kdb_tally_t;
+
+static int kdb_tally_init(kdb_tally_t *tally, const kdb_aggs_t *aggs, const kdb_t *table, const uint64_t epoch) {
+    uint8_t k;
+    tally->aggs = aggs;
+    tally->epoch = epoch;
+    tally->batch = NULL;
+    tally->view.cols = NULL;
+    tally->view.filters = NULL;
+    tally->view.data = NULL;
+    memset(&tally->groups, 0, sizeof(kdb_groups_t));
+    if ((tally->totals = malloc(aggs->n_accs * sizeof(kdb_acc_t))) == NULL ||
+        (tally->batch = malloc(aggs->n_accs * sizeof(kdb_acc_t))) == NULL)
+        return KDB_ERR_MEMORY;
+    for (k = 0; k < aggs->n_accs; k++)
+        kdb_acc_init(&tally->totals[k], &table->cols[aggs->acc_cols[k]]);
+    if (aggs->group >= 0 && kdb_groups_init(&tally->groups, tally->totals, aggs->n_accs))
+        return KDB_ERR_MEMORY;
+    return KDB_OK;
+}
+
+static void kdb_tally_free(kdb_tally_t *tally) {
+    kdb_view_free(&tally->view);
+    kdb_groups_free(&tally->groups);
+    free(tally->totals);
+    free(tally->batch);
+}
+
+static int kdb_tally_merge(kdb_tally_t *tally, const kdb_tally_t *from) {
+    uint8_t k;
+    for (k = 0; k < tally->aggs->n_accs; k++)
+        kdb_acc_merge(&tally->totals[k], &from->totals[k]);
+    if (tally->aggs->group >= 0 && kdb_groups_merge(&tally->groups, &from->groups))
+        return KDB_ERR_MEMORY;
+    return KDB_OK;
+}
+
+static int kdb_tally_row(kdb_t *table, const uint64_t row, void *arg) {
+    uint8_t k;
+    kdb_acc_t *accs;
+    kproto_value_t key, values[KDB_MAX_LIST];
+    kdb_tally_t *tally = (kdb_tally_t*)arg;
+    const kdb_aggs_t *aggs = tally->aggs;
+
+    // the row is read out first, it only counts if no writer got to it
+    // meanwhile. views are never stamped
+    if (aggs->group >= 0)
+        kdb_table_get(table, &table->cols[aggs->group], row, &key);
+    for (k = 0; k < aggs->n_accs; k++)
+        kdb_table_get(table, &table->cols[aggs->acc_cols[k]], row, &values[k]);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (kdb_version_stamp(table, row / KDB_BLOCK) > tally->epoch)
+        return KDB_RETRY;
+    if ((accs = aggs->group >= 0 ? kdb_groups_find(&tally->groups, &key) : tally->totals) == NULL)
+        return KDB_ERR_MEMORY;
+    for (k = 0; k < aggs->n_accs; k++)
+        kdb_acc_add(&accs[k], &values[k]);
+    return KDB_OK;
+}
+
+static uint64_t kdb_tally_stale(const kdb_t *table, const kdb_plan_t *plan, const uint64_t block, const size_t n, const uint64_t *stamps, uint64_t stale) {
+    size_t i;
+
+    // blocks a writer changed since the epoch, or since they were stamped
+    if (plan->epoch == KDB_EPOCH_LATEST)
+        return stale;
+    for (i = 0; i < n; i++)
+        if (stamps[i] > plan->epoch || kdb_version_stamp(table, block + i) != stamps[i])
+            stale |= 1ULL << i;
+    return stale;
+}
+
+static int kdb_tally_blocks(kdb_t *table, const kdb_plan_t *plan, kdb_tally_t *tally, const uint64_t first, const uint64_t last) {
+    size_t i, n;
+    uint8_t k;
+    kdb_t *from;
+    uint64_t block, seen, stale, rows[KDB_BATCH], bits[KDB_BATCH], stamps[KDB_BATCH];
+    const kdb_aggs_t *aggs = tally->aggs;
+
+    // filter and fold a batch of blocks at a time straight off the columns.
+    // a fold only counts once no block in it changed while it was read,
+    // ones that did are left out and folded from a view as the epoch saw it
+    for (block = first; block < last; block += n) {
+        n = last - block < KDB_BATCH ? last - block : KDB_BATCH;
+        for (i = 0; i < n; i++)
+            stamps[i] = kdb_version_stamp(table, block + i);
+        memcpy(rows, table->live + block, n * sizeof(uint64_t));
+        kdb_filter_batch(table, plan->filters, plan->n_filters, block, n, rows);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        stale = kdb_tally_stale(table, plan, block, n, stamps, 0);
+        do {
+            seen = stale;
+            for (i = 0; i < n; i++)
+                bits[i] = (stale >> i) & 1 ? 0 : rows[i];
+            for (k = 0; k < aggs->n_accs; k++) {
+                kdb_acc_init(&tally->batch[k], &table->cols[aggs->acc_cols[k]]);
+                kdb_agg_batch(&table->cols[aggs->acc_cols[k]], block, n, bits, &tally->batch[k]);
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            stale = kdb_tally_stale(table, plan, block, n, stamps, stale);
+        } while (stale != seen);
+        for (k = 0; k < aggs->n_accs; k++)
+            kdb_acc_merge(&tally->totals[k], &tally->batch[k]);
+        for (; stale; stale &= stale - 1) {
+            bits[0] = UINT64_MAX;
+            if ((from = kdb_block_view(table, plan, &tally->view, block + __builtin_ctzll(stale), &bits[0])) == NULL)
+                return KDB_ERR_MEMORY;
+            for (k = 0; k < aggs->n_accs; k++)
+                kdb_agg_batch(&from->cols[aggs->acc_cols[k]], 0, 1, &bits[0], &tally->totals[k]);
+        }
+    }
+    return KDB_OK;
+}
+
+static int kdb_tally_range(kdb_t *table, const kdb_plan_t *plan, kdb_tally_t *tally, const uint64_t first, const uint64_t last) {
+    uint64_t matched;
+
+    // totals fold whole blocks at once, groups take a row at a time
+    if (tally->aggs->group < 0)
+        return kdb_tally_blocks(table, plan, tally, first, last);
+    return kdb_scan_blocks(table, plan, &tally->view, first, last, kdb_tally_row, tally, &matched);
+}
+
+// a full scan folded over the team, each thread into a tally of its own
+typedef struct {
+    kdb_t *table;
+    const kdb_plan_t *plan;
+    kdb_tally_t *tallies;
+    int status;
+} kdb_tallies_t;
+
+static void kdb_morsel_tally(void *arg, const size_t worker, const size_t i) {
+    int err;
+    kdb_tallies_t *scan = (kdb_tallies_t*)arg;
+    const uint64_t blocks = (scan->table->n_rows + 63) / 64;
+    const uint64_t first = (uint64_t)i * KDB_MORSEL;
+    const uint64_t last = blocks - first < KDB_MORSEL ? blocks : first + KDB_MORSEL;
+
+    // morsels after one failed are left alone
+    if (__atomic_load_n(&scan->status, __ATOMIC_RELAXED) != KDB_OK)
+        return;
+    if ((err = kdb_tally_range(scan->table, scan->plan, &scan->tallies[worker], first, last)))
+        __atomic_store_n(&scan->status, err, __ATOMIC_RELAXED);
+}
+
+static int kdb_morsels_tally(kdb_ctx_t *ctx, kdb_t *table, const kdb_plan_t *plan, kdb_tally_t *tally) {
+    size_t i;
+    kdb_tallies_t scan;
+    const size_t n_tallies = kdb_team_size(ctx->team);
+    const uint64_t blocks = (table->n_rows + 63) / 64;
+
+    scan.table = table;
+    scan.plan = plan;
+    scan.status = KDB_OK;
+    if ((scan.tallies = calloc(n_tallies, sizeof(kdb_tally_t))) == NULL)
+        return KDB_ERR_MEMORY;
+    for (i = 0; i < n_tallies && scan.status == KDB_OK; i++)
+        scan.status = kdb_tally_init(&scan.tallies[i], tally->aggs, table, plan->epoch);
+    if (scan.status == KDB_OK)
+        kdb_team_range(ctx->team, kdb_morsel_tally, &scan, (blocks + KDB_MORSEL - 1) / KDB_MORSEL);
+
+    // what each thread folded goes into the tally of the command
+    for (i = 0; i < n_tallies; i++) {
+        if (scan.status == KDB_OK)
+            scan.status = kdb_tally_merge(tally, &scan.tallies[i]);
+        kdb_tally_free(&scan.tallies[i]);
+    }
+    free(scan.tallies);
+    return scan.status;
+}
+
+static int kdb_tally_scan(kdb_ctx_t *ctx, kdb_t *table, const kdb_plan_t *plan, kdb_tally_t *tally) {
+    uint64_t matched;
+    if (plan->index != NULL || plan->range != NULL)
+        return kdb_scan(table, plan, kdb_tally_row, tally, &matched);
+    if (kdb_plan_shared(ctx, table, plan))
+        return kdb_morsels_tally(ctx, table, plan, tally);
+    return kdb_tally_range(table, plan, tally, 0, (table->n_rows + 63) / 64);
+}
+
+// a shard an AGG fans out to, folded on its own and merged once every
+// shard is done
+typedef struct {
+    kdb_ctx_t *ctx;         // of the shard
+    kdb_t *table;           // the sharded table
+    kdb_t *shard;
+    const kdb_plan_t *plan; // over the table
+    size_t reader;
+    kdb_tally_t tally;
+    int status;
+} kdb_agg_part_t;
+
+static void kdb_agg_part(void *arg) {
+    kdb_plan_t plan;
+    kdb_agg_part_t *part = (kdb_agg_part_t*)arg;
+    const int reads = kdb_shard_enter(part->ctx, part->plan, part->table, part->shard, part->reader, &plan);
+
+    part->tally.epoch = plan.epoch;
+    part->status = kdb_tally_scan(part->ctx, part->shard, &plan, &part->tally);
+    kdb_shard_leave(part->ctx, reads, part->reader);
+}
+
+static int kdb_shard_tally(kdb_ctx_t *ctx, kdb_t *table, const kdb_plan_t *plan, const size_t reader, kdb_locks_t *locks, kdb_tally_t *tally) {
+    int err = KDB_OK;
+    size_t i, n = 0;
+    uint64_t shards = kdb_plan_shards(table, plan);
+    kdb_agg_part_t parts[KDB_MAX_SHARDS];
+
+    // shards go as they do for a GET
+    if (plan->epoch == KDB_EPOCH_LATEST)
+        kdb_shards_lock(ctx, shards, locks);
+    for (; shards; shards &= shards - 1, n++) {
+        kdb_agg_part_t *part = &parts[n];
+        part->ctx = kdb_ctx_shard(ctx, __builtin_ctzll(shards));
+        part->table = table;
+        part->shard = kdb_table_shard(table, __builtin_ctzll(shards));
+        part->plan = plan;
+        part->reader = reader;
+        if ((part->status = kdb_tally_init(&part->tally, tally->aggs, table, plan->epoch)))
+            err = part->status;
+    }
+    if (err == KDB_OK)
+        kdb_team_run(ctx->team, kdb_agg_part, parts, sizeof(kdb_agg_part_t), n);
+    for (i = 0; i < n; i++) {
+        if (err == KDB_OK && (err = parts[i].status) == KDB_OK)
+            err = kdb_tally_merge(tally, &parts[i].tally);
+        kdb_tally_free(&parts[i].tally);
+    }
+    return err;
+}
+
+static int kdb_tally_put(const kdb_t *table, const kdb_aggs_t *aggs, const kdb_tally_t *tally, const uint64_t limit, kproto_writer_t *out) {
+    uint8_t i;
+    uint32_t *order;
+    uint64_t g, n;
+    size_t count_at;
+    kproto_value_t value;
+    const kdb_acc_t *accs;
+    const kdb_column_t *col;
+
+    // described as a GET would be, the GROUP column first
+    kproto_put_u8(out, (uint8_t)(aggs->n_aggs + (aggs->group >= 0)));
+    if (aggs->group >= 0) {
+        col = &table->cols[aggs->group];
+        kproto_put_u8(out, col->type | (col->flags << 3));
+        kproto_put_name(out, col->name, col->name_len);
+    }
+    for (i = 0; i < aggs->n_aggs; i++) {
+        col = &table->cols[aggs->cols[i]];
+        kproto_put_u8(out, kdb_agg_type(col, aggs->ops[i]));
+        kproto_put_name(out, col->name, col->name_len);
+    }
+    count_at = out->len;
+    kproto_put_u32(out, 0);
+
+    // without GROUP the totals are the one row, with it groups go in
+    // order of their keys
+    if (aggs->group < 0) {
+        for (i = 0; i < aggs->n_aggs && limit; i++) {
+            kdb_acc_value(&tally->totals[aggs->accs[i]], aggs->ops[i], &value);
+            kproto_put_value(out, &value);
+        }
+        return kdb_get_count(out, count_at, limit ? 1 : 0);
+    }
+    if ((order = kdb_groups_sort(&tally->groups)) == NULL)
+        return KDB_ERR_MEMORY;
+    n = tally->groups.len < limit ? tally->groups.len : limit;
+    for (g = 0; g < n; g++) {
+        accs = tally->groups.accs + (size_t)order[g] * aggs->n_accs;
+        kproto_put_value(out, &tally->groups.keys[order[g]]);
+        for (i = 0; i < aggs->n_aggs; i++) {
+            kdb_acc_value(&accs[aggs->accs[i]], aggs->ops[i], &value);
+            kproto_put_value(out, &value);
+        }
+    }
+    free(order);
+    return kdb_get_count(out, count_at, n);
+}
+
+static int kdb_query_agg(kdb_ctx_t *ctx, const kproto_cmd_t *cmd, kproto_writer_t *out, const uint64_t epoch, const size_t reader, kdb_locks_t *locks) {
+    int err;
+    uint8_t i, k, op;
+    uint64_t limit;
+    kdb_aggs_t aggs;
+    kdb_plan_t plan;
+    kdb_tally_t tally;
+    kproto_ref_t ref;
+    kdb_column_t *col;
+    kproto_clause_t clause;
+    kproto_reader_t cols = cmd->cols;
+    kproto_reader_t clauses = cmd->clauses;
+    kdb_t *table = kdb_ctx_table(ctx, &cmd->table);
+    if (table == NULL)
+        return KDB_ERR_TABLE;
+
+    // the first aggregate of a column gives it an accumulator, the rest
+    // of them share it
+    aggs.n_aggs = cmd->n_cols;
+    aggs.n_accs = 0;
+    aggs.group = -1;
+    for (i = 0; i < aggs.n_aggs; i++) {
+        kproto_agg(&cols, &op, &ref);
+        if ((col = kdb_ctx_column(ctx, table, &ref)) == NULL)
+            return KDB_ERR_COLUMN;
+        if ((err = kdb_agg_check(col, op)))
+            return err;
+        aggs.ops[i] = op;
+        aggs.cols[i] = (uint8_t)(col - table->cols);
+        for (k = 0; k < aggs.n_accs && aggs.acc_cols[k] != aggs.cols[i]; k++);
+        if (k == aggs.n_accs)
+            aggs.acc_cols[aggs.n_accs++] = aggs.cols[i];
+        aggs.accs[i] = k;
+    }
+    for (i = 0; i < cmd->n_clauses; i++) {
+        kproto_clause(&clauses, &clause);
+        if (clause.type != K_Q_GROUP)
+            continue;
+        if ((col = kdb_ctx_column(ctx, table, &clause.column)) == NULL)
+            return KDB_ERR_COLUMN;
+        aggs.group = (int)(col - table->cols);
+    }
+    if (aggs.group >= 0 && aggs.n_aggs == UINT8_MAX)
+        return KDB_ERR_VALUE;
+
+    // LIMIT caps the rows of the answer, every matching row is folded
+    if ((err = kdb_plan(ctx, table, cmd, &plan)))
+        return err;
+    limit = plan.limit;
+    plan.limit = UINT64_MAX;
+    plan.epoch = epoch;
+    kdb_plan_scan(&plan);
+    if ((err = kdb_tally_init(&tally, &aggs, table, epoch)) == KDB_OK) {
+        if (table->n_shards)
+            err = kdb_shard_tally(ctx, table, &plan, reader, locks, &tally);
+        else
+            err = kdb_tally_scan(ctx, table, &plan, &tally);
+    }
+    if (err == KDB_OK)
+        err = kdb_tally_put(table, &aggs, &tally, limit, out);
+    kdb_tally_free(&tally);
+    return err;
+}
+
+typedef struct {
+    uint8_t n_cols;
+    kdb_ctx_t *ctx;
+    kdb_column_t *cols[KDB_MAX_LIST];
+    kproto_value_t values[KDB_MAX_LIST];
+} kdb_set_t;
+
+static int kdb_set_row(kdb_t *table, const uint64_t row, void *arg) {
+    int err;
+    uint8_t i;
+    kdb_set_t *set = (kdb_set_t*)arg;
+
+    // a string that moves its arena pulls it out from under readers
+    for (i = 0; i < set->n_cols; i++)
+        if (kdb_table_grows(set->cols[i], &set->values[i]))
+            kdb_ctx_exclusive(set->ctx);
+    if ((err = kdb_version_keep(&set->ctx->epochs, table, row, kdb_ctx_keep(set->ctx))))
+        return err;
+    for (i = 0; i < set->n_cols; i++)
+        if ((err = kdb_table_set(table, set->cols[i], row, &set->values[i])))
+            return err;
+    return KDB_OK;
+}
+
+static int kdb_del_row(kdb_t *table, const uint64_t row, void *arg) {
+    int err;
+    kdb_ctx_t *ctx = (kdb_ctx_t*)arg;
+    if ((err = kdb_version_keep(&ctx->epochs, table, row, kdb_ctx_keep(ctx))))
+        return err;
+    return kdb_table_del(table, row);
+}
+
+static int kdb_run_set(kdb_t *table, const kdb_plan_t *plan, kdb_set_t *set, uint64_t *matched) {
+    uint8_t i;
+
+    // moving a row to another key reshapes the indexes readers walk
+    for (i = 0; i < set->n_cols; i++)
+        if (set->cols[i]->index.slots || set->cols[i]->tree.root)
+            kdb_ctx_exclusive(set->ctx);
+    return kdb_scan(table, plan, kdb_set_row, set, matched);
+}
+
+static int kdb_shard_change(kdb_ctx_t *ctx, kdb_t *table, const kdb_plan_t *plan, const kdb_set_t *set, kdb_locks_t *locks, uint64_t *matched) {
+    int err = KDB_OK;
+    uint8_t i;
+    size_t at;
+    uint64_t found, shards = kdb_plan_shards(table, plan);
+    kdb_t *shard;
+    kdb_set_t moved;
+    kdb_plan_t part;
+
+    // a row stays in the shard its key put it in
+    if (set != NULL)
+        for (i = 0; i < set->n_cols; i++)
+            if (set->cols[i] == &table->cols[table->shard_key])
+                return KDB_ERR_SHARD;
+
+    // shards go in turn with what the limit left them, so replaying the
+    // log changes the same rows
+    kdb_shards_lock(ctx, shards, locks);
+    for (*matched = 0; shards && *matched < plan->limit && err == KDB_OK; shards &= shards - 1) {
+        at = __builtin_ctzll(shards);
+        shard = kdb_table_shard(table, at);
+        moved.ctx = kdb_ctx_shard(ctx, at);
+        kdb_ctx_begin(moved.ctx);
+        kdb_plan_move(&part, plan, table, shard);
+        part.limit = plan->limit - *matched;
+        found = 0;
+        if (set != NULL) {
+            moved.n_cols = set->n_cols;
+            for (i = 0; i < set->n_cols; i++) {
+                moved.cols[i] = shard->cols + (set->cols[i] - table->cols);
+                moved.values[i] = set->values[i];
+            }
+            err = kdb_run_set(shard, &part, &moved, &found);
+        } else {
+            err = kdb_scan(shard, &part, kdb_del_row, moved.ctx, &found);
+        }
+        kdb_ctx_publish(moved.ctx);
+        *matched += found;
+    }
+    return err;
+}
+
+static int kdb_run_change(kdb_ctx_t *ctx, kdb_t *table, const kdb_plan_t *plan, kdb_set_t *set, kdb_locks_t *locks, kproto_writer_t *out) {
+    int err;
+    uint64_t matched;
+
+    // a SET without a set is a DEL
+    if (table->n_shards)
+        err = kdb_shard_change(ctx, table, plan, set, locks, &matched);
+    else if (set != NULL)
+        err = kdb_run_set(table, plan, set, &matched);
+    else
+        err = kdb_scan(table, plan, kdb_del_row, ctx, &matched);
+    if (err)
+        return err;
+    kproto_put_u64(out, matched);
+    return KDB_OK;
+}
+
+static int kdb_query_set(kdb_ctx_t *ctx, const kproto_cmd_t *cmd, kproto_writer_t *out, kdb_locks_t *locks) {
+    int err;
+    uint8_t i;
+    kdb_set_t set;
+    kdb_plan_t plan;
+    kproto_ref_t ref;
+    kproto_value_t value;
+    kproto_reader_t cols = cmd->cols;
+    kdb_t *table = kdb_ctx_table(ctx, &cmd->table);
+    if (table == NULL)
+        return KDB_ERR_TABLE;
+
+    // cast every assignment once up front
+    set.ctx = ctx;
+    set.n_cols = cmd->n_cols;
+    for (i = 0; i < set.n_cols; i++) {
+        kproto_assign(&cols, &ref, &value);
+        if ((set.cols[i] = kdb_ctx_column(ctx, table, &ref)) == NULL)
+            return KDB_ERR_COLUMN;
+        if ((err = kdb_value_cast(set.cols[i], &value, &set.values[i])))
+            return err;
+    }
+    if ((err = kdb_plan(ctx, table, cmd, &plan)))
+        return err;
+    return kdb_run_change(ctx, table, &plan, &set, locks, out);
+}
+
+static int kdb_query_del(kdb_ctx_t *ctx, const kproto_cmd_t *cmd, kproto_writer_t *out, kdb_locks_t *locks) {
+    int err;
+    kdb_plan_t plan;
+    kdb_t *table = kdb_ctx_table(ctx, &cmd->table);
+    if (table == NULL)
+        return KDB_ERR_TABLE;
+    if ((err = kdb_plan(ctx, table, cmd, &plan)))
+        return err;
+    return kdb_run_change(ctx, table, &plan, NULL, locks, out);
+}
+
+static void kdb_stmt_reader(const kdb_stmt_t *stmt, const kproto_cmd_t *cmd, const kproto_reader_t *from, kproto_reader_t *to) {
+    // the same list, read out of the copy kept with the statement
+    const size_t at = from->len ? (const char*)from->data - cmd->body.data : 0;
+    kproto_reader(to, stmt->body + at, from->len);
+}
+
+static void kdb_stmt_param(kdb_stmt_t *stmt, const kproto_value_t *value, const uint8_t at, const uint8_t filter) {
+    kdb_param_t *param = &stmt->params[stmt->n_params++];
+    param->type = value->type | ((value->flags & ~K_TYPE_PARAM) << 3);
+    param->at = at;
+    param->filter = filter;
+}
+
+static int kdb_stmt_compile(kdb_ctx_t *ctx, kdb_t *table, kdb_stmt_t *stmt, const kproto_cmd_t *cmd) {
+    int err;
+    uint8_t i;
+    kdb_plan_t plan;
+    kproto_ref_t ref;
+    kproto_value_t value;
+    kproto_clause_t clause;
+    kdb_column_t *col = NULL;
+    kproto_reader_t cols, clauses;
+
+    // literal strings have to outlive the frame, so the statement reads
+    // them out of its own copy of the command
+    if ((stmt->body = malloc(cmd->body.len)) == NULL)
+        return KDB_ERR_MEMORY;
+    memcpy(stmt->body, cmd->body.data, cmd->body.len);
+    stmt->body_len = cmd->body.len;
+    stmt->hash = kdb_stmt_hash(cmd->stmt_op, &cmd->body);
+    stmt->table = table->handle;
+    stmt->op = cmd->stmt_op;
+    stmt->n_cols = cmd->n_cols;
+    kdb_stmt_reader(stmt, cmd, &cmd->cols, &cols);
+    kdb_stmt_reader(stmt, cmd, &cmd->clauses, &clauses);
+    if ((cmd->n_cols && (stmt->cols = malloc(cmd->n_cols)) == NULL) ||
+        (cmd->stmt_op == K_CMD_SET && cmd->n_cols && (stmt->values = calloc(cmd->n_cols, sizeof(kproto_value_t))) == NULL) ||
+        (cmd->n_params && (stmt->params = calloc(cmd->n_params, sizeof(kdb_param_t))) == NULL))
+        return KDB_ERR_MEMORY;
+
+    // columns go by their place, literal values are cast once here
+    for (i = 0; i < cmd->n_cols; i++) {
+        if (cmd->stmt_op == K_CMD_GET)
+            kproto_ref(&cols, &ref, 0);
+        else
+            kproto_assign(&cols, &ref, &value);
+        if ((col = kdb_ctx_column(ctx, table, &ref)) == NULL)
+            return KDB_ERR_COLUMN;
+        stmt->cols[i] = (uint8_t)(col - table->cols);
+        if (cmd->stmt_op != K_CMD_SET)
+            continue;
+        if (value.flags & K_TYPE_PARAM)
+            kdb_stmt_param(stmt, &value, i, 0);
+        else if ((err = kdb_value_cast(col, &value, &stmt->values[i])))
+            return err;
+    }
+
+    // clauses compile the way they would to run, a placeholder only
+    // gets its column until EXEC binds it
+    plan.n_filters = 0;
+    plan.limit = UINT64_MAX;
+    for (i = 0; i < cmd->n_clauses; i++) {
+        kproto_clause(&clauses, &clause);
+        if (clause.type != K_Q_LIMIT && (col = kdb_ctx_column(ctx, table, &clause.column)) == NULL)
+            return KDB_ERR_COLUMN;
+        if (clause.type != K_Q_LIMIT && (clause.value.flags & K_TYPE_PARAM)) {
+            kdb_filter_t *filter = &plan.filters[plan.n_filters];
+            filter->col = col;
+            filter->join = clause.type;
+            filter->cmp = clause.cmp;
+            kdb_stmt_param(stmt, &clause.value, (uint8_t)plan.n_filters++, 1);
+        } else if ((err = kdb_plan_clause(&plan, col, &clause))) {
+            return err;
+        }
+    }
+    if (plan.n_filters) {
+        if ((stmt->filters = malloc(plan.n_filters * sizeof(kdb_filter_t))) == NULL)
+            return KDB_ERR_MEMORY;
+        memcpy(stmt->filters, plan.filters, plan.n_filters * sizeof(kdb_filter_t));
+    }
+    stmt->n_filters = plan.n_filters;
+    stmt->limit = plan.limit;
+    return KDB_OK;
+}
+
+static int kdb_query_stmt(kdb_ctx_t *ctx, kdb_stmts_t *stmts, const kproto_cmd_t *cmd, kproto_writer_t *out) {
+    int err;
+    uint16_t i;
+    kdb_stmt_t *stmt;
+    kdb_t *table = kdb_ctx_table(ctx, &cmd->table);
+    if (table == NULL)
+        return KDB_ERR_TABLE;
+    if (stmts == NULL)
+        return KDB_ERR_MEMORY;
+
+    // a command prepared before on the same table is already compiled
+    stmt = kdb_stmts_match(stmts, table->handle, cmd->stmt_op, &cmd->body, kdb_stmt_hash(cmd->stmt_op, &cmd->body));
+    if (stmt == NULL && (err = kdb_stmt_compile(ctx, table, stmt = kdb_stmts_take(stmts), cmd))) {
+        kdb_stmt_free(stmt);
+        return err;
+    }
+    kproto_put_u32(out, stmt->id);
+    kproto_put_u8(out, stmt->n_params & 0xff);
+    kproto_put_u8(out, stmt->n_params >> 8);
+    for (i = 0; i < stmt->n_params; i++)
+        kproto_put_u8(out, stmt->params[i].type);
+    return KDB_OK;
+}
+
+static int kdb_stmt_bind(const kdb_stmt_t *stmt, kproto_reader_t *params, kdb_set_t *set, kdb_plan_t *plan) {
+    int err;
+    uint16_t i;
+    kproto_value_t value;
+
+    // values come in the order their placeholders appear in the command
+    for (i = 0; i < stmt->n_params; i++) {
+        const kdb_param_t *param = &stmt->params[i];
+        if (kproto_value(params, param->type, &value))
+            return KDB_ERR_VALUE;
+        if (param->filter) {
+            kdb_filter_t *filter = &plan->filters[param->at];
+            err = kdb_filter_init(filter, filter->col, filter->join, filter->cmp, &value);
+        } else {
+            err = kdb_value_cast(set->cols[param->at], &value, &set->values[param->at]);
+        }
+        if (err)
+            return err;
+    }
+    return params->pos == params->len ? KDB_OK : KDB_ERR_VALUE;
+}
+
+static void kdb_redo(kproto_writer_t *redo, const uint8_t op, const kdb_t *table, const kdb_set_t *set, const kdb_plan_t *plan, const kproto_reader_t *rows) {
+    size_t i;
+    char *data;
+    uint32_t len;
+    const size_t start = redo->len;
+
+    // the command a statement ran, by handles and with its values bound,
+    // so the log replays it without the connection that prepared it
+    kproto_put_u8(redo, op);
+    kproto_put_u32(redo, 0);
+    kproto_put_u8(redo, 0);
+    kproto_put_u32(redo, table->handle);
+    if (op == K_CMD_ADD) {
+        if ((data = kproto_put(redo, rows->len)) != NULL)
+            memcpy(data, rows->data, rows->len);
+    } else {
+        if (op == K_CMD_SET) {
+            kproto_put_u8(redo, set->n_cols);
+            for (i = 0; i < set->n_cols; i++) {
+                kproto_put_u8(redo, 0);
+                kproto_put_u8(redo, (uint8_t)(set->cols[i] - table->cols));
+                kproto_put_typed(redo, &set->values[i]);
+            }
+        }
+        kproto_put_u8(redo, (uint8_t)(plan->n_filters + (plan->limit != UINT64_MAX)));
+        for (i = 0; i < plan->n_filters; i++) {
+            kproto_put_u8(redo, plan->filters[i].join);
+            kproto_put_u8(redo, 0);
+            kproto_put_u8(redo, (uint8_t)(plan->filters[i].col - table->cols));
+            kproto_put_u8(redo, plan->filters[i].cmp);
+            kproto_put_typed(redo, &plan->filters[i].value);
+        }
+        if (plan->limit != UINT64_MAX) {
+            kproto_put_u8(redo, K_Q_LIMIT);
+            kproto_put_u64(redo, plan->limit);
+        }
+    }
+    if (!redo->failed) {
+        len = htole32((uint32_t)(redo->len - start - KPROTO_CMD_HEADER));
+        memcpy(redo->data + start + 1, &len, 4);
+    }
+}
+
+static int kdb_query_exec(kdb_ctx_t *ctx, kdb_stmts_t *stmts, const kproto_cmd_t *cmd, kproto_writer_t *out, kproto_writer_t *redo, const uint64_t epoch, const size_t reader, kdb_locks_t *locks) {
+    int err;
+    uint8_t i;
+    uint64_t slot;
+    kdb_t *table;
+    kdb_get_t get;
+    kdb_set_t set;
+    kdb_plan_t plan;
+    kproto_value_t count;
+    kproto_reader_t params = cmd->params;
+    const kdb_stmt_t *stmt = stmts != NULL ? kdb_stmts_find(stmts, cmd->stmt) : NULL;
+    if (stmt == NULL)
+        return KDB_ERR_STMT;
+    if ((slot = kdb_catalog_handle(&ctx->catalog, stmt->table)) == KDB_INDEX_END)
+        return KDB_ERR_TABLE;
+    table = &ctx->dbs[slot];
+
+    // rows are all an ADD takes, laid out as they would follow its table
+    if (stmt->op == K_CMD_ADD) {
+        if (kproto_value(&params, K_TYPE_INT | (K_TYPE_UNSIGNED << 3), &count))
+            return KDB_ERR_VALUE;
+        if ((err = kdb_run_add(ctx, table, &params, (uint32_t)count.u, locks)))
+            return err;
+        kproto_put_u64(out, count.u);
+        if (redo != NULL)
+            kdb_redo(redo, K_CMD_ADD, table, NULL, NULL, &cmd->params);
+        return KDB_OK;
+    }
+
+    // columns and clauses are ready, the bound values fill in the rest
+    get.out = out;
+    set.ctx = ctx;
+    get.n_cols = set.n_cols = stmt->op == K_CMD_GET && stmt->n_cols == 0 ? table->n_cols : stmt->n_cols;
+    for (i = 0; i < get.n_cols; i++) {
+        get.cols[i] = stmt->n_cols ? stmt->cols[i] : i;
+        set.cols[i] = &table->cols[get.cols[i]];
+    }
+    if (stmt->op == K_CMD_SET && stmt->n_cols)
+        memcpy(set.values, stmt->values, stmt->n_cols * sizeof(kproto_value_t));
+    if (stmt->n_filters)
+        memcpy(plan.filters, stmt->filters, stmt->n_filters * sizeof(kdb_filter_t));
+    plan.n_filters = stmt->n_filters;
+    plan.limit = stmt->limit;
+    plan.epoch = epoch;
+    if ((err = kdb_stmt_bind(stmt, &params, &set, &plan)))
+        return err;
+    kdb_plan_scan(&plan);
+
+    switch (stmt->op) {
+        case K_CMD_GET: return kdb_run_get(ctx, table, &get, &plan, reader, locks, out);
+        case K_CMD_SET: err = kdb_run_change(ctx, table, &plan, &set, locks, out); break;
+        default: err = kdb_run_change(ctx, table, &plan, NULL, locks, out); break;
+    }
+    if (err == KDB_OK && redo != NULL)
+        kdb_redo(redo, stmt->op, table, &set, &plan, NULL);
+    return err;
+}
+
+int kdb_query_reads(const kdb_stmts_t *stmts, const kproto_cmd_t *cmd) {
+    const kdb_stmt_t *stmt;
+    if (cmd->op == K_CMD_EXEC)
+        return stmts != NULL && (stmt = kdb_stmts_peek(stmts, cmd->stmt)) != NULL && stmt->op == K_CMD_GET;
+    return cmd->op == K_CMD_GET || cmd->op == K_CMD_AGG || cmd->op == K_CMD_PREP || cmd->op == K_CMD_STMT;
+}
+
+static int kdb_query_run(kdb_ctx_t *ctx, kdb_stmts_t *stmts, const kproto_cmd_t *cmd, kproto_writer_t *out, kproto_writer_t *redo, const uint64_t epoch, const size_t reader, kdb_locks_t *locks) {
+    int status = KDB_ERR_VALUE;
+    const size_t start = out->len;
+
+    // answer with the opcode and status, the body only follows on success.
+    // commands that move tables or rows around wait for readers to leave,
+    // and readers never get to run anything but reads
+    kproto_put_u8(out, cmd->op);
+    kproto_put_u8(out, KDB_OK);
+    if (epoch == KDB_EPOCH_LATEST || kdb_query_reads(stmts, cmd)) {
+        switch (cmd->op) {
+            case K_CMD_NEW: kdb_ctx_exclusive(ctx); status = kdb_query_new(ctx, cmd, out); break;
+            case K_CMD_REM: kdb_ctx_exclusive(ctx); status = kdb_query_rem(ctx, cmd, out); break;
+            case K_CMD_ADD: status = kdb_query_add(ctx, cmd, out, locks); break;
+            case K_CMD_GET: status = kdb_query_get(ctx, cmd, out, epoch, reader, locks); break;
+            case K_CMD_SET: status = kdb_query_set(ctx, cmd, out, locks); break;
+            case K_CMD_DEL: status = kdb_query_del(ctx, cmd, out, locks); break;
+            case K_CMD_PREP: status = kdb_query_prep(ctx, cmd, out); break;
+            case K_CMD_STMT: status = kdb_query_stmt(ctx, stmts, cmd, out); break;
+            case K_CMD_EXEC: status = kdb_query_exec(ctx, stmts, cmd, out, redo, epoch, reader, locks); break;
+            case K_CMD_AGG: status = kdb_query_agg(ctx, cmd, out, epoch, reader, locks); break;
+        }
+    }
+    if (status != KDB_OK && !out->failed) {
+        out->len = start + 2;
+        out->data[start + 1] = (char)status;
+    }
+    return status;
+}
+
+static int kdb_query_sharded(kdb_ctx_t *ctx, kdb_stmts_t *stmts, const kproto_cmd_t *cmd) {
+    uint64_t slot;
+    const kdb_t *table = NULL;
+    const kdb_stmt_t *stmt;
+
+    switch (cmd->op) {
+        case K_CMD_ADD:
+        case K_CMD_GET:
+        case K_CMD_SET:
+        case K_CMD_DEL:
+        case K_CMD_AGG:
+            table = kdb_ctx_table(ctx, &cmd->table);
+            break;
+        case K_CMD_EXEC:
+            if (stmts != NULL && (stmt = kdb_stmts_peek(stmts, cmd->stmt)) != NULL && (slot = kdb_catalog_handle(&ctx->catalog, stmt->table)) != KDB_INDEX_END)
+                table = &ctx->dbs[slot];
+            break;
+    }
+    return table != NULL && table->n_shards;
+}
+
+int kdb_query(kdb_ctx_t *ctx, kdb_stmts_t *stmts, const kproto_cmd_t *cmd, kproto_writer_t *out, kproto_writer_t *redo, kdb_locks_t *locks) {
+    int status;
+
+    // rows of a sharded table only need the shards they are in, with the
+    // layout read locked so no table comes or goes under the command
+    locks->shards = 0;
+    locks->root = 0;
+    if (__atomic_load_n(&ctx->n_shards, __ATOMIC_ACQUIRE)) {
+        pthread_rwlock_rdlock(&ctx->layout);
+        if (kdb_query_sharded(ctx, stmts, cmd))
+            return kdb_query_run(ctx, stmts, cmd, out, redo, KDB_EPOCH_LATEST, 0, locks);
+        pthread_rwlock_unlock(&ctx->layout);
+    }
+
+    // anything else goes one at a time under the lock
+    locks->root = 1;
+    pthread_mutex_lock(&ctx->lock);
+    kdb_ctx_begin(ctx);
+    status = kdb_query_run(ctx, stmts, cmd, out, redo, KDB_EPOCH_LATEST, 0, locks);
+    kdb_ctx_publish(ctx);
+    return status;
+}
+
+void kdb_query_unlock(kdb_ctx_t *ctx, kdb_locks_t *locks) {
+    uint64_t shards;
+
+    // held until the command is logged, so the log has each shard in the
+    // order its commands ran
+    for (shards = locks->shards; shards; shards &= shards - 1)
+        pthread_mutex_unlock(&kdb_ctx_shard(ctx, __builtin_ctzll(shards))->lock);
+    if (locks->root)
+        pthread_mutex_unlock(&ctx->lock);
+    else
+        pthread_rwlock_unlock(&ctx->layout);
+}
+
+int kdb_query_read(kdb_ctx_t *ctx, const size_t reader, kdb_stmts_t *stmts, const kproto_cmd_t *cmd, kproto_writer_t *out) {
+    int status;
+
+    // the snapshot is the last command the writer finished, versions of
+    // the rows it changes since keep it readable
+    pthread_rwlock_rdlock(&ctx->layout);
+    status = kdb_query_run(ctx, stmts, cmd, out, NULL, kdb_epochs_enter(&ctx->epochs, reader, &ctx->epoch), reader, NULL);
+    kdb_epochs_leave(&ctx->epochs, reader);
+    pthread_rwlock_unlock(&ctx->layout);
+    return status;
+}
@@ -0,0 +1,35 @@
+#ifndef K_QUERY_H
+#define K_QUERY_H
+
+#include "stmt.h"
+#include "version.h"
+
+// what a writer holds for the command it ran, kept until it is logged.
+// commands on rows of a sharded table read lock the layout instead of
+// taking the lock, and lock only the shards they touch
+typedef struct {
+    uint64_t shards; // a bit for each shard locked
+    uint8_t root;    // the lock, else the layout read locked
+} kdb_locks_t;
+
+int kdb_ctx_init(kdb_ctx_t *ctx);
+void kdb_ctx_free(kdb_ctx_t *ctx);
+int kdb_ctx_share(kdb_ctx_t *ctx, const size_t readers);
+int kdb_ctx_shards(kdb_ctx_t *ctx, const size_t n);
+kdb_ctx_t* kdb_ctx_shard(const kdb_ctx_t *ctx, const size_t shard);
+void kdb_ctx_lock(kdb_ctx_t *ctx);
+void kdb_ctx_unlock(kdb_ctx_t *ctx);
+kdb_t* kdb_ctx_table(kdb_ctx_t *ctx, const kproto_ref_t *ref);
+kdb_column_t* kdb_ctx_column(kdb_ctx_t *ctx, kdb_t *table, const kproto_ref_t *ref);
+int kdb_ctx_register(kdb_ctx_t *ctx, const size_t slot);
+void kdb_ctx_collect(kdb_ctx_t *ctx);
+int kdb_query(kdb_ctx_t *ctx, kdb_stmts_t *stmts, const kproto_cmd_t *cmd, kproto_writer_t *out, kproto_writer_t *redo, kdb_locks_t *locks);
+void kdb_query_unlock(kdb_ctx_t *ctx, kdb_locks_t *locks);
+
+// runs a command for which kdb_query_reads holds beside the writer, at the
+// last epoch it published and without its lock. each reader has a slot
+// of its own, given to kdb_ctx_share
+int kdb_query_reads(const kdb_stmts_t *stmts, const kproto_cmd_t *cmd);
+int kdb_query_read(kdb_ctx_t *ctx, const size_t reader, kdb_stmts_t *stmts, const kproto_cmd_t *cmd, kproto_writer_t *out);
+
+#endif // K_QUERY_H
@@ -0,0 +1,61 @@
+#include "ring.h"
+
+#include <stdlib.h>
+
+int kring_init(kring_t *ring, size_t size) {
+    uint64_t i, cells = 1;
+
+    // a power of two so positions wrap with a mask
+    while (cells < size)
+        cells *= 2;
+    ring->head = ring->tail = 0;
+    ring->mask = cells - 1;
+    if ((ring->cells = malloc(cells * sizeof(kring_cell_t))) == NULL)
+        return -1;
+    for (i = 0; i < cells; i++)
+        ring->cells[i].seq = i;
+    return 0;
+}
+
+void kring_free(kring_t *ring) {
+    free(ring->cells);
+    ring->cells = NULL;
+}
+
+int kring_push(kring_t *ring, void *data) {
+    int64_t turn;
+    kring_cell_t *cell;
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    // a cell is free for the producer at pos once its seq reached pos,
+    // one still a lap behind means the consumer hasnt taken it yet
+    for (;;) {
+        cell = &ring->cells[pos & ring->mask];
+        turn = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (turn == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (turn < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void* kring_pop(kring_t *ring) {
+    void *data;
+    const uint64_t pos = ring->tail;
+    kring_cell_t *cell = &ring->cells[pos & ring->mask];
+
+    // filled cells are one past their position, freed ones a lap ahead
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return NULL;
+    data = cell->data;
+    __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    ring->tail = pos + 1;
+    return data;
+}
@@ -0,0 +1,32 @@
+#ifndef K_RING_H
+#define K_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// pointers held by a ring when no size is asked for
+#ifndef KRING_SIZE
+#define KRING_SIZE 1024
+#endif
+
+typedef struct {
+    uint64_t seq;
+    void *data;
+} kring_cell_t;
+
+// bounded lock-free queue of pointers, any number of threads push and a
+// single one pops. each cell carries the turn it is on, so a producer
+// claims a cell by moving head and the consumer never touches head
+typedef struct {
+    kring_cell_t *cells;
+    uint64_t mask;
+    uint64_t head __attribute__((aligned(64))); // next cell producers claim
+    uint64_t tail __attribute__((aligned(64))); // next cell the consumer takes
+} kring_t;
+
+int kring_init(kring_t *ring, size_t size);
+void kring_free(kring_t *ring);
+int kring_push(kring_t *ring, void *data);
+void* kring_pop(kring_t *ring);
+
+#endif // K_RING_H
@@ -0,0 +1,335 @@
+#include "snap.h"
+#include "wal.h"
+#include "query.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// rows are kept in steps whose live bitmap fills whole aligned lines, so
+// arrays grown from a loaded table stay multiples of KDB_ALIGN
+#define KDB_SNAP_ROWS (KDB_BLOCK * KDB_ALIGN / sizeof(uint64_t))
+
+// arrays are file offsets, 0 is an empty array since the header is there
+typedef struct {
+    uint64_t magic;
+    uint64_t lsn; // log the snapshot covers up to
+    uint64_t size;
+    uint64_t n_tables;
+    uint64_t next; // handle the next table gets
+} kdb_snap_header_t;
+
+typedef struct {
+    char name[256];
+    uint64_t handle;
+    uint64_t n_rows;
+    uint64_t n_live;
+    uint64_t cap;
+    uint64_t live;
+    uint8_t name_len;
+    uint8_t n_cols;
+    uint8_t n_shards; // records after this one's columns holding its rows
+    uint8_t shard_key;
+} kdb_snap_table_t;
+
+typedef struct {
+    char name[256];
+    uint64_t maxsize;
+    uint64_t data;
+    uint64_t lens;
+    uint64_t arena;
+    uint64_t arena_len;
+    uint8_t name_len;
+    uint8_t type;
+    uint8_t flags; // column flags plus K_TYPE_INDEX/ORDERED to rebuild
+    uint8_t width;
+} kdb_snap_column_t;
+
+static int kdb_snap_put(const int fd, const void *data, size_t len, uint64_t off) {
+    ssize_t n;
+    while (len > 0) {
+        if ((n = pwrite(fd, data, len, off)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data = (const char*)data + n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static int kdb_snap_array(const int fd, const void *data, const size_t len, const size_t room, uint64_t *end, uint64_t *off) {
+    // arrays follow one another on their own alignment, the room past
+    // the used part is left as a hole that reads back as zeros
+    *off = 0;
+    if (room == 0)
+        return 0;
+    *off = (*end + KDB_ALIGN - 1) & ~(uint64_t)(KDB_ALIGN - 1);
+    *end = *off + room;
+    return len ? kdb_snap_put(fd, data, len, *off) : 0;
+}
+
+static int kdb_snap_record(const kdb_t *table, const int fd, uint64_t *meta, uint64_t *end) {
+    uint8_t j;
+    kdb_snap_table_t st;
+    kdb_snap_column_t sc;
+
+    memset(&st, 0, sizeof(st));
+    memcpy(st.name, table->name, table->name_len);
+    st.name_len = table->name_len;
+    st.handle = table->handle;
+    st.n_cols = table->n_cols;
+    st.n_shards = table->n_shards;
+    st.shard_key = table->shard_key;
+    st.n_rows = table->n_rows;
+    st.n_live = table->n_live;
+    st.cap = (table->n_rows + KDB_SNAP_ROWS - 1) & ~(uint64_t)(KDB_SNAP_ROWS - 1);
+    if (kdb_snap_array(fd, table->live, st.cap / 64 * sizeof(uint64_t), st.cap / 64 * sizeof(uint64_t), end, &st.live))
+        return -1;
+    if (kdb_snap_put(fd, &st, sizeof(st), *meta))
+        return -1;
+    *meta += sizeof(st);
+
+    for (j = 0; j < table->n_cols; j++) {
+        const kdb_column_t *col = &table->cols[j];
+        memset(&sc, 0, sizeof(sc));
+        memcpy(sc.name, col->name, col->name_len);
+        sc.name_len = col->name_len;
+        sc.type = col->type;
+        sc.flags = col->flags | (col->index.slots ? K_TYPE_INDEX : 0) | (col->tree.root ? K_TYPE_ORDERED : 0);
+        sc.width = col->width;
+        sc.maxsize = col->maxsize;
+        sc.arena_len = col->arena_len;
+        if (kdb_snap_array(fd, col->data, st.n_rows * col->width, st.cap * col->width, end, &sc.data))
+            return -1;
+        if (col->type == K_TYPE_STRING && kdb_snap_array(fd, col->lens, st.n_rows * sizeof(uint32_t), st.cap * sizeof(uint32_t), end, &sc.lens))
+            return -1;
+        if (kdb_snap_array(fd, col->arena, col->arena_len, col->arena_len, end, &sc.arena))
+            return -1;
+        if (kdb_snap_put(fd, &sc, sizeof(sc), *meta))
+            return -1;
+        *meta += sizeof(sc);
+    }
+    return 0;
+}
+
+static int kdb_snap_tables(const kdb_ctx_t *ctx, const int fd, uint64_t *end) {
+    size_t i;
+    uint8_t j;
+    uint64_t meta = sizeof(kdb_snap_header_t);
+
+    // metadata goes front to back, arrays start where it ends
+    *end = meta;
+    for (i = 0; i < ctx->db_len; i++)
+        *end += (1 + ctx->dbs[i].n_shards) * (sizeof(kdb_snap_table_t) + ctx->dbs[i].n_cols * sizeof(kdb_snap_column_t));
+
+    for (i = 0; i < ctx->db_len; i++) {
+        if (kdb_snap_record(&ctx->dbs[i], fd, &meta, end))
+            return -1;
+        for (j = 0; j < ctx->dbs[i].n_shards; j++)
+            if (kdb_snap_record(kdb_table_shard(&ctx->dbs[i], j), fd, &meta, end))
+                return -1;
+    }
+    return 0;
+}
+
+int kdb_snap_write(const kdb_ctx_t *ctx, const char *path, const uint64_t lsn) {
+    int fd;
+    char tmp[PATH_MAX];
+    kdb_snap_header_t header;
+
+    // written next to the last snapshot and swapped in once complete
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "[KDB] Failed to open snapshot %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    header.magic = KDB_SNAP_MAGIC;
+    header.lsn = lsn;
+    header.n_tables = ctx->db_len;
+    header.next = ctx->catalog.next;
+    if (kdb_snap_tables(ctx, fd, &header.size) || kdb_snap_put(fd, &header, sizeof(header), 0) ||
+        ftruncate(fd, header.size) < 0 || fdatasync(fd) < 0 || rename(tmp, path) < 0 || kdb_sync_dir(path)) {
+        fprintf(stderr, "[KDB] Failed to write snapshot %s: %s\n", path, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static int kdb_snap_at(char *map, const uint64_t size, const uint64_t off, const uint64_t len, void *out) {
+    // arrays have to be aligned and inside the file
+    *(void**)out = NULL;
+    if (off == 0)
+        return len ? -1 : 0;
+    if (off % KDB_ALIGN || off > size || len > size - off)
+        return -1;
+    *(void**)out = map + off;
+    return 0;
+}
+
+static int kdb_snap_table(kdb_ctx_t *ctx, kdb_t *table, char *map, const uint64_t size, uint64_t *meta, kdb_snap_table_t *out) {
+    uint8_t i, j;
+    kproto_str_t name;
+    kdb_snap_table_t st;
+    kdb_snap_column_t sc;
+
+    if (sizeof(st) > size - *meta)
+        return -1;
+    memcpy(&st, map + *meta, sizeof(st));
+    memcpy(out, &st, sizeof(st));
+    *meta += sizeof(st);
+    if (st.n_live > st.n_rows || st.cap < st.n_rows || st.cap % KDB_SNAP_ROWS || st.name_len == 0)
+        return -1;
+    if (st.handle == 0 || st.handle >= ctx->catalog.next || kdb_catalog_handle(&ctx->catalog, st.handle) != KDB_INDEX_END)
+        return -1;
+    name.data = st.name;
+    name.len = st.name_len;
+    if (kdb_table_name(&ctx->catalog, &name, &table->name, &table->sym) || (table->cols = calloc(st.n_cols, sizeof(kdb_column_t))) == NULL)
+        return -1;
+    if (kdb_catalog_table(&ctx->catalog, table->sym) != KDB_INDEX_END)
+        return -1;
+    table->handle = st.handle;
+    table->name_len = st.name_len;
+    table->n_rows = st.n_rows;
+    table->n_live = st.n_live;
+    table->cap = st.cap;
+    if (kdb_snap_at(map, size, st.live, st.cap / 64 * sizeof(uint64_t), &table->live))
+        return -1;
+    table->mapped = table->live != NULL;
+
+    for (i = 0; i < st.n_cols; i++) {
+        kdb_column_t *col = &table->cols[i];
+        if (sizeof(sc) > size - *meta)
+            return -1;
+        memcpy(&sc, map + *meta, sizeof(sc));
+        *meta += sizeof(sc);
+        if (sc.type > K_TYPE_STRING || (sc.width != 1 && sc.width != 2 && sc.width != 4 && sc.width != 8) || sc.name_len == 0)
+            return -1;
+        name.data = sc.name;
+        name.len = sc.name_len;
+        if (kdb_table_name(&ctx->catalog, &name, &col->name, &col->sym))
+            return -1;
+        for (j = 0; j < i; j++)
+            if (table->cols[j].sym == col->sym)
+                return -1;
+        col->name_len = sc.name_len;
+        col->type = sc.type;
+        col->flags = sc.flags & K_TYPE_UNSIGNED;
+        col->width = sc.width;
+        col->maxsize = sc.maxsize;
+        table->n_cols++;
+
+        // columns are served from the mapping until they change size
+        if (kdb_snap_at(map, size, sc.data, st.cap * sc.width, &col->data))
+            return -1;
+        if (sc.type == K_TYPE_STRING && kdb_snap_at(map, size, sc.lens, st.cap * sizeof(uint32_t), &col->lens))
+            return -1;
+        if (kdb_snap_at(map, size, sc.arena, sc.arena_len, &col->arena))
+            return -1;
+        col->arena_len = col->arena_max = sc.arena_len;
+        col->mapped = (col->data ? KDB_MAPPED_DATA : 0) | (col->lens ? KDB_MAPPED_LENS : 0) | (col->arena ? KDB_MAPPED_ARENA : 0);
+
+        // indexes hold pointers so they are built again over the rows
+        if (kdb_table_index(table, col, sc.flags))
+            return -1;
+    }
+    return 0;
+}
+
+static int kdb_snap_shards(kdb_ctx_t *ctx, kdb_t *table, const kdb_snap_table_t *st, char *map, const uint64_t size, uint64_t *meta) {
+    uint8_t i, j;
+    kdb_t *shard;
+    kdb_snap_table_t sst;
+
+    // shards follow their table, with its name, handle and schema
+    if (st->n_shards == 0)
+        return 0;
+    if (st->n_shards < 2 || st->n_shards > KDB_MAX_SHARDS || st->shard_key >= table->n_cols || table->n_rows)
+        return -1;
+    if (kdb_ctx_shards(ctx, st->n_shards) || (table->shards = calloc(st->n_shards, sizeof(kdb_t))) == NULL)
+        return -1;
+    table->n_shards = st->n_shards;
+    table->shard_key = st->shard_key;
+    for (i = 0; i < table->n_shards; i++) {
+        shard = kdb_table_shard(table, i);
+        if (kdb_snap_table(ctx, shard, map, size, meta, &sst) || sst.n_shards || shard->handle != table->handle ||
+            shard->sym != table->sym || shard->n_cols != table->n_cols)
+            return -1;
+        for (j = 0; j < table->n_cols; j++) {
+            const kdb_column_t *a = &table->cols[j], *b = &shard->cols[j];
+            if (a->sym != b->sym || a->type != b->type || a->flags != b->flags || a->width != b->width || a->maxsize != b->maxsize)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+
+int kdb_snap_load(kdb_ctx_t *ctx, const char *path, uint64_t *lsn) {
+    int fd;
+    char *map;
+    struct stat st;
+    uint64_t meta;
+    kdb_snap_header_t header;
+    kdb_snap_table_t record;
+
+    // no snapshot yet, start empty
+    *lsn = 0;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "[KDB] Failed to open snapshot %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(header)) {
+        fprintf(stderr, "[KDB] Snapshot %s is torn\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // private so changes to mapped columns never reach the file, only
+    // pages that get changed take memory so none is reserved up front
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[KDB] Failed to map snapshot: %s\n", strerror(errno));
+        return -1;
+    }
+    ctx->snap = map;
+    ctx->snap_len = st.st_size;
+    memcpy(&header, map, sizeof(header));
+    if (header.magic != KDB_SNAP_MAGIC || header.size != (uint64_t)st.st_size || header.n_tables > header.size / sizeof(kdb_snap_table_t) ||
+        header.next == 0 || header.next > UINT32_MAX) {
+        fprintf(stderr, "[KDB] Snapshot %s is torn\n", path);
+        return -1;
+    }
+
+    // tables are filled in place, the context frees whatever got made
+    if (header.n_tables && (ctx->dbs = calloc(header.n_tables, sizeof(kdb_t))) == NULL) {
+        fprintf(stderr, "[KDB] Not enough memory for snapshot\n");
+        return -1;
+    }
+    ctx->catalog.next = header.next;
+    for (meta = sizeof(header); ctx->db_len < header.n_tables; ctx->db_len++) {
+        if (kdb_snap_table(ctx, &ctx->dbs[ctx->db_len], map, header.size, &meta, &record) ||
+            kdb_snap_shards(ctx, &ctx->dbs[ctx->db_len], &record, map, header.size, &meta) || kdb_ctx_register(ctx, ctx->db_len)) {
+            fprintf(stderr, "[KDB] Snapshot %s is corrupt\n", path);
+            ctx->db_len++;
+            return -1;
+        }
+    }
+    *lsn = header.lsn;
+    printf("Loaded %zu tables from the snapshot\n", ctx->db_len);
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef K_SNAP_H
+#define K_SNAP_H
+
+#include "table.h"
+
+#define KDB_SNAP_MAGIC 0x33504e5342444bULL // "KDBSNP3"
+#define KDB_SNAP_INTERVAL 60               // default seconds between snapshots
+
+// point in time copy of every table laid out the way columns are kept in
+// memory, in native byte order. loading maps the file and points the
+// columns straight into it:
+//
+//   snapshot := header | (table column* shard*)* | array*
+//   shard    := table column*
+//
+// a sharded table holds no rows itself, its shards follow it under the
+// same name and handle.
+// every array starts on KDB_ALIGN and holds whole blocks of rows, a file
+// shorter than its header says is torn
+int kdb_snap_write(const kdb_ctx_t *ctx, const char *path, const uint64_t lsn);
+int kdb_snap_load(kdb_ctx_t *ctx, const char *path, uint64_t *lsn);
+
+#endif // K_SNAP_H
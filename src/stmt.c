@@ -0,0 +1,79 @@
+#include "stmt.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void kdb_stmts_init(kdb_stmts_t *stmts) {
+    memset(stmts, 0, sizeof(kdb_stmts_t));
+}
+
+void kdb_stmts_free(kdb_stmts_t *stmts) {
+    size_t i;
+    for (i = 0; i < KDB_STMT_MAX; i++)
+        kdb_stmt_free(&stmts->stmts[i]);
+}
+
+void kdb_stmt_free(kdb_stmt_t *stmt) {
+    free(stmt->body);
+    free(stmt->cols);
+    free(stmt->values);
+    free(stmt->filters);
+    free(stmt->params);
+    memset(stmt, 0, sizeof(kdb_stmt_t));
+}
+
+uint64_t kdb_stmt_hash(const uint8_t op, const kproto_str_t *body) {
+    kproto_value_t value;
+    value.type = K_TYPE_STRING;
+    value.s = *body;
+    return kdb_index_key(&value) ^ op;
+}
+
+const kdb_stmt_t* kdb_stmts_peek(const kdb_stmts_t *stmts, const uint32_t id) {
+    // ids carry the entry they were given, a newer statement there means
+    // this one was dropped
+    const kdb_stmt_t *stmt = &stmts->stmts[id % KDB_STMT_MAX];
+    return id != 0 && stmt->id == id ? stmt : NULL;
+}
+
+kdb_stmt_t* kdb_stmts_find(kdb_stmts_t *stmts, const uint32_t id) {
+    kdb_stmt_t *stmt = (kdb_stmt_t*)kdb_stmts_peek(stmts, id);
+    if (stmt == NULL) {
+        stmts->misses++;
+        return NULL;
+    }
+    stmts->hits++;
+    stmt->used = ++stmts->clock;
+    return stmt;
+}
+
+kdb_stmt_t* kdb_stmts_match(kdb_stmts_t *stmts, const uint32_t table, const uint8_t op, const kproto_str_t *body, const uint64_t hash) {
+    size_t i;
+
+    // the same command names a new table once the old one was removed
+    for (i = 0; i < KDB_STMT_MAX; i++) {
+        kdb_stmt_t *stmt = &stmts->stmts[i];
+        if (stmt->id != 0 && stmt->hash == hash && stmt->table == table && stmt->op == op &&
+            stmt->body_len == body->len && !memcmp(stmt->body, body->data, body->len)) {
+            stmts->hits++;
+            stmt->used = ++stmts->clock;
+            return stmt;
+        }
+    }
+    return NULL;
+}
+
+kdb_stmt_t* kdb_stmts_take(kdb_stmts_t *stmts) {
+    size_t i, lru = 0;
+
+    // a free entry or else the least recently used one
+    for (i = 0; i < KDB_STMT_MAX && stmts->stmts[lru].id != 0; i++)
+        if (stmts->stmts[i].id == 0 || stmts->stmts[i].used < stmts->stmts[lru].used)
+            lru = i;
+    kdb_stmt_free(&stmts->stmts[lru]);
+    stmts->misses++;
+    stmts->seq = stmts->seq < UINT32_MAX / KDB_STMT_MAX - 1 ? stmts->seq + 1 : 1;
+    stmts->stmts[lru].id = stmts->seq * KDB_STMT_MAX + lru;
+    stmts->stmts[lru].used = ++stmts->clock;
+    return &stmts->stmts[lru];
+}
@@ -0,0 +1,54 @@
+#ifndef K_STMT_H
+#define K_STMT_H
+
+#include "filter.h"
+
+// statements a connection keeps before the least recently used goes
+#define KDB_STMT_MAX 64
+
+// where EXEC binds a placeholder, a filter or a SET assignment
+typedef struct {
+    uint8_t type; // sent with, less K_TYPE_PARAM
+    uint8_t at;
+    uint8_t filter;
+} kdb_param_t;
+
+// a command compiled against the schema once, table by handle and
+// columns by their place so running it again resolves nothing
+typedef struct {
+    uint32_t id;    // 0 while the entry is free
+    uint32_t table; // handle it was prepared on
+    uint64_t hash;  // of the command, to find it when prepared again
+    uint64_t used;  // cache clock at the last use
+    uint8_t op;
+    uint8_t n_cols; // projection or assignments, a GET of 0 gets every column
+    uint16_t n_params;
+    uint64_t limit;
+    size_t n_filters;
+    char *body; // the command, literal strings point into it
+    size_t body_len;
+    uint8_t *cols;
+    kproto_value_t *values; // SET values cast to their columns
+    kdb_filter_t *filters;  // clauses, placeholders have no value yet
+    kdb_param_t *params;
+} kdb_stmt_t;
+
+// lives on a connection, so only ever touched from its worker
+typedef struct {
+    uint32_t seq;
+    uint64_t clock;
+    uint64_t hits;   // EXECs that found their statement, STMTs already compiled
+    uint64_t misses; // EXECs of a dropped statement, STMTs compiled
+    kdb_stmt_t stmts[KDB_STMT_MAX];
+} kdb_stmts_t;
+
+void kdb_stmts_init(kdb_stmts_t *stmts);
+void kdb_stmts_free(kdb_stmts_t *stmts);
+kdb_stmt_t* kdb_stmts_find(kdb_stmts_t *stmts, const uint32_t id);
+const kdb_stmt_t* kdb_stmts_peek(const kdb_stmts_t *stmts, const uint32_t id);
+kdb_stmt_t* kdb_stmts_match(kdb_stmts_t *stmts, const uint32_t table, const uint8_t op, const kproto_str_t *body, const uint64_t hash);
+kdb_stmt_t* kdb_stmts_take(kdb_stmts_t *stmts);
+void kdb_stmt_free(kdb_stmt_t *stmt);
+uint64_t kdb_stmt_hash(const uint8_t op, const kproto_str_t *body);
+
+#endif // K_STMT_H
@@ -0,0 +1,441 @@
+#include "table.h"
+#include "version.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// bytes per row in a column, strings keep a 64 bit arena offset per row
+static const uint8_t kdb_widths[] = { 1, 2, 4, 8, 1, 4, 8, 8 };
+
+int kdb_table_name(kdb_catalog_t *catalog, const kproto_str_t *name, const char **out, uint32_t *sym) {
+    // names point into the catalog, which keeps them for good
+    if ((*sym = kdb_catalog_intern(catalog, name)) == KDB_CATALOG_NONE)
+        return KDB_ERR_MEMORY;
+    *out = kdb_catalog_name(catalog, *sym)->data;
+    return KDB_OK;
+}
+
+int kdb_table_init(kdb_t *table, kdb_catalog_t *catalog, const kproto_cmd_t *cmd) {
+    uint8_t i, j;
+    kproto_column_t def;
+    kproto_reader_t cols = cmd->cols;
+
+    // take the name and schema out of the request
+    memset(table, 0, sizeof(kdb_t));
+    if (kdb_table_name(catalog, &cmd->table.name, &table->name, &table->sym))
+        return KDB_ERR_MEMORY;
+    table->name_len = (uint8_t)cmd->table.name.len;
+    if ((table->cols = calloc(cmd->n_cols, sizeof(kdb_column_t))) == NULL)
+        return KDB_ERR_MEMORY;
+
+    for (i = 0; i < cmd->n_cols; i++) {
+        kdb_column_t *col = &table->cols[i];
+        kproto_column(&cols, &def);
+        if (kdb_table_name(catalog, &def.name, &col->name, &col->sym))
+            return KDB_ERR_MEMORY;
+        for (j = 0; j < i; j++)
+            if (table->cols[j].sym == col->sym)
+                return KDB_ERR_COLUMN;
+        col->name_len = (uint8_t)def.name.len;
+        col->type = def.type;
+        col->flags = kdb_is_integer(def.type) && def.type != K_TYPE_BOOL ? def.flags & K_TYPE_UNSIGNED : 0;
+        col->width = kdb_widths[def.type];
+        col->maxsize = def.type == K_TYPE_STRING ? def.maxsize : 0;
+        table->n_cols++;
+        if (def.flags & K_TYPE_DEFAULT)
+            return KDB_ERR_VALUE;
+        if ((def.flags & K_TYPE_INDEX) && kdb_index_init(&col->index))
+            return KDB_ERR_MEMORY;
+        if ((def.flags & K_TYPE_ORDERED) && def.type == K_TYPE_STRING)
+            return KDB_ERR_TYPE;
+        if ((def.flags & K_TYPE_ORDERED) && kdb_tree_init(&col->tree))
+            return KDB_ERR_MEMORY;
+    }
+    return KDB_OK;
+}
+
+void kdb_table_free(kdb_t *table) {
+    uint8_t i;
+    for (i = 0; i < table->n_shards; i++)
+        kdb_table_free(kdb_table_shard(table, i));
+    free(table->shards);
+    for (i = 0; i < table->n_cols; i++) {
+        if (!(table->cols[i].mapped & KDB_MAPPED_DATA))
+            free(table->cols[i].data);
+        if (!(table->cols[i].mapped & KDB_MAPPED_LENS))
+            free(table->cols[i].lens);
+        if (!(table->cols[i].mapped & KDB_MAPPED_ARENA))
+            free(table->cols[i].arena);
+        kdb_index_free(&table->cols[i].index);
+        kdb_tree_free(&table->cols[i].tree);
+    }
+    free(table->cols);
+    if (!table->mapped)
+        free(table->live);
+    kdb_version_free(table);
+    memset(table, 0, sizeof(kdb_t));
+}
+
+static void* kdb_grow(void *data, const size_t used, const size_t size, const int mapped) {
+    // aligned arrays cant be realloc'ed, move the used part over instead
+    void *grown = aligned_alloc(KDB_ALIGN, size);
+    if (grown == NULL)
+        return NULL;
+    if (data != NULL)
+        memcpy(grown, data, used);
+    if (!mapped)
+        free(data);
+    return grown;
+}
+
+int kdb_table_reserve(kdb_t *table, const uint64_t rows) {
+    uint8_t i;
+    void *grown;
+    uint64_t cap = table->cap ? table->cap : KDB_MIN_ROWS;
+    if (rows <= table->cap)
+        return KDB_OK;
+
+    // double in whole blocks, a column that grew before a failure is
+    // simply grown again next time since only used rows are copied
+    while (cap < rows)
+        cap *= 2;
+    if (kdb_version_grow(table, cap))
+        return KDB_ERR_MEMORY;
+    for (i = 0; i < table->n_cols; i++) {
+        kdb_column_t *col = &table->cols[i];
+        if ((grown = kdb_grow(col->data, table->n_rows * col->width, cap * col->width, col->mapped & KDB_MAPPED_DATA)) == NULL)
+            return KDB_ERR_MEMORY;
+        col->data = grown;
+        col->mapped &= ~KDB_MAPPED_DATA;
+        if (col->type != K_TYPE_STRING)
+            continue;
+        if ((grown = kdb_grow(col->lens, table->n_rows * sizeof(uint32_t), cap * sizeof(uint32_t), col->mapped & KDB_MAPPED_LENS)) == NULL)
+            return KDB_ERR_MEMORY;
+        col->lens = grown;
+        col->mapped &= ~KDB_MAPPED_LENS;
+    }
+    if ((grown = kdb_grow(table->live, (table->cap / 64) * sizeof(uint64_t), (cap / 64) * sizeof(uint64_t), table->mapped)) == NULL)
+        return KDB_ERR_MEMORY;
+    table->live = grown;
+    table->mapped = 0;
+    memset(table->live + table->cap / 64, 0, ((cap - table->cap) / 64) * sizeof(uint64_t));
+    table->cap = cap;
+    return KDB_OK;
+}
+
+static int kdb_arena_put(kdb_column_t *col, const uint64_t row, const kproto_str_t *str) {
+    char *arena;
+    size_t max = col->arena_max ? col->arena_max : 4096;
+
+    // strings are appended, overwritten ones are left behind in the arena,
+    // one still in a snapshot is copied out the first time it grows
+    if (col->arena_len + str->len > col->arena_max) {
+        while (max < col->arena_len + str->len)
+            max *= 2;
+        if (col->mapped & KDB_MAPPED_ARENA) {
+            if ((arena = malloc(max)) == NULL)
+                return KDB_ERR_MEMORY;
+            memcpy(arena, col->arena, col->arena_len);
+            col->mapped &= ~KDB_MAPPED_ARENA;
+        } else if ((arena = realloc(col->arena, max)) == NULL) {
+            return KDB_ERR_MEMORY;
+        }
+        col->arena = arena;
+        col->arena_max = max;
+    }
+    // the string is in the arena before the row points at it, see
+    // kdb_table_str
+    memcpy(col->arena + col->arena_len, str->data, str->len);
+    col->arena_len += str->len;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ((uint64_t*)col->data)[row] = col->arena_len - str->len;
+    col->lens[row] = str->len;
+    return KDB_OK;
+}
+
+static int kdb_column_put(kdb_column_t *col, const uint64_t row, const kproto_value_t *value) {
+    float f;
+
+    // values are already cast to the column type
+    switch (col->type) {
+        case K_TYPE_BYTE:
+        case K_TYPE_BOOL:
+            ((uint8_t*)col->data)[row] = (uint8_t)value->u;
+            break;
+        case K_TYPE_SHORT:
+            ((uint16_t*)col->data)[row] = (uint16_t)value->u;
+            break;
+        case K_TYPE_INT:
+            ((uint32_t*)col->data)[row] = (uint32_t)value->u;
+            break;
+        case K_TYPE_LONG:
+            ((uint64_t*)col->data)[row] = value->u;
+            break;
+        case K_TYPE_FLOAT:
+            f = (float)value->d;
+            ((float*)col->data)[row] = f;
+            break;
+        case K_TYPE_DOUBLE:
+            ((double*)col->data)[row] = value->d;
+            break;
+        case K_TYPE_STRING:
+            return kdb_arena_put(col, row, &value->s);
+    }
+    return KDB_OK;
+}
+
+void kdb_table_get(const kdb_t *table, const kdb_column_t *col, const uint64_t row, kproto_value_t *value) {
+    const int is_unsigned = col->flags & K_TYPE_UNSIGNED;
+    value->type = col->type;
+    value->flags = col->flags;
+    switch (col->type) {
+        case K_TYPE_BYTE:
+            value->u = is_unsigned ? ((uint8_t*)col->data)[row] : (uint64_t)(int64_t)((int8_t*)col->data)[row];
+            break;
+        case K_TYPE_SHORT:
+            value->u = is_unsigned ? ((uint16_t*)col->data)[row] : (uint64_t)(int64_t)((int16_t*)col->data)[row];
+            break;
+        case K_TYPE_INT:
+            value->u = is_unsigned ? ((uint32_t*)col->data)[row] : (uint64_t)(int64_t)((int32_t*)col->data)[row];
+            break;
+        case K_TYPE_LONG:
+            value->u = ((uint64_t*)col->data)[row];
+            break;
+        case K_TYPE_BOOL:
+            value->u = ((uint8_t*)col->data)[row];
+            break;
+        case K_TYPE_FLOAT:
+            value->d = ((float*)col->data)[row];
+            break;
+        case K_TYPE_DOUBLE:
+            value->d = ((double*)col->data)[row];
+            break;
+        case K_TYPE_STRING:
+            value->s.data = kdb_table_str(col, row, &value->s.len);
+            break;
+    }
+}
+
+static inline uint64_t kdb_row_key(const kdb_t *table, const kdb_column_t *col, const uint64_t row) {
+    kproto_value_t value;
+    kdb_table_get(table, col, row, &value);
+    return kdb_index_key(&value);
+}
+
+static inline uint64_t kdb_row_rank(const kdb_t *table, const kdb_column_t *col, const uint64_t row) {
+    kproto_value_t value;
+    kdb_table_get(table, col, row, &value);
+    return kdb_tree_key(&value);
+}
+
+int kdb_table_index(kdb_t *table, kdb_column_t *col, const uint8_t flags) {
+    uint64_t row;
+
+    // index the rows already in the table, as if they were just added
+    if (!(flags & (K_TYPE_INDEX | K_TYPE_ORDERED)))
+        return KDB_OK;
+    if ((flags & K_TYPE_INDEX) && (kdb_index_init(&col->index) || kdb_index_reserve(&col->index, table->n_live)))
+        return KDB_ERR_MEMORY;
+    if ((flags & K_TYPE_ORDERED) && kdb_tree_init(&col->tree))
+        return KDB_ERR_MEMORY;
+    for (row = 0; row < table->n_rows; row++) {
+        if (!(table->live[row / 64] & (1ULL << (row % 64))))
+            continue;
+        if (col->index.slots)
+            kdb_index_put(&col->index, kdb_row_key(table, col, row), row);
+        if (col->tree.root && kdb_tree_put(&col->tree, kdb_row_rank(table, col, row), row))
+            return KDB_ERR_MEMORY;
+    }
+    return KDB_OK;
+}
+
+int kdb_value_cast(const kdb_column_t *col, const kproto_value_t *value, kproto_value_t *out) {
+    const int from_unsigned = value->flags & K_TYPE_UNSIGNED;
+    out->type = col->type;
+    out->flags = col->flags;
+
+    // strings only ever match strings and have to fit
+    if (col->type == K_TYPE_STRING || value->type == K_TYPE_STRING) {
+        if (col->type != value->type)
+            return KDB_ERR_TYPE;
+        if (col->maxsize && value->s.len > col->maxsize)
+            return KDB_ERR_VALUE;
+        out->s = value->s;
+        return KDB_OK;
+    }
+
+    // floating point columns take any number
+    if (kdb_is_float(col->type)) {
+        if (kdb_is_float(value->type))
+            out->d = value->d;
+        else
+            out->d = from_unsigned ? (double)value->u : (double)value->i;
+        return KDB_OK;
+    }
+    if (!kdb_is_integer(value->type))
+        return KDB_ERR_TYPE;
+    if (col->type == K_TYPE_BOOL) {
+        out->u = value->u != 0;
+        return KDB_OK;
+    }
+
+    // integers have to be representable in the column width and sign
+    const unsigned bits = col->width * 8;
+    if (col->flags & K_TYPE_UNSIGNED) {
+        if (!from_unsigned && value->type != K_TYPE_BOOL && value->i < 0)
+            return KDB_ERR_VALUE;
+        if (bits < 64 && value->u >> bits)
+            return KDB_ERR_VALUE;
+    } else {
+        if (from_unsigned && value->u > (uint64_t)INT64_MAX)
+            return KDB_ERR_VALUE;
+        if (bits < 64 && (value->i < -(1LL << (bits - 1)) || value->i >= (1LL << (bits - 1))))
+            return KDB_ERR_VALUE;
+    }
+    out->u = value->u;
+    return KDB_OK;
+}
+
+int kdb_table_add(kdb_t *table, kproto_reader_t *rows, const uint32_t n_rows) {
+    int err;
+    uint8_t i, j;
+    uint32_t r, k;
+    size_t min_row = 0;
+    kproto_value_t values[256];
+    const uint64_t first = table->n_rows;
+
+    // every row takes at least this many bytes, reject counts the body
+    // cannot hold before reserving space for them
+    for (i = 0; i < table->n_cols; i++)
+        min_row += table->cols[i].type == K_TYPE_STRING ? 4 : table->cols[i].width;
+    if (n_rows > rows->len / min_row)
+        return KDB_ERR_VALUE;
+    if ((err = kdb_table_reserve(table, table->n_rows + n_rows)))
+        return err;
+    for (i = 0; i < table->n_cols; i++)
+        if (table->cols[i].index.slots && kdb_index_reserve(&table->cols[i].index, table->cols[i].index.used + n_rows))
+            return KDB_ERR_MEMORY;
+
+    // decode a whole row before storing it so a bad value leaves no half row
+    for (r = 0; r < n_rows; r++) {
+        for (i = 0; i < table->n_cols; i++) {
+            kdb_column_t *col = &table->cols[i];
+            if (kproto_value(rows, col->type | (col->flags << 3), &values[i])) {
+                err = KDB_ERR_VALUE;
+                goto rollback;
+            }
+            if (col->maxsize && col->type == K_TYPE_STRING && values[i].s.len > col->maxsize) {
+                err = KDB_ERR_VALUE;
+                goto rollback;
+            }
+        }
+        for (i = 0; i < table->n_cols; i++)
+            if ((err = kdb_column_put(&table->cols[i], table->n_rows, &values[i])))
+                goto rollback;
+        table->live[table->n_rows / 64] |= 1ULL << (table->n_rows % 64);
+        table->n_rows++;
+        table->n_live++;
+    }
+
+    // the whole body has to be rows
+    if (rows->pos != rows->len) {
+        err = KDB_ERR_VALUE;
+        goto rollback;
+    }
+
+    // index rows once every value is in, tree inserts can still run out
+    // of memory so they go first and are undone on failure
+    for (i = 0; i < table->n_cols; i++) {
+        kdb_column_t *col = &table->cols[i];
+        if (col->tree.root == NULL)
+            continue;
+        for (r = 0; r < n_rows; r++) {
+            if (kdb_tree_put(&col->tree, kdb_row_rank(table, col, first + r), first + r)) {
+                err = KDB_ERR_MEMORY;
+                goto unorder;
+            }
+        }
+    }
+    for (i = 0; i < table->n_cols; i++) {
+        kdb_column_t *col = &table->cols[i];
+        if (col->index.slots == NULL)
+            continue;
+        for (r = 0; r < n_rows; r++)
+            kdb_index_put(&col->index, kdb_row_key(table, col, first + r), first + r);
+    }
+    return KDB_OK;
+
+    // take back the tree entries made so far, column i got as far as row r
+    unorder:
+        for (j = 0; j <= i; j++) {
+            kdb_column_t *col = &table->cols[j];
+            if (col->tree.root == NULL)
+                continue;
+            for (k = 0; k < (j == i ? r : n_rows); k++)
+                kdb_tree_remove(&col->tree, kdb_row_rank(table, col, first + k), first + k);
+        }
+
+    // drop the rows of this command, string arenas end where its first row began
+    rollback:
+        for (i = 0; i < table->n_cols; i++)
+            if (table->cols[i].type == K_TYPE_STRING && table->n_rows > first)
+                table->cols[i].arena_len = ((uint64_t*)table->cols[i].data)[first];
+        while (table->n_rows > first) {
+            table->n_rows--;
+            table->n_live--;
+            table->live[table->n_rows / 64] &= ~(1ULL << (table->n_rows % 64));
+        }
+        return err;
+}
+
+int kdb_table_set(kdb_t *table, kdb_column_t *col, const uint64_t row, const kproto_value_t *value) {
+    int err;
+    if (col->index.slots == NULL && col->tree.root == NULL)
+        return kdb_column_put(col, row, value);
+
+    // take whatever the indexes need first so the row can always be put
+    // back under a key, trees only hold numbers which cant fail to store
+    if (col->index.slots && kdb_index_reserve(&col->index, col->index.used + 1))
+        return KDB_ERR_MEMORY;
+    if (col->tree.root) {
+        if (kdb_tree_put(&col->tree, kdb_tree_key(value), row))
+            return KDB_ERR_MEMORY;
+        kdb_tree_remove(&col->tree, kdb_row_rank(table, col, row), row);
+    }
+    if (col->index.slots)
+        kdb_index_remove(&col->index, kdb_row_key(table, col, row), row);
+    err = kdb_column_put(col, row, value);
+    if (col->index.slots)
+        kdb_index_put(&col->index, kdb_row_key(table, col, row), row);
+    return err;
+}
+
+int kdb_table_del(kdb_t *table, const uint64_t row) {
+    const uint64_t bit = 1ULL << (row % 64);
+    if (!(table->live[row / 64] & bit))
+        return KDB_OK;
+
+    // readers of a table keeping versions may still see the row and find
+    // it through the indexes, it leaves them once they are out
+    if (table->versions.touched != NULL && kdb_version_gone(table, row))
+        return KDB_ERR_MEMORY;
+    table->live[row / 64] &= ~bit;
+    table->n_live--;
+    if (table->versions.touched == NULL)
+        kdb_table_unindex(table, row);
+    return KDB_OK;
+}
+
+int kdb_table_grows(const kdb_column_t *col, const kproto_value_t *value) {
+    return col->type == K_TYPE_STRING && col->arena_len + value->s.len > col->arena_max;
+}
+
+void kdb_table_unindex(kdb_t *table, const uint64_t row) {
+    uint8_t i;
+    for (i = 0; i < table->n_cols; i++) {
+        if (table->cols[i].index.slots)
+            kdb_index_remove(&table->cols[i].index, kdb_row_key(table, &table->cols[i], row), row);
+        if (table->cols[i].tree.root)
+            kdb_tree_remove(&table->cols[i].tree, kdb_row_rank(table, &table->cols[i], row), row);
+    }
+}
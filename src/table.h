@@ -0,0 +1,74 @@
+#ifndef K_TABLE_H
+#define K_TABLE_H
+
+#include "db.h"
+#include "proto.h"
+
+// column arrays are aligned for vector loads and grow in whole blocks,
+// a block is the set of rows covered by one word of the live bitmap
+#define KDB_ALIGN 64
+#define KDB_BLOCK 64
+#define KDB_MIN_ROWS 1024
+
+// shards a table can split into, a writer locking them keeps a bit each
+#define KDB_MAX_SHARDS 64
+
+// column arrays mapped from a snapshot, they are copied out instead of
+// freed when they grow
+#define KDB_MAPPED_DATA 1
+#define KDB_MAPPED_LENS 2
+#define KDB_MAPPED_ARENA 4
+
+// command status codes sent back with every result
+#define KDB_OK 0
+#define KDB_ERR_TABLE 1  // unknown table
+#define KDB_ERR_EXISTS 2 // table already exists
+#define KDB_ERR_COLUMN 3 // unknown or duplicate column
+#define KDB_ERR_TYPE 4   // value type does not fit the column
+#define KDB_ERR_VALUE 5  // malformed, out of range or oversized value
+#define KDB_ERR_MEMORY 6 // out of memory
+#define KDB_ERR_STMT 7   // statement dropped from the cache, prepare it again
+#define KDB_ERR_SHARD 8  // SET on the shard key, the row would change shard
+
+// where a string cell points in the arena. a reader racing a SET can pair
+// the offset of one string with the length of another, the pair is kept
+// inside the arena and the read thrown away once the row shows it changed
+static inline const char* kdb_table_str(const kdb_column_t *col, const uint64_t row, uint32_t *len) {
+    uint64_t at = ((uint64_t*)col->data)[row];
+    uint32_t size = col->lens[row];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    const size_t end = __atomic_load_n(&col->arena_len, __ATOMIC_RELAXED);
+    if (at > end || size > end - at)
+        at = size = 0;
+    *len = size;
+    return col->arena + at;
+}
+
+static inline int kdb_is_integer(const uint8_t type) {
+    return type <= K_TYPE_LONG || type == K_TYPE_BOOL;
+}
+
+static inline int kdb_is_float(const uint8_t type) {
+    return type == K_TYPE_FLOAT || type == K_TYPE_DOUBLE;
+}
+
+// the table holding the rows of a shard of a sharded table
+static inline kdb_t* kdb_table_shard(const kdb_t *table, const size_t shard) {
+    return &((kdb_t*)table->shards)[shard];
+}
+
+int kdb_table_name(kdb_catalog_t *catalog, const kproto_str_t *name, const char **out, uint32_t *sym);
+int kdb_table_init(kdb_t *table, kdb_catalog_t *catalog, const kproto_cmd_t *cmd);
+void kdb_table_free(kdb_t *table);
+int kdb_table_reserve(kdb_t *table, const uint64_t rows);
+int kdb_table_index(kdb_t *table, kdb_column_t *col, const uint8_t flags);
+int kdb_table_add(kdb_t *table, kproto_reader_t *rows, const uint32_t n_rows);
+int kdb_table_set(kdb_t *table, kdb_column_t *col, const uint64_t row, const kproto_value_t *value);
+int kdb_table_del(kdb_t *table, const uint64_t row);
+void kdb_table_unindex(kdb_t *table, const uint64_t row);
+int kdb_table_grows(const kdb_column_t *col, const kproto_value_t *value);
+void kdb_table_get(const kdb_t *table, const kdb_column_t *col, const uint64_t row, kproto_value_t *value);
+
+int kdb_value_cast(const kdb_column_t *col, const kproto_value_t *value, kproto_value_t *out);
+
+#endif // K_TABLE_H
@@ -0,0 +1,191 @@
+#include "team.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// a run of indices a thread takes from the front of, the next one in the
+// low half and the end in the high half so the owner and a thief taking
+// from the back settle it with a single compare and swap
+typedef struct {
+    uint64_t run __attribute__((aligned(64)));
+} kdb_deque_t;
+
+#define KDB_RUN(next, end) ((uint64_t)(end) << 32 | (uint64_t)(next))
+
+// a range as the threads working on it see it. each thread starts on a
+// run of its own, the range itself goes with the last thread to let go
+// so helpers that get to it late find it empty
+typedef struct {
+    kdb_range_cb_t run;
+    void *arg;
+    size_t n_deques;
+    size_t joined; // helpers that came to it, numbering them
+    size_t left;   // indices yet to finish
+    size_t refs;   // threads that may still look at the range
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    kdb_deque_t deques[];
+} kdb_batch_t;
+
+// a batch of tasks handed out by their place in it
+typedef struct {
+    kdb_task_cb_t run;
+    char *tasks;
+    size_t size;
+} kdb_tasks_t;
+
+static int kdb_deque_take(kdb_deque_t *deque, size_t *i) {
+    uint64_t next, end, run = __atomic_load_n(&deque->run, __ATOMIC_ACQUIRE);
+    do {
+        next = run & UINT32_MAX;
+        end = run >> 32;
+        if (next >= end)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&deque->run, &run, KDB_RUN(next + 1, end), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    *i = next;
+    return 1;
+}
+
+static int kdb_deque_steal(kdb_deque_t *from, kdb_deque_t *to) {
+    uint64_t next, end, half, run = __atomic_load_n(&from->run, __ATOMIC_ACQUIRE);
+
+    // the back half goes to the thief, which owns an empty run nobody
+    // else can take from until it is stored
+    do {
+        next = run & UINT32_MAX;
+        end = run >> 32;
+        if (next >= end)
+            return 0;
+        half = (end - next + 1) / 2;
+    } while (!__atomic_compare_exchange_n(&from->run, &run, KDB_RUN(next, end - half), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    __atomic_store_n(&to->run, KDB_RUN(end - half, end), __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void kdb_batch_drop(kdb_batch_t *batch) {
+    if (__atomic_sub_fetch(&batch->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->done);
+    free(batch);
+}
+
+static void kdb_batch_work(kdb_batch_t *batch, const size_t worker) {
+    size_t i, k, done = 0;
+    kdb_deque_t *own = &batch->deques[worker];
+
+    // a thread works through its own run in order, once it is out it
+    // takes half of what the next thread along has left
+    for (;;) {
+        while (kdb_deque_take(own, &i)) {
+            batch->run(batch->arg, worker, i);
+            done++;
+        }
+        for (k = 1; k < batch->n_deques && !kdb_deque_steal(&batch->deques[(worker + k) % batch->n_deques], own); k++);
+        if (k == batch->n_deques)
+            break;
+    }
+
+    // the thread finishing the last index wakes the one waiting on them
+    if (done && __atomic_sub_fetch(&batch->left, done, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&batch->lock);
+        pthread_cond_signal(&batch->done);
+        pthread_mutex_unlock(&batch->lock);
+    }
+}
+
+static void kdb_team_job(void *exec, void *job) {
+    kdb_batch_t *batch = (kdb_batch_t*)job;
+    if (batch == NULL)
+        return;
+    kdb_batch_work(batch, __atomic_add_fetch(&batch->joined, 1, __ATOMIC_RELAXED));
+    kdb_batch_drop(batch);
+}
+
+static void kdb_team_left(void *exec, void *job) {
+    // every index of it ran before its thread returned
+    kdb_batch_drop((kdb_batch_t*)job);
+}
+
+int kdb_team_start(kdb_team_t *team, const size_t threads) {
+    size_t i;
+    team->n_execs = 0;
+    team->next = 0;
+    if ((team->execs = calloc(threads, sizeof(kdb_exec_t))) == NULL) {
+        fprintf(stderr, "[KDB] Not enough memory for scan threads\n");
+        return -1;
+    }
+    for (i = 0; i < threads; i++) {
+        if (kdb_exec_start(&team->execs[i], i, kdb_team_job, team)) {
+            kdb_team_stop(team);
+            return -1;
+        }
+        team->n_execs++;
+    }
+    return 0;
+}
+
+void kdb_team_stop(kdb_team_t *team) {
+    size_t i;
+    for (i = 0; i < team->n_execs; i++)
+        kdb_exec_stop(&team->execs[i]);
+    for (i = 0; i < team->n_execs; i++)
+        kdb_exec_join(&team->execs[i], kdb_team_left);
+    free(team->execs);
+    team->execs = NULL;
+    team->n_execs = 0;
+}
+
+size_t kdb_team_size(const kdb_team_t *team) {
+    // the thread handing a range over counts as one
+    return team != NULL ? team->n_execs + 1 : 1;
+}
+
+void kdb_team_range(kdb_team_t *team, kdb_range_cb_t run, void *arg, const size_t n) {
+    size_t i, size, helpers = 0;
+    kdb_batch_t *batch = NULL;
+
+    // a single index, or no team to share with, runs right here
+    if (team != NULL && n > 1 && n <= UINT32_MAX)
+        helpers = n - 1 < team->n_execs ? n - 1 : team->n_execs;
+    size = (sizeof(kdb_batch_t) + (helpers + 1) * sizeof(kdb_deque_t) + 63) & ~(size_t)63;
+    if (helpers == 0 || (batch = aligned_alloc(64, size)) == NULL) {
+        for (i = 0; i < n; i++)
+            run(arg, 0, i);
+        return;
+    }
+    batch->run = run;
+    batch->arg = arg;
+    batch->n_deques = helpers + 1;
+    batch->joined = 0;
+    batch->left = n;
+    batch->refs = helpers + 1;
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->done, NULL);
+    for (i = 0; i < batch->n_deques; i++)
+        batch->deques[i].run = KDB_RUN(i * n / batch->n_deques, (i + 1) * n / batch->n_deques);
+
+    // ranges start on different threads so two at once dont both wait
+    // on the same one, a full ring just means one hand less
+    const size_t first = __atomic_fetch_add(&team->next, helpers, __ATOMIC_RELAXED);
+    for (i = 0; i < helpers; i++)
+        if (kdb_exec_push(&team->execs[(first + i) % team->n_execs], batch))
+            kdb_batch_drop(batch);
+    kdb_batch_work(batch, 0);
+
+    pthread_mutex_lock(&batch->lock);
+    while (__atomic_load_n(&batch->left, __ATOMIC_ACQUIRE) > 0)
+        pthread_cond_wait(&batch->done, &batch->lock);
+    pthread_mutex_unlock(&batch->lock);
+    kdb_batch_drop(batch);
+}
+
+static void kdb_team_task(void *arg, const size_t worker, const size_t i) {
+    kdb_tasks_t *tasks = (kdb_tasks_t*)arg;
+    tasks->run(tasks->tasks + i * tasks->size);
+}
+
+void kdb_team_run(kdb_team_t *team, kdb_task_cb_t run, void *tasks, const size_t size, const size_t n) {
+    kdb_tasks_t batch = { run, (char*)tasks, size };
+    kdb_team_range(team, kdb_team_task, &batch, n);
+}
@@ -0,0 +1,27 @@
+#ifndef K_TEAM_H
+#define K_TEAM_H
+
+#include "exec.h"
+
+// runs one task of a batch
+typedef void (*kdb_task_cb_t)(void *task);
+
+// runs index i of a range on the thread numbered worker, the thread
+// handing the range over is 0 and helpers count up from 1
+typedef void (*kdb_range_cb_t)(void *arg, const size_t worker, const size_t i);
+
+// threads lending a hand with batches of tasks, the thread handing a
+// batch over works on it as well and returns once every task ran
+typedef struct {
+    kdb_exec_t *execs;
+    size_t n_execs;
+    size_t next; // first thread the next batch goes to
+} kdb_team_t;
+
+int kdb_team_start(kdb_team_t *team, const size_t threads);
+void kdb_team_stop(kdb_team_t *team);
+size_t kdb_team_size(const kdb_team_t *team);
+void kdb_team_run(kdb_team_t *team, kdb_task_cb_t run, void *tasks, const size_t size, const size_t n);
+void kdb_team_range(kdb_team_t *team, kdb_range_cb_t run, void *arg, const size_t n);
+
+#endif // K_TEAM_H
@@ -0,0 +1,202 @@
+#include "timer.h"
+
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+#define KTIMER_DUE -1
+
+uint64_t ktimer_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + ((uint64_t)ts.tv_nsec / 1000000);
+}
+
+void ktimer_init(ktimer_wheel_t *wheel, const uint64_t now) {
+    memset(wheel, 0, sizeof(ktimer_wheel_t));
+    wheel->now = now;
+}
+
+static inline void ktimer_link(ktimer_t **head, ktimer_t *timer) {
+    timer->next = *head;
+    timer->prev = (void**)head;
+    if (*head != NULL)
+        (*head)->prev = &timer->next;
+    *head = timer;
+}
+
+static inline void ktimer_unlink(ktimer_t *timer) {
+    *timer->prev = timer->next;
+    if (timer->next != NULL)
+        ((ktimer_t*)timer->next)->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+static void ktimer_place(ktimer_wheel_t *wheel, ktimer_t *timer) {
+    int level = 0;
+    uint64_t expires, delta;
+
+    // already expired, queue it to be popped on the next expire
+    if (timer->expires <= wheel->now) {
+        timer->slot = KTIMER_DUE;
+        ktimer_link(&wheel->due, timer);
+        return;
+    }
+
+    // clamp timers too far out, they get re-placed when cascaded
+    delta = timer->expires - wheel->now;
+    if (delta >= KTIMER_MAX_SPAN)
+        delta = KTIMER_MAX_SPAN - 1;
+    expires = wheel->now + delta;
+
+    // find the lowest level whose span covers the delay
+    while (level < KTIMER_LEVELS - 1 && delta >= (1ULL << ((level + 1) * KTIMER_SLOT_BITS)))
+        level++;
+
+    // link into the slot and mark it as occupied
+    const int idx = (expires >> (level * KTIMER_SLOT_BITS)) & KTIMER_SLOT_MASK;
+    timer->slot = (level << KTIMER_SLOT_BITS) | idx;
+    ktimer_link(&wheel->slots[level][idx], timer);
+    wheel->bitmap[level] |= 1ULL << idx;
+    wheel->count++;
+}
+
+void ktimer_add(ktimer_wheel_t *wheel, ktimer_t *timer) {
+    if (wheel == NULL || timer == NULL) return;
+    ktimer_place(wheel, timer);
+}
+
+void ktimer_del(ktimer_wheel_t *wheel, ktimer_t *timer) {
+    if (wheel == NULL || timer == NULL || timer->prev == NULL) return;
+    const int slot = timer->slot;
+    ktimer_unlink(timer);
+
+    // timers in the due list dont occupy any wheel slot
+    if (slot == KTIMER_DUE)
+        return;
+
+    // clear slot bit if it became empty
+    const int level = slot >> KTIMER_SLOT_BITS;
+    const int idx = slot & KTIMER_SLOT_MASK;
+    if (wheel->slots[level][idx] == NULL)
+        wheel->bitmap[level] &= ~(1ULL << idx);
+    wheel->count--;
+}
+
+ktimer_t* ktimer_pop(ktimer_wheel_t *wheel) {
+    ktimer_t *timer = wheel->due;
+    if (timer != NULL)
+        ktimer_unlink(timer);
+    return timer;
+}
+
+ktimer_t* ktimer_drain(ktimer_wheel_t *wheel) {
+    int level;
+    ktimer_t *timer;
+
+    // unlink any timer still held by the wheel, used for freeing
+    if ((timer = ktimer_pop(wheel)) != NULL)
+        return timer;
+    for (level = 0; level < KTIMER_LEVELS; level++) {
+        if (wheel->bitmap[level] == 0)
+            continue;
+        timer = wheel->slots[level][__builtin_ctzll(wheel->bitmap[level])];
+        ktimer_del(wheel, timer);
+        return timer;
+    }
+    return NULL;
+}
+
+static void ktimer_cascade(ktimer_wheel_t *wheel, const int level, const int idx) {
+    ktimer_t *timer, *list = wheel->slots[level][idx];
+
+    // detach the whole slot and re-place every timer relative to now
+    wheel->slots[level][idx] = NULL;
+    wheel->bitmap[level] &= ~(1ULL << idx);
+    while ((timer = list) != NULL) {
+        list = (ktimer_t*)timer->next;
+        timer->next = NULL;
+        timer->prev = NULL;
+        wheel->count--;
+        ktimer_place(wheel, timer);
+    }
+}
+
+static inline uint64_t ktimer_range(const int from, const int to) {
+    return (~0ULL << from) & (~0ULL >> (KTIMER_SLOT_MASK - to));
+}
+
+void ktimer_expire(ktimer_wheel_t *wheel, const uint64_t now) {
+    int level, idx;
+    uint64_t next, last, bits;
+
+    while (wheel->now < now) {
+
+        // nothing on the wheel, jump straight to the target time
+        if (wheel->count == 0) {
+            wheel->now = now;
+            break;
+        }
+
+        // skip over empty level 0 slots up to the end of the current block
+        next = wheel->now + 1;
+        if (next & KTIMER_SLOT_MASK) {
+            last = wheel->now | KTIMER_SLOT_MASK;
+            if (last > now)
+                last = now;
+            bits = wheel->bitmap[0] & ktimer_range(next & KTIMER_SLOT_MASK, last & KTIMER_SLOT_MASK);
+            if (bits == 0) {
+                wheel->now = last;
+                continue;
+            }
+            next = (wheel->now & ~(uint64_t)KTIMER_SLOT_MASK) | __builtin_ctzll(bits);
+        }
+        wheel->now = next;
+
+        // entering a new block, cascade higher levels down (outermost first)
+        if ((next & KTIMER_SLOT_MASK) == 0) {
+            for (level = 1; level < KTIMER_LEVELS - 1; level++)
+                if ((next >> (level * KTIMER_SLOT_BITS)) & KTIMER_SLOT_MASK)
+                    break;
+            for (; level > 0; level--) {
+                idx = (next >> (level * KTIMER_SLOT_BITS)) & KTIMER_SLOT_MASK;
+                if (wheel->bitmap[level] & (1ULL << idx))
+                    ktimer_cascade(wheel, level, idx);
+            }
+        }
+
+        // every level 0 timer in the current slot expires now
+        idx = next & KTIMER_SLOT_MASK;
+        if (wheel->bitmap[0] & (1ULL << idx))
+            ktimer_cascade(wheel, 0, idx);
+    }
+}
+
+int ktimer_timeout(ktimer_wheel_t *wheel) {
+    int level, shift, from;
+    uint64_t cur, bits, delay, wait = UINT64_MAX;
+
+    // run expired timers immediately, block forever when there are none
+    if (wheel->due != NULL)
+        return 0;
+    if (wheel->count == 0)
+        return -1;
+
+    // find the closest occupied slot on each level, a level 0 slot expires
+    // its timers while higher level slots only cascade at their block start
+    for (level = 0; level < KTIMER_LEVELS; level++) {
+        if (wheel->bitmap[level] == 0)
+            continue;
+        shift = level * KTIMER_SLOT_BITS;
+        cur = wheel->now >> shift;
+        from = (cur + 1) & KTIMER_SLOT_MASK;
+        bits = wheel->bitmap[level];
+        bits = (bits >> from) | (from ? bits << (KTIMER_SLOTS - from) : 0);
+        delay = ((cur + 1 + __builtin_ctzll(bits)) << shift) - wheel->now;
+        if (delay < wait)
+            wait = delay;
+    }
+
+    return wait > INT_MAX ? INT_MAX : (int)wait;
+}
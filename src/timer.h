@@ -0,0 +1,43 @@
+#ifndef K_TIMER_H
+#define K_TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// hierarchical wheel layout: 4 levels of 64 slots at 1ms resolution
+// covers 64^4 ms (~4.6 hours), anything further out is re-cascaded
+#define KTIMER_LEVELS 4
+#define KTIMER_SLOT_BITS 6
+#define KTIMER_SLOTS (1 << KTIMER_SLOT_BITS)
+#define KTIMER_SLOT_MASK (KTIMER_SLOTS - 1)
+#define KTIMER_MAX_SPAN (1ULL << (KTIMER_LEVELS * KTIMER_SLOT_BITS))
+
+typedef void (*ktimer_cb_t)(void *data);
+
+typedef struct {
+    void *data;
+    void *next;
+    void **prev;
+    int slot;
+    uint64_t expires;
+    ktimer_cb_t callback;
+} ktimer_t;
+
+typedef struct {
+    uint64_t now;
+    size_t count;
+    ktimer_t *due;
+    uint64_t bitmap[KTIMER_LEVELS];
+    ktimer_t *slots[KTIMER_LEVELS][KTIMER_SLOTS];
+} ktimer_wheel_t;
+
+uint64_t ktimer_clock();
+void ktimer_init(ktimer_wheel_t *wheel, const uint64_t now);
+void ktimer_add(ktimer_wheel_t *wheel, ktimer_t *timer);
+void ktimer_del(ktimer_wheel_t *wheel, ktimer_t *timer);
+int ktimer_timeout(ktimer_wheel_t *wheel);
+ktimer_t* ktimer_pop(ktimer_wheel_t *wheel);
+ktimer_t* ktimer_drain(ktimer_wheel_t *wheel);
+void ktimer_expire(ktimer_wheel_t *wheel, const uint64_t now);
+
+#endif // K_TIMER_H
@@ -0,0 +1,244 @@
+#include "tree.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void* kdb_tree_node(const size_t size) {
+    // nodes start on a cache line and take up whole ones
+    const size_t lines = (size + 63) & ~(size_t)63;
+    void *node = aligned_alloc(64, lines);
+    if (node != NULL)
+        memset(node, 0, lines);
+    return node;
+}
+
+static inline int kdb_tree_less(const uint64_t ak, const uint64_t ar, const uint64_t bk, const uint64_t br) {
+    return ak < bk || (ak == bk && ar < br);
+}
+
+static uint32_t kdb_leaf_lower(const kdb_leaf_t *leaf, const uint64_t key, const uint64_t row) {
+    // first entry not below (key, row)
+    uint32_t mid, lo = 0, hi = leaf->n;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (kdb_tree_less(leaf->keys[mid], leaf->rows[mid], key, row))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static uint32_t kdb_inner_child(const kdb_inner_t *inner, const uint64_t key, const uint64_t row) {
+    // entries equal to a separator live right of it
+    uint32_t mid, lo = 0, hi = inner->n;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (!kdb_tree_less(key, row, inner->keys[mid], inner->rows[mid]))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static kdb_leaf_t* kdb_tree_leaf(const kdb_tree_t *tree, const uint64_t key, const uint64_t row) {
+    uint32_t level;
+    void *node = tree->root;
+    for (level = tree->height; level > 0; level--)
+        node = ((kdb_inner_t*)node)->children[kdb_inner_child(node, key, row)];
+    return node;
+}
+
+int kdb_tree_init(kdb_tree_t *tree) {
+    tree->height = 0;
+    tree->size = 0;
+    return (tree->root = kdb_tree_node(sizeof(kdb_leaf_t))) == NULL ? -1 : 0;
+}
+
+static void kdb_tree_drop(void *node, const uint32_t height) {
+    uint32_t i;
+    kdb_inner_t *inner = (kdb_inner_t*)node;
+    if (height > 0)
+        for (i = 0; i <= inner->n; i++)
+            kdb_tree_drop(inner->children[i], height - 1);
+    free(node);
+}
+
+void kdb_tree_free(kdb_tree_t *tree) {
+    if (tree->root != NULL)
+        kdb_tree_drop(tree->root, tree->height);
+    memset(tree, 0, sizeof(kdb_tree_t));
+}
+
+int kdb_tree_put(kdb_tree_t *tree, const uint64_t key, const uint64_t row) {
+    void *child;
+    kdb_leaf_t *leaf, *right;
+    uint32_t level, pos, i, need, half;
+    uint64_t up_key, up_row;
+    kdb_inner_t *path[KDB_TREE_DEPTH + 1];
+    uint32_t slots[KDB_TREE_DEPTH + 1];
+    void *spare[KDB_TREE_DEPTH + 2];
+    uint64_t keys[KDB_TREE_INNER + 1 > KDB_TREE_LEAF + 1 ? KDB_TREE_INNER + 1 : KDB_TREE_LEAF + 1];
+    uint64_t rows[sizeof(keys) / sizeof(uint64_t)];
+    void *children[KDB_TREE_INNER + 2];
+
+    // walk down remembering the way back up
+    child = tree->root;
+    for (level = tree->height; level > 0; level--) {
+        path[level] = child;
+        slots[level] = kdb_inner_child(path[level], key, row);
+        child = path[level]->children[slots[level]];
+    }
+    leaf = child;
+    pos = kdb_leaf_lower(leaf, key, row);
+    tree->size++;
+    if (leaf->n < KDB_TREE_LEAF) {
+        memmove(leaf->keys + pos + 1, leaf->keys + pos, (leaf->n - pos) * sizeof(uint64_t));
+        memmove(leaf->rows + pos + 1, leaf->rows + pos, (leaf->n - pos) * sizeof(uint64_t));
+        leaf->keys[pos] = key;
+        leaf->rows[pos] = row;
+        leaf->n++;
+        return 0;
+    }
+
+    // take every node the split needs up front so running out of memory
+    // leaves the tree untouched
+    need = 1;
+    for (level = 1; level <= tree->height && path[level]->n == KDB_TREE_INNER; level++)
+        need++;
+    if (level > tree->height && tree->height == KDB_TREE_DEPTH) {
+        tree->size--;
+        return -1;
+    }
+    need += level > tree->height;
+    for (i = 0; i < need; i++) {
+        if ((spare[i] = kdb_tree_node(i ? sizeof(kdb_inner_t) : sizeof(kdb_leaf_t))) == NULL) {
+            while (i--)
+                free(spare[i]);
+            tree->size--;
+            return -1;
+        }
+    }
+
+    // split the full leaf in half with the new entry in place
+    memcpy(keys, leaf->keys, pos * sizeof(uint64_t));
+    memcpy(rows, leaf->rows, pos * sizeof(uint64_t));
+    keys[pos] = key;
+    rows[pos] = row;
+    memcpy(keys + pos + 1, leaf->keys + pos, (KDB_TREE_LEAF - pos) * sizeof(uint64_t));
+    memcpy(rows + pos + 1, leaf->rows + pos, (KDB_TREE_LEAF - pos) * sizeof(uint64_t));
+    half = (KDB_TREE_LEAF + 1) / 2;
+    right = spare[0];
+    leaf->n = half;
+    memcpy(leaf->keys, keys, half * sizeof(uint64_t));
+    memcpy(leaf->rows, rows, half * sizeof(uint64_t));
+    right->n = KDB_TREE_LEAF + 1 - half;
+    memcpy(right->keys, keys + half, right->n * sizeof(uint64_t));
+    memcpy(right->rows, rows + half, right->n * sizeof(uint64_t));
+    right->next = leaf->next;
+    leaf->next = right;
+
+    // push the first entry of the new node up until a parent has room
+    up_key = right->keys[0];
+    up_row = right->rows[0];
+    child = right;
+    for (level = 1, i = 1; level <= tree->height; level++) {
+        kdb_inner_t *inner = path[level], *sibling;
+        pos = slots[level];
+        if (inner->n < KDB_TREE_INNER) {
+            memmove(inner->keys + pos + 1, inner->keys + pos, (inner->n - pos) * sizeof(uint64_t));
+            memmove(inner->rows + pos + 1, inner->rows + pos, (inner->n - pos) * sizeof(uint64_t));
+            memmove(inner->children + pos + 2, inner->children + pos + 1, (inner->n - pos) * sizeof(void*));
+            inner->keys[pos] = up_key;
+            inner->rows[pos] = up_row;
+            inner->children[pos + 1] = child;
+            inner->n++;
+            return 0;
+        }
+
+        // full parent, the middle separator moves up a level
+        memcpy(keys, inner->keys, pos * sizeof(uint64_t));
+        memcpy(rows, inner->rows, pos * sizeof(uint64_t));
+        memcpy(children, inner->children, (pos + 1) * sizeof(void*));
+        keys[pos] = up_key;
+        rows[pos] = up_row;
+        children[pos + 1] = child;
+        memcpy(keys + pos + 1, inner->keys + pos, (KDB_TREE_INNER - pos) * sizeof(uint64_t));
+        memcpy(rows + pos + 1, inner->rows + pos, (KDB_TREE_INNER - pos) * sizeof(uint64_t));
+        memcpy(children + pos + 2, inner->children + pos + 1, (KDB_TREE_INNER - pos) * sizeof(void*));
+        half = (KDB_TREE_INNER + 1) / 2;
+        sibling = spare[i++];
+        inner->n = half;
+        memcpy(inner->keys, keys, half * sizeof(uint64_t));
+        memcpy(inner->rows, rows, half * sizeof(uint64_t));
+        memcpy(inner->children, children, (half + 1) * sizeof(void*));
+        sibling->n = KDB_TREE_INNER - half;
+        memcpy(sibling->keys, keys + half + 1, sibling->n * sizeof(uint64_t));
+        memcpy(sibling->rows, rows + half + 1, sibling->n * sizeof(uint64_t));
+        memcpy(sibling->children, children + half + 1, (sibling->n + 1) * sizeof(void*));
+        up_key = keys[half];
+        up_row = rows[half];
+        child = sibling;
+    }
+
+    // the root split too, grow a level
+    kdb_inner_t *root = spare[i];
+    root->n = 1;
+    root->keys[0] = up_key;
+    root->rows[0] = up_row;
+    root->children[0] = tree->root;
+    root->children[1] = child;
+    tree->root = root;
+    tree->height++;
+    return 0;
+}
+
+void kdb_tree_remove(kdb_tree_t *tree, const uint64_t key, const uint64_t row) {
+    kdb_leaf_t *leaf = kdb_tree_leaf(tree, key, row);
+    const uint32_t pos = kdb_leaf_lower(leaf, key, row);
+
+    // nodes are never merged, separators stay valid bounds and emptied
+    // leaves are skipped by cursors and refilled by later inserts
+    if (pos == leaf->n || leaf->keys[pos] != key || leaf->rows[pos] != row)
+        return;
+    memmove(leaf->keys + pos, leaf->keys + pos + 1, (leaf->n - pos - 1) * sizeof(uint64_t));
+    memmove(leaf->rows + pos, leaf->rows + pos + 1, (leaf->n - pos - 1) * sizeof(uint64_t));
+    leaf->n--;
+    tree->size--;
+}
+
+void kdb_tree_seek(const kdb_tree_t *tree, const uint64_t key, kdb_cursor_t *cursor) {
+    cursor->leaf = kdb_tree_leaf(tree, key, 0);
+    cursor->pos = kdb_leaf_lower(cursor->leaf, key, 0);
+}
+
+int kdb_tree_next(kdb_cursor_t *cursor, uint64_t *key, uint64_t *row) {
+    while (cursor->leaf != NULL && cursor->pos >= cursor->leaf->n) {
+        cursor->leaf = cursor->leaf->next;
+        cursor->pos = 0;
+    }
+    if (cursor->leaf == NULL)
+        return 0;
+    *key = cursor->leaf->keys[cursor->pos];
+    *row = cursor->leaf->rows[cursor->pos++];
+    return 1;
+}
+
+uint64_t kdb_tree_key(const kproto_value_t *value) {
+    double d;
+    uint64_t bits;
+
+    // floats at the precision of the column with both zeros folded, negative
+    // ones flipped whole and positive ones above them
+    if (value->type == K_TYPE_FLOAT || value->type == K_TYPE_DOUBLE) {
+        d = value->type == K_TYPE_FLOAT ? (float)value->d : value->d;
+        if (d == 0)
+            d = 0;
+        memcpy(&bits, &d, sizeof(bits));
+        return bits >> 63 ? ~bits : bits | (1ULL << 63);
+    }
+
+    // integers are sign extended, flipping the sign bit orders signed ones
+    return value->flags & K_TYPE_UNSIGNED ? value->u : value->u ^ (1ULL << 63);
+}
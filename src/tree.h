@@ -0,0 +1,46 @@
+#ifndef K_TREE_H
+#define K_TREE_H
+
+#include "proto.h"
+
+// entries per node, both node kinds fill whole cache lines
+#define KDB_TREE_LEAF 31
+#define KDB_TREE_INNER 20
+#define KDB_TREE_DEPTH 16
+
+// b+-tree over (key, row) pairs so duplicate keys stay distinct entries,
+// keys are normalized so unsigned order is the column order
+typedef struct {
+    uint64_t keys[KDB_TREE_LEAF];
+    uint64_t rows[KDB_TREE_LEAF];
+    uint32_t n;
+    void *next;
+} kdb_leaf_t;
+
+typedef struct {
+    uint64_t keys[KDB_TREE_INNER];
+    uint64_t rows[KDB_TREE_INNER];
+    void *children[KDB_TREE_INNER + 1];
+    uint32_t n;
+} kdb_inner_t;
+
+typedef struct {
+    void *root;
+    uint32_t height; // inner levels above the leaves
+    uint64_t size;
+} kdb_tree_t;
+
+typedef struct {
+    const kdb_leaf_t *leaf;
+    uint32_t pos;
+} kdb_cursor_t;
+
+int kdb_tree_init(kdb_tree_t *tree);
+void kdb_tree_free(kdb_tree_t *tree);
+int kdb_tree_put(kdb_tree_t *tree, const uint64_t key, const uint64_t row);
+void kdb_tree_remove(kdb_tree_t *tree, const uint64_t key, const uint64_t row);
+void kdb_tree_seek(const kdb_tree_t *tree, const uint64_t key, kdb_cursor_t *cursor);
+int kdb_tree_next(kdb_cursor_t *cursor, uint64_t *key, uint64_t *row);
+uint64_t kdb_tree_key(const kproto_value_t *value);
+
+#endif // K_TREE_H
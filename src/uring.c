@@ -0,0 +1,235 @@
+#include "uring.h"
+
+#ifdef KURING_SUPPORTED
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static inline int kuring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int kuring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t size) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static inline int kuring_register(int fd, unsigned opcode, void *arg, unsigned nargs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+int kuring_init(kuring_t *ring, const unsigned entries) {
+    unsigned i;
+    struct io_uring_params params;
+
+    // create the ring with a larger completion queue since multishot
+    // requests can post many completions per submission
+    memset(ring, 0, sizeof(kuring_t));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    ring->fd = kuring_setup(entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    // timeouts are passed through the extended enter argument
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        kuring_free(ring);
+        errno = ENOSYS;
+        return -1;
+    }
+    ring->features = params.features;
+    ring->sq_entries = params.sq_entries;
+
+    // map submission and completion rings, shared when the kernel allows
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto failed;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto failed;
+    }
+
+    // map submission queue entries
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto failed;
+
+    // resolve ring offsets
+    ring->sq_head = (unsigned*)((char*)ring->sq_ring + params.sq_off.head);
+    ring->sq_ktail = (unsigned*)((char*)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+    ring->cq_head = (unsigned*)((char*)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned*)((char*)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+
+    // entries are always submitted in order, so the index array is fixed
+    unsigned *array = (unsigned*)((char*)ring->sq_ring + params.sq_off.array);
+    for (i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+    ring->sq_tail = *ring->sq_ktail;
+    return 0;
+
+    failed:
+        kuring_free(ring);
+        return -1;
+}
+
+void kuring_free(kuring_t *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(kuring_t));
+    ring->fd = -1;
+}
+
+static int kuring_flush(kuring_t *ring, unsigned wait, unsigned flags, void *arg, size_t size) {
+    // publish queued entries to the kernel and enter once for all of them
+    __atomic_store_n(ring->sq_ktail, ring->sq_tail, __ATOMIC_RELEASE);
+    const unsigned submit = ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return kuring_enter(ring->fd, submit, wait, flags, arg, size);
+}
+
+struct io_uring_sqe* kuring_sqe(kuring_t *ring) {
+    struct io_uring_sqe *sqe;
+
+    // submission queue is full, push what is queued and try again
+    if (ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        kuring_flush(ring, 0, 0, NULL, 0);
+        if (ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+            return NULL;
+    }
+
+    sqe = &ring->sqes[ring->sq_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_tail++;
+    return sqe;
+}
+
+int kuring_submit(kuring_t *ring, const int timeout) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned wait = 1;
+
+    // dont block when completions are already waiting or no wait requested
+    memset(&arg, 0, sizeof(arg));
+    if (timeout == 0 || *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        wait = 0;
+    } else if (timeout > 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    // submit every queued entry and wait for completions in one syscall
+    if (kuring_flush(ring, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0) {
+        if (errno == ETIME || errno == EINTR || errno == EBUSY)
+            return 0;
+        return -1;
+    }
+    return 0;
+}
+
+struct io_uring_cqe* kuring_cqe(kuring_t *ring) {
+    const unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void kuring_cqe_seen(kuring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int kuring_bufs_init(kuring_t *ring, kuring_bufs_t *bufs, const uint16_t bgid, const unsigned count, const unsigned size) {
+    unsigned i;
+    struct io_uring_buf_reg reg;
+
+    // the ring entry count must be a power of 2 and page aligned in memory
+    memset(bufs, 0, sizeof(kuring_bufs_t));
+    if (count == 0 || (count & (count - 1)) || count > 32768)
+        return -1;
+    bufs->bgid = bgid;
+    bufs->count = count;
+    bufs->size = size;
+    bufs->ring_size = count * sizeof(struct io_uring_buf);
+    bufs->ring = mmap(NULL, bufs->ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (bufs->ring == MAP_FAILED) {
+        bufs->ring = NULL;
+        return -1;
+    }
+    bufs->data = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (bufs->data == MAP_FAILED) {
+        bufs->data = NULL;
+        kuring_bufs_free(ring, bufs);
+        return -1;
+    }
+
+    // register the buffer ring for the group
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)bufs->ring;
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+    if (kuring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        kuring_bufs_free(NULL, bufs);
+        return -1;
+    }
+
+    // hand every buffer to the kernel
+    for (i = 0; i < count; i++)
+        kuring_bufs_recycle(bufs, i);
+    return 0;
+}
+
+void kuring_bufs_free(kuring_t *ring, kuring_bufs_t *bufs) {
+    struct io_uring_buf_reg reg;
+    if (ring != NULL && ring->fd >= 0 && bufs->ring != NULL) {
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = bufs->bgid;
+        kuring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    if (bufs->ring != NULL)
+        munmap(bufs->ring, bufs->ring_size);
+    if (bufs->data != NULL)
+        munmap(bufs->data, (size_t)bufs->count * bufs->size);
+    bufs->ring = NULL;
+    bufs->data = NULL;
+}
+
+char* kuring_bufs_get(kuring_bufs_t *bufs, const unsigned bid) {
+    return bufs->data + ((size_t)bid * bufs->size);
+}
+
+void kuring_bufs_recycle(kuring_bufs_t *bufs, const unsigned bid) {
+    struct io_uring_buf *buf = &bufs->ring->bufs[bufs->tail & (bufs->count - 1)];
+
+    // write the entry, then publish it by bumping the shared tail
+    buf->addr = (uint64_t)(uintptr_t)kuring_bufs_get(bufs, bid);
+    buf->len = bufs->size;
+    buf->bid = bid;
+    bufs->tail++;
+    __atomic_store_n(&bufs->ring->tail, bufs->tail, __ATOMIC_RELEASE);
+}
+
+#endif // KURING_SUPPORTED
@@ -0,0 +1,59 @@
+#ifndef K_URING_H
+#define K_URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define KURING_SUPPORTED 1
+#endif
+#endif
+
+#ifdef KURING_SUPPORTED
+#include <linux/io_uring.h>
+
+typedef struct {
+    int fd;
+    unsigned features;
+    unsigned sq_entries;
+    unsigned sq_tail;
+    unsigned *sq_head;
+    unsigned *sq_ktail;
+    unsigned *sq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} kuring_t;
+
+typedef struct {
+    char *data;
+    uint16_t bgid;
+    uint16_t tail;
+    unsigned count;
+    unsigned size;
+    size_t ring_size;
+    struct io_uring_buf_ring *ring;
+} kuring_bufs_t;
+
+int kuring_init(kuring_t *ring, const unsigned entries);
+void kuring_free(kuring_t *ring);
+struct io_uring_sqe* kuring_sqe(kuring_t *ring);
+int kuring_submit(kuring_t *ring, const int timeout);
+struct io_uring_cqe* kuring_cqe(kuring_t *ring);
+void kuring_cqe_seen(kuring_t *ring);
+
+int kuring_bufs_init(kuring_t *ring, kuring_bufs_t *bufs, const uint16_t bgid, const unsigned count, const unsigned size);
+void kuring_bufs_free(kuring_t *ring, kuring_bufs_t *bufs);
+char* kuring_bufs_get(kuring_bufs_t *bufs, const unsigned bid);
+void kuring_bufs_recycle(kuring_bufs_t *bufs, const unsigned bid);
+
+#endif // KURING_SUPPORTED
+#endif // K_URING_H
@@ -0,0 +1,281 @@
+#include "version.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    void *next; // cut after this one
+    uint64_t end; // of the newest version cut from it
+    char data[];
+} kdb_chunk_t;
+
+int kdb_epochs_init(kdb_epochs_t *epochs, const size_t readers) {
+    size_t i;
+    memset(epochs, 0, sizeof(kdb_epochs_t));
+    if (readers == 0)
+        return KDB_OK;
+    if ((epochs->reading = malloc(readers * sizeof(uint64_t))) == NULL)
+        return KDB_ERR_MEMORY;
+    for (i = 0; i < readers; i++)
+        epochs->reading[i] = KDB_EPOCH_LATEST;
+    epochs->n_readers = readers;
+    return KDB_OK;
+}
+
+static void kdb_chunks_free(kdb_chunk_t *chunk) {
+    kdb_chunk_t *next;
+    for (; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+}
+
+void kdb_epochs_free(kdb_epochs_t *epochs) {
+    kdb_chunks_free(epochs->oldest);
+    kdb_chunks_free(epochs->spare);
+    free(epochs->reading);
+    memset(epochs, 0, sizeof(kdb_epochs_t));
+}
+
+uint64_t kdb_epochs_enter(kdb_epochs_t *epochs, const size_t reader, const uint64_t *epoch) {
+    uint64_t at, now = __atomic_load_n(epoch, __ATOMIC_ACQUIRE);
+
+    // announced, then checked to still be the latest. a writer reclaiming
+    // holds the epoch still, so it either sees the announcement or the
+    // reader sees the epoch moved and tries again with the newer one
+    do {
+        at = now;
+        __atomic_store_n(&epochs->reading[reader], at, __ATOMIC_SEQ_CST);
+    } while ((now = __atomic_load_n(epoch, __ATOMIC_SEQ_CST)) != at);
+    return at;
+}
+
+void kdb_epochs_leave(kdb_epochs_t *epochs, const size_t reader) {
+    __atomic_store_n(&epochs->reading[reader], KDB_EPOCH_LATEST, __ATOMIC_RELEASE);
+}
+
+void kdb_epochs_reclaim(kdb_epochs_t *epochs, uint64_t epoch) {
+    size_t i;
+    uint64_t at;
+    kdb_chunk_t *chunk;
+
+    // the oldest snapshot still read, versions ending at or before it are
+    // never followed again. run by the writer, see kdb_epochs_enter
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < epochs->n_readers; i++)
+        if ((at = __atomic_load_n(&epochs->reading[i], __ATOMIC_SEQ_CST)) < epoch)
+            epoch = at;
+
+    // versions are cut in epoch order, so whole chunks go oldest first
+    // and the newest is simply cut from again
+    while ((chunk = epochs->oldest) != NULL && chunk->end <= epoch) {
+        if (chunk == epochs->newest) {
+            epochs->used = 0;
+            return;
+        }
+        epochs->oldest = chunk->next;
+        if (epochs->n_spare < KDB_VERSION_SPARE) {
+            chunk->next = epochs->spare;
+            epochs->spare = chunk;
+            epochs->n_spare++;
+        } else {
+            free(chunk);
+        }
+    }
+}
+
+static inline void kdb_version_cell(char *to, const char *from, const uint8_t width) {
+    // cells are a handful of bytes, copies of a known size stay inline
+    switch (width) {
+        case 8: memcpy(to, from, 8); break;
+        case 4: memcpy(to, from, 4); break;
+        case 2: memcpy(to, from, 2); break;
+        case 1: *to = *from; break;
+        default: memcpy(to, from, width); break;
+    }
+}
+
+static kdb_version_t* kdb_version_alloc(kdb_epochs_t *epochs, const size_t size, const uint64_t end) {
+    kdb_chunk_t *chunk = epochs->newest;
+    if (chunk == NULL || epochs->used + size > KDB_VERSION_CHUNK) {
+        if ((chunk = epochs->spare) != NULL) {
+            epochs->spare = chunk->next;
+            epochs->n_spare--;
+        } else if ((chunk = malloc(sizeof(kdb_chunk_t) + KDB_VERSION_CHUNK)) == NULL) {
+            return NULL;
+        }
+        chunk->next = NULL;
+        if (epochs->newest != NULL)
+            ((kdb_chunk_t*)epochs->newest)->next = chunk;
+        else
+            epochs->oldest = chunk;
+        epochs->newest = chunk;
+        epochs->used = 0;
+    }
+    chunk->end = end;
+    epochs->used += size;
+    return (kdb_version_t*)(chunk->data + epochs->used - size);
+}
+
+int kdb_version_keep(kdb_epochs_t *epochs, kdb_t *table, const uint64_t row, const uint64_t epoch) {
+    uint8_t i;
+    char *data;
+    uint64_t *touched;
+    kdb_version_t *version;
+    kdb_versions_t *versions = &table->versions;
+    const uint64_t block = row / KDB_BLOCK, bit = 1ULL << (row % KDB_BLOCK);
+    if (epoch == 0)
+        return KDB_OK;
+
+    // tables get their stamps the first time a writer changes one under
+    // readers, who take no stamps as never touched
+    if ((touched = versions->touched) == NULL) {
+        uint64_t *kept = calloc(table->cap / KDB_BLOCK, sizeof(uint64_t));
+        void **chains = calloc(table->cap / KDB_BLOCK, sizeof(void*));
+        if (kept == NULL || chains == NULL || (touched = calloc(table->cap / KDB_BLOCK, sizeof(uint64_t))) == NULL) {
+            free(kept);
+            free(chains);
+            return KDB_ERR_MEMORY;
+        }
+        versions->size = sizeof(kdb_version_t);
+        for (i = 0; i < table->n_cols; i++)
+            versions->size += table->cols[i].width + (table->cols[i].type == K_TYPE_STRING ? sizeof(uint32_t) : 0);
+        versions->size = (versions->size + 7) & ~(size_t)7;
+        versions->kept = kept;
+        versions->chains = chains;
+        __atomic_store_n(&versions->touched, touched, __ATOMIC_RELEASE);
+    }
+
+    // a row is kept once per epoch, before its first change
+    if (touched[block] != epoch)
+        versions->kept[block] = 0;
+    if (versions->kept[block] & bit)
+        return KDB_OK;
+    if ((version = kdb_version_alloc(epochs, versions->size, epoch)) == NULL)
+        return KDB_ERR_MEMORY;
+    version->next = versions->chains[block];
+    version->next_end = touched[block];
+    version->end = epoch;
+    version->row = row % KDB_BLOCK;
+    version->live = (table->live[block] & bit) != 0;
+    data = version->data;
+    for (i = 0; i < table->n_cols; i++) {
+        const kdb_column_t *col = &table->cols[i];
+        kdb_version_cell(data, col->data + row * col->width, col->width);
+        data += col->width;
+        if (col->type != K_TYPE_STRING)
+            continue;
+        kdb_version_cell(data, (const char*)&col->lens[row], sizeof(uint32_t));
+        data += sizeof(uint32_t);
+    }
+    versions->kept[block] |= bit;
+
+    // version before stamp, and stamp before the change, so a reader that
+    // sees any of the change sees the stamp and finds the version behind it
+    __atomic_store_n(&versions->chains[block], version, __ATOMIC_RELEASE);
+    __atomic_store_n(&touched[block], epoch, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return KDB_OK;
+}
+
+void kdb_version_read(const kdb_t *table, const uint64_t block, const uint64_t epoch, kdb_t *view) {
+    uint8_t i;
+    const char *data;
+    const kdb_version_t *version;
+    uint64_t live = __atomic_load_n(&table->live[block], __ATOMIC_RELAXED);
+
+    // copy the block as it is, rows a writer changes meanwhile are kept
+    // before they change and so are put back right after
+    for (i = 0; i < table->n_cols; i++) {
+        const kdb_column_t *col = &table->cols[i];
+        memcpy(view->cols[i].data, col->data + block * KDB_BLOCK * col->width, KDB_BLOCK * col->width);
+        if (col->type == K_TYPE_STRING)
+            memcpy(view->cols[i].lens, col->lens + block * KDB_BLOCK, KDB_BLOCK * sizeof(uint32_t));
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    for (i = 0; i < table->n_cols; i++)
+        view->cols[i].arena_len = __atomic_load_n(&table->cols[i].arena_len, __ATOMIC_RELAXED);
+
+    // newest first, the oldest version kept after the epoch is how the
+    // row looked at it. the stamp is the end of a head no older than the
+    // one it was loaded with, and versions are only followed while they
+    // end after the epoch, which keeps them from being reclaimed
+    if (kdb_version_stamp(table, block) <= epoch) {
+        view->live[0] = live;
+        return;
+    }
+    version = __atomic_load_n(&table->versions.chains[block], __ATOMIC_ACQUIRE);
+    for (;; version = version->next) {
+        data = version->data;
+        for (i = 0; i < table->n_cols; i++) {
+            kdb_column_t *col = &view->cols[i];
+            kdb_version_cell(col->data + version->row * col->width, data, col->width);
+            data += col->width;
+            if (col->type != K_TYPE_STRING)
+                continue;
+            kdb_version_cell((char*)&col->lens[version->row], data, sizeof(uint32_t));
+            data += sizeof(uint32_t);
+        }
+        live = (live & ~(1ULL << version->row)) | ((uint64_t)version->live << version->row);
+        if (version->next_end <= epoch)
+            break;
+    }
+    view->live[0] = live;
+}
+
+int kdb_version_grow(kdb_t *table, const uint64_t cap) {
+    void *grown;
+    kdb_versions_t *versions = &table->versions;
+    const uint64_t blocks = table->cap / KDB_BLOCK, grow = cap / KDB_BLOCK - blocks;
+    if (versions->touched == NULL)
+        return KDB_OK;
+
+    // only ever grown with no reader around, the old arrays can go
+    if ((grown = realloc(versions->touched, cap / KDB_BLOCK * sizeof(uint64_t))) == NULL)
+        return KDB_ERR_MEMORY;
+    versions->touched = grown;
+    memset(versions->touched + blocks, 0, grow * sizeof(uint64_t));
+    if ((grown = realloc(versions->kept, cap / KDB_BLOCK * sizeof(uint64_t))) == NULL)
+        return KDB_ERR_MEMORY;
+    versions->kept = grown;
+    memset(versions->kept + blocks, 0, grow * sizeof(uint64_t));
+    if ((grown = realloc(versions->chains, cap / KDB_BLOCK * sizeof(void*))) == NULL)
+        return KDB_ERR_MEMORY;
+    versions->chains = grown;
+    memset(versions->chains + blocks, 0, grow * sizeof(void*));
+    return KDB_OK;
+}
+
+int kdb_version_gone(kdb_t *table, const uint64_t row) {
+    uint64_t *gone;
+    kdb_versions_t *versions = &table->versions;
+    if (versions->n_gone == versions->max_gone) {
+        const size_t max = versions->max_gone ? versions->max_gone * 2 : 64;
+        if ((gone = realloc(versions->gone, max * sizeof(uint64_t))) == NULL)
+            return KDB_ERR_MEMORY;
+        versions->gone = gone;
+        versions->max_gone = max;
+    }
+    versions->gone[versions->n_gone++] = row;
+    return KDB_OK;
+}
+
+void kdb_version_collect(kdb_t *table) {
+    size_t i;
+    kdb_versions_t *versions = &table->versions;
+
+    // taken with no reader around, rows deleted under them can finally
+    // leave the indexes
+    for (i = 0; i < versions->n_gone; i++)
+        kdb_table_unindex(table, versions->gone[i]);
+    versions->n_gone = 0;
+}
+
+void kdb_version_free(kdb_t *table) {
+    kdb_versions_t *versions = &table->versions;
+    free(versions->touched);
+    free(versions->kept);
+    free(versions->chains);
+    free(versions->gone);
+    memset(versions, 0, sizeof(kdb_versions_t));
+}
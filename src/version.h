@@ -0,0 +1,51 @@
+#ifndef K_VERSION_H
+#define K_VERSION_H
+
+#include "table.h"
+
+// the epoch a writer reads at, it sees every change including its own
+#define KDB_EPOCH_LATEST UINT64_MAX
+
+// bytes of versions cut from one chunk
+#define KDB_VERSION_CHUNK 65536
+
+// chunks readers are past kept for reuse instead of freed
+#define KDB_VERSION_SPARE 16
+
+// a row as it was before the writer at end changed it, readers at an
+// epoch before end see these values. columns follow in schema order, a
+// cell each with strings also taking their length
+typedef struct {
+    void *next;        // older version in the same block, gone once
+    uint64_t next_end; // every reader is at its end or later
+    uint64_t end;
+    uint8_t row; // in the block
+    uint8_t live;
+    char data[];
+} kdb_version_t;
+
+// epoch the block last changed at while readers could look, 0 until then
+static inline uint64_t kdb_version_stamp(const kdb_t *table, const uint64_t block) {
+    const uint64_t *touched = __atomic_load_n(&table->versions.touched, __ATOMIC_ACQUIRE);
+    return touched != NULL ? __atomic_load_n(&touched[block], __ATOMIC_ACQUIRE) : 0;
+}
+
+// bytes a column takes in a block of a view
+static inline size_t kdb_version_slice(const kdb_column_t *col) {
+    return KDB_BLOCK * col->width + (col->type == K_TYPE_STRING ? KDB_BLOCK * sizeof(uint32_t) : 0);
+}
+
+int kdb_epochs_init(kdb_epochs_t *epochs, const size_t readers);
+void kdb_epochs_free(kdb_epochs_t *epochs);
+uint64_t kdb_epochs_enter(kdb_epochs_t *epochs, const size_t reader, const uint64_t *epoch);
+void kdb_epochs_leave(kdb_epochs_t *epochs, const size_t reader);
+void kdb_epochs_reclaim(kdb_epochs_t *epochs, uint64_t epoch);
+
+int kdb_version_keep(kdb_epochs_t *epochs, kdb_t *table, const uint64_t row, const uint64_t epoch);
+void kdb_version_read(const kdb_t *table, const uint64_t block, const uint64_t epoch, kdb_t *view);
+int kdb_version_grow(kdb_t *table, const uint64_t cap);
+int kdb_version_gone(kdb_t *table, const uint64_t row);
+void kdb_version_collect(kdb_t *table);
+void kdb_version_free(kdb_t *table);
+
+#endif // K_VERSION_H
@@ -0,0 +1,397 @@
+#include "wal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define KDB_WAL_HEADER 8
+#define KDB_WAL_RECORD 4
+
+static uint32_t kdb_crc_table[256];
+
+static void kdb_crc_init() {
+    uint32_t i, j, crc;
+    for (i = 0; i < 256; i++) {
+        for (crc = i, j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        kdb_crc_table[i] = crc;
+    }
+}
+
+static uint32_t kdb_crc32(const char *data, const size_t len) {
+    size_t i;
+    uint32_t crc = 0xFFFFFFFF;
+    for (i = 0; i < len; i++)
+        crc = kdb_crc_table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static int kdb_wal_write(const int fd, const char *data, size_t len) {
+    ssize_t n;
+    while (len > 0) {
+        if ((n = write(fd, data, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int kdb_wal_header(const int fd, const uint64_t base) {
+    const uint64_t le = htole64(base);
+    return kdb_wal_write(fd, (const char*)&le, sizeof(le));
+}
+
+static int kdb_wal_restart(kdb_wal_t *wal, const uint64_t base) {
+    // nothing in the file is needed, start it over at base
+    if (ftruncate(wal->fd, 0) < 0 || kdb_wal_header(wal->fd, base)) {
+        fprintf(stderr, "[KDB] Failed to start log: %s\n", strerror(errno));
+        return -1;
+    }
+    wal->base = wal->appended = wal->written = wal->synced = base;
+    return 0;
+}
+
+static int kdb_wal_replay(kdb_wal_t *wal, const uint64_t from, kdb_replay_t replay, void *arg) {
+    char *data;
+    struct stat st;
+    uint64_t base;
+    uint32_t crc, body;
+    size_t len, pos = KDB_WAL_HEADER, count = 0;
+
+    if (fstat(wal->fd, &st) < 0) {
+        fprintf(stderr, "[KDB] Failed to stat log: %s\n", strerror(errno));
+        return -1;
+    }
+    if (st.st_size < KDB_WAL_HEADER)
+        return kdb_wal_restart(wal, from);
+    if ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, wal->fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "[KDB] Failed to map log: %s\n", strerror(errno));
+        return -1;
+    }
+    memcpy(&base, data, sizeof(base));
+    base = le64toh(base);
+    if (base > from) {
+        fprintf(stderr, "[KDB] Log starts at %lu past the snapshot at %lu\n", (unsigned long)base, (unsigned long)from);
+        munmap(data, st.st_size);
+        return -1;
+    }
+
+    // replay records until the end or the first one that didnt fully make
+    // it, skipping the ones the snapshot already has
+    while (pos + KDB_WAL_RECORD + KPROTO_CMD_HEADER <= (size_t)st.st_size) {
+        memcpy(&crc, data + pos, 4);
+        memcpy(&body, data + pos + KDB_WAL_RECORD + 1, 4);
+        len = KPROTO_CMD_HEADER + (size_t)le32toh(body);
+        if (len > st.st_size - pos - KDB_WAL_RECORD)
+            break;
+        if (kdb_crc32(data + pos + KDB_WAL_RECORD, len) != le32toh(crc))
+            break;
+        pos += KDB_WAL_RECORD + len;
+        if (base + pos - KDB_WAL_HEADER > from) {
+            replay(data + pos - len, len, arg);
+            count++;
+        }
+    }
+    munmap(data, st.st_size);
+    printf("Replayed %zu commands from the log\n", count);
+
+    // the snapshot is newer than anything that made it to the log
+    if (base + pos - KDB_WAL_HEADER < from)
+        return kdb_wal_restart(wal, from);
+
+    // new records go after the last good one
+    if (pos < (size_t)st.st_size) {
+        fprintf(stderr, "[KDB] Dropping %zu bytes of torn log\n", (size_t)st.st_size - pos);
+        if (ftruncate(wal->fd, pos) < 0) {
+            fprintf(stderr, "[KDB] Failed to truncate log: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    wal->base = base;
+    wal->appended = wal->written = wal->synced = base + pos - KDB_WAL_HEADER;
+    return 0;
+}
+
+int kdb_wal_open(kdb_wal_t *wal, const char *path, const int mode, const uint64_t from, kdb_replay_t replay, void *arg) {
+    memset(wal, 0, sizeof(kdb_wal_t));
+    wal->mode = mode;
+    kproto_writer(&wal->buf);
+    kproto_writer(&wal->spare);
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->done, NULL);
+    kdb_crc_init();
+
+    if ((wal->path = strdup(path)) == NULL) {
+        fprintf(stderr, "[KDB] Not enough memory for log\n");
+        wal->fd = -1;
+        return -1;
+    }
+    if ((wal->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "[KDB] Failed to open log %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return kdb_wal_replay(wal, from, replay, arg);
+}
+
+void kdb_wal_close(kdb_wal_t *wal) {
+    // whatever was acknowledged without a sync gets one now
+    if (wal->fd >= 0) {
+        kdb_wal_commit(wal, wal->appended);
+        if (fdatasync(wal->fd) < 0)
+            fprintf(stderr, "[KDB] Failed to sync log: %s\n", strerror(errno));
+        close(wal->fd);
+    }
+    kproto_writer_free(&wal->buf);
+    kproto_writer_free(&wal->spare);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->done);
+    free(wal->path);
+    wal->path = NULL;
+    wal->fd = -1;
+}
+
+uint64_t kdb_wal_append(kdb_wal_t *wal, const char *cmd, const size_t len) {
+    char *dst;
+    uint64_t lsn;
+
+    // callers append in the order commands ran, the lsn is where it ends.
+    // a command the caller could not encode fails the log like one it
+    // could not buffer
+    pthread_mutex_lock(&wal->lock);
+    if (cmd == NULL) {
+        wal->failed = 1;
+        lsn = wal->appended + 1; // past the end, committing it only fails
+        pthread_mutex_unlock(&wal->lock);
+        return lsn;
+    }
+    kproto_put_u32(&wal->buf, kdb_crc32(cmd, len));
+    if ((dst = kproto_put(&wal->buf, len)) != NULL)
+        memcpy(dst, cmd, len);
+    if (wal->buf.failed)
+        wal->failed = 1;
+    lsn = wal->appended += KDB_WAL_RECORD + len;
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+int kdb_wal_commit(kdb_wal_t *wal, const uint64_t lsn) {
+    int err;
+    uint64_t end;
+    kproto_writer_t batch;
+
+    pthread_mutex_lock(&wal->lock);
+    while (!wal->failed && (wal->mode == KDB_WAL_BATCH ? wal->synced : wal->written) < lsn) {
+        // someone is already writing, their batch or the next one covers us
+        if (wal->flushing) {
+            pthread_cond_wait(&wal->done, &wal->lock);
+            continue;
+        }
+
+        // lead the next batch, appends keep going into the spare buffer
+        wal->flushing = 1;
+        batch = wal->buf;
+        wal->buf = wal->spare;
+        end = wal->appended;
+        pthread_mutex_unlock(&wal->lock);
+
+        err = kdb_wal_write(wal->fd, batch.data, batch.len);
+        if (!err && wal->mode == KDB_WAL_BATCH)
+            err = fdatasync(wal->fd);
+        if (err)
+            fprintf(stderr, "[KDB] Failed to write log: %s\n", strerror(errno));
+
+        pthread_mutex_lock(&wal->lock);
+        batch.len = 0;
+        wal->spare = batch;
+        wal->flushing = 0;
+        wal->batches++;
+        if (err) {
+            wal->failed = 1;
+        } else {
+            wal->written = end;
+            if (wal->mode == KDB_WAL_BATCH) {
+                wal->synced = end;
+                wal->syncs++;
+            }
+        }
+        pthread_cond_broadcast(&wal->done);
+    }
+    err = wal->failed ? -1 : 0;
+    pthread_mutex_unlock(&wal->lock);
+    return err;
+}
+
+int kdb_wal_sync(kdb_wal_t *wal) {
+    int err;
+    uint64_t end;
+
+    // write out what is buffered, then sync up to there if nobody has
+    pthread_mutex_lock(&wal->lock);
+    end = wal->appended;
+    pthread_mutex_unlock(&wal->lock);
+    if (kdb_wal_commit(wal, end))
+        return -1;
+    pthread_mutex_lock(&wal->lock);
+    while (wal->flushing)
+        pthread_cond_wait(&wal->done, &wal->lock);
+    if (wal->synced >= end) {
+        pthread_mutex_unlock(&wal->lock);
+        return 0;
+    }
+    wal->flushing = 1;
+    pthread_mutex_unlock(&wal->lock);
+
+    err = fdatasync(wal->fd);
+    if (err)
+        fprintf(stderr, "[KDB] Failed to sync log: %s\n", strerror(errno));
+    pthread_mutex_lock(&wal->lock);
+    if (err)
+        wal->failed = 1;
+    else if (end > wal->synced)
+        wal->synced = end;
+    wal->syncs++;
+    wal->flushing = 0;
+    pthread_cond_broadcast(&wal->done);
+    pthread_mutex_unlock(&wal->lock);
+    return err ? -1 : 0;
+}
+
+static int kdb_wal_copy(kdb_wal_t *wal, const int fd, const uint64_t from, const uint64_t to) {
+    ssize_t n;
+    char buf[65536];
+    off_t pos = from - wal->base + KDB_WAL_HEADER;
+    const off_t stop = to - wal->base + KDB_WAL_HEADER;
+
+    // records up to written never change, they copy without the lock
+    while (pos < stop) {
+        if ((n = pread(wal->fd, buf, stop - pos < (off_t)sizeof(buf) ? stop - pos : sizeof(buf), pos)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (kdb_wal_write(fd, buf, n))
+            return -1;
+        pos += n;
+    }
+    return 0;
+}
+
+static int kdb_wal_rewrite(kdb_wal_t *wal, const uint64_t lsn, const uint64_t end, const char *tmp) {
+    int fd;
+
+    // copy what the snapshot doesnt cover into a new file, commits keep
+    // going to the old one meanwhile
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    if (kdb_wal_header(fd, lsn) || kdb_wal_copy(wal, fd, lsn, end) || fdatasync(fd) < 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    return fd;
+}
+
+static void* kdb_wal_drop(void *arg) {
+    close((int)(intptr_t)arg);
+    return NULL;
+}
+
+int kdb_wal_truncate(kdb_wal_t *wal, const uint64_t lsn) {
+    int fd, err;
+    uint64_t end;
+    int unsynced = 0;
+    char tmp[PATH_MAX];
+
+    // covered records have to be in the file before they can be cut
+    if (kdb_wal_commit(wal, lsn))
+        return -1;
+    pthread_mutex_lock(&wal->lock);
+    if (wal->failed || lsn <= wal->base) {
+        fd = wal->failed ? -1 : 0;
+        pthread_mutex_unlock(&wal->lock);
+        return fd;
+    }
+    end = wal->written;
+    pthread_mutex_unlock(&wal->lock);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", wal->path);
+    if ((fd = kdb_wal_rewrite(wal, lsn, end, tmp)) < 0) {
+        fprintf(stderr, "[KDB] Failed to truncate log: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // commits only wait on what they wrote during the copy, then the new
+    // file takes over. appends keep going into the buffer
+    pthread_mutex_lock(&wal->lock);
+    while (wal->flushing)
+        pthread_cond_wait(&wal->done, &wal->lock);
+    wal->flushing = 1;
+    err = wal->failed;
+    pthread_mutex_unlock(&wal->lock);
+    if (!err && (kdb_wal_copy(wal, fd, end, wal->written) || fdatasync(fd) < 0 || rename(tmp, wal->path) < 0))
+        err = -1;
+    if (err) {
+        fprintf(stderr, "[KDB] Failed to truncate log: %s\n", strerror(errno));
+        close(fd);
+        unlink(tmp);
+    } else {
+        // past the rename the new file is the log either way, but until
+        // the directory is synced a crash can bring back the old one
+        unsynced = kdb_sync_dir(wal->path) && kdb_sync_dir(wal->path);
+        if (unsynced)
+            fprintf(stderr, "[KDB] Failed to sync log directory: %s\n", strerror(errno));
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    if (!err) {
+        // the last close frees the old file, which takes a while for a
+        // long log so it happens off the callers thread
+        pthread_t dropper;
+        if (pthread_create(&dropper, NULL, kdb_wal_drop, (void*)(intptr_t)wal->fd) == 0)
+            pthread_detach(dropper);
+        else
+            close(wal->fd);
+        wal->fd = fd;
+        wal->base = lsn;
+        if (wal->written > wal->synced)
+            wal->synced = wal->written;
+
+        // nothing written from here on is sure to survive a crash, so
+        // it fails rather than being acknowledged
+        if (unsynced)
+            wal->failed = 1;
+    }
+    wal->flushing = 0;
+    pthread_cond_broadcast(&wal->done);
+    pthread_mutex_unlock(&wal->lock);
+    return err || unsynced ? -1 : 0;
+}
+
+int kdb_sync_dir(const char *path) {
+    int fd, err;
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    // a rename only lasts once the directory holding it is synced
+    if (slash == NULL)
+        strcpy(dir, ".");
+    else if (slash == path)
+        strcpy(dir, "/");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+    err = fsync(fd);
+    close(fd);
+    return err < 0 ? -1 : 0;
+}
@@ -0,0 +1,51 @@
+#ifndef K_WAL_H
+#define K_WAL_H
+
+#include "proto.h"
+#include <pthread.h>
+
+// durability modes, what an acknowledged command survives
+#define KDB_WAL_NONE 0     // written every batch, the os syncs when it likes
+#define KDB_WAL_PERIODIC 1 // written every batch, synced on an interval
+#define KDB_WAL_BATCH 2    // synced before the batch is acknowledged
+
+#define KDB_WAL_INTERVAL 100 // default periodic sync in milliseconds
+
+// append only log of the mutating commands exactly as they arrived, an
+// EXEC as the command it ran with its values bound:
+//
+//   log    := u64 base | record*
+//   record := u32 crc32(command) | command
+//
+// lsns keep counting when covered records are truncated away, base is
+// the lsn the first record in the file starts at. a torn or corrupt
+// record ends the log and is cut off on open
+typedef struct {
+    int fd;
+    int mode;
+    char *path;
+    uint64_t base;
+    kproto_writer_t buf;   // appended but not yet written
+    kproto_writer_t spare; // swapped in while a leader writes buf out
+    uint64_t appended;     // log offsets, every record ends at its lsn
+    uint64_t written;
+    uint64_t synced;
+    uint64_t batches;
+    uint64_t syncs;
+    unsigned flushing : 1;
+    unsigned failed : 1;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} kdb_wal_t;
+
+typedef void (*kdb_replay_t)(const char *cmd, const size_t len, void *arg);
+
+int kdb_wal_open(kdb_wal_t *wal, const char *path, const int mode, const uint64_t from, kdb_replay_t replay, void *arg);
+void kdb_wal_close(kdb_wal_t *wal);
+uint64_t kdb_wal_append(kdb_wal_t *wal, const char *cmd, const size_t len);
+int kdb_wal_commit(kdb_wal_t *wal, const uint64_t lsn);
+int kdb_wal_sync(kdb_wal_t *wal);
+int kdb_wal_truncate(kdb_wal_t *wal, const uint64_t lsn);
+int kdb_sync_dir(const char *path);
+
+#endif // K_WAL_H
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "ws.h"
 #include "sha1.h"
 #include "ws_parse.h"
@@ -6,8 +7,10 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <endian.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 
 // data sizes
 #define WS_CLRF_SIZE 2
@@ -33,8 +36,18 @@ static const char *WS_RESP =
 static int k_b64_mod[] = {0, 2, 1};
 static const char *k_b64_table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-static inline void kws_tolower(char *str, size_t len) {
-    while (len--, str[len] = tolower(str[len]));
+static inline void kws_tolower(char *str, const size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++)
+        str[i] = tolower((unsigned char)str[i]);
+}
+
+// a header line names key, compared whole, and its value starts with prefix
+static inline int kws_header(const char *key, const size_t key_len, const char *name,
+                             const char *value, const size_t value_len, const char *prefix) {
+    const size_t name_len = strlen(name), prefix_len = strlen(prefix);
+    return key_len == name_len && !strncasecmp(key, name, name_len) &&
+           value_len >= prefix_len && !strncasecmp(value, prefix, prefix_len);
 }
 
 static const int kws_gen_key(const char *ckey, char *skey, const size_t csize) {
@@ -71,49 +84,61 @@ static const int kws_gen_key(const char *ckey, char *skey, const size_t csize) {
 }
 
 static void kws_client_close(kio_client_t *client) {
-    // close websocket client
+    // connection went away without a close handshake, report it as 1006
     kws_client_t *ws = (kws_client_t*)client->data;
+    if (ws->state == KWS_STATE_OPEN && ws->on_close != NULL) {
+        ws->state = KWS_STATE_CLOSED;
+        ((kws_close_t)ws->on_close)(ws, 1006, "", 0);
+    }
+
+    // close websocket client
     kbuf_free(&ws->fragment);
-    free(ws);
+    kpool_release(&client->ctx->data_pool, ws);
     ws = NULL;
 }
 
 static void kws_handshake(kio_client_t *client) {
     size_t len, value_len, key_len;
     uint8_t status = 0, method = 1;
-    char *data = client->rbuf.data + client->rbuf.pos;
+    kbuf_t *buf = &client->rbuf;
     char *pos, *value, *key, skey[WS_SKEY_SIZE] = { 0 };
-    kbuf_read(&client->rbuf, data, strstr(data, WS_ECLRF) + 4 - data);
+
+    // the request ends at the delimiter kio_read_until found, view it as one
+    // block keeping the last header line terminator
+    const size_t req_len = kbuf_find(buf, 0, WS_ECLRF, WS_ECLRF_SIZE) + WS_ECLRF_SIZE;
+    char *data = kbuf_peek(buf, req_len);
+    if (data == NULL)
+        goto invalid_request;
+    char *end = data + req_len - WS_CLRF_SIZE;
 
     // start parsing http request
-    while ((pos = strstr(data, WS_CLRF))) {
+    while ((pos = memmem(data, end - data, WS_CLRF, WS_CLRF_SIZE))) {
         len = pos - data;
         if (len < 1) break;
 
         // parse first line
         if (method) {
-            kws_tolower(data, len);
-            if (strncmp(data, "get", 3))
+            if (len < 4 || strncasecmp(data, "get ", 4))
                 goto invalid_request;
             method = 0;
         
-        // parse headers
+        // parse headers, the key ends at the colon and the value starts
+        // after the whitespace following it
         } else {
             key = data;
-            if (!(value = strchr(data, ' ')))
+            if (!(value = memchr(data, ':', len)) || value == data)
                 goto invalid_request;
-            value++;
-            value_len = pos - value;
-            key_len = value - 2 - key;
+            key_len = value - key;
             kws_tolower(key, key_len);
+            for (value++; value < pos && (*value == ' ' || *value == '\t'); value++);
+            value_len = pos - value;
 
             // perform function based on header
-            if (!strncmp(key, "sec-websocket-key", 17) && kws_gen_key(value, skey, value_len))
+            if (kws_header(key, key_len, "sec-websocket-key", value, value_len, "") && kws_gen_key(value, skey, value_len))
                 goto invalid_request;
-            kws_tolower(value, value_len);
-            if (!strncmp(key, "upgrade", 7) && !strncmp(value, "websocket", 9))
+            if (kws_header(key, key_len, "upgrade", value, value_len, "websocket"))
                 status |= KWS_HANDSHAKE_UPGRADE;
-            if (!strncmp(key, "connection", 10) && !strncmp(value, "upgrade", 7))
+            if (kws_header(key, key_len, "connection", value, value_len, "upgrade"))
                 status |= KWS_HANDSHAKE_CONNECTION;
         }
 
@@ -131,6 +156,7 @@ static void kws_handshake(kio_client_t *client) {
     memcpy(resp + WS_RESP_SIZE, skey, WS_SKEY_SIZE);
     memcpy(resp + WS_RESP_SIZE + WS_SKEY_SIZE, WS_ECLRF, WS_ECLRF_SIZE);
     kio_write(client, resp, WS_FINAL_RESP_SIZE);
+    kbuf_skip(buf, req_len);
 
     // start parsing websocket frames
     kws_client_t *ws = (kws_client_t*)client->data;
@@ -150,7 +176,7 @@ static void kws_handshake(kio_client_t *client) {
 
 static void kws_accept(kio_client_t *client) {
     // get context and create ws_client 
-    kws_client_t *ws = malloc(sizeof(kws_client_t));
+    kws_client_t *ws = kpool_alloc(&client->ctx->data_pool);
     if (ws == NULL) {
         fprintf(stderr, "Not enough memory for kws_client_t");
         kio_close(client);
@@ -164,6 +190,7 @@ static void kws_accept(kio_client_t *client) {
     ws->on_close = NULL;
     ws->on_message = NULL;
     kbuf_init(&ws->fragment);
+    ws->fragment_op = KWS_OP_CONT;
     ws->state = KWS_STATE_HANDSHAKE;
 
     // bind to client and read handshake
@@ -176,6 +203,7 @@ void kws_init(kio_ctx_t *ctx, kws_callback_t callback) {
     if (ctx == NULL) return;
     ctx->data = callback;
     ctx->accept_cb = kws_accept;
+    kpool_init(&ctx->data_pool, sizeof(kws_client_t));
 }
 
 void kws_on_close(kws_client_t *ws, kws_close_t callback) {
@@ -205,36 +233,16 @@ void kws_ping(kws_client_t *ws, const char *data, const size_t len) {
         kws_send_raw(ws, data, len, KWS_OP_PING);
 }
 
-void kws_close(kws_client_t *ws, const uint16_t code, const char *reason) {
-
-    // create close frame data
-    const size_t len = strlen(reason);
-    char *data = malloc((sizeof(char) * len) + k_short_s);
-    if (data == NULL) {
-        fprintf(stderr, "[KDB] Not enough memory for close frame!");
-        return;
-    }
-
-    // write close frame data
-    memcpy(data, &code, k_short_s);
-    memcpy(data + k_short_s, reason, len);
+static void kws_sendv(kws_client_t *ws, struct iovec *iov, const int iovcnt, const uint8_t opcode, kio_release_t release, void *arg) {
+    int i;
+    size_t len = 0;
+    char header[10];
+    uint8_t padding;
 
-    // send close frame
-    kws_send_raw(ws, data, len + k_short_s, KWS_OP_FIN);
-    free(data);
-    data = NULL;
+    // payload length over every buffer after the header slot
+    for (i = 1; i < iovcnt; i++)
+        len += iov[i].iov_len;
 
-    // perform callback and close websocket
-    if (ws->on_close != NULL)
-        ((kws_close_t)ws->on_close)(ws, code, reason, len);
-    kio_close(ws->client);
-}
-
-void kws_send_raw(kws_client_t *ws, const char *data, const size_t len, const uint8_t opcode) {
-    size_t length;
-    uint8_t padding;
-    char *output;
-    
     // calculate size padding
     if (len < 126)
         padding = 0;
@@ -242,29 +250,79 @@ void kws_send_raw(kws_client_t *ws, const char *data, const size_t len, const ui
         padding = 2;
     else
         padding = 8;
-    
-    // create message data
-    length = 2 + len + padding;
-    output = malloc(sizeof(output) * length);
-    if (output == NULL) {
-        fprintf(stderr, "[KDB] Not enough memory for websocket frame");
-        return;
-    }
 
     // write headers
-    output[0] = (1 << 7) | opcode;
-    output[1] = padding == 0 ? len : (padding == 2 ? 0x7e : 0x7f);
+    header[0] = (1 << 7) | opcode;
+    header[1] = padding == 0 ? len : (padding == 2 ? 0x7e : 0x7f);
     if (padding == 2) {
         uint16_t size = htons(len);
-        memcpy(output + 2, &size, k_short_s);
+        memcpy(header + 2, &size, k_short_s);
     } else if (padding == 8) {
-        uint64_t size =be64toh(len);
-        memcpy(output + 2, &size, k_long_s);
+        uint64_t size = htobe64(len);
+        memcpy(header + 2, &size, k_long_s);
     }
 
-    // write data
-    memcpy(output + 2 + padding, data, len);
-    kio_write(ws->client, output, length);
-    free(output);
-    output = NULL;
-}
\ No newline at end of file
+    // send header and payload together, the payload is never copied here
+    iov[0].iov_base = header;
+    iov[0].iov_len = 2 + padding;
+    kio_writev(ws->client, iov, iovcnt, release, arg);
+}
+
+void kws_close(kws_client_t *ws, const uint16_t code, const char *reason) {
+    struct iovec iov[3];
+    const size_t len = strlen(reason);
+    const uint16_t net_code = htons(code);
+
+    // send close frame, status code in network order followed by the reason
+    iov[1].iov_base = (void*)&net_code;
+    iov[1].iov_len = k_short_s;
+    iov[2].iov_base = (void*)reason;
+    iov[2].iov_len = len;
+    kws_sendv(ws, iov, 3, KWS_OP_FIN, NULL, NULL);
+
+    // perform callback and close websocket
+    ws->state = KWS_STATE_CLOSED;
+    if (ws->on_close != NULL)
+        ((kws_close_t)ws->on_close)(ws, code, reason, len);
+    kio_close(ws->client);
+}
+
+void kws_send_raw(kws_client_t *ws, const char *data, const size_t len, const uint8_t opcode) {
+    struct iovec iov[2];
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    kws_sendv(ws, iov, 2, opcode, NULL, NULL);
+}
+
+typedef struct {
+    const char *data;
+    size_t len;
+    uint8_t opcode;
+} kws_broadcast_t;
+
+static void kws_broadcast_each(kio_client_t *client, void *arg) {
+    kws_broadcast_t *msg = (kws_broadcast_t*)arg;
+    kws_client_t *ws = (kws_client_t*)client->data;
+    if (ws != NULL && ws->state == KWS_STATE_OPEN)
+        kws_send_raw(ws, msg->data, msg->len, msg->opcode);
+}
+
+void kws_broadcast(kio_ctx_t *ctx, const char *data, const size_t len, const uint8_t opcode) {
+    kws_broadcast_t msg = { data, len, opcode };
+    kio_each(ctx, kws_broadcast_each, &msg);
+}
+
+void kws_send_owned(kws_client_t *ws, const char *data, const size_t len, const uint8_t opcode, kio_release_t release, void *arg) {
+    struct iovec iov[2];
+
+    // not open anymore, nothing will reference the buffer
+    if (ws->state != KWS_STATE_OPEN) {
+        if (release != NULL)
+            release(arg);
+        return;
+    }
+
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    kws_sendv(ws, iov, 2, opcode, release, arg);
+}
@@ -18,11 +18,21 @@
 #define KWS_HANDSHAKE_UPGRADE 1
 #define KWS_HANDSHAKE_CONNECTION 2
 
+// parser states
+#define KWS_PARSE_HEADER 0
+#define KWS_PARSE_PAYLOAD 1
+
+// largest frame header and payload accepted before closing with 1009
+#define KWS_MAX_HEADER 14
+#define KWS_MAX_FRAME (16 * 1024 * 1024)
+
 typedef struct {
     char *data;
-    char *mask;
+    uint8_t mask[4];
+    uint8_t state;
     uint8_t opcode;
     size_t data_len;
+    size_t unmasked;
     unsigned fin : 1;
     unsigned masked : 1;
 } kws_frame_t;
@@ -33,6 +43,7 @@ typedef struct {
     void *on_close;
     void *on_message;
     uint8_t state;
+    uint8_t fragment_op; // of the message being reassembled, CONT for none
     kbuf_t fragment;
     kws_frame_t frame;
     kio_client_t *client;
@@ -54,5 +65,7 @@ void kws_ping(kws_client_t *client, const char *data, const size_t len);
 void kws_close(kws_client_t *client, const uint16_t code, const char *reason);
 void kws_send_bin(kws_client_t *client, const char* data, const size_t len);
 void kws_send_raw(kws_client_t *client, const char *data, const size_t len, const uint8_t opcode);
+void kws_send_owned(kws_client_t *client, const char *data, const size_t len, const uint8_t opcode, kio_release_t release, void *arg);
+void kws_broadcast(kio_ctx_t *ctx, const char *data, const size_t len, const uint8_t opcode);
 
 #endif // K_WS_H
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include "ws_mask.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KWS_MASK_X86 1
+#endif
+
+typedef void (*kws_mask_fn)(const uint8_t*, uint8_t*, size_t);
+
+void kws_mask_scalar(const uint8_t *mask, uint8_t *data, const size_t len, const size_t offset) {
+    size_t i;
+    for (i = 0; i < len; i++)
+        data[i] ^= mask[(i + offset) & 3];
+}
+
+static inline uint64_t kws_mask_word(const uint8_t *key) {
+    uint32_t half;
+    memcpy(&half, key, sizeof(half));
+    return ((uint64_t)half << 32) | half;
+}
+
+static inline size_t kws_mask_head(const uint8_t *key, uint8_t *data, size_t len, const size_t align) {
+    // unmask bytes one at a time until data is aligned
+    size_t i = 0, head = (align - ((uintptr_t)data & (align - 1))) & (align - 1);
+    if (head > len)
+        head = len;
+    for (; i < head; i++)
+        data[i] ^= key[i & 3];
+    return head;
+}
+
+static void kws_mask_words(const uint8_t *key, uint8_t *data, size_t len) {
+    uint64_t word, m64;
+    uint8_t rkey[4];
+    size_t i;
+
+    // align to 8 bytes, then rotate the key so it lines up with the words
+    i = kws_mask_head(key, data, len, sizeof(uint64_t));
+    rkey[0] = key[i & 3];
+    rkey[1] = key[(i + 1) & 3];
+    rkey[2] = key[(i + 2) & 3];
+    rkey[3] = key[(i + 3) & 3];
+    m64 = kws_mask_word(rkey);
+
+    // 8 bytes per step
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&word, data + i, sizeof(word));
+        word ^= m64;
+        memcpy(data + i, &word, sizeof(word));
+    }
+
+    // tail
+    for (; i < len; i++)
+        data[i] ^= key[i & 3];
+}
+
+#ifdef KWS_MASK_X86
+static void kws_mask_sse2(const uint8_t *key, uint8_t *data, size_t len) {
+    uint8_t rkey[4];
+    size_t i;
+
+    // align to 16 bytes and splat the rotated key over a vector
+    i = kws_mask_head(key, data, len, 16);
+    rkey[0] = key[i & 3];
+    rkey[1] = key[(i + 1) & 3];
+    rkey[2] = key[(i + 2) & 3];
+    rkey[3] = key[(i + 3) & 3];
+    int32_t k32;
+    memcpy(&k32, rkey, sizeof(k32));
+    const __m128i m = _mm_set1_epi32(k32);
+
+    for (; i + 64 <= len; i += 64) {
+        __m128i *v = (__m128i*)(data + i);
+        _mm_store_si128(v + 0, _mm_xor_si128(_mm_load_si128(v + 0), m));
+        _mm_store_si128(v + 1, _mm_xor_si128(_mm_load_si128(v + 1), m));
+        _mm_store_si128(v + 2, _mm_xor_si128(_mm_load_si128(v + 2), m));
+        _mm_store_si128(v + 3, _mm_xor_si128(_mm_load_si128(v + 3), m));
+    }
+    for (; i + 16 <= len; i += 16) {
+        __m128i *v = (__m128i*)(data + i);
+        _mm_store_si128(v, _mm_xor_si128(_mm_load_si128(v), m));
+    }
+
+    // tail falls back to the word path, the key is still aligned at i
+    kws_mask_words(rkey, data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void kws_mask_avx2(const uint8_t *key, uint8_t *data, size_t len) {
+    uint8_t rkey[4];
+    size_t i;
+
+    // align to 32 bytes and splat the rotated key over a vector
+    i = kws_mask_head(key, data, len, 32);
+    rkey[0] = key[i & 3];
+    rkey[1] = key[(i + 1) & 3];
+    rkey[2] = key[(i + 2) & 3];
+    rkey[3] = key[(i + 3) & 3];
+    int32_t k32;
+    memcpy(&k32, rkey, sizeof(k32));
+    const __m256i m = _mm256_set1_epi32(k32);
+
+    for (; i + 128 <= len; i += 128) {
+        __m256i *v = (__m256i*)(data + i);
+        _mm256_store_si256(v + 0, _mm256_xor_si256(_mm256_load_si256(v + 0), m));
+        _mm256_store_si256(v + 1, _mm256_xor_si256(_mm256_load_si256(v + 1), m));
+        _mm256_store_si256(v + 2, _mm256_xor_si256(_mm256_load_si256(v + 2), m));
+        _mm256_store_si256(v + 3, _mm256_xor_si256(_mm256_load_si256(v + 3), m));
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i *v = (__m256i*)(data + i);
+        _mm256_store_si256(v, _mm256_xor_si256(_mm256_load_si256(v), m));
+    }
+
+    // tail falls back to the word path, the key is still aligned at i
+    kws_mask_words(rkey, data + i, len - i);
+}
+#endif
+
+static kws_mask_fn kws_mask_pick() {
+#ifdef KWS_MASK_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return kws_mask_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return kws_mask_sse2;
+#endif
+    return kws_mask_words;
+}
+
+void kws_mask(const uint8_t *mask, uint8_t *data, const size_t len, const size_t offset) {
+    static kws_mask_fn impl = NULL;
+    uint8_t key[4];
+
+    // short payloads arent worth the setup
+    if (len < 16) {
+        kws_mask_scalar(mask, data, len, offset);
+        return;
+    }
+
+    // pick the widest kernel the cpu supports once
+    kws_mask_fn fn = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+    if (fn == NULL) {
+        fn = kws_mask_pick();
+        __atomic_store_n(&impl, fn, __ATOMIC_RELAXED);
+    }
+
+    // rotate the key so kernels always start at key index 0
+    key[0] = mask[offset & 3];
+    key[1] = mask[(offset + 1) & 3];
+    key[2] = mask[(offset + 2) & 3];
+    key[3] = mask[(offset + 3) & 3];
+    fn(key, data, len);
+}
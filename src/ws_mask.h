@@ -0,0 +1,12 @@
+#ifndef K_WS_MASK_H
+#define K_WS_MASK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// xor data with the 4 byte websocket masking key, offset is the position
+// of data[0] within the payload so a payload can be unmasked in pieces
+void kws_mask(const uint8_t *mask, uint8_t *data, const size_t len, const size_t offset);
+void kws_mask_scalar(const uint8_t *mask, uint8_t *data, const size_t len, const size_t offset);
+
+#endif // K_WS_MASK_H
@@ -1,116 +1,158 @@
 #include "ws.h"
 #include "ws_parse.h"
+#include "ws_mask.h"
 #include <string.h>
+#include <endian.h>
 
-void kws_parse_header(kio_client_t *client);
-void kws_parse_size(kio_client_t *client);
-void kws_parse_mask(kio_client_t *client);
-void kws_parse_content(kio_client_t *client);
 int kws_process_frame(kws_client_t *ws, kws_frame_t *frame);
 
-void kws_start_parsing(kws_client_t *ws) {
-    kio_read(ws->client, 2, kws_parse_header);
+static void kws_reset_frame(kws_frame_t *frame) {
+    frame->data = NULL;
+    frame->data_len = 0;
+    frame->unmasked = 0;
+    frame->state = KWS_PARSE_HEADER;
 }
 
-void kws_parse_header(kio_client_t *client) {
-    kbuf_t *buf = &client->rbuf;
-    kws_frame_t *frame = &((kws_client_t*)client->data)->frame;
-
-    // parse frame header
-    uint8_t *data = (uint8_t*)(buf->data + buf->pos);
-    frame->fin      = (data[0] >> 7) & 1;
-    frame->opcode   = data[0] & 0x0F;
-    frame->masked   = (data[1] >> 7) & 1;
-    frame->data_len = data[1] & (~0x80);
-    kbuf_read(buf, buf->data, 2);
-
-    // decide what to do based on header
-    if (frame->data_len == 0x7f) // read 8 bytes to get actual payload size
-        kio_read(client, 8, kws_parse_size);
-    else if (frame->data_len == 0x7e) // read 2 bytes to get actual payload size
-        kio_read(client, 2, kws_parse_size);
-    else if (frame->masked) // read mask of packet
-        kio_read(client, 4, kws_parse_mask);
-    else // go straight to reading content
-        kio_read(client, frame->data_len, kws_parse_content);
-}
+// decode a frame header from the front of the buffer, returns the header
+// size or 0 if not all of it has arrived yet
+static size_t kws_parse_header(kws_frame_t *frame, const uint8_t *data, const size_t avail) {
+    uint16_t len16;
+    uint64_t len64;
+    size_t size = 2;
 
-void kws_parse_size(kio_client_t *client) {
-    kbuf_t *buf = &client->rbuf;
-    kws_frame_t *frame = &((kws_client_t*)client->data)->frame;
+    if (avail < size)
+        return 0;
+    const uint8_t len = data[1] & 0x7f;
+    size += (len == 0x7f ? 8 : len == 0x7e ? 2 : 0) + ((data[1] & 0x80) ? 4 : 0);
+    if (avail < size)
+        return 0;
 
-    // read data into frame->data_len
-    const uint8_t num_bytes = frame->data_len == 0x7f ? 8 : 2;
-    frame->data_len = 0;
-    memcpy(&frame->data_len, buf->data + buf->pos, num_bytes);
-    kbuf_read(buf, buf->data, num_bytes);
+    frame->fin    = (data[0] >> 7) & 1;
+    frame->opcode = data[0] & 0x0F;
+    frame->masked = (data[1] >> 7) & 1;
+
+    // extended payload lengths are in network order
+    data += 2;
+    if (len == 0x7f) {
+        memcpy(&len64, data, 8);
+        frame->data_len = be64toh(len64);
+        data += 8;
+    } else if (len == 0x7e) {
+        memcpy(&len16, data, 2);
+        frame->data_len = be16toh(len16);
+        data += 2;
+    } else {
+        frame->data_len = len;
+    }
 
-    // read mask or go straight to data
+    // keep a copy of the mask since the buffer may move under it
     if (frame->masked)
-        kio_read(client, 4, kws_parse_mask);
-    else
-        kio_read(client, frame->data_len, kws_parse_content);
-}
-
-void kws_parse_mask(kio_client_t *client) {
-    kbuf_t *buf = &client->rbuf;
-    kws_frame_t *frame = &((kws_client_t*)client->data)->frame;
-
-    frame->mask = buf->data + buf->pos;
-    // kbuf_read(buf, buf->data, 4) // do not read because could rewrite mask
-    kio_read(client, frame->data_len, kws_parse_content);
+        memcpy(frame->mask, data, 4);
+    return size;
 }
 
-static inline void kws_mask(const char *mask, char *data, size_t len) {
-    while (len--, data[len] ^= mask[len % 4]);
-}
-
-void kws_parse_content(kio_client_t *client) {
+static void kws_parse(kio_client_t *client) {
+    uint8_t *data;
+    size_t avail, size;
     kbuf_t *buf = &client->rbuf;
     kws_client_t *ws = (kws_client_t*)client->data;
     kws_frame_t *frame = &ws->frame;
 
-    // get data and unmask it if needed
-    frame->data = buf->data + buf->pos + (frame->masked ? 4 : 0);
-    if (frame->masked && frame->mask != NULL)
-        kws_mask(frame->mask, frame->data, frame->data_len);
+    // decode every complete frame that is buffered, empty payloads included
+    while (!client->closing) {
+        avail = buf->len;
+
+        if (frame->state == KWS_PARSE_HEADER) {
+            data = (uint8_t*)kbuf_peek(buf, avail < KWS_MAX_HEADER ? avail : KWS_MAX_HEADER);
+            if (data == NULL || (size = kws_parse_header(frame, data, avail)) == 0)
+                return;
+            kbuf_skip(buf, size);
+            if (frame->data_len > KWS_MAX_FRAME) {
+                kws_close(ws, 1009, "Frame too large");
+                return;
+            }
 
-    // process the frame and reset
-    const int should_close = kws_process_frame(ws, frame);
-    frame->data = NULL;
-    frame->mask = NULL;
-    kbuf_read(buf, buf->data, frame->data_len + 4);
-
-    // close connection or continue reading
-    if (should_close)
-        kio_close(client);
-    else
-        kws_start_parsing(ws);
+            // have the rest of the payload land right after what is buffered
+            if (kbuf_expect(buf, frame->data_len)) {
+                fprintf(stderr, "[KDB] Not enough memory for websocket frame\n");
+                kio_close(client);
+                return;
+            }
+            frame->state = KWS_PARSE_PAYLOAD;
+            continue;
+        }
+
+        // unmask whatever arrived so far, partial payloads resume at the same offset
+        size = avail < frame->data_len ? avail : frame->data_len;
+        if ((data = (uint8_t*)kbuf_peek(buf, size)) == NULL)
+            return;
+        if (frame->masked && size > frame->unmasked) {
+            kws_mask(frame->mask, data + frame->unmasked, size - frame->unmasked, frame->unmasked);
+            frame->unmasked = size;
+        }
+        if (size < frame->data_len)
+            return;
+
+        // process the frame and reset, payload stays in place until consumed.
+        // a closed client already gave back its buffer and websocket
+        frame->data = (char*)data;
+        if (kws_process_frame(ws, frame) || client->closing) {
+            kio_close(client);
+            return;
+        }
+        kbuf_skip(buf, frame->data_len);
+        kws_reset_frame(frame);
+    }
 }
 
-int kws_process_frame(kws_client_t *ws, kws_frame_t *frame) {
-    char *payload;
-    size_t payload_len;
+void kws_start_parsing(kws_client_t *ws) {
+    kws_reset_frame(&ws->frame);
+    kio_on_data(ws->client, kws_parse);
+}
 
-    // frame is fragmented
-    if (!frame->fin || frame->opcode == KWS_OP_CONT) {
-        kbuf_write(&ws->fragment, frame->data, frame->data_len);
-        return 0;
-    }
+// returns 1 once the connection should close or was closed, ws and frame
+// are gone in the latter case
+int kws_process_frame(kws_client_t *ws, kws_frame_t *frame) {
+    kio_client_t *client = ws->client;
+    char *payload = frame->data;
+    size_t payload_len = frame->data_len;
+    uint8_t opcode = frame->opcode;
+
+    // a message split in fragments starts with a non-fin data frame and
+    // ends with a fin continuation, control frames may come in between
+    if (opcode <= KWS_OP_BIN) {
+        if (opcode == KWS_OP_CONT && ws->fragment_op == KWS_OP_CONT) {
+            kws_close(ws, 1002, "Unexpected continuation frame");
+            return 1;
+        }
+        if (opcode != KWS_OP_CONT && ws->fragment_op != KWS_OP_CONT) {
+            kws_close(ws, 1002, "Expected continuation frame");
+            return 1;
+        }
+        if (opcode == KWS_OP_CONT || !frame->fin) {
+            if (ws->fragment.len + frame->data_len > KWS_MAX_FRAME) {
+                kws_close(ws, 1009, "Message too large");
+                return 1;
+            }
+            if (kbuf_write(&ws->fragment, frame->data, frame->data_len))
+                return 1;
+            if (!frame->fin) {
+                if (opcode != KWS_OP_CONT)
+                    ws->fragment_op = opcode;
+                return 0;
+            }
 
-    // frame is not fragmented
-    if (ws->fragment.len - ws->fragment.pos > 0) {
-        kbuf_write(&ws->fragment, frame->data, frame->data_len);
-        payload = ws->fragment.data + ws->fragment.pos;
-        payload_len = ws->fragment.len - ws->fragment.pos;
-        kbuf_read(&ws->fragment, payload, payload_len);
-    } else {
-        payload = frame->data;
-        payload_len = frame->data_len;
+            // the whole message goes on as the opcode of its first frame
+            opcode = ws->fragment_op;
+            ws->fragment_op = KWS_OP_CONT;
+            payload_len = ws->fragment.len;
+            if ((payload = kbuf_peek(&ws->fragment, payload_len)) == NULL)
+                return 1;
+        }
     }
 
     // decide what to do with the trame
-    switch (frame->opcode) {
+    switch (opcode) {
 
         // pong back packet
         case KWS_OP_PING:
@@ -140,13 +182,20 @@ int kws_process_frame(kws_client_t *ws, kws_frame_t *frame) {
             if (ws->on_close != NULL) {
                 uint8_t *data = (uint8_t*)frame->data;
                 kws_close_t callback = (kws_close_t)ws->on_close;
-                callback(ws, (data[0] << 8) | (data[1]), frame->data + 2, frame->data_len - 2);
+                if (frame->data_len >= 2)
+                    callback(ws, (data[0] << 8) | (data[1]), frame->data + 2, frame->data_len - 2);
+                else
+                    callback(ws, 1005, "", 0);
             }
             return 1;
             break;
         }
     }
 
-    // normal frame process
+    // a callback may have closed the connection, drop the reassembled message
+    if (client->closing)
+        return 1;
+    if (payload != frame->data)
+        kbuf_skip(&ws->fragment, payload_len);
     return 0;
 }
\ No newline at end of file